@@ -17,6 +17,10 @@ out vec4          fragColor;
 
 float model(vec3 p); // forward-declaration
 
+#ifndef FRAKTAL_BRICKS
+#define cachedModel model // without a brick cache (see libf/bricks.f)
+#endif
+
 #if DENOISE
 vec2 seed = vec2(-1,1)*(iSamples*(1.0/12.0) + 1.0);
 #else
@@ -66,7 +70,7 @@ float trace(vec3 ro, vec3 rd)
     for (int i = ZERO; i < STEPS; i++)
     {
         vec3 p = ro + t*rd;
-        float d = model(p);
+        float d = cachedModel(p);
         if (d <= EPSILON) return t;
         t += d;
         if (t > MAX_DISTANCE) break;
@@ -83,7 +87,7 @@ float ambientOcclusion(vec3 p)
     for (int i = ZERO; i < STEPS && t < MAX_AO_DISTANCE; i++)
     {
         vec3 p = ro + t*rd;
-        float d = model(p);
+        float d = cachedModel(p);
         t += d;
         if (d <= EPSILON)
             return 0.0;
@@ -21,6 +21,10 @@ out vec4          fragColor;
 
 float model(vec3 p); // forward-declaration
 
+#ifndef FRAKTAL_BRICKS
+#define cachedModel model // without a brick cache (see libf/bricks.f)
+#endif
+
 // lumina.sourceforge.net/Tutorials/Noise.html
 vec2 seed = vec2(-1,1)*(iSamples*(1.0/12.0) + 1.0);
 vec2 noise2f()
@@ -46,7 +50,7 @@ float traceModel(vec3 ro, vec3 rd, float t)
     for (int i = ZERO; i < STEPS; i++)
     {
         vec3 p = ro + t*rd;
-        float d = model(p);
+        float d = cachedModel(p);
         if (d <= EPSILON) return t;
         t += d;
         if (t > MAX_DISTANCE) return INFINITY;
@@ -163,13 +167,13 @@ void main()
         rd = normalize((iView * vec4(rd, 0.0)).xyz);
 
         // Initial step is shared for *all* rays
-        float t = model(ro);
+        float t = cachedModel(ro);
 
         int i;
         for (i = ZERO; i < STEPS; i++)
         {
             vec3 p = ro + t*rd;
-            float d = min(p.y - iGroundHeight, model(p));
+            float d = min(p.y - iGroundHeight, cachedModel(p));
             if (d <= sin_alpha_half*t + EPSILON) break;
 
             #if 0
@@ -0,0 +1,64 @@
+// Developed by Simen Haugo.
+// See LICENSE.txt for copyright and licensing details (standard MIT License).
+
+// Reads the brick cache made by fraktal_bake_bricks. Add this file with
+// fraktal_add_link_library before the model and the renderer, and set its
+// parameters with fraktal_param_bricks. Renderers that trace rays with
+// cachedModel then read the distance from the cache, and only call model
+// near the surface and outside the box of the cache.
+
+#define FRAKTAL_BRICKS
+
+uniform sampler3D iBrickAtlas;
+uniform sampler3D iBrickIndex;
+uniform vec3      iBrickBoxMin;
+uniform float     iBrickCell;
+uniform ivec3     iBrickGrid;
+
+#define BRICK_CELLS 7    // cells along each side of a brick
+#define BRICK_EXACT 2.0  // distance (in cells) below which model is called
+
+float model(vec3 p); // forward-declaration
+
+float cachedModel(vec3 p)
+{
+    vec3 u = (p - iBrickBoxMin)/iBrickCell;
+    ivec3 b = ivec3(floor(u/float(BRICK_CELLS)));
+    if (any(lessThan(b, ivec3(0))) || any(greaterThanEqual(b, iBrickGrid)))
+        return model(p);
+
+    // blocks away from the surface store a lower bound of the distance
+    // in the block, and the distance at its center
+    vec4 entry = texelFetch(iBrickIndex, b, 0);
+    if (entry.x < 0.0)
+    {
+        vec3 center = iBrickBoxMin + (vec3(b) + 0.5)*float(BRICK_CELLS)*iBrickCell;
+        return sign(entry.w)*max(entry.y, abs(entry.w) - length(p - center));
+    }
+
+    // near the surface, the nearest sample is enough to tell that the
+    // exact distance is needed
+    vec3 f = clamp(u - vec3(b*BRICK_CELLS), 0.0, float(BRICK_CELLS));
+    float nearest = texelFetch(iBrickAtlas, ivec3(entry.xyz) + ivec3(f + 0.5), 0).r;
+    if (abs(nearest) < BRICK_EXACT*iBrickCell)
+        return model(p);
+
+    // trilinear interpolation between the samples at the corners of the cell
+    ivec3 i = min(ivec3(f), ivec3(BRICK_CELLS - 1));
+    f -= vec3(i);
+    ivec3 a = ivec3(entry.xyz) + i;
+    float d000 = texelFetch(iBrickAtlas, a + ivec3(0,0,0), 0).r;
+    float d100 = texelFetch(iBrickAtlas, a + ivec3(1,0,0), 0).r;
+    float d010 = texelFetch(iBrickAtlas, a + ivec3(0,1,0), 0).r;
+    float d110 = texelFetch(iBrickAtlas, a + ivec3(1,1,0), 0).r;
+    float d001 = texelFetch(iBrickAtlas, a + ivec3(0,0,1), 0).r;
+    float d101 = texelFetch(iBrickAtlas, a + ivec3(1,0,1), 0).r;
+    float d011 = texelFetch(iBrickAtlas, a + ivec3(0,1,1), 0).r;
+    float d111 = texelFetch(iBrickAtlas, a + ivec3(1,1,1), 0).r;
+    float d = mix(mix(mix(d000, d100, f.x), mix(d010, d110, f.x), f.y),
+                  mix(mix(d001, d101, f.x), mix(d011, d111, f.x), f.y), f.z);
+
+    if (abs(d) < BRICK_EXACT*iBrickCell)
+        return model(p);
+    return d;
+}
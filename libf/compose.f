@@ -2,17 +2,22 @@
 // See LICENSE.txt for copyright and licensing details (standard MIT License).
 
 // This shader calculates the mean of accumulated sample images and applies
-// gamma correction to the output.
+// gamma correction to the output. While a sample is being accumulated over
+// several frames, the rows below iSampleRow have one more sample.
 
 uniform vec2      iResolution;
 uniform sampler2D iChannel0;
 uniform int       iSamples;
+uniform int       iSampleRow;
 out vec4          fragColor;
 
 void main()
 {
     vec2 uv = gl_FragCoord.xy / iResolution.xy;
-    fragColor = texture(iChannel0, uv) / float(iSamples);
+    float samples = float(iSamples);
+    if (gl_FragCoord.y < float(iSampleRow))
+        samples += 1.0;
+    fragColor = texture(iChannel0, uv) / max(samples, 1.0);
     fragColor.rgb = sqrt(fragColor.rgb);
     fragColor.a = 1.0;
 }
@@ -32,6 +32,10 @@ vec3 rayPinhole(vec2 fragOffset)
 
 float model(vec3 p); // forward-declaration
 
+#ifndef FRAKTAL_BRICKS
+#define cachedModel model // without a brick cache (see libf/bricks.f)
+#endif
+
 // Adapted from Inigo Quilez
 // Source: http://iquilezles.org/www/articles/normalsSDF/normalsSDF.htm
 vec3 normal(vec3 p)
@@ -52,7 +56,7 @@ float calcThickness(vec3 ro, vec3 rd)
     for (int i = ZERO; i < STEPS; i++)
     {
         vec3 p = ro + t*rd;
-        float d = model(p);
+        float d = cachedModel(p);
         if (d >= -EPSILON)
         {
             t += max(EPSILON, d);
@@ -73,7 +77,7 @@ float traceModel(vec3 ro, vec3 rd)
     for (int i = ZERO; i < STEPS; i++)
     {
         vec3 p = ro + t*rd;
-        float d = model(p);
+        float d = cachedModel(p);
         if (d <= EPSILON) return t;
         t += d;
         if (t > MAX_DISTANCE) break;
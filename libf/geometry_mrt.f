@@ -0,0 +1,109 @@
+// Developed by Simen Haugo.
+// See LICENSE.txt for copyright and licensing details (standard MIT License).
+
+// Variant of geometry.f that writes every channel in one pass, to be run
+// with fraktal_run_kernel_mrt with three output arrays.
+
+uniform vec2      iResolution;
+uniform vec2      iCameraCenter;
+uniform float     iCameraF;
+uniform mat4      iView;
+uniform float     iMinDistance;
+uniform float     iMaxDistance;
+uniform float     iMinThickness;
+uniform float     iMaxThickness;
+out vec4 fragNormal;    // normal (rgb) and 1.0 on hit (a)
+out vec4 fragDepth;     // distance to surface (r) and normalized distance (g)
+out vec4 fragThickness; // thickness (r) and normalized thickness (g)
+
+#define EPSILON 0.0001
+#define STEPS 512
+#define MAX_DISTANCE 100.0
+
+vec3 rayPinhole(vec2 fragOffset)
+{
+    vec2 uv = vec2(gl_FragCoord.x, iResolution.y - gl_FragCoord.y) + fragOffset - iCameraCenter;
+    float d = 1.0/length(vec3(uv, iCameraF));
+    return vec3(uv*d, -iCameraF*d);
+}
+
+float model(vec3 p); // forward-declaration
+
+#ifndef FRAKTAL_BRICKS
+#define cachedModel model // without a brick cache (see libf/bricks.f)
+#endif
+
+// Adapted from Inigo Quilez
+// Source: http://iquilezles.org/www/articles/normalsSDF/normalsSDF.htm
+vec3 normal(vec3 p)
+{
+    vec3 n = vec3(0.0);
+    for (int i = ZERO; i < 4; i++)
+    {
+        vec3 e = 0.5773*(2.0*vec3((((i+3)>>1)&1),((i>>1)&1),(i&1))-1.0);
+        n += e*model(p + e*0.002);
+    }
+    return normalize(n);
+}
+
+float calcThickness(vec3 ro, vec3 rd)
+{
+    float t = 0.0;
+    float thickness = 0.0;
+    for (int i = ZERO; i < STEPS; i++)
+    {
+        vec3 p = ro + t*rd;
+        float d = cachedModel(p);
+        if (d >= -EPSILON)
+        {
+            t += max(EPSILON, d);
+        }
+        else
+        {
+            t += max(EPSILON, -d);
+            thickness += max(EPSILON, -d);
+        }
+        if (t > MAX_DISTANCE) break;
+    }
+    return thickness;
+}
+
+float traceModel(vec3 ro, vec3 rd)
+{
+    float t = 0.0;
+    for (int i = ZERO; i < STEPS; i++)
+    {
+        vec3 p = ro + t*rd;
+        float d = cachedModel(p);
+        if (d <= EPSILON) return t;
+        t += d;
+        if (t > MAX_DISTANCE) break;
+    }
+    return -1.0;
+}
+
+void main()
+{
+    vec3 rd = rayPinhole(vec2(0.0));
+    vec3 ro = (iView * vec4(0.0, 0.0, 0.0, 1.0)).xyz;
+    rd = normalize((iView * vec4(rd, 0.0)).xyz);
+
+    fragNormal = vec4(0.0);
+    fragDepth = vec4(0.0);
+    fragThickness = vec4(0.0);
+
+    float t = traceModel(ro, rd);
+    if (t > 0.0)
+    {
+        vec3 p = ro + t*rd;
+        vec3 n = normal(p);
+        float thickness = calcThickness(p, rd);
+
+        float t_normalized = (t - iMinDistance) / (iMaxDistance - iMinDistance);
+        float thickness_normalized = (thickness - iMinThickness) / (iMaxThickness - iMinThickness);
+
+        fragNormal = vec4(n, 1.0);
+        fragDepth = vec4(t, t_normalized, 0.0, 1.0);
+        fragThickness = vec4(thickness, thickness_normalized, 0.0, 1.0);
+    }
+}
@@ -0,0 +1,26 @@
+// Developed by Simen Haugo.
+// See LICENSE.txt for copyright and licensing details (standard MIT License).
+
+// This shader shows one of the counts accumulated by a renderer in its
+// steps draw mode (see libf/publication.f and libf/geometry.f) with a
+// colormap, where the mean count iMaxCount and above is the brightest.
+
+uniform vec2      iResolution;
+uniform sampler2D iChannel0;
+uniform int       iSamples;
+uniform sampler1D iColormap;
+uniform int       iCount; // channel of iChannel0 (0: primary, 1: shadow, 2: ao, 3: evaluations)
+uniform float     iMaxCount;
+out vec4          fragColor;
+
+void main()
+{
+    vec2 uv = gl_FragCoord.xy / iResolution.xy;
+    vec4 counts = texture(iChannel0, uv) / float(max(iSamples, 1));
+    float count = counts.x;
+    if      (iCount == 1) count = counts.y;
+    else if (iCount == 2) count = counts.z;
+    else if (iCount == 3) count = counts.w;
+    fragColor.rgb = texture(iColormap, clamp(count/iMaxCount, 0.0, 1.0)).rgb;
+    fragColor.a = 1.0;
+}
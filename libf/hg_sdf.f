@@ -28,11 +28,11 @@
 
 // Sign function that doesn't return 0
 float sgn(float x) {
-    return (x<0)?-1:1;
+    return (x<0)?-1.0:1.0;
 }
 
 vec2 sgn(vec2 v) {
-    return vec2((v.x<0)?-1:1, (v.y<0)?-1:1);
+    return vec2((v.x<0)?-1.0:1.0, (v.y<0)?-1.0:1.0);
 }
 
 float square (float x) {
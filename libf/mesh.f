@@ -0,0 +1,28 @@
+// Developed by Simen Haugo.
+// See LICENSE.txt for copyright and licensing details (standard MIT License).
+
+// Writes the distance (r) and normal (gba) of the model at each point, to be
+// linked with a model and passed to fraktal_extract_mesh.
+
+out vec4 fragColor;
+
+float model(vec3 p); // forward-declaration
+
+// Adapted from Inigo Quilez
+// Source: http://iquilezles.org/www/articles/normalsSDF/normalsSDF.htm
+vec3 normal(vec3 p)
+{
+    vec3 n = vec3(0.0);
+    for (int i = ZERO; i < 4; i++)
+    {
+        vec3 e = 0.5773*(2.0*vec3((((i+3)>>1)&1),((i>>1)&1),(i&1))-1.0);
+        n += e*model(p + e*0.0005);
+    }
+    return normalize(n);
+}
+
+void main()
+{
+    vec3 p = fraktal_point().xyz;
+    fragColor = vec4(model(p), normal(p));
+}
@@ -23,6 +23,7 @@ uniform int       iGroundReflective;
 uniform float     iGroundHeight;
 uniform float     iGroundSpecularExponent;
 uniform float     iGroundReflectivity;
+uniform int       iDrawMode;
 out vec4          fragColor;
 
 #define EPSILON 0.0007
@@ -31,8 +32,26 @@ out vec4          fragColor;
 #define MAX_DISTANCE 100.0
 #define MAX_DISTANCE_VISIBILITY_TEST 10.0
 
+// The values follow on from the draw modes of libf/geometry.f, so that a
+// mode means the same thing in every renderer that has it
+#define DRAW_MODE_COLOR 0
+#define DRAW_MODE_STEPS 4
+
+// Counted for DRAW_MODE_STEPS, which outputs the steps of the camera and
+// reflection rays, of the shadow rays toward the sun, of the ambient
+// occlusion and glossy rays, and all calls of the model (with a brick
+// cache, the calls of cachedModel are counted instead of the model).
+int primarySteps = 0;
+int shadowSteps = 0;
+int aoSteps = 0;
+int evaluations = 0;
+
 float model(vec3 p); // forward declaration
 
+#ifndef FRAKTAL_BRICKS
+#define cachedModel model // without a brick cache (see libf/bricks.f)
+#endif
+
 // Adapted from: lumina.sourceforge.net/Tutorials/Noise.html
 vec2 seed = vec2(-1,1)*(iSamples*(1.0/12.0) + 1.0);
 vec2 noise2f()
@@ -58,6 +77,7 @@ vec3 normal(vec3 p)
     {
         vec3 e = 0.5773*(2.0*vec3((((i+3)>>1)&1),((i>>1)&1),(i&1))-1.0);
         n += e*model(p + e*0.002);
+        evaluations++;
     }
     return normalize(n);
 }
@@ -74,7 +94,9 @@ float traceModel(vec3 ro, vec3 rd)
     for (int i = ZERO; i < STEPS; i++)
     {
         vec3 p = ro + t*rd;
-        float d = model(p);
+        float d = cachedModel(p);
+        primarySteps++;
+        evaluations++;
         if (d <= EPSILON) return t;
         t += d;
         if (t > MAX_DISTANCE) break;
@@ -82,7 +104,7 @@ float traceModel(vec3 ro, vec3 rd)
     return -1.0;
 }
 
-bool isVisible(vec3 ro, vec3 rd)
+bool isVisible(vec3 ro, vec3 rd, inout int steps)
 {
     float tGround = traceGround(ro, rd);
     if (tGround > EPSILON)
@@ -90,7 +112,9 @@ bool isVisible(vec3 ro, vec3 rd)
     float t = 0.0;
     for (int i = ZERO; i < STEPS; i++)
     {
-        float d = model(ro + t*rd);
+        float d = cachedModel(ro + t*rd);
+        steps++;
+        evaluations++;
         t += d;
         if (d <= EPSILON)
             return false;
@@ -139,11 +163,11 @@ vec3 colorModel(vec3 p, vec3 ro)
     vec3 result = vec3(0.0);
 
     vec3 rd = cosineWeightedSample(n);
-    if (isVisible(ro,rd))
+    if (isVisible(ro,rd,aoSteps))
         result += vec3(1.0);
 
     rd = iToSun;
-    if (isVisible(ro,rd))
+    if (isVisible(ro,rd,shadowSteps))
         result += vec3(1.0)*max(0.0,dot(n, rd));
 
     result *= iMaterialAlbedo;
@@ -152,7 +176,7 @@ vec3 colorModel(vec3 p, vec3 ro)
     {
         vec3 w_s = v - 2.0*dot(n, v)*n;
         rd = phongWeightedSample(w_s, iMaterialSpecularExponent);
-        if (isVisible(ro, rd) && dot(rd, iToSun) >= iCosSunSize)
+        if (isVisible(ro, rd, aoSteps) && dot(rd, iToSun) >= iCosSunSize)
             result += iMaterialSpecularAlbedo;
     }
     return result;
@@ -163,6 +187,7 @@ vec3 colorModel(vec3 p, vec3 ro)
 vec3 colorIsolines(vec3 p)
 {
     float d = model(p);
+    evaluations++;
     float a = mod(d - iIsolineThickness*0.5, iIsolineSpacing);
     float t = step(iIsolineSpacing-iIsolineThickness, a) * (1.0 - step(iIsolineMax, d));
     return mix(vec3(1.0), iIsolineColor, t);
@@ -181,11 +206,11 @@ vec3 colorGround(vec3 p, vec3 ro)
     vec3 result = vec3(0.0);
 
     vec3 rd = cosineWeightedSample(n);
-    if (isVisible(ro,rd))
+    if (isVisible(ro,rd,aoSteps))
         result += vec3(1.0);
 
     rd = iToSun;
-    if (isVisible(ro,rd))
+    if (isVisible(ro,rd,shadowSteps))
         result += vec3(1.0)*max(0.0,dot(n, rd));
 
     if (iGroundReflective == 1)
@@ -214,4 +239,7 @@ void main()
     else if (tModel > 0.0 && ((tGround > 0.0 && tModel < tGround) || tGround < 0.0))
         fragColor.rgb = colorModel(ro + rd*tModel, ro);
     fragColor.a = 1.0;
+
+    if (iDrawMode == DRAW_MODE_STEPS)
+        fragColor = vec4(float(primarySteps), float(shadowSteps), float(aoSteps), float(evaluations));
 }
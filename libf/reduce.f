@@ -0,0 +1,23 @@
+// Developed by Simen Haugo.
+// See LICENSE.txt for copyright and licensing details (standard MIT License).
+
+// This shader sums blocks of REDUCE_BLOCK x REDUCE_BLOCK texels of
+// iChannel0 into each output texel. Running it repeatedly on its own output
+// reduces an array to a few texels that are cheap to read back.
+
+uniform sampler2D iChannel0;
+out vec4          fragColor;
+
+#define REDUCE_BLOCK 8
+
+void main()
+{
+    ivec2 size = textureSize(iChannel0, 0);
+    ivec2 first = REDUCE_BLOCK*ivec2(gl_FragCoord.xy);
+    ivec2 last = min(first + ivec2(REDUCE_BLOCK), size);
+    vec4 sum = vec4(0.0);
+    for (int y = first.y; y < last.y; y++)
+    for (int x = first.x; x < last.x; x++)
+        sum += texelFetch(iChannel0, ivec2(x, y), 0);
+    fragColor = sum;
+}
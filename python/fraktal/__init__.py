@@ -8,6 +8,7 @@ __license__ = 'MIT'
 import sys
 import os
 import ctypes
+import struct
 
 _to_char_p = lambda s: s.encode('utf-8')
 
@@ -50,6 +51,13 @@ CLAMP_TO_EDGE = 4
 REPEAT        = 5
 LINEAR        = 6
 NEAREST       = 7
+HALF          = 8
+UINT16        = 9
+UINT32        = 10
+INT32         = 11
+EMPTY         = 12
+FULL          = 13
+AMBIGUOUS     = 14
 
 class FraktalError(Exception):
     def __init__(self, message):
@@ -59,25 +67,80 @@ class FraktalError(Exception):
 # §2 Arrays
 ############################################################
 
+# CPU representation of each array format. Half floats are passed to
+# fraktal as raw 16-bit values and converted with the struct module.
+_format_ctypes = {
+    FLOAT: ctypes.c_float,
+    HALF: ctypes.c_uint16,
+    UINT8: ctypes.c_ubyte,
+    UINT16: ctypes.c_uint16,
+    UINT32: ctypes.c_uint32,
+    INT32: ctypes.c_int32,
+}
+
+def _buffer_type(format, count):
+    if format not in _format_ctypes:
+        raise FraktalError('Invalid array format.')
+    return _format_ctypes[format] * count
+
+def _empty_buffer(format, count):
+    return _buffer_type(format, count)()
+
+def _to_buffer(format, count, data):
+    if format == HALF:
+        return _buffer_type(format, count).from_buffer_copy(struct.pack('<%de' % count, *data))
+    return _buffer_type(format, count)(*data)
+
+def _from_buffer(format, dcpu):
+    if format == HALF:
+        return list(struct.unpack('<%de' % len(dcpu), bytes(dcpu)))
+    elif format == FLOAT:
+        return [float(i) for i in dcpu]
+    else:
+        return [int(i) for i in dcpu]
+
 _fraktal.fraktal_create_array.restype = ctypes.c_void_p
 _fraktal.fraktal_create_array.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int]
 def create_array(data, width, height, channels, format, access):
     if data is None:
         return _fraktal.fraktal_create_array(None, width, height, channels, format, access)
     else:
-        if format == FLOAT:
-            pdata = (ctypes.c_float*(channels*width*height))(*data)
-        elif format == UINT8:
-            pdata = (ctypes.c_ubyte*(channels*width*height))(*data)
-        else:
-            raise
+        pdata = _to_buffer(format, channels*width*height, data)
         return _fraktal.fraktal_create_array(pdata, width, height, channels, format, access)
 
+_fraktal.fraktal_create_array_3d.restype = ctypes.c_void_p
+_fraktal.fraktal_create_array_3d.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int]
+def create_array_3d(data, width, height, depth, channels, format, access):
+    if data is None:
+        return _fraktal.fraktal_create_array_3d(None, width, height, depth, channels, format, access)
+    else:
+        pdata = _to_buffer(format, channels*width*height*depth, data)
+        return _fraktal.fraktal_create_array_3d(pdata, width, height, depth, channels, format, access)
+
+_fraktal.fraktal_create_points.restype = ctypes.c_void_p
+_fraktal.fraktal_create_points.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int]
+def create_points(data, count, channels, format, access):
+    if data is None:
+        return _fraktal.fraktal_create_points(None, count, channels, format, access)
+    else:
+        pdata = _to_buffer(format, channels*count, data)
+        return _fraktal.fraktal_create_points(pdata, count, channels, format, access)
+
 _fraktal.fraktal_destroy_array.restype = None
 _fraktal.fraktal_destroy_array.argtypes = [ctypes.c_void_p]
 def destroy_array(array):
     _fraktal.fraktal_destroy_array(array)
 
+_fraktal.fraktal_set_array_pool_budget.restype = None
+_fraktal.fraktal_set_array_pool_budget.argtypes = [ctypes.c_size_t]
+def set_array_pool_budget(max_bytes):
+    _fraktal.fraktal_set_array_pool_budget(max_bytes)
+
+_fraktal.fraktal_trim_array_pool.restype = None
+_fraktal.fraktal_trim_array_pool.argtypes = [ctypes.c_size_t]
+def trim_array_pool(max_bytes):
+    _fraktal.fraktal_trim_array_pool(max_bytes)
+
 _fraktal.fraktal_zero_array.restype = None
 _fraktal.fraktal_zero_array.argtypes = [ctypes.c_void_p]
 def zero_array(array):
@@ -85,22 +148,73 @@ def zero_array(array):
 
 _fraktal.fraktal_to_cpu.restype = None
 _fraktal.fraktal_to_cpu.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+# Number of scalar values of the array in CPU memory.
+def _array_length(array):
+    count = array_count(array)
+    if count == 0:
+        width,height = array_size(array)
+        count = width * height * max(array_depth(array), 1)
+    return count * array_channels(array)
+
 def to_cpu(array):
-    width,height = array_size(array)
+    format = array_format(array)
+    dcpu = _empty_buffer(format, _array_length(array))
+    _fraktal.fraktal_to_cpu(dcpu, array)
+    return _from_buffer(format, dcpu)
+
+_fraktal.fraktal_update_array.restype = None
+_fraktal.fraktal_update_array.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+def update_array(array, data):
+    format = array_format(array)
+    pdata = _to_buffer(format, _array_length(array), data)
+    _fraktal.fraktal_update_array(array, pdata)
+
+_fraktal.fraktal_to_cpu_region.restype = None
+_fraktal.fraktal_to_cpu_region.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_void_p]
+def to_cpu_region(array, x, y, width, height):
     channels = array_channels(array)
     format = array_format(array)
-    if format == FLOAT:
-        array_type = ctypes.c_float * (channels * width * height)
-        dcpu = array_type()
-        _fraktal.fraktal_to_cpu(dcpu, array)
-        return [float(i) for i in dcpu]
-    elif format == UINT8:
-        array_type = ctypes.c_ubyte * (channels * width * height)
-        dcpu = array_type()
-        _fraktal.fraktal_to_cpu(dcpu, array)
-        return [int(i) for i in dcpu]
-    else:
-        raise
+    dcpu = _empty_buffer(format, channels * width * height)
+    _fraktal.fraktal_to_cpu_region(array, x, y, width, height, dcpu)
+    return _from_buffer(format, dcpu)
+
+_fraktal.fraktal_upload_region.restype = None
+_fraktal.fraktal_upload_region.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_void_p]
+def upload_region(array, x, y, width, height, data):
+    channels = array_channels(array)
+    format = array_format(array)
+    pdata = _to_buffer(format, channels*width*height, data)
+    _fraktal.fraktal_upload_region(array, x, y, width, height, pdata)
+
+class _Transfer:
+    def __init__(self, handle, dcpu, format):
+        self.handle = handle
+        self.dcpu = dcpu
+        self.format = format
+        self.done = False
+
+_fraktal.fraktal_to_cpu_async.restype = ctypes.c_void_p
+_fraktal.fraktal_to_cpu_async.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+def to_cpu_async(array):
+    format = array_format(array)
+    dcpu = _empty_buffer(format, _array_length(array))
+    return _Transfer(_fraktal.fraktal_to_cpu_async(dcpu, array), dcpu, format)
+
+_fraktal.fraktal_poll.restype = ctypes.c_bool
+_fraktal.fraktal_poll.argtypes = [ctypes.c_void_p]
+def poll(transfer):
+    if not transfer.done:
+        transfer.done = _fraktal.fraktal_poll(transfer.handle)
+    return transfer.done
+
+_fraktal.fraktal_wait.restype = None
+_fraktal.fraktal_wait.argtypes = [ctypes.c_void_p]
+def wait(transfer):
+    """ Returns the array values, like to_cpu. """
+    if not transfer.done:
+        _fraktal.fraktal_wait(transfer.handle)
+        transfer.done = True
+    return _from_buffer(transfer.format, transfer.dcpu)
 
 _fraktal.fraktal_array_size.restype = None
 _fraktal.fraktal_array_size.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_int), ctypes.POINTER(ctypes.c_int)]
@@ -112,8 +226,8 @@ def array_size(array):
     _fraktal.fraktal_array_size(array, pwidth, pheight)
     return width.value, height.value
 
-_fraktal.fraktal_array_channels.restype = ctypes.c_int
-_fraktal.fraktal_array_channels.argtypes = [ctypes.c_void_p]
+_fraktal.fraktal_array_format.restype = ctypes.c_int
+_fraktal.fraktal_array_format.argtypes = [ctypes.c_void_p]
 def array_format(array):
     return _fraktal.fraktal_array_format(array)
 
@@ -122,6 +236,16 @@ _fraktal.fraktal_array_channels.argtypes = [ctypes.c_void_p]
 def array_channels(array):
     return _fraktal.fraktal_array_channels(array)
 
+_fraktal.fraktal_array_depth.restype = ctypes.c_int
+_fraktal.fraktal_array_depth.argtypes = [ctypes.c_void_p]
+def array_depth(array):
+    return _fraktal.fraktal_array_depth(array)
+
+_fraktal.fraktal_array_count.restype = ctypes.c_int
+_fraktal.fraktal_array_count.argtypes = [ctypes.c_void_p]
+def array_count(array):
+    return _fraktal.fraktal_array_count(array)
+
 ############################################################
 # §3 Kernels
 ############################################################
@@ -146,6 +270,26 @@ _fraktal.fraktal_add_link_file.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
 def add_link_file(link, path):
     return _fraktal.fraktal_add_link_file(link, _to_char_p(path))
 
+_fraktal.fraktal_add_link_library.restype = None
+_fraktal.fraktal_add_link_library.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t, ctypes.c_char_p]
+def add_link_library(link, data, size, name):
+    return _fraktal.fraktal_add_link_library(link, data, size, _to_char_p(name))
+
+_fraktal.fraktal_link_kernel.restype = ctypes.c_void_p
+_fraktal.fraktal_link_kernel.argtypes = [ctypes.c_void_p]
+def link_kernel(link):
+    return _fraktal.fraktal_link_kernel(link)
+
+_fraktal.fraktal_link_kernel_async.restype = ctypes.c_void_p
+_fraktal.fraktal_link_kernel_async.argtypes = [ctypes.c_void_p]
+def link_kernel_async(link):
+    return _fraktal.fraktal_link_kernel_async(link)
+
+_fraktal.fraktal_kernel_ready.restype = ctypes.c_int
+_fraktal.fraktal_kernel_ready.argtypes = [ctypes.c_void_p]
+def kernel_ready(kernel):
+    return _fraktal.fraktal_kernel_ready(kernel)
+
 _fraktal.fraktal_destroy_kernel.restype = None
 _fraktal.fraktal_destroy_kernel.argtypes = [ctypes.c_void_p]
 def destroy_kernel(kernel):
@@ -166,6 +310,78 @@ _fraktal.fraktal_run_kernel.argtypes = [ctypes.c_void_p]
 def run_kernel(array):
     _fraktal.fraktal_run_kernel(array)
 
+_fraktal.fraktal_run_kernel_region.restype = None
+_fraktal.fraktal_run_kernel_region.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int]
+def run_kernel_region(array, x, y, width, height):
+    _fraktal.fraktal_run_kernel_region(array, x, y, width, height)
+
+_fraktal.fraktal_run_kernel_slices.restype = None
+_fraktal.fraktal_run_kernel_slices.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int]
+def run_kernel_slices(array, first_slice, num_slices):
+    _fraktal.fraktal_run_kernel_slices(array, first_slice, num_slices)
+
+_fraktal.fraktal_run_kernel_mrt.restype = None
+_fraktal.fraktal_run_kernel_mrt.argtypes = [ctypes.c_void_p, ctypes.c_int]
+def run_kernel_mrt(arrays):
+    outs = (ctypes.c_void_p*len(arrays))(*arrays)
+    _fraktal.fraktal_run_kernel_mrt(outs, len(arrays))
+
+_fraktal.fraktal_eval_points.restype = None
+_fraktal.fraktal_eval_points.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+def eval_points(kernel, points, out):
+    _fraktal.fraktal_eval_points(kernel, points, out)
+
+_fraktal.fraktal_run_kernel_batch.restype = None
+_fraktal.fraktal_run_kernel_batch.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int, ctypes.c_int]
+def run_kernel_batch(array, params, tile_width, tile_height):
+    _fraktal.fraktal_run_kernel_batch(array, params, tile_width, tile_height)
+
+_fraktal.fraktal_set_kernel_cache_dir.restype = None
+_fraktal.fraktal_set_kernel_cache_dir.argtypes = [ctypes.c_char_p]
+def set_kernel_cache_dir(path):
+    _fraktal.fraktal_set_kernel_cache_dir(None if path is None else _to_char_p(path))
+
+_fraktal.fraktal_export_kernel.restype = ctypes.c_bool
+_fraktal.fraktal_export_kernel.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+def export_kernel(kernel, path):
+    return _fraktal.fraktal_export_kernel(kernel, _to_char_p(path))
+
+_fraktal.fraktal_import_kernel.restype = ctypes.c_void_p
+_fraktal.fraktal_import_kernel.argtypes = [ctypes.c_char_p]
+def import_kernel(path):
+    return _fraktal.fraktal_import_kernel(_to_char_p(path))
+
+class _KernelStats(ctypes.Structure):
+    _fields_ = [('dispatches', ctypes.c_int),
+                ('pixels', ctypes.c_longlong),
+                ('total_ms', ctypes.c_double),
+                ('min_ms', ctypes.c_double),
+                ('max_ms', ctypes.c_double),
+                ('average_ms', ctypes.c_double)]
+
+_fraktal.fraktal_enable_kernel_stats.restype = None
+_fraktal.fraktal_enable_kernel_stats.argtypes = [ctypes.c_bool]
+def enable_kernel_stats(enable):
+    _fraktal.fraktal_enable_kernel_stats(enable)
+
+_fraktal.fraktal_get_kernel_stats.restype = None
+_fraktal.fraktal_get_kernel_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(_KernelStats)]
+def get_kernel_stats(kernel):
+    """ Returns the statistics as a dict (kernel may be None, see fraktal.h). """
+    stats = _KernelStats()
+    _fraktal.fraktal_get_kernel_stats(kernel, ctypes.byref(stats))
+    return dict((name, getattr(stats, name)) for name,_ in _KernelStats._fields_)
+
+_fraktal.fraktal_reset_kernel_stats.restype = None
+_fraktal.fraktal_reset_kernel_stats.argtypes = [ctypes.c_void_p]
+def reset_kernel_stats(kernel):
+    _fraktal.fraktal_reset_kernel_stats(kernel)
+
+_fraktal.fraktal_set_tile_budget.restype = None
+_fraktal.fraktal_set_tile_budget.argtypes = [ctypes.c_float]
+def set_tile_budget(budget_ms):
+    _fraktal.fraktal_set_tile_budget(budget_ms)
+
 ############################################################
 # §4 Parameters
 ############################################################
@@ -240,15 +456,25 @@ def param_array(offset, array):
 # §5 Context management
 ############################################################
 
-_fraktal.fraktal_create_context.restype = None
+_fraktal.fraktal_create_context.restype = ctypes.c_void_p
 _fraktal.fraktal_create_context.argtypes = []
 def create_context():
-    _fraktal.fraktal_create_context()
+    return _fraktal.fraktal_create_context()
 
 _fraktal.fraktal_destroy_context.restype = None
-_fraktal.fraktal_destroy_context.argtypes = []
-def destroy_context():
-    _fraktal.fraktal_destroy_context()
+_fraktal.fraktal_destroy_context.argtypes = [ctypes.c_void_p]
+def destroy_context(context):
+    _fraktal.fraktal_destroy_context(context)
+
+_fraktal.fraktal_set_current_context.restype = None
+_fraktal.fraktal_set_current_context.argtypes = [ctypes.c_void_p]
+def set_current_context(context):
+    _fraktal.fraktal_set_current_context(context)
+
+_fraktal.fraktal_get_current_context.restype = ctypes.c_void_p
+_fraktal.fraktal_get_current_context.argtypes = []
+def get_current_context():
+    return _fraktal.fraktal_get_current_context()
 
 _fraktal.fraktal_push_current_context.restype = None
 _fraktal.fraktal_push_current_context.argtypes = []
@@ -259,3 +485,144 @@ _fraktal.fraktal_pop_current_context.restype = None
 _fraktal.fraktal_pop_current_context.argtypes = []
 def pop_current_context():
     _fraktal.fraktal_pop_current_context()
+
+############################################################
+# §6 CPU evaluation
+############################################################
+
+_fraktal.fraktal_create_cpu_model.restype = ctypes.c_void_p
+_fraktal.fraktal_create_cpu_model.argtypes = [ctypes.POINTER(ctypes.c_char_p), ctypes.c_int]
+def create_cpu_model(sources):
+    psources = (ctypes.c_char_p * len(sources))(*[_to_char_p(s) for s in sources])
+    return _fraktal.fraktal_create_cpu_model(psources, len(sources))
+
+_fraktal.fraktal_load_cpu_model.restype = ctypes.c_void_p
+_fraktal.fraktal_load_cpu_model.argtypes = [ctypes.POINTER(ctypes.c_char_p), ctypes.c_int]
+def load_cpu_model(paths):
+    ppaths = (ctypes.c_char_p * len(paths))(*[_to_char_p(p) for p in paths])
+    return _fraktal.fraktal_load_cpu_model(ppaths, len(paths))
+
+_fraktal.fraktal_destroy_cpu_model.restype = None
+_fraktal.fraktal_destroy_cpu_model.argtypes = [ctypes.c_void_p]
+def destroy_cpu_model(model):
+    _fraktal.fraktal_destroy_cpu_model(model)
+
+_fraktal.fraktal_eval_cpu_model.restype = None
+_fraktal.fraktal_eval_cpu_model.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int]
+def eval_cpu_model(model, x, y, z):
+    count = len(x)
+    assert len(y) == count and len(z) == count
+    px = _to_buffer(FLOAT, count, x)
+    py = _to_buffer(FLOAT, count, y)
+    pz = _to_buffer(FLOAT, count, z)
+    d = _empty_buffer(FLOAT, count)
+    _fraktal.fraktal_eval_cpu_model(model, px, py, pz, d, count)
+    return _from_buffer(FLOAT, d)
+
+_fraktal.fraktal_eval_cpu_model_bounds.restype = None
+_fraktal.fraktal_eval_cpu_model_bounds.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int]
+def eval_cpu_model_bounds(model, box_min, box_max):
+    """ box_min and box_max are lists of (x,y,z) corners. Returns (d_min, d_max). """
+    count = len(box_min)
+    assert len(box_max) == count
+    pmin = _to_buffer(FLOAT, 3*count, [v for p in box_min for v in p])
+    pmax = _to_buffer(FLOAT, 3*count, [v for p in box_max for v in p])
+    d_min = _empty_buffer(FLOAT, count)
+    d_max = _empty_buffer(FLOAT, count)
+    _fraktal.fraktal_eval_cpu_model_bounds(model, pmin, pmax, d_min, d_max, count)
+    return _from_buffer(FLOAT, d_min), _from_buffer(FLOAT, d_max)
+
+_fraktal.fraktal_set_cpu_threads.restype = None
+_fraktal.fraktal_set_cpu_threads.argtypes = [ctypes.c_int]
+def set_cpu_threads(count):
+    _fraktal.fraktal_set_cpu_threads(count)
+
+_fraktal.fraktal_create_octree.restype = ctypes.c_void_p
+_fraktal.fraktal_create_octree.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int]
+def create_octree(model, box_min, box_max, depth):
+    return _fraktal.fraktal_create_octree(model, _to_buffer(FLOAT, 3, box_min), _to_buffer(FLOAT, 3, box_max), depth)
+
+_fraktal.fraktal_destroy_octree.restype = None
+_fraktal.fraktal_destroy_octree.argtypes = [ctypes.c_void_p]
+def destroy_octree(octree):
+    _fraktal.fraktal_destroy_octree(octree)
+
+_fraktal.fraktal_octree_cell.restype = ctypes.c_int
+_fraktal.fraktal_octree_cell.argtypes = [ctypes.c_void_p, ctypes.c_float, ctypes.c_float, ctypes.c_float]
+def octree_cell(octree, x, y, z):
+    return _fraktal.fraktal_octree_cell(octree, x, y, z)
+
+_fraktal.fraktal_octree_cells.restype = ctypes.c_int
+_fraktal.fraktal_octree_cells.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int]
+def octree_cells(octree, state):
+    """ Returns the leaf cells with the given state as a list of (box_min, box_max) pairs. """
+    count = _fraktal.fraktal_octree_cells(octree, state, None, None, 0)
+    pmin = _empty_buffer(FLOAT, 3*count)
+    pmax = _empty_buffer(FLOAT, 3*count)
+    _fraktal.fraktal_octree_cells(octree, state, pmin, pmax, count)
+    return [((pmin[3*i], pmin[3*i+1], pmin[3*i+2]), (pmax[3*i], pmax[3*i+1], pmax[3*i+2])) for i in range(count)]
+
+############################################################
+# §7 Mesh extraction
+############################################################
+
+_fraktal.fraktal_extract_mesh.restype = ctypes.c_void_p
+_fraktal.fraktal_extract_mesh.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int]
+def extract_mesh(kernel, box_min, box_max, resolution):
+    return _fraktal.fraktal_extract_mesh(kernel, _to_buffer(FLOAT, 3, box_min), _to_buffer(FLOAT, 3, box_max), resolution)
+
+_fraktal.fraktal_destroy_mesh.restype = None
+_fraktal.fraktal_destroy_mesh.argtypes = [ctypes.c_void_p]
+def destroy_mesh(mesh):
+    _fraktal.fraktal_destroy_mesh(mesh)
+
+_fraktal.fraktal_mesh_vertex_count.restype = ctypes.c_int
+_fraktal.fraktal_mesh_vertex_count.argtypes = [ctypes.c_void_p]
+_fraktal.fraktal_mesh_triangle_count.restype = ctypes.c_int
+_fraktal.fraktal_mesh_triangle_count.argtypes = [ctypes.c_void_p]
+_fraktal.fraktal_mesh_vertices.restype = ctypes.POINTER(ctypes.c_float)
+_fraktal.fraktal_mesh_vertices.argtypes = [ctypes.c_void_p]
+_fraktal.fraktal_mesh_normals.restype = ctypes.POINTER(ctypes.c_float)
+_fraktal.fraktal_mesh_normals.argtypes = [ctypes.c_void_p]
+_fraktal.fraktal_mesh_indices.restype = ctypes.POINTER(ctypes.c_uint)
+_fraktal.fraktal_mesh_indices.argtypes = [ctypes.c_void_p]
+def mesh_buffers(mesh):
+    """ Returns the vertices, normals and triangles of the mesh as lists of triples. """
+    nv = _fraktal.fraktal_mesh_vertex_count(mesh)
+    nt = _fraktal.fraktal_mesh_triangle_count(mesh)
+    v = _fraktal.fraktal_mesh_vertices(mesh)
+    n = _fraktal.fraktal_mesh_normals(mesh)
+    t = _fraktal.fraktal_mesh_indices(mesh)
+    vertices = [(v[3*i], v[3*i+1], v[3*i+2]) for i in range(nv)]
+    normals = [(n[3*i], n[3*i+1], n[3*i+2]) for i in range(nv)]
+    triangles = [(t[3*i], t[3*i+1], t[3*i+2]) for i in range(nt)]
+    return vertices, normals, triangles
+
+_fraktal.fraktal_save_mesh.restype = ctypes.c_bool
+_fraktal.fraktal_save_mesh.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+def save_mesh(mesh, path):
+    return _fraktal.fraktal_save_mesh(mesh, _to_char_p(path))
+
+############################################################
+# §8 Brick cache
+############################################################
+
+_fraktal.fraktal_bake_bricks.restype = ctypes.c_void_p
+_fraktal.fraktal_bake_bricks.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int]
+def bake_bricks(kernel, box_min, box_max, resolution):
+    return _fraktal.fraktal_bake_bricks(kernel, _to_buffer(FLOAT, 3, box_min), _to_buffer(FLOAT, 3, box_max), resolution)
+
+_fraktal.fraktal_destroy_bricks.restype = None
+_fraktal.fraktal_destroy_bricks.argtypes = [ctypes.c_void_p]
+def destroy_bricks(bricks):
+    _fraktal.fraktal_destroy_bricks(bricks)
+
+_fraktal.fraktal_brick_count.restype = ctypes.c_int
+_fraktal.fraktal_brick_count.argtypes = [ctypes.c_void_p]
+def brick_count(bricks):
+    return _fraktal.fraktal_brick_count(bricks)
+
+_fraktal.fraktal_param_bricks.restype = None
+_fraktal.fraktal_param_bricks.argtypes = [ctypes.c_void_p]
+def param_bricks(bricks):
+    _fraktal.fraktal_param_bricks(bricks)
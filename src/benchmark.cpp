@@ -0,0 +1,350 @@
+/*
+    Headless render benchmark for fraktal.
+    Developed by Simen Haugo.
+    See LICENSE.txt for copyright and licensing details (standard MIT License).
+
+    Renders every model in examples/ with each of the bundled renderers, at
+    a fixed resolution and number of samples, from the camera and scene
+    parameters that the GUI starts with, and writes the timings as JSON.
+    Run it from the root of the repository (see 'make benchmark'):
+
+        bin/benchmark -out benchmark.json
+
+    For each model and renderer (and draw mode of libf/geometry.f) the
+    result has the time to link the kernel, the GPU time per sample (see
+    fraktal_get_kernel_stats), and the wall time of all samples including
+    the read-back at the end. Primary rays per second are computed from
+    the wall time, as some drivers (e.g. llvmpipe) do not count all of the
+    work in their timer queries. A sample is rendered before the timed
+    ones, so that lazy allocations and compilation are not timed.
+*/
+#include "fraktal.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <chrono>
+#include <file.h>
+#include <args.h>
+#include "widgets/view_matrix.h"
+#include "widgets/defaults.h"
+
+static double benchmark_now_ms()
+{
+    using namespace std::chrono;
+    return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+struct benchmarkRenderer
+{
+    const char *path;
+    int draw_mode; // iDrawMode, or -1 if the renderer has none
+};
+
+static const benchmarkRenderer benchmark_renderers[] = {
+    { "libf/publication.f", 0 }, // color
+    { "libf/basic.f", -1 },
+    { "libf/ao.f", -1 },
+    { "libf/geometry.f", 0 }, // normals
+    { "libf/geometry.f", 1 }, // depth
+    { "libf/geometry.f", 2 }, // thickness
+    { "libf/geometry.f", 3 }, // gbuffer
+};
+
+struct benchmarkResult
+{
+    bool ok;
+    double link_ms;
+    int timed_samples;
+    double gpu_ms_per_sample;
+    double mrays_per_s;
+    double wall_ms;
+};
+
+// The default values of the GUI widgets (see src/widgets/defaults.h),
+// turned into parameters as the widgets' set_params do
+static void set_default_params(fKernel *f, int width, int height)
+{
+    // Widget_Camera
+    float3 r = { deg2rad(default_camera_dir.theta), deg2rad(default_camera_dir.phi), 0.0f };
+    float view[4*4];
+    compute_view_matrix(view, default_camera_pos, r);
+    float cx = (0.5f + 0.5f*default_camera_shift.x)*width;
+    float cy = (0.5f + 0.5f*default_camera_shift.y)*height;
+    fraktal_param_2f(fraktal_get_param_offset(f, "iCameraCenter"), cx, cy);
+    fraktal_param_1f(fraktal_get_param_offset(f, "iCameraF"), yfov2pinhole_f(default_camera_yfov, (float)height));
+    fraktal_param_transpose_matrix4f(fraktal_get_param_offset(f, "iView"), view);
+
+    // Widget_Sun
+    float3 strength = default_sun_color;
+    strength.x *= default_sun_intensity;
+    strength.y *= default_sun_intensity;
+    strength.z *= default_sun_intensity;
+    float3 to_sun = angle2float3(default_sun_dir);
+    fraktal_param_3f(fraktal_get_param_offset(f, "iSunStrength"), strength.x, strength.y, strength.z);
+    fraktal_param_3f(fraktal_get_param_offset(f, "iToSun"), to_sun.x, to_sun.y, to_sun.z);
+    fraktal_param_1f(fraktal_get_param_offset(f, "iCosSunSize"), cosf(deg2rad(default_sun_size)/2.0f));
+
+    // Widget_Ground
+    float3 isoline_color = default_isolines_color;
+    float isoline_max = default_isolines_count*default_isolines_spacing + default_isolines_thickness*0.5f;
+    fraktal_param_1i(fraktal_get_param_offset(f, "iDrawIsolines"), default_isolines_enabled ? 1 : 0);
+    fraktal_param_3f(fraktal_get_param_offset(f, "iIsolineColor"), isoline_color.x, isoline_color.y, isoline_color.z);
+    fraktal_param_1f(fraktal_get_param_offset(f, "iIsolineThickness"), default_isolines_thickness);
+    fraktal_param_1f(fraktal_get_param_offset(f, "iIsolineSpacing"), default_isolines_spacing);
+    fraktal_param_1f(fraktal_get_param_offset(f, "iIsolineMax"), isoline_max);
+    fraktal_param_1i(fraktal_get_param_offset(f, "iGroundReflective"), default_ground_reflective ? 1 : 0);
+    fraktal_param_1f(fraktal_get_param_offset(f, "iGroundHeight"), default_ground_height);
+    fraktal_param_1f(fraktal_get_param_offset(f, "iGroundSpecularExponent"), default_ground_specular_exponent);
+    fraktal_param_1f(fraktal_get_param_offset(f, "iGroundReflectivity"), default_ground_reflectivity);
+
+    // Widget_Material
+    float3 specular_albedo = default_material_specular_albedo;
+    float3 albedo = default_material_albedo;
+    fraktal_param_1i(fraktal_get_param_offset(f, "iMaterialGlossy"), default_material_glossy ? 1 : 0);
+    fraktal_param_1f(fraktal_get_param_offset(f, "iMaterialSpecularExponent"), default_material_specular_exponent);
+    fraktal_param_3f(fraktal_get_param_offset(f, "iMaterialSpecularAlbedo"), specular_albedo.x, specular_albedo.y, specular_albedo.z);
+    fraktal_param_3f(fraktal_get_param_offset(f, "iMaterialAlbedo"), albedo.x, albedo.y, albedo.z);
+
+    // Widget_Geometry (without the colormap)
+    fraktal_param_1f(fraktal_get_param_offset(f, "iMinDistance"), default_min_distance);
+    fraktal_param_1f(fraktal_get_param_offset(f, "iMaxDistance"), default_max_distance);
+    fraktal_param_1f(fraktal_get_param_offset(f, "iMinThickness"), default_min_thickness);
+    fraktal_param_1f(fraktal_get_param_offset(f, "iMaxThickness"), default_max_thickness);
+    fraktal_param_1i(fraktal_get_param_offset(f, "iApplyColormap"), default_apply_colormap ? 1 : 0);
+
+    fraktal_param_2f(fraktal_get_param_offset(f, "iResolution"), (float)width, (float)height);
+}
+
+static fKernel *link_render_kernel(const char *model_path, const char *render_path)
+{
+    static char *hg_sdf = read_file("libf/hg_sdf.f");
+    if (!hg_sdf)
+    {
+        log_err("Failed to load hg_sdf: file is corrupt or not in the expected directory (libf/hg_sdf.f)\n");
+        return NULL;
+    }
+    fLinkState *link = fraktal_create_link();
+    fKernel *kernel = NULL;
+    if (fraktal_add_link_library(link, hg_sdf, 0, "libf/hg_sdf.f") &&
+        fraktal_add_link_file(link, model_path) &&
+        fraktal_add_link_file(link, render_path))
+        kernel = fraktal_link_kernel(link);
+    fraktal_destroy_link(link);
+    return kernel;
+}
+
+static benchmarkResult run_benchmark(const char *model_path, benchmarkRenderer renderer, int width, int height, int samples)
+{
+    benchmarkResult result = { 0 };
+
+    double link_begin = benchmark_now_ms();
+    fKernel *f = link_render_kernel(model_path, renderer.path);
+    result.link_ms = benchmark_now_ms() - link_begin;
+    if (!f)
+        return result;
+
+    fArray *out = fraktal_create_array(NULL, width, height, 4, FRAKTAL_FLOAT, FRAKTAL_READ_WRITE);
+    float *pixels = (float*)malloc((size_t)width*height*4*sizeof(float));
+    fraktal_assert(out && pixels);
+
+    fraktal_use_kernel(f);
+    set_default_params(f, width, height);
+    fraktal_param_1i(fraktal_get_param_offset(f, "iDrawMode"), renderer.draw_mode);
+
+    // libf/basic.f starts each ray at a distance found by tracing cones
+    // through a low-resolution buffer (as in the GUI's render_color)
+    fArray *cones = NULL;
+    if (fraktal_get_param_offset(f, "iMode") >= 0)
+    {
+        cones = fraktal_create_array(NULL, 16, 12, 1, FRAKTAL_FLOAT, FRAKTAL_READ_WRITE);
+        fraktal_param_2f(fraktal_get_param_offset(f, "iLowResolution"), 16.0f, 12.0f);
+        fraktal_param_1i(fraktal_get_param_offset(f, "iMode"), 1);
+        fraktal_zero_array(cones);
+        fraktal_run_kernel(cones);
+        fraktal_param_1i(fraktal_get_param_offset(f, "iMode"), 0);
+        fraktal_param_array(fraktal_get_param_offset(f, "iChannel0"), cones);
+    }
+
+    // warm-up sample, which is not timed
+    fraktal_zero_array(out);
+    fraktal_param_1i(fraktal_get_param_offset(f, "iSamples"), 0);
+    fraktal_run_kernel(out);
+    fraktal_to_cpu(pixels, out);
+    fraktal_reset_kernel_stats(f);
+
+    double begin = benchmark_now_ms();
+    fraktal_zero_array(out);
+    for (int i = 0; i < samples; i++)
+    {
+        fraktal_param_1i(fraktal_get_param_offset(f, "iSamples"), i);
+        fraktal_run_kernel(out);
+    }
+    fraktal_to_cpu(pixels, out);
+    result.wall_ms = benchmark_now_ms() - begin;
+
+    // the read-back waits for the GPU, so every result is available
+    fKernelStats stats;
+    fraktal_get_kernel_stats(f, &stats);
+    result.timed_samples = stats.dispatches;
+    if (stats.dispatches > 0)
+        result.gpu_ms_per_sample = stats.total_ms/stats.dispatches;
+    if (result.wall_ms > 0.0)
+        result.mrays_per_s = 1e-3*(double)width*height*samples/result.wall_ms;
+    result.ok = true;
+
+    fraktal_use_kernel(NULL);
+    fraktal_destroy_array(cones);
+    fraktal_destroy_array(out);
+    fraktal_destroy_kernel(f);
+    free(pixels);
+    return result;
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+// Returns the .f files in 'dir' in sorted order, so that the results are
+// listed in the same order on every run.
+static int list_models(const char *dir, char **paths, int max_paths)
+{
+    DIR *d = opendir(dir);
+    if (!d)
+        return 0;
+    int count = 0;
+    while (struct dirent *e = readdir(d))
+    {
+        size_t n = strlen(e->d_name);
+        if (n < 3 || strcmp(e->d_name + n - 2, ".f") != 0 || count == max_paths)
+            continue;
+        paths[count] = (char*)malloc(strlen(dir) + 1 + n + 1);
+        fraktal_assert(paths[count] && "Ran out of memory");
+        sprintf(paths[count], "%s/%s", dir, e->d_name);
+        count++;
+    }
+    closedir(d);
+    qsort(paths, count, sizeof(char*), compare_strings);
+    return count;
+}
+
+// Writes 's' as a JSON string, with quotes, backslashes and control
+// characters escaped (driver strings and paths may contain any of them)
+static void write_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (const unsigned char *c = (const unsigned char*)s; *c; c++)
+    {
+        if (*c == '"' || *c == '\\') fprintf(f, "\\%c", *c);
+        else if (*c == '\n') fprintf(f, "\\n");
+        else if (*c == '\t') fprintf(f, "\\t");
+        else if (*c < 0x20) fprintf(f, "\\u%04x", *c);
+        else fputc(*c, f);
+    }
+    fputc('"', f);
+}
+
+int main(int argc, char **argv)
+{
+    int width, height, samples;
+    const char *out_path;
+    const char *models_dir;
+    arg_int32(&width, 320, "-width", "Width of the rendered images");
+    arg_int32(&height, 240, "-height", "Height of the rendered images");
+    arg_int32(&samples, 16, "-samples", "Number of timed samples per model and renderer");
+    arg_string(&models_dir, "examples", "-models", "Directory of models to render");
+    arg_string(&out_path, NULL, "-out", "Write the JSON results to this file (default: stdout)");
+    if (!arg_parse(argc, argv) || width < 1 || height < 1 || samples < 1)
+    {
+        arg_help();
+        return 1;
+    }
+
+    fContext *context = fraktal_create_context();
+    if (!context)
+    {
+        log_err("Failed to create a context for fraktal.\n");
+        return 1;
+    }
+    fraktal_enable_kernel_stats(true);
+
+    enum { max_models = 256 };
+    char *models[max_models];
+    int num_models = list_models(models_dir, models, max_models);
+    if (num_models == 0)
+    {
+        log_err("Found no models (.f files) in '%s'.\n", models_dir);
+        return 1;
+    }
+
+    FILE *f = out_path ? fopen(out_path, "w") : stdout;
+    if (!f)
+    {
+        log_err("Failed to open '%s' for writing.\n", out_path);
+        return 1;
+    }
+
+    #ifdef FRAKTAL_SOFTWARE
+    const char *backend = "software";
+    const char *device = "cpu";
+    #else
+    const char *backend = "opengl";
+    const char *device = (const char*)glGetString(GL_RENDERER);
+    const char *version = (const char*)glGetString(GL_VERSION);
+    #endif
+
+    fprintf(f, "{\n");
+    fprintf(f, "\t\"backend\": \"%s\",\n", backend);
+    fprintf(f, "\t\"device\": ");
+    write_json_string(f, device ? device : "");
+    fprintf(f, ",\n");
+    #ifndef FRAKTAL_SOFTWARE
+    fprintf(f, "\t\"driver_version\": ");
+    write_json_string(f, version ? version : "");
+    fprintf(f, ",\n");
+    #endif
+    fprintf(f, "\t\"width\": %d,\n", width);
+    fprintf(f, "\t\"height\": %d,\n", height);
+    fprintf(f, "\t\"samples\": %d,\n", samples);
+    fprintf(f, "\t\"results\": [\n");
+
+    bool all_ok = true;
+    double total_begin = benchmark_now_ms();
+    int num_renderers = sizeof(benchmark_renderers)/sizeof(benchmark_renderers[0]);
+    for (int i = 0; i < num_models; i++)
+    for (int j = 0; j < num_renderers; j++)
+    {
+        benchmarkRenderer renderer = benchmark_renderers[j];
+        benchmarkResult r = run_benchmark(models[i], renderer, width, height, samples);
+        if (!r.ok)
+        {
+            log_err("Failed to link '%s' with '%s'.\n", models[i], renderer.path);
+            all_ok = false;
+        }
+        fprintf(f, "\t\t{ \"model\": ");
+        write_json_string(f, models[i]);
+        fprintf(f, ", \"renderer\": ");
+        write_json_string(f, renderer.path);
+        fprintf(f, ", \"draw_mode\": %d, ", renderer.draw_mode);
+        if (r.ok)
+            fprintf(f, "\"link_ms\": %.3f, \"timed_samples\": %d, \"gpu_ms_per_sample\": %.4f, \"mrays_per_s\": %.3f, \"wall_ms\": %.3f }",
+                r.link_ms, r.timed_samples, r.gpu_ms_per_sample, r.mrays_per_s, r.wall_ms);
+        else
+            fprintf(f, "\"error\": \"link failed\" }");
+        fprintf(f, i == num_models - 1 && j == num_renderers - 1 ? "\n" : ",\n");
+        fflush(f);
+    }
+
+    fprintf(f, "\t],\n");
+    fprintf(f, "\t\"total_wall_ms\": %.3f\n", benchmark_now_ms() - total_begin);
+    fprintf(f, "}\n");
+    if (f != stdout)
+        fclose(f);
+
+    for (int i = 0; i < num_models; i++)
+        free(models[i]);
+    fraktal_destroy_context(context);
+    return all_ok ? 0 : 1;
+}
@@ -23,6 +23,20 @@ or #define them directly if you do a unity build.
 -D FRAKTAL_OMIT_GL_SYMBOLS -> prevents definition of OpenGL symbols
                               (useful for unity-builds)
 -D fraktal_assert          -> bring your own assert macro
+-D FRAKTAL_HEADLESS        -> create contexts with EGL instead of GLFW, which
+                              needs no display server (link with -lEGL)
+-D FRAKTAL_SOFTWARE        -> run kernels on the CPU instead of OpenGL, by
+                              compiling them with the system C++ compiler
+                              (Linux and macOS; link with -ldl -pthread)
+
+The software backend invokes the compiler given by the FRAKTAL_CXX
+environment variable (default c++) when a kernel is linked, with any extra
+flags given by FRAKTAL_CXXFLAGS. It cannot be used with the GUI.
+
+The CPU evaluator (fraktal_eval_cpu_model) uses std::thread, so link with
+-pthread on Linux. Its inner loops are vectorized by the compiler; build
+with optimizations and e.g. -march=native -fno-math-errno to get 8 or 16
+lanes with AVX2 or AVX-512.
 
 */
 
@@ -37,6 +51,21 @@ or #define them directly if you do a unity build.
 #define fraktal_assert assert
 #endif
 
+#if defined(FRAKTAL_SOFTWARE) && defined(FRAKTAL_GUI)
+#error "The GUI needs OpenGL and cannot be built with FRAKTAL_SOFTWARE."
+#endif
+
+#ifdef FRAKTAL_SOFTWARE
+#include "fraktal_types.h"
+#include "fraktal_cpu.h"
+#include "fraktal_software.h"
+#include "fraktal_cache.h"
+#include "fraktal_parse.h"
+#include "fraktal_link.h"
+#include "fraktal_software_link.h"
+#include "fraktal_mesh.h"
+#include "fraktal_bricks.h"
+#else
 #ifndef FRAKTAL_OMIT_GL_SYMBOLS
 #include <GL/gl3w.h>
 #include <GL/gl3w.c>
@@ -46,7 +75,13 @@ or #define them directly if you do a unity build.
 
 #include "fraktal_types.h"
 #include "fraktal_context.h"
+#include "fraktal_timer.h"
 #include "fraktal_array.h"
 #include "fraktal_kernel.h"
+#include "fraktal_cache.h"
 #include "fraktal_parse.h"
 #include "fraktal_link.h"
+#include "fraktal_cpu.h"
+#include "fraktal_mesh.h"
+#include "fraktal_bricks.h"
+#endif
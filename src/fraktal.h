@@ -10,11 +10,23 @@ Index of this file:
 ....fEnum
 §2 Arrays
 ....fraktal_create_array
+....fraktal_create_array_3d
+....fraktal_create_points
 ....fraktal_destroy_array
+....fraktal_set_array_pool_budget
+....fraktal_trim_array_pool
 ....fraktal_zero_array
 ....fraktal_to_cpu
+....fraktal_update_array
+....fraktal_to_cpu_region
+....fraktal_upload_region
+....fraktal_to_cpu_async
+....fraktal_poll
+....fraktal_wait
 ....fraktal_array_format
 ....fraktal_array_size
+....fraktal_array_depth
+....fraktal_array_count
 ....fraktal_array_channels
 ....fraktal_is_valid_array
 ....fraktal_get_gl_handle
@@ -22,22 +34,65 @@ Index of this file:
 ....fraktal_create_link
 ....fraktal_destroy_link
 ....fraktal_add_link_data
+....fraktal_add_link_library
 ....fraktal_link_kernel
+....fraktal_link_kernel_async
+....fraktal_kernel_ready
 ....fraktal_destroy_kernel
 ....fraktal_load_kernel
 ....fraktal_use_kernel
 ....fraktal_run_kernel
+....fraktal_run_kernel_region
+....fraktal_run_kernel_slices
+....fraktal_run_kernel_mrt
+....fraktal_eval_points
+....fraktal_run_kernel_batch
+....fraktal_set_kernel_cache_dir
+....fraktal_export_kernel
+....fraktal_import_kernel
+....fraktal_enable_kernel_stats
+....fraktal_get_kernel_stats
+....fraktal_reset_kernel_stats
+....fraktal_set_tile_budget
 §4 Parameters
 ....fraktal_get_param_offset
 ....fraktal_param_...
 §5 Context management
 ....fraktal_create_context
 ....fraktal_destroy_context
+....fraktal_set_current_context
+....fraktal_get_current_context
 ....fraktal_push_current_context
 ....fraktal_pop_current_context
+§6 CPU evaluation
+....fraktal_create_cpu_model
+....fraktal_load_cpu_model
+....fraktal_destroy_cpu_model
+....fraktal_eval_cpu_model
+....fraktal_eval_cpu_model_bounds
+....fraktal_set_cpu_threads
+....fraktal_create_octree
+....fraktal_destroy_octree
+....fraktal_octree_cell
+....fraktal_octree_cells
+§7 Mesh extraction
+....fraktal_extract_mesh
+....fraktal_destroy_mesh
+....fraktal_mesh_vertex_count
+....fraktal_mesh_triangle_count
+....fraktal_mesh_vertices
+....fraktal_mesh_normals
+....fraktal_mesh_indices
+....fraktal_save_mesh
+§8 Brick cache
+....fraktal_bake_bricks
+....fraktal_destroy_bricks
+....fraktal_brick_count
+....fraktal_param_bricks
 */
 
 #pragma once
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -78,29 +133,59 @@ enum fEnum_
     // Texture filter modes
     FRAKTAL_LINEAR,
     FRAKTAL_NEAREST,
+
+    // Array formats (continued)
+    FRAKTAL_HALF,
+    FRAKTAL_UINT16,
+    FRAKTAL_UINT32,
+    FRAKTAL_INT32,
+
+    // Octree cell states
+    FRAKTAL_EMPTY,
+    FRAKTAL_FULL,
+    FRAKTAL_AMBIGUOUS,
 };
 
 struct fArray;
 struct fKernel;
 struct fLinkState;
+struct fContext;
+struct fTransfer;
+struct fCpuModel;
+struct fOctree;
+struct fMesh;
+struct fBrickMap;
+struct fKernelStats;
 
 //-----------------------------------------------------------------------------
 // §2 Arrays
 //-----------------------------------------------------------------------------
 
 /*
-    Creates a 1D or 2D GPU array of packed float or uint8 vector values
-    of the specified dimensions.
+    Creates a 1D or 2D GPU array of packed vector values of the
+    specified dimensions and format.
 
     'data'    : An optional pointer to a region in CPU memory used
                 to initialize the array. The CPU memory must be a
-                contiguous array of packed float or uint8 vector
-                values matching the given channels and dimensions.
+                contiguous array of packed vector values matching the
+                given channels, dimensions and format.
     'width'   : The number of array values along x.
     'height'  : The number of array values along y. If 1, the array
                 is a 1D array, otherwise the array is a 2D array.
     'channels': The number of vector components. Must be 1, 2 or 4.
-    'format'  : Must be FRAKTAL_FLOAT or FRAKTAL_UINT8.
+    'format'  : The type of each vector component, in CPU and GPU
+                memory alike:
+                FRAKTAL_FLOAT  32-bit float
+                FRAKTAL_HALF   16-bit float (IEEE 754 half precision)
+                FRAKTAL_UINT8  8-bit unsigned, normalized to [0,1]
+                FRAKTAL_UINT16 16-bit unsigned, normalized to [0,1]
+                FRAKTAL_UINT32 32-bit unsigned integer
+                FRAKTAL_INT32  32-bit signed integer
+                Kernels read float and normalized formats with
+                sampler1D/2D, and integer formats with usampler1D/2D
+                and isampler1D/2D respectively. Kernel output to an
+                integer array is not blended: it replaces the values
+                instead of being added to them.
     'access'  : Must be FRAKTAL_READ_ONLY or FRAKTAL_READ_WRITE.
 
     If successful, the function returns a handle to a GPU array that
@@ -118,6 +203,43 @@ FRAKTALAPI fArray *fraktal_create_array(
     fEnum format,
     fEnum access);
 
+/*
+    Creates a 3D GPU array of 'depth' slices, each 'width' by 'height'
+    values. The arguments are otherwise as for fraktal_create_array, and
+    'data' holds the slices one after another.
+
+    Kernels read 3D arrays with sampler3D (isampler3D or usampler3D for
+    integer formats), and render into them slice by slice (see
+    fraktal_run_kernel_slices). fraktal_to_cpu_region and
+    fraktal_upload_region do not support 3D arrays.
+*/
+FRAKTALAPI fArray *fraktal_create_array_3d(
+    const void *data,
+    int width,
+    int height,
+    int depth,
+    int channels,
+    fEnum format,
+    fEnum access);
+
+/*
+    Creates a GPU array of 'count' points, each a vector value of the
+    specified channels and format. 'data' holds the points one after
+    another, and is otherwise as for fraktal_create_array.
+
+    Arrays are limited in width by the driver (often to 16384 values),
+    so the points are folded row by row into a 2D array that is as wide
+    as allowed. The folding is undone by fraktal_to_cpu, _to_cpu_async
+    and fraktal_update_array, which read and write 'count' values. Use
+    fraktal_eval_points to run a kernel over the points.
+*/
+FRAKTALAPI fArray *fraktal_create_points(
+    const void *data,
+    int count,
+    int channels,
+    fEnum format,
+    fEnum access);
+
 /*
     Frees all memory associated with an array.
 
@@ -125,6 +247,29 @@ FRAKTALAPI fArray *fraktal_create_array(
 */
 FRAKTALAPI void fraktal_destroy_array(fArray *a);
 
+/*
+    Enables recycling of destroyed arrays in the current context. Up to
+    'max_bytes' of arrays passed to fraktal_destroy_array are kept on the
+    GPU, and fraktal_create_array returns one of them, instead of making
+    a new allocation, if it has the same width, height, channels, format
+    and access mode. This makes temporary arrays in multipass pipelines
+    free to create after the first pass.
+
+    A recycled array holds the values it had when it was destroyed,
+    unless 'data' is given.
+
+    The budget is 0 (recycling disabled) by default. Lowering it frees
+    recycled arrays until it is met.
+*/
+FRAKTALAPI void fraktal_set_array_pool_budget(size_t max_bytes);
+
+/*
+    Frees recycled arrays, least recently destroyed first, until they
+    take up no more than 'max_bytes' (e.g. 0 to free all of them). The
+    budget is unchanged.
+*/
+FRAKTALAPI void fraktal_trim_array_pool(size_t max_bytes);
+
 /*
     Sets each value in the array to 0. If 'a' has multiple channels,
     each channel is set to the value 0.
@@ -142,12 +287,82 @@ FRAKTALAPI void fraktal_zero_array(fArray *a);
 */
 FRAKTALAPI void fraktal_to_cpu(void *cpu_memory, fArray *a);
 
+/*
+    Replaces all values of an array with values from CPU memory, laid
+    out as for fraktal_create_array. The array keeps its GPU allocation,
+    so this is the preferred way to stream new inputs (e.g. a point cloud
+    per frame) to a kernel, instead of destroying and creating arrays.
+
+    The call does not wait for kernels that are still reading the old
+    values; the GPU sees the new values in kernels run after the call.
+*/
+FRAKTALAPI void fraktal_update_array(fArray *a, const void *cpu_memory);
+
+/*
+    Copies the values in a rectangle of a GPU array to CPU memory. Only
+    the rectangle is transferred, so reading a few rows or a crop of a
+    large array is proportionally cheaper than fraktal_to_cpu.
+
+    'x', 'y': The array index of the lower-left value of the rectangle.
+    'width', 'height': The size of the rectangle. It must lie inside
+              the array (for a 1D array, 'y' is 0 and 'height' is 1).
+    'cpu_memory': Receives the packed values of the rectangle, row by
+              row, and must be width*height values large.
+*/
+FRAKTALAPI void fraktal_to_cpu_region(fArray *a, int x, int y, int width, int height, void *cpu_memory);
+
+/*
+    Replaces the values in a rectangle of a GPU array with values from
+    CPU memory, laid out as for fraktal_to_cpu_region. Arrays of either
+    access mode can be updated.
+*/
+FRAKTALAPI void fraktal_upload_region(fArray *a, int x, int y, int width, int height, const void *cpu_memory);
+
+/*
+    Starts copying the values of a GPU array to CPU memory, like
+    fraktal_to_cpu, but returns without waiting for the GPU to finish
+    rendering into the array. The values are copied into a GPU staging
+    buffer, and from there into 'cpu_memory' once the transfer is
+    completed by fraktal_poll or fraktal_wait. Until then, 'cpu_memory'
+    must remain valid, but the array may be rendered into again.
+
+    For example, a loop can render frame N+1 while frame N is being
+    transferred:
+        fTransfer *t = NULL;
+        for (int i = 0; i < n; i++) {
+            fraktal_run_kernel(out[i % 2]);
+            if (t) fraktal_wait(t);
+            t = fraktal_to_cpu_async(frames[i], out[i % 2]);
+        }
+        fraktal_wait(t);
+
+    Staging buffers are reused for later transfers of the same size.
+
+    The returned handle must be completed by fraktal_poll or fraktal_wait
+    in the same context, which invalidate it.
+*/
+FRAKTALAPI fTransfer *fraktal_to_cpu_async(void *cpu_memory, fArray *a);
+
+/*
+    Returns true and completes the transfer if the GPU has finished
+    copying the array, otherwise returns false immediately.
+*/
+FRAKTALAPI bool fraktal_poll(fTransfer *t);
+
+/*
+    Blocks until the GPU has finished copying the array, and completes
+    the transfer.
+*/
+FRAKTALAPI void fraktal_wait(fTransfer *t);
+
 /*
     These methods return information about an array.
 */
 FRAKTALAPI void fraktal_array_size(fArray *a, int *width, int *height);
 FRAKTALAPI fEnum fraktal_array_format(fArray *a); // -1 if 'a' is NULL
 FRAKTALAPI int fraktal_array_channels(fArray *a); // 0 is 'a' is NULL
+FRAKTALAPI int fraktal_array_depth(fArray *a); // 0 if 'a' is not a 3D array
+FRAKTALAPI int fraktal_array_count(fArray *a); // 0 if 'a' was not created by fraktal_create_points
 
 /*
     Returns true if the fArray satisfies the following properties:
@@ -162,8 +377,10 @@ FRAKTALAPI bool fraktal_is_valid_array(fArray *a);
 /*
     If the backend uses OpenGL 3.1, the result is a GLuint handle to
     the array's underlying Texture Object, which can be passed to
-    glBindTexture. The texture target is either GL_TEXTURE_1D, if
-    'a' is a 1D array, or GL_TEXTURE_2D, if 'a' is a 2D array.
+    glBindTexture. The texture target is GL_TEXTURE_1D, GL_TEXTURE_2D
+    or GL_TEXTURE_3D, if 'a' is a 1D, 2D or 3D array respectively.
+    The software backend (see FRAKTAL_SOFTWARE in fraktal.cpp) has no
+    textures, and returns 0.
 */
 FRAKTALAPI unsigned int fraktal_get_gl_handle(fArray *a);
 
@@ -196,6 +413,10 @@ FRAKTALAPI void fraktal_destroy_link(fLinkState *link);
     'name': An optional name for this input in log messages.
 
     No references are kept to 'data' (it can safely be freed afterward).
+
+    The input is parsed immediately, but compilation is deferred until
+    fraktal_link_kernel. Compilation errors are therefore reported by
+    fraktal_link_kernel.
 */
 FRAKTALAPI bool fraktal_add_link_data(
     fLinkState *link,
@@ -212,6 +433,25 @@ FRAKTALAPI bool fraktal_add_link_data(
 */
 FRAKTALAPI bool fraktal_add_link_file(fLinkState *link, const char *path);
 
+/*
+    Adds source that is shared by several kernels, such as a library of
+    distance functions. Arguments are the same as for add_link_data.
+
+    Preprocessor definitions, constants, structs, uniforms and function
+    prototypes declared by the library are made visible to all inputs
+    that are added to 'link' after it, so these need not #include or
+    repeat the library source. Other global variables remain private
+    to the library.
+
+    Compiled inputs are cached by the content of their source, so a
+    library that is added to many links is only compiled once.
+*/
+FRAKTALAPI bool fraktal_add_link_library(
+    fLinkState *link,
+    const char *data,
+    unsigned int size,
+    const char *name);
+
 /*
     On success, the method returns a fKernel handle required in all
     kernel-specific operations, such as execution, setting parameters,
@@ -222,6 +462,31 @@ FRAKTALAPI bool fraktal_add_link_file(fLinkState *link, const char *path);
 */
 FRAKTALAPI fKernel *fraktal_link_kernel(fLinkState *link);
 
+/*
+    Starts linking a kernel without waiting for the driver to compile
+    it, and returns a pending fKernel handle (or NULL if the link could
+    not be started). 'link' may be destroyed immediately afterward.
+
+    A pending kernel must not be used or given parameters until
+    fraktal_kernel_ready returns 1. It can be destroyed at any time
+    with fraktal_destroy_kernel, which cancels the link.
+
+    If the driver supports GL_KHR_parallel_shader_compile, compilation
+    happens in the background. Otherwise, the work is split up across
+    calls to fraktal_kernel_ready, each compiling at most one input.
+*/
+FRAKTALAPI fKernel *fraktal_link_kernel_async(fLinkState *link);
+
+/*
+    Returns 1 if 'f' has finished linking and can be used, 0 if it is
+    still pending, and -1 if compilation or linking failed, in which
+    case the error is written to the log and 'f' should be destroyed.
+
+    This function does not block, but should be called regularly (e.g.
+    once per frame) for the link to make progress.
+*/
+FRAKTALAPI int fraktal_kernel_ready(fKernel *f);
+
 /*
     Frees memory associated with a kernel. On return, the fKernel handle
     is invalidated and should not be used anywhere.
@@ -267,18 +532,225 @@ FRAKTALAPI void fraktal_use_kernel(fKernel *f);
     * A 2D array of dimensions (w,h) launches a 2D grid of threads with
       indices [0, w-1] x [0, h-1].
 
+    * A 3D array runs the kernel for every slice, as described below.
+
     Results are **added** to the values in 'out'. The array may be
     cleared to zero using fraktal_zero_array(out).
 */
 FRAKTALAPI void fraktal_run_kernel(fArray *out);
 
+/*
+    Runs the current kernel over a rectangle of a 1D or 2D array, with
+    the rectangle given as for fraktal_to_cpu_region. Threads get the
+    same indices as they would in fraktal_run_kernel over the whole
+    array, so an output can be filled over several calls, for example to
+    spread an expensive kernel across the frames of an interactive
+    program.
+*/
+FRAKTALAPI void fraktal_run_kernel_region(fArray *out, int x, int y, int width, int height);
+
+/*
+    Runs the current kernel over the slices [first_slice, first_slice +
+    num_slices) of a 3D array, as a 2D grid of threads per slice. The
+    kernel reads the index of the slice it is writing with
+        int fraktal_slice_index();
+    which is 0 when the output is not a 3D array.
+
+    Large volumes can be filled in batches of slices over several calls,
+    for example to keep an interactive program responsive.
+*/
+FRAKTALAPI void fraktal_run_kernel_slices(fArray *out, int first_slice, int num_slices);
+
+/*
+    Runs the current kernel once and adds each of its outputs to the
+    corresponding array in 'outs', so that a kernel that computes several
+    quantities (e.g. normals, depth and thickness) does not need a pass
+    for each.
+
+    The outputs are the global 'out' variables of the linked kernel,
+    numbered in the order they are declared, e.g.
+        out vec4 fragNormal;    // written to outs[0]
+        out vec4 fragDepth;     // written to outs[1]
+    Outputs declared by several inputs of the link are only counted once.
+
+    'n' can be at most 8. The arrays must have the same dimensions, but
+    may differ in channels and format.
+*/
+FRAKTALAPI void fraktal_run_kernel_mrt(fArray **outs, int n);
+
+/*
+    Runs 'kernel' once for each point in 'points' and adds the results
+    to 'out'. Both arrays must be created by fraktal_create_points with
+    the same number of points. 'points' may be NULL, for kernels that
+    only need the index of the point.
+
+    The kernel reads its point and index with
+        vec4 fraktal_point();
+        int fraktal_point_index(); // in [0, count-1]
+    Outside of fraktal_eval_points the index is gl_FragCoord.x, i.e. the
+    thread index of a 1D output.
+
+    The kernel is made current for the duration of the call, and the
+    previously current kernel is restored afterwards.
+*/
+FRAKTALAPI void fraktal_eval_points(fKernel *kernel, fArray *points, fArray *out);
+
+/*
+    Runs the current kernel once for each of several parameter sets, in
+    a single draw call, and adds the results to tiles of 'out'.
+
+    'params': An array with one row per parameter set. Its height is
+              the number of sets, and its width is the number of values
+              (of up to four channels each) in a set.
+
+    'tile_width', 'tile_height': The size of each tile. Tiles are laid
+              out in rows from the lower-left corner of 'out', with
+              as many tiles per row as fit in its width.
+
+    The kernel reads the values of its set by column index:
+        vec4 fraktal_batch_param(int column);
+    and can use the following in place of gl_FragCoord.xy:
+        vec2 fraktal_batch_coord(); // pixel coordinate within the tile
+        int fraktal_batch_index();  // row of 'params' for this tile
+    When the kernel is run with fraktal_run_kernel, the index is zero,
+    the coordinate is gl_FragCoord.xy, and fraktal_batch_param should
+    not be used.
+
+    Regular parameters (fraktal_param_*) have the same value in all tiles.
+    'out' must be large enough to hold a tile for every set.
+*/
+FRAKTALAPI void fraktal_run_kernel_batch(fArray *out, fArray *params, int tile_width, int tile_height);
+
+/*
+    Enables a persistent on-disk cache of linked kernels. Subsequent
+    calls to fraktal_link_kernel look for a program binary in 'dir'
+    before compiling anything, and store the result there otherwise.
+
+    Entries are keyed by a hash of all inputs to the link, the GLSL
+    version and the GPU driver (vendor, renderer and version string),
+    so an entry is never used with different sources or another driver.
+    Entries are never evicted; the directory can safely be emptied.
+
+    'dir': A path to an existing directory, or NULL to disable the
+           cache (the default).
+
+    The cache has no effect if the driver does not support program
+    binaries (OpenGL 4.1 or ARB_get_program_binary).
+*/
+FRAKTALAPI void fraktal_set_kernel_cache_dir(const char *dir);
+
+/*
+    Writes the linked program binary of a kernel, along with its
+    parameter information, to a file. The file can be loaded with
+    fraktal_import_kernel on a machine with the same GPU and driver,
+    for example to ship pre-linked kernels with a deployed program.
+
+    Returns false if the driver does not support program binaries or
+    the file could not be written.
+*/
+FRAKTALAPI bool fraktal_export_kernel(fKernel *f, const char *path);
+
+/*
+    Loads a kernel written by fraktal_export_kernel. The result is
+    equivalent to the kernel that was exported.
+
+    Returns NULL if the file could not be read, or if the binary was
+    rejected by the driver (e.g. it was created by another driver or
+    driver version). In this case, the caller should fall back to
+    linking the kernel from source.
+
+    If the call is successful, the caller owns the returned fKernel,
+    which should eventually be destroyed with fraktal_destroy_kernel.
+*/
+FRAKTALAPI fKernel *fraktal_import_kernel(const char *path);
+
+/*
+    Enables timing of kernels in the current context. Kernel runs return
+    before the GPU has finished them, so the time is measured on the GPU
+    with timer queries (OpenGL 3.3 or ARB_timer_query), and collected
+    once the results are available without waiting for them. The
+    statistics therefore lag a few runs behind. Runs are not timed while
+    too many results are outstanding, or if the driver has no timer
+    queries. The software backend measures the time of each run on the
+    CPU instead.
+
+    Timing is disabled by default.
+*/
+FRAKTALAPI void fraktal_enable_kernel_stats(bool enable);
+
+/*
+    Statistics of the timed runs of a kernel (see fraktal_enable_kernel_stats).
+    'pixels' counts the output values written by each run (for all slices
+    or tiles), and 'average_ms' is an exponential moving average that
+    follows recent runs. Times are in milliseconds.
+*/
+struct fKernelStats
+{
+    int dispatches;
+    long long pixels;
+    double total_ms;
+    double min_ms;
+    double max_ms;
+    double average_ms;
+};
+
+/*
+    Copies the statistics of a kernel into 'stats', after collecting the
+    timer results that have become available. If 'f' is NULL, the result
+    is the time spent in fraktal_zero_array and fraktal_to_cpu in the
+    current context.
+*/
+FRAKTALAPI void fraktal_get_kernel_stats(fKernel *f, fKernelStats *stats);
+
+/*
+    Sets the statistics of a kernel (or of the context, if 'f' is NULL)
+    to zero. Results of runs before the reset that are still outstanding
+    are discarded.
+*/
+FRAKTALAPI void fraktal_reset_kernel_stats(fKernel *f);
+
+/*
+    Makes fraktal_run_kernel draw its output in tiles that each take about
+    'budget_ms' milliseconds on the GPU, and send each tile to the GPU
+    before drawing the next. A single draw of a large output with an
+    expensive kernel can otherwise run long enough for the operating
+    system to reset the driver, and holds up other users of the GPU (such
+    as a user interface) until it has finished.
+
+    The tiles are cut out of the full output, so kernels see the same
+    gl_FragCoord as without tiles. Their size follows the time measured
+    for the previous tiles of the same kernel (with timer queries, see
+    fraktal_enable_kernel_stats), and the first run of a kernel waits for
+    its first tile to be measured. Without timer queries, the tiles are
+    64x64 pixels. Kernel statistics count each tile as a run.
+
+    A budget of 0 (the default) draws the output at once. The budget
+    applies to the current context, and does not apply to the other ways
+    of running a kernel, or to the software backend.
+*/
+FRAKTALAPI void fraktal_set_tile_budget(float budget_ms);
+
 //-----------------------------------------------------------------------------
 // §4 Parameters
 //-----------------------------------------------------------------------------
 
 /*
+    Uniforms declared by a kernel's source files are gathered into one
+    std140 uniform block, named FraktalParams, and the fraktal_param_*
+    functions write into a CPU copy of that block. The changed part of
+    the block is uploaded in a single update by fraktal_run_kernel, so
+    setting parameters is cheap and values that did not change cost
+    nothing. Parameter values belong to the kernel and persist across
+    calls to fraktal_use_kernel.
+
+    If the driver does not accept the block (e.g. it exceeds
+    GL_MAX_UNIFORM_BLOCK_SIZE), the kernel falls back to plain uniforms,
+    which are set by fraktal_run_kernel from the same CPU copy.
+
+    The offset of a parameter is its byte offset in the block, or its
+    uniform location for samplers (which cannot be placed in a block).
     The value -1 is returned if 'name' refers to a non-existent
-    or unused parameter.
+    parameter or an unused sampler.
 */
 FRAKTALAPI int fraktal_get_param_offset(fKernel *f, const char *name);
 
@@ -323,16 +795,65 @@ FRAKTALAPI void fraktal_param_transpose_matrix4f(int offset, float m[4*4]);
     you may wish to share their context so that GPU resources are visible
     between them. You can achieve this by NOT calling fraktal_create_context.
     In this case, you are responsible for ensuring that a context is current
-    on the thread when calling fraktal functions.
+    on the thread when calling fraktal functions, and for calling
+    fraktal_destroy_context(fraktal_get_current_context()) before you
+    destroy it.
 
     If for some reason you do not wish to share their context, you can
     call fraktal_create_context and use fraktal_push/pop_current_context
     to manage which library has access to the GPU (usually, only one
     context can be current on the same OS thread).
+
+    By default, the context belongs to a hidden GLFW window, which needs
+    a display server. If fraktal is compiled with FRAKTAL_HEADLESS, the
+    context is instead created with EGL (using the surfaceless platform
+    on Mesa, or a pbuffer), and fraktal does not depend on GLFW.
+*/
+
+/*
+    Creates a GPU context and makes it the current fraktal context on the
+    calling thread. Returns NULL on failure. The caller owns the returned
+    fContext, which should eventually be destroyed with
+    fraktal_destroy_context.
+
+    Contexts share nothing, so several threads can use fraktal at the
+    same time as long as each has its own context current. Arrays and
+    kernels belong to the context that was current when they were created,
+    and may only be used while that context is current.
+
+    GLFW only allows windows to be created on the main thread. Without
+    FRAKTAL_HEADLESS, contexts for worker threads must therefore be created
+    on the main thread and handed over with fraktal_set_current_context.
 */
+FRAKTALAPI fContext *fraktal_create_context();
 
-FRAKTALAPI bool fraktal_create_context();
-FRAKTALAPI void fraktal_destroy_context();
+/*
+    Frees the context and its GPU context. Arrays and kernels created in
+    the context should be destroyed first. If 'c' is current on the
+    calling thread, the thread is left without a current context.
+
+    If fraktal was used without calling fraktal_create_context, the fContext
+    it made for your GPU context is freed by passing
+    fraktal_get_current_context() to this function. Your GPU context is
+    left alone, but it must still be current on the calling thread, as the
+    GPU objects fraktal created in it (pooled arrays, pixel buffers, cached
+    shaders) are deleted.
+
+    If 'c' is NULL the function silently returns.
+*/
+FRAKTALAPI void fraktal_destroy_context(fContext *c);
+
+/*
+    Makes 'c' the current fraktal context on the calling thread and binds
+    its GPU context to the thread. A context can only be current on one
+    thread at a time. Passing NULL unbinds the current context.
+*/
+FRAKTALAPI void fraktal_set_current_context(fContext *c);
+
+/*
+    Returns the current fraktal context on the calling thread, or NULL.
+*/
+FRAKTALAPI fContext *fraktal_get_current_context();
 
 /*
     Saves the current GPU context on the calling thread and makes the
@@ -348,6 +869,223 @@ FRAKTALAPI void fraktal_push_current_context();
 */
 FRAKTALAPI void fraktal_pop_current_context();
 
+//-----------------------------------------------------------------------------
+// §6 CPU evaluation
+//-----------------------------------------------------------------------------
+
+/*
+    Models can be evaluated on the CPU, for tools that need distances at
+    a few arbitrary points (collision, placement, picking) or that run on
+    machines without a GPU. None of the functions in this section need a
+    context.
+
+    The evaluator compiles the GLSL subset used by model files and
+    libf/hg_sdf.f: float, int, bool and vec2-4 values, constant arrays,
+    functions (with in, out and inout parameters), if, for, while, break,
+    continue and return, and the common built-in functions. The number of
+    iterations of a loop must be bounded by a constant (it may break out
+    earlier), and array indices must be constant expressions. Uniforms,
+    textures, matrices and structs are not supported. The macros
+    FRAKTAL_CPU and ZERO (=0) are predefined.
+
+    The results agree with the GPU to within floating point rounding:
+    the largest difference measured for the examples, over points in
+    [-2,2]^3, is below 1e-5 in absolute value (or 1e-5 relative to the
+    distance, if it is larger than one).
+*/
+
+/*
+    Compiles the entrypoint 'float model(vec3 p)' from the sources, which
+    are concatenated, e.g. {hg_sdf_source, model_source}. Returns NULL and
+    logs the error if the sources do not compile.
+*/
+FRAKTALAPI fCpuModel *fraktal_create_cpu_model(const char **sources, int num_sources);
+
+/*
+    Same as fraktal_create_cpu_model, but reads the sources from files,
+    e.g. {"libf/hg_sdf.f", "examples/vase.f"}.
+*/
+FRAKTALAPI fCpuModel *fraktal_load_cpu_model(const char **paths, int num_paths);
+
+/*
+    If 'm' is NULL the function silently returns.
+*/
+FRAKTALAPI void fraktal_destroy_cpu_model(fCpuModel *m);
+
+/*
+    Evaluates the model at 'count' points, given as separate arrays of
+    x, y and z coordinates, and writes the distances to 'd'. The points
+    are split into chunks that are shared between threads (see
+    fraktal_set_cpu_threads), and each thread evaluates a batch of points
+    at a time using SIMD instructions (AVX-512 or AVX2 if the CPU has
+    them, when built with GCC on x86-64 Linux).
+*/
+FRAKTALAPI void fraktal_eval_cpu_model(fCpuModel *m, const float *x, const float *y, const float *z, float *d, int count);
+
+/*
+    Bounds the model over 'count' axis-aligned boxes, using interval
+    arithmetic. 'box_min' and 'box_max' hold the corners of each box as
+    xyz triples (3*count values each). For every point p in box i, the
+    function guarantees that
+
+        d_min[i] <= model(p) <= d_max[i]
+
+    up to the differences between the CPU and GPU (see above). The bounds
+    are conservative, but can be much wider than the actual range of the
+    model in the box, especially for large boxes. Boxes are shared between
+    threads as in fraktal_eval_cpu_model.
+*/
+FRAKTALAPI void fraktal_eval_cpu_model_bounds(fCpuModel *m, const float *box_min, const float *box_max, float *d_min, float *d_max, int count);
+
+/*
+    Sets the number of threads used by fraktal_eval_cpu_model, including
+    the calling thread. 0 (the default) uses one per hardware thread.
+    In the software backend, this also sets the number of threads that
+    run kernels.
+*/
+FRAKTALAPI void fraktal_set_cpu_threads(int count);
+
+/*
+    Builds an octree over the box [box_min, box_max] that classifies
+    space by the sign of the model, to skip empty space when rendering,
+    voxelizing or meshing. Each cell is bounded with
+    fraktal_eval_cpu_model_bounds, and marked as
+
+        FRAKTAL_EMPTY     if the model is positive in the entire cell
+        FRAKTAL_FULL      if the model is negative in the entire cell
+        FRAKTAL_AMBIGUOUS otherwise (the cell may contain surface)
+
+    Ambiguous cells are split into eight, down to 'depth' levels below
+    the root (at most 16). The smallest cells are thus 2^-depth times
+    the size of the box along each axis. Ambiguous cells are a superset
+    of the cells that contain the surface, as the bounds are not tight.
+*/
+FRAKTALAPI fOctree *fraktal_create_octree(fCpuModel *m, const float box_min[3], const float box_max[3], int depth);
+
+/*
+    If 'o' is NULL the function silently returns.
+*/
+FRAKTALAPI void fraktal_destroy_octree(fOctree *o);
+
+/*
+    Returns the state of the smallest cell containing the point. Points
+    outside the box of the octree are FRAKTAL_AMBIGUOUS.
+*/
+FRAKTALAPI fEnum fraktal_octree_cell(fOctree *o, float x, float y, float z);
+
+/*
+    Writes the corners of up to 'max_count' leaf cells with the given
+    state to 'box_min' and 'box_max' (as xyz triples), and returns the
+    number of such cells. Pass 0 for max_count to only get the number.
+*/
+FRAKTALAPI int fraktal_octree_cells(fOctree *o, fEnum state, float *box_min, float *box_max, int max_count);
+
+//-----------------------------------------------------------------------------
+// §7 Mesh extraction
+//-----------------------------------------------------------------------------
+
+/*
+    Extracts a triangle mesh of the surface of a model inside the box
+    [box_min, box_max], for tools that need meshes (printing, game
+    engines, CAD). The kernel must write the distance and normal of the
+    model at fraktal_point() to the first four channels of its output,
+    as libf/mesh.f does when linked with the model:
+
+        fLinkState *link = fraktal_create_link();
+        fraktal_add_link_library(link, hg_sdf_source, 0, "libf/hg_sdf.f");
+        fraktal_add_link_file(link, "examples/vase.f");
+        fraktal_add_link_file(link, "libf/mesh.f");
+        fKernel *kernel = fraktal_link_kernel(link);
+        fMesh *mesh = fraktal_extract_mesh(kernel, box_min, box_max, 256);
+
+    The box is divided into cubic cells, 'resolution' along its longest
+    side (at most 65536). The kernel is first evaluated on a coarse grid,
+    which is refined only where the surface may pass, so the time and
+    memory needed grow with the area of the surface and not the volume
+    of the box. This assumes that the model does not overestimate the
+    distance to the surface, as for rendering.
+
+    Each cell that the surface passes through gets one vertex, placed
+    with dual contouring to keep sharp edges and corners. The triangles
+    face the outside (where the model is positive), with counter-clockwise
+    winding, and the normals at the vertices are those of the kernel. The
+    mesh is closed, except where the surface leaves the box and where
+    parts thinner than a cell share vertices (raise the resolution).
+
+    Returns NULL if the kernel could not be evaluated.
+*/
+FRAKTALAPI fMesh *fraktal_extract_mesh(fKernel *kernel, const float box_min[3], const float box_max[3], int resolution);
+
+/*
+    If 'm' is NULL the function silently returns.
+*/
+FRAKTALAPI void fraktal_destroy_mesh(fMesh *m);
+
+/*
+    The vertex and index buffers of the mesh. The vertices and normals
+    are xyz triples (3*vertex_count values each), and the indices give
+    the three vertices of each triangle (3*triangle_count values), ready
+    to be uploaded to e.g. a vertex and element array buffer. They are
+    valid until the mesh is destroyed.
+*/
+FRAKTALAPI int fraktal_mesh_vertex_count(fMesh *m);
+FRAKTALAPI int fraktal_mesh_triangle_count(fMesh *m);
+FRAKTALAPI const float *fraktal_mesh_vertices(fMesh *m);
+FRAKTALAPI const float *fraktal_mesh_normals(fMesh *m);
+FRAKTALAPI const unsigned int *fraktal_mesh_indices(fMesh *m);
+
+/*
+    Writes the mesh to a file, as binary PLY if the path ends in .ply or
+    as Wavefront OBJ if it ends in .obj, with vertex normals in both.
+    Returns false and logs the error if the file could not be written.
+*/
+FRAKTALAPI bool fraktal_save_mesh(fMesh *m, const char *path);
+
+//-----------------------------------------------------------------------------
+// §8 Brick cache
+//-----------------------------------------------------------------------------
+
+/*
+    Samples a model into a sparse cache of distances, to speed up the
+    rendering of models that are expensive to evaluate. The kernel is
+    run as for fraktal_extract_mesh (e.g. with libf/mesh.f), and only its
+    first channel is used.
+
+    The box is divided into cubic cells, 'resolution' along its longest
+    side, which are grouped into blocks of 7^3 cells. Each block near the
+    surface stores the distance at the corners of its cells, in a brick
+    of 8^3 samples, and the other blocks store a lower bound of the
+    distance. The bricks are packed into a 3D array (the atlas), and a
+    second 3D array with one entry per block (the index) points into it.
+
+    Kernels read the cache with cachedModel(p) from libf/bricks.f, which
+    interpolates the samples trilinearly, and calls the exact model near
+    the surface (within two cells) and outside the box. Rays are thus
+    traced with a few texture reads per step until they get close to
+    the surface, and the hit points and normals are unchanged.
+
+    Returns NULL and logs the error if the kernel could not be evaluated
+    or the arrays could not be created.
+*/
+FRAKTALAPI fBrickMap *fraktal_bake_bricks(fKernel *kernel, const float box_min[3], const float box_max[3], int resolution);
+
+/*
+    If 'b' is NULL the function silently returns.
+*/
+FRAKTALAPI void fraktal_destroy_bricks(fBrickMap *b);
+
+/*
+    Returns the number of bricks in the atlas.
+*/
+FRAKTALAPI int fraktal_brick_count(fBrickMap *b);
+
+/*
+    Sets the parameters of libf/bricks.f (iBrickAtlas, iBrickIndex,
+    iBrickBoxMin, iBrickCell and iBrickGrid) of the current kernel to
+    read the cache. Kernels that do not use the cache are unaffected.
+*/
+FRAKTALAPI void fraktal_param_bricks(fBrickMap *b);
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,11 +7,68 @@ struct fArray
     GLuint color0;
     int width;
     int height;
+    int depth; // 0 unless the array is a 3D array
+    int count; // number of points if created by fraktal_create_points, otherwise 0
     int channels;
     fEnum format;
     fEnum access;
+    fContext *context;
+    GLuint upload_buffer; // created by the first fraktal_update_array
 };
 
+static int fraktal_format_size(fEnum format)
+{
+    if (format == FRAKTAL_FLOAT)  return 4;
+    if (format == FRAKTAL_HALF)   return 2;
+    if (format == FRAKTAL_UINT8)  return 1;
+    if (format == FRAKTAL_UINT16) return 2;
+    if (format == FRAKTAL_UINT32) return 4;
+    if (format == FRAKTAL_INT32)  return 4;
+    return 0;
+}
+
+static bool fraktal_is_integer_format(fEnum format)
+{
+    return format == FRAKTAL_UINT32 || format == FRAKTAL_INT32;
+}
+
+// Size in bytes of the packed CPU representation of an array
+static size_t fraktal_array_bytes(fArray *a)
+{
+    size_t slices = a->depth > 0 ? a->depth : 1;
+    return (size_t)a->width*a->height*slices*a->channels*fraktal_format_size(a->format);
+}
+
+// Points are always folded into a 2D texture, even when they fit in a single
+// row, so that kernels can read them with the same sampler.
+static GLenum fraktal_array_target(fArray *a)
+{
+    if (a->depth > 0)
+        return GL_TEXTURE_3D;
+    return a->height == 1 && a->count == 0 ? GL_TEXTURE_1D : GL_TEXTURE_2D;
+}
+
+// Size of the values as they are laid out in CPU memory. This is less than
+// fraktal_array_bytes for points, as the last row of the fold is padded.
+static size_t fraktal_array_data_bytes(fArray *a)
+{
+    if (a->count > 0)
+        return (size_t)a->count*a->channels*fraktal_format_size(a->format);
+    return fraktal_array_bytes(a);
+}
+
+// Attaches the array (or one slice of a 3D array) to the bound framebuffer
+static void fraktal_attach_array(GLenum framebuffer, fArray *a, int slice, GLenum attachment=GL_COLOR_ATTACHMENT0)
+{
+    GLenum target = fraktal_array_target(a);
+    if (target == GL_TEXTURE_1D)
+        glFramebufferTexture1D(framebuffer, attachment, target, a->color0, 0);
+    else if (target == GL_TEXTURE_2D)
+        glFramebufferTexture2D(framebuffer, attachment, target, a->color0, 0);
+    else
+        glFramebufferTextureLayer(framebuffer, attachment, a->color0, 0, slice);
+}
+
 static bool fraktal_format_to_gl_format(int channels,
                                  fEnum format,
                                  GLenum *internal_format,
@@ -25,6 +82,13 @@ static bool fraktal_format_to_gl_format(int channels,
         else if (channels == 2) { *internal_format = GL_RG32F; *data_format = GL_RG; return true; }
         else if (channels == 4) { *internal_format = GL_RGBA32F; *data_format = GL_RGBA; return true; }
     }
+    else if (format == FRAKTAL_HALF)
+    {
+        *data_type = GL_HALF_FLOAT;
+        if      (channels == 1) { *internal_format = GL_R16F; *data_format = GL_RED; return true; }
+        else if (channels == 2) { *internal_format = GL_RG16F; *data_format = GL_RG; return true; }
+        else if (channels == 4) { *internal_format = GL_RGBA16F; *data_format = GL_RGBA; return true; }
+    }
     else if (format == FRAKTAL_UINT8)
     {
         *data_type = GL_UNSIGNED_BYTE;
@@ -32,95 +96,346 @@ static bool fraktal_format_to_gl_format(int channels,
         else if (channels == 2) { *internal_format = GL_RG8; *data_format = GL_RG; return true; }
         else if (channels == 4) { *internal_format = GL_RGBA8; *data_format = GL_RGBA; return true; }
     }
+    else if (format == FRAKTAL_UINT16)
+    {
+        *data_type = GL_UNSIGNED_SHORT;
+        if      (channels == 1) { *internal_format = GL_R16; *data_format = GL_RED; return true; }
+        else if (channels == 2) { *internal_format = GL_RG16; *data_format = GL_RG; return true; }
+        else if (channels == 4) { *internal_format = GL_RGBA16; *data_format = GL_RGBA; return true; }
+    }
+    else if (format == FRAKTAL_UINT32)
+    {
+        *data_type = GL_UNSIGNED_INT;
+        if      (channels == 1) { *internal_format = GL_R32UI; *data_format = GL_RED_INTEGER; return true; }
+        else if (channels == 2) { *internal_format = GL_RG32UI; *data_format = GL_RG_INTEGER; return true; }
+        else if (channels == 4) { *internal_format = GL_RGBA32UI; *data_format = GL_RGBA_INTEGER; return true; }
+    }
+    else if (format == FRAKTAL_INT32)
+    {
+        *data_type = GL_INT;
+        if      (channels == 1) { *internal_format = GL_R32I; *data_format = GL_RED_INTEGER; return true; }
+        else if (channels == 2) { *internal_format = GL_RG32I; *data_format = GL_RG_INTEGER; return true; }
+        else if (channels == 4) { *internal_format = GL_RGBA32I; *data_format = GL_RGBA_INTEGER; return true; }
+    }
     return false;
 }
 
-fArray *fraktal_create_array(
+/*
+Destroyed arrays can be kept in a per-context pool and handed out again
+by fraktal_create_array for an array of the same dimensions, format and
+access mode, which then costs no GPU allocation. The pool is disabled
+until a byte budget is set with fraktal_set_array_pool_budget; arrays
+are evicted from it in the order they were released.
+*/
+enum { FRAKTAL_MAX_POOLED_ARRAYS = 64 };
+struct fArrayPool
+{
+    fArray *arrays[FRAKTAL_MAX_POOLED_ARRAYS]; // ordered from least to most recently released
+    int count;
+    size_t bytes;
+    size_t budget;
+};
+
+static fArrayPool &fraktal_array_pool()
+{
+    fContext *c = fraktal_current_context;
+    fraktal_assert(c);
+    if (!c->array_pool)
+    {
+        c->array_pool = (fArrayPool*)calloc(1, sizeof(fArrayPool));
+        fraktal_assert(c->array_pool && "Ran out of memory");
+    }
+    return *c->array_pool;
+}
+
+static void fraktal_free_array(fArray *a)
+{
+    glDeleteTextures(1, &a->color0);
+    glDeleteFramebuffers(1, &a->fbo);
+    if (a->upload_buffer)
+        glDeleteBuffers(1, &a->upload_buffer);
+    free(a);
+}
+
+static void fraktal_remove_pooled_array(fArrayPool &pool, int i)
+{
+    pool.bytes -= fraktal_array_bytes(pool.arrays[i]);
+    for (int j = i; j < pool.count - 1; j++)
+        pool.arrays[j] = pool.arrays[j + 1];
+    pool.count--;
+}
+
+static void fraktal_free_array_pool(fArrayPool *pool, bool delete_gpu_objects)
+{
+    if (!pool)
+        return;
+    for (int i = 0; i < pool->count; i++)
+    {
+        if (delete_gpu_objects)
+            fraktal_free_array(pool->arrays[i]);
+        else
+            free(pool->arrays[i]);
+    }
+    free(pool);
+}
+
+static fArray *fraktal_take_pooled_array(int width, int height, int depth, int count, int channels, fEnum format, fEnum access)
+{
+    fArrayPool &pool = fraktal_array_pool();
+    for (int i = pool.count - 1; i >= 0; i--)
+    {
+        fArray *a = pool.arrays[i];
+        if (a->width == width && a->height == height && a->depth == depth &&
+            (a->count > 0) == (count > 0) &&
+            a->channels == channels && a->format == format && a->access == access)
+        {
+            fraktal_remove_pooled_array(pool, i);
+            a->count = count;
+            return a;
+        }
+    }
+    return NULL;
+}
+
+void fraktal_trim_array_pool(size_t max_bytes)
+{
+    fraktal_ensure_context();
+    fArrayPool &pool = fraktal_array_pool();
+    while (pool.count > 0 && pool.bytes > max_bytes)
+    {
+        fArray *a = pool.arrays[0];
+        fraktal_remove_pooled_array(pool, 0);
+        fraktal_free_array(a);
+    }
+    fraktal_check_gl_error();
+}
+
+void fraktal_set_array_pool_budget(size_t max_bytes)
+{
+    fraktal_ensure_context();
+    fraktal_array_pool().budget = max_bytes;
+    fraktal_trim_array_pool(max_bytes);
+}
+
+// Replaces a box of values with packed values from CPU memory, or from an
+// offset into the bound GL_PIXEL_UNPACK_BUFFER. The texture is bound to the
+// active unit, which may hold an input of the current kernel (see
+// fraktal_param_array), so its binding is restored along with the unpack
+// alignment.
+static void fraktal_tex_sub_image(fArray *a, int x, int y, int z, int width, int height, int depth, const void *data)
+{
+    GLenum internal_format,data_format,data_type;
+    fraktal_assert(fraktal_format_to_gl_format(a->channels, a->format, &internal_format, &data_format, &data_type));
+    GLenum target = fraktal_array_target(a);
+    GLenum binding = target == GL_TEXTURE_1D ? GL_TEXTURE_BINDING_1D :
+                     target == GL_TEXTURE_2D ? GL_TEXTURE_BINDING_2D : GL_TEXTURE_BINDING_3D;
+    GLint last_texture; glGetIntegerv(binding, &last_texture);
+    GLint last_unpack_alignment; glGetIntegerv(GL_UNPACK_ALIGNMENT, &last_unpack_alignment);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindTexture(target, a->color0);
+    if (target == GL_TEXTURE_1D)
+        glTexSubImage1D(target, 0, x, width, data_format, data_type, data);
+    else if (target == GL_TEXTURE_2D)
+        glTexSubImage2D(target, 0, x, y, width, height, data_format, data_type, data);
+    else
+        glTexSubImage3D(target, 0, x, y, z, width, height, depth, data_format, data_type, data);
+    glBindTexture(target, last_texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, last_unpack_alignment);
+}
+
+// Replaces all values of the array. Points fill the rows of their fold
+// in order, and the padding at the end of the last row is not touched.
+static void fraktal_tex_image(fArray *a, const void *data)
+{
+    if (a->count > 0)
+    {
+        int rows = a->count / a->width;
+        int rest = a->count % a->width;
+        size_t row_bytes = (size_t)a->width*a->channels*fraktal_format_size(a->format);
+        if (rows > 0)
+            fraktal_tex_sub_image(a, 0, 0, 0, a->width, rows, 1, data);
+        if (rest > 0)
+            fraktal_tex_sub_image(a, 0, rows, 0, rest, 1, 1, (const char*)data + rows*row_bytes);
+    }
+    else
+    {
+        fraktal_tex_sub_image(a, 0, 0, 0, a->width, a->height, a->depth, data);
+    }
+}
+
+static fArray *fraktal_create_array_nd(
     const void *data,
     int width,
     int height,
+    int depth,
     int channels,
     fEnum format,
-    fEnum access)
+    fEnum access,
+    int count=0)
 {
     fraktal_ensure_context();
     fraktal_check_gl_error();
     fraktal_assert(channels > 0 && channels <= 4);
-    fraktal_assert(width > 0 && height > 0);
+    fraktal_assert(width > 0 && height > 0 && depth >= 0);
     fraktal_assert(access == FRAKTAL_READ_ONLY || access == FRAKTAL_READ_WRITE);
     fraktal_assert(channels == 1 || channels == 2 || channels == 4);
 
     GLenum internal_format,data_format,data_type;
     fraktal_assert(fraktal_format_to_gl_format(channels, format, &internal_format, &data_format, &data_type) && "Invalid array format");
 
-    GLenum target = height == 1 ? GL_TEXTURE_1D : GL_TEXTURE_2D;
+    if (fArray *a = fraktal_take_pooled_array(width, height, depth, count, channels, format, access))
+    {
+        if (data)
+            fraktal_tex_image(a, data);
+        fraktal_check_gl_error();
+        return a;
+    }
+
+    fArray *a = (fArray*)calloc(1, sizeof(fArray));
+    fraktal_assert(a && "Ran out of memory");
+    a->width = width;
+    a->height = height;
+    a->depth = depth;
+    a->count = count;
+    a->channels = channels;
+    a->format = format;
+    a->access = access;
+    a->context = fraktal_current_context;
 
-    GLuint color0 = 0;
+    GLenum target = fraktal_array_target(a);
     {
-        glGenTextures(1, &color0);
-        glBindTexture(target, color0);
+        // only storage is allocated here: the values are uploaded below by
+        // fraktal_tex_image, like on every other upload path, as it sets
+        // up the unpacking of rows that are not a multiple of 4 bytes
+        glGenTextures(1, &a->color0);
+        glBindTexture(target, a->color0);
         if (target == GL_TEXTURE_1D)
         {
-            glTexImage1D(target, 0, internal_format, width, 0, data_format, data_type, data);
+            glTexImage1D(target, 0, internal_format, width, 0, data_format, data_type, NULL);
             glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         }
         else if (target == GL_TEXTURE_2D)
         {
-            glTexImage2D(target, 0, internal_format, width, height, 0, data_format, data_type, data);
+            glTexImage2D(target, 0, internal_format, width, height, 0, data_format, data_type, NULL);
+            glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+        else if (target == GL_TEXTURE_3D)
+        {
+            glTexImage3D(target, 0, internal_format, width, height, depth, 0, data_format, data_type, NULL);
             glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
             glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(target, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
         }
         glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
         glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
         glBindTexture(target, 0);
         if (glGetError() != GL_NO_ERROR)
         {
-            glDeleteTextures(1, &color0);
+            glDeleteTextures(1, &a->color0);
+            free(a);
             log_err("Failed to create OpenGL texture object.\n");
             return NULL;
         }
     }
 
-    GLuint fbo = 0;
+    // Kernels render into 3D arrays one slice at a time, by attaching
+    // each slice in turn (see fraktal_run_kernel_slices)
     if (access == FRAKTAL_READ_WRITE)
     {
-        glGenFramebuffers(1, &fbo);
-        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-        if (target == GL_TEXTURE_1D)
-            glFramebufferTexture1D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, target, color0, 0);
-        else if (target == GL_TEXTURE_2D)
-            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, target, color0, 0);
+        glGenFramebuffers(1, &a->fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, a->fbo);
+        fraktal_attach_array(GL_FRAMEBUFFER, a, 0);
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
         if (glGetError() != GL_NO_ERROR)
         {
-            glDeleteFramebuffers(1, &fbo);
-            glDeleteTextures(1, &color0);
+            glDeleteFramebuffers(1, &a->fbo);
+            glDeleteTextures(1, &a->color0);
+            free(a);
             log_err("Failed to create framebuffer object.\n");
             return NULL;
         }
     }
 
-    fArray *a = (fArray*)calloc(1, sizeof(fArray));
-    a->color0 = color0;
-    a->fbo = fbo;
-    a->width = width;
-    a->height = height;
-    a->channels = channels;
-    a->format = format;
-    a->access = access;
+    if (data)
+        fraktal_tex_image(a, data);
+
     fraktal_check_gl_error();
     return a;
 }
 
+fArray *fraktal_create_array(
+    const void *data,
+    int width,
+    int height,
+    int channels,
+    fEnum format,
+    fEnum access)
+{
+    return fraktal_create_array_nd(data, width, height, 0, channels, format, access);
+}
+
+fArray *fraktal_create_array_3d(
+    const void *data,
+    int width,
+    int height,
+    int depth,
+    int channels,
+    fEnum format,
+    fEnum access)
+{
+    fraktal_assert(depth > 0);
+    return fraktal_create_array_nd(data, width, height, depth, channels, format, access);
+}
+
+// Points are folded into rows as wide as the driver allows, so that
+// any number of points fits in a texture.
+fArray *fraktal_create_points(
+    const void *data,
+    int count,
+    int channels,
+    fEnum format,
+    fEnum access)
+{
+    fraktal_ensure_context();
+    fraktal_assert(count > 0);
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    int width = count < max_size ? count : max_size;
+    int height = (count + width - 1) / width;
+    if (height > max_size)
+    {
+        log_err("Too many points: at most %d x %d are supported.\n", max_size, max_size);
+        return NULL;
+    }
+    return fraktal_create_array_nd(data, width, height, 0, channels, format, access, count);
+}
+
 void fraktal_destroy_array(fArray *a)
 {
     if (a)
     {
         fraktal_ensure_context();
         fraktal_check_gl_error();
-        glDeleteTextures(1, &a->color0);
-        glDeleteFramebuffers(1, &a->fbo);
-        free(a);
+        fraktal_assert(a->context == fraktal_current_context && "Array was created in a different context");
+        fArrayPool &pool = fraktal_array_pool();
+        size_t bytes = fraktal_array_bytes(a);
+        if (bytes <= pool.budget)
+        {
+            if (pool.count == FRAKTAL_MAX_POOLED_ARRAYS)
+            {
+                fArray *oldest = pool.arrays[0];
+                fraktal_remove_pooled_array(pool, 0);
+                fraktal_free_array(oldest);
+            }
+            pool.arrays[pool.count++] = a;
+            pool.bytes += bytes;
+            fraktal_trim_array_pool(pool.budget);
+        }
+        else
+        {
+            fraktal_free_array(a);
+        }
         fraktal_check_gl_error();
     }
 }
@@ -133,10 +448,35 @@ void fraktal_zero_array(fArray *a)
     fraktal_assert(a->color0);
     fraktal_ensure_context();
     fraktal_check_gl_error();
+    fraktal_assert(a->context == fraktal_current_context && "Array was created in a different context");
     GLint last_framebuffer; glGetIntegerv(GL_FRAMEBUFFER_BINDING, &last_framebuffer);
     glBindFramebuffer(GL_FRAMEBUFFER, a->fbo);
     glClearColor(0,0,0,0);
-    glClear(GL_COLOR_BUFFER_BIT);
+    int slices = a->depth > 0 ? a->depth : 1;
+    bool timed = fraktal_begin_timer(NULL, (long long)a->width*a->height*slices);
+    for (int slice = 0; slice < slices; slice++)
+    {
+        if (a->depth > 0)
+            fraktal_attach_array(GL_FRAMEBUFFER, a, slice);
+        // glClear is undefined for integer color buffers, which must be
+        // cleared with the variant that matches their signedness
+        if (a->format == FRAKTAL_INT32)
+        {
+            static const GLint zero[4] = { 0 };
+            glClearBufferiv(GL_COLOR, 0, zero);
+        }
+        else if (a->format == FRAKTAL_UINT32)
+        {
+            static const GLuint zero[4] = { 0 };
+            glClearBufferuiv(GL_COLOR, 0, zero);
+        }
+        else
+        {
+            glClear(GL_COLOR_BUFFER_BIT);
+        }
+    }
+    if (timed)
+        fraktal_end_timer();
     glBindFramebuffer(GL_FRAMEBUFFER, last_framebuffer);
     fraktal_check_gl_error();
 }
@@ -148,16 +488,280 @@ void fraktal_to_cpu(void *cpu_memory, fArray *a)
     fraktal_assert(a->color0);
     fraktal_ensure_context();
     fraktal_check_gl_error();
-    GLenum target = a->height == 1 ? GL_TEXTURE_1D : GL_TEXTURE_2D;
+    fraktal_assert(a->context == fraktal_current_context && "Array was created in a different context");
+    GLenum target = fraktal_array_target(a);
     GLenum internal_format,data_format,data_type;
     fraktal_assert(fraktal_format_to_gl_format(a->channels, a->format, &internal_format, &data_format, &data_type));
     glPixelStorei(GL_PACK_ALIGNMENT, 1);
     glBindTexture(target, a->color0);
-    glGetTexImage(target, 0, data_format, data_type, cpu_memory);
+    int slices = a->depth > 0 ? a->depth : 1;
+    bool timed = fraktal_begin_timer(NULL, (long long)a->width*a->height*slices);
+    if (a->count > 0)
+    {
+        // the padding at the end of the fold is dropped
+        void *folded = malloc(fraktal_array_bytes(a));
+        fraktal_assert(folded && "Ran out of memory");
+        glGetTexImage(target, 0, data_format, data_type, folded);
+        memcpy(cpu_memory, folded, fraktal_array_data_bytes(a));
+        free(folded);
+    }
+    else
+    {
+        glGetTexImage(target, 0, data_format, data_type, cpu_memory);
+    }
+    if (timed)
+        fraktal_end_timer();
     glBindTexture(target, 0);
     fraktal_check_gl_error();
 }
 
+void fraktal_to_cpu_region(fArray *a, int x, int y, int width, int height, void *cpu_memory)
+{
+    fraktal_assert(cpu_memory);
+    fraktal_assert(a);
+    fraktal_assert(a->color0);
+    fraktal_assert(width > 0 && height > 0);
+    fraktal_assert(x >= 0 && y >= 0 && x + width <= a->width && y + height <= a->height && "Region is outside the array.");
+    fraktal_assert(a->depth == 0 && "3D arrays are not supported.");
+    fraktal_ensure_context();
+    fraktal_check_gl_error();
+    fraktal_assert(a->context == fraktal_current_context && "Array was created in a different context");
+    GLenum internal_format,data_format,data_type;
+    fraktal_assert(fraktal_format_to_gl_format(a->channels, a->format, &internal_format, &data_format, &data_type));
+
+    GLint last_read_framebuffer; glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &last_read_framebuffer);
+
+    // read-only arrays have no framebuffer, so one is attached temporarily
+    GLuint fbo = a->fbo;
+    if (!fbo)
+    {
+        glGenFramebuffers(1, &fbo);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+        fraktal_attach_array(GL_READ_FRAMEBUFFER, a, 0);
+    }
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+
+    // the values are read into CPU memory, whatever the caller has bound
+    GLint last_pack_buffer; glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &last_pack_buffer);
+    GLint last_pack_alignment; glGetIntegerv(GL_PACK_ALIGNMENT, &last_pack_alignment);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(x, y, width, height, data_format, data_type, cpu_memory);
+    glPixelStorei(GL_PACK_ALIGNMENT, last_pack_alignment);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, last_pack_buffer);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, last_read_framebuffer);
+    if (fbo != a->fbo)
+        glDeleteFramebuffers(1, &fbo);
+    fraktal_check_gl_error();
+}
+
+void fraktal_upload_region(fArray *a, int x, int y, int width, int height, const void *cpu_memory)
+{
+    fraktal_assert(cpu_memory);
+    fraktal_assert(a);
+    fraktal_assert(a->color0);
+    fraktal_assert(width > 0 && height > 0);
+    fraktal_assert(x >= 0 && y >= 0 && x + width <= a->width && y + height <= a->height && "Region is outside the array.");
+    fraktal_assert(a->depth == 0 && "3D arrays are not supported.");
+    fraktal_ensure_context();
+    fraktal_check_gl_error();
+    fraktal_assert(a->context == fraktal_current_context && "Array was created in a different context");
+    fraktal_tex_sub_image(a, x, y, 0, width, height, 1, cpu_memory);
+    fraktal_check_gl_error();
+}
+
+// The values are staged in a pixel unpack buffer that is orphaned before
+// each update: the driver hands out fresh storage if the previous contents
+// are still being read by queued uploads, so the CPU never waits on them.
+void fraktal_update_array(fArray *a, const void *cpu_memory)
+{
+    fraktal_assert(cpu_memory);
+    fraktal_assert(a);
+    fraktal_assert(a->color0);
+    fraktal_ensure_context();
+    fraktal_check_gl_error();
+    fraktal_assert(a->context == fraktal_current_context && "Array was created in a different context");
+
+    size_t size = fraktal_array_data_bytes(a);
+    if (!a->upload_buffer)
+        glGenBuffers(1, &a->upload_buffer);
+    GLint last_unpack_buffer; glGetIntegerv(GL_PIXEL_UNPACK_BUFFER_BINDING, &last_unpack_buffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, a->upload_buffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+    void *dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_BUFFER_BIT);
+    fraktal_assert(dst && "Failed to map pixel buffer");
+    memcpy(dst, cpu_memory, size);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    // with an unpack buffer bound, the pointer argument is an offset into it
+    fraktal_tex_image(a, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, last_unpack_buffer);
+    fraktal_check_gl_error();
+}
+
+/*
+Pixel buffer objects that are not in use by a transfer are kept in a
+per-context pool, so that repeated readbacks of arrays of the same size
+(e.g. one per frame) reuse the same few buffers instead of allocating
+new ones. When the pool is full the least recently released buffer is
+deleted.
+*/
+enum { FRAKTAL_MAX_POOLED_PIXEL_BUFFERS = 8 };
+struct fPixelBufferPool
+{
+    GLuint buffer[FRAKTAL_MAX_POOLED_PIXEL_BUFFERS];
+    size_t size[FRAKTAL_MAX_POOLED_PIXEL_BUFFERS];
+    int count; // ordered from least to most recently released
+};
+
+struct fTransfer
+{
+    GLuint buffer;
+    size_t size;
+    size_t data_size; // bytes copied to cpu_memory (see fraktal_array_data_bytes)
+    GLsync fence; // NULL if the driver lacks sync objects
+    void *cpu_memory;
+    fContext *context;
+};
+
+static fPixelBufferPool &fraktal_pixel_buffers()
+{
+    fContext *c = fraktal_current_context;
+    fraktal_assert(c);
+    if (!c->pixel_buffers)
+    {
+        c->pixel_buffers = (fPixelBufferPool*)calloc(1, sizeof(fPixelBufferPool));
+        fraktal_assert(c->pixel_buffers && "Ran out of memory");
+    }
+    return *c->pixel_buffers;
+}
+
+// Returns a buffer bound to GL_PIXEL_PACK_BUFFER with storage for 'size' bytes.
+static GLuint fraktal_acquire_pixel_buffer(size_t size)
+{
+    fPixelBufferPool &pool = fraktal_pixel_buffers();
+    for (int i = pool.count - 1; i >= 0; i--)
+    {
+        if (pool.size[i] == size)
+        {
+            GLuint buffer = pool.buffer[i];
+            for (int j = i; j < pool.count - 1; j++)
+            {
+                pool.buffer[j] = pool.buffer[j + 1];
+                pool.size[j] = pool.size[j + 1];
+            }
+            pool.count--;
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+            return buffer;
+        }
+    }
+    GLuint buffer = 0;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+    glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+    return buffer;
+}
+
+static void fraktal_release_pixel_buffer(GLuint buffer, size_t size)
+{
+    fPixelBufferPool &pool = fraktal_pixel_buffers();
+    if (pool.count == FRAKTAL_MAX_POOLED_PIXEL_BUFFERS)
+    {
+        glDeleteBuffers(1, &pool.buffer[0]);
+        for (int j = 0; j < pool.count - 1; j++)
+        {
+            pool.buffer[j] = pool.buffer[j + 1];
+            pool.size[j] = pool.size[j + 1];
+        }
+        pool.count--;
+    }
+    pool.buffer[pool.count] = buffer;
+    pool.size[pool.count] = size;
+    pool.count++;
+}
+
+static void fraktal_free_pixel_buffers(fPixelBufferPool *pool, bool delete_gpu_objects)
+{
+    if (!pool)
+        return;
+    if (delete_gpu_objects && pool->count > 0)
+        glDeleteBuffers(pool->count, pool->buffer);
+    free(pool);
+}
+
+fTransfer *fraktal_to_cpu_async(void *cpu_memory, fArray *a)
+{
+    fraktal_assert(cpu_memory);
+    fraktal_assert(a);
+    fraktal_assert(a->color0);
+    fraktal_ensure_context();
+    fraktal_check_gl_error();
+    fraktal_assert(a->context == fraktal_current_context && "Array was created in a different context");
+    GLenum target = fraktal_array_target(a);
+    GLenum internal_format,data_format,data_type;
+    fraktal_assert(fraktal_format_to_gl_format(a->channels, a->format, &internal_format, &data_format, &data_type));
+
+    fTransfer *t = (fTransfer*)calloc(1, sizeof(fTransfer));
+    fraktal_assert(t && "Ran out of memory");
+    t->size = fraktal_array_bytes(a);
+    t->data_size = fraktal_array_data_bytes(a);
+    t->cpu_memory = cpu_memory;
+    t->context = fraktal_current_context;
+    t->buffer = fraktal_acquire_pixel_buffer(t->size);
+
+    // with a pack buffer bound, the copy is queued and the pointer
+    // argument is an offset into the buffer
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glBindTexture(target, a->color0);
+    glGetTexImage(target, 0, data_format, data_type, 0);
+    glBindTexture(target, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (glFenceSync)
+        t->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    fraktal_check_gl_error();
+    return t;
+}
+
+static void fraktal_finish_transfer(fTransfer *t)
+{
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, t->buffer);
+    void *data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, t->size, GL_MAP_READ_BIT);
+    fraktal_assert(data && "Failed to map pixel buffer");
+    memcpy(t->cpu_memory, data, t->data_size);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (t->fence)
+        glDeleteSync(t->fence);
+    fraktal_release_pixel_buffer(t->buffer, t->size);
+    free(t);
+    fraktal_check_gl_error();
+}
+
+bool fraktal_poll(fTransfer *t)
+{
+    fraktal_assert(t);
+    fraktal_ensure_context();
+    fraktal_assert(t->context == fraktal_current_context && "Transfer was started in a different context");
+    if (t->fence)
+    {
+        // the flush ensures that the fence is eventually signaled
+        GLenum status = glClientWaitSync(t->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if (status == GL_TIMEOUT_EXPIRED)
+            return false;
+    }
+    fraktal_finish_transfer(t);
+    return true;
+}
+
+void fraktal_wait(fTransfer *t)
+{
+    fraktal_assert(t);
+    fraktal_ensure_context();
+    fraktal_assert(t->context == fraktal_current_context && "Transfer was started in a different context");
+    fraktal_finish_transfer(t);
+}
+
 void fraktal_array_size(fArray *a, int *width, int *height)
 {
     if (a)
@@ -167,6 +771,18 @@ void fraktal_array_size(fArray *a, int *width, int *height)
     }
 }
 
+int fraktal_array_depth(fArray *a)
+{
+    if (a) return a->depth;
+    return 0;
+}
+
+int fraktal_array_count(fArray *a)
+{
+    if (a) return a->count;
+    return 0;
+}
+
 int fraktal_array_channels(fArray *a)
 {
     if (a) return a->channels;
@@ -184,9 +800,11 @@ bool fraktal_is_valid_array(fArray *a)
     return a &&
            a->width > 0 &&
            a->height > 0 &&
+           a->depth >= 0 &&
+           a->count >= 0 &&
            (a->channels == 1 || a->channels == 2 || a->channels == 4) &&
            (a->access == FRAKTAL_READ_ONLY || (a->access == FRAKTAL_READ_WRITE && a->fbo)) &&
-           (a->format == FRAKTAL_FLOAT || a->format == FRAKTAL_UINT8);
+           fraktal_format_size(a->format) > 0;
 }
 
 unsigned int fraktal_get_gl_handle(fArray *a)
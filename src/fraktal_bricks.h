@@ -0,0 +1,245 @@
+// Developed by Simen Haugo.
+// See LICENSE.txt for copyright and licensing details (standard MIT License).
+
+#pragma once
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "reuse/log.h"
+
+/*
+Brick cache (see fraktal_bake_bricks).
+
+The box is divided into blocks of FBRICK_CELLS^3 cubic cells, and the
+blocks near the surface are found as for mesh extraction (see
+fmesh_find_blocks). Each of them gets a brick of FBRICK_SIZE^3 samples of
+the model, at the corners of its cells, so that neighboring bricks share
+the samples on their common face and can be interpolated without reading
+from each other. The bricks are packed into a 3D atlas, and a 3D index
+array holds one entry per block:
+
+    (x, y, z, 0)    texel of the first sample of the block's brick in the atlas
+    (-1, r, 0, d)   the block has no brick, and the model is at least r
+                    from the surface in the block; d is the model at the
+                    center of the block, which gives a tighter bound that
+                    varies with the distance from the center
+
+libf/bricks.f reads the cache in a kernel.
+*/
+
+enum { FBRICK_SIZE = 8 };                   // samples along each side of a brick
+enum { FBRICK_CELLS = FBRICK_SIZE - 1 };    // cells along each side of a block
+
+struct fBrickMap
+{
+    float box_min[3];
+    float cell;
+    int blocks[3];      // size of the index array
+    int num_bricks;
+    fArray *atlas;
+    fArray *index;
+};
+
+fBrickMap *fraktal_bake_bricks(fKernel *kernel, const float box_min[3], const float box_max[3], int resolution)
+{
+    fraktal_assert(kernel);
+    fraktal_assert(box_min && box_max);
+    fraktal_assert(resolution > 0 && resolution <= FRAKTAL_MAX_MESH_RESOLUTION);
+
+    float extent = 0.0f;
+    for (int k = 0; k < 3; k++)
+    {
+        fraktal_assert(box_min[k] < box_max[k]);
+        if (box_max[k] - box_min[k] > extent)
+            extent = box_max[k] - box_min[k];
+    }
+    float cell = extent/(float)resolution;
+    int blocks[3];
+    for (int k = 0; k < 3; k++)
+    {
+        int cells = (int)ceilf((box_max[k] - box_min[k])/cell);
+        if (cells < 1) cells = 1;
+        if (cells > resolution) cells = resolution;
+        blocks[k] = (cells + FBRICK_CELLS - 1)/FBRICK_CELLS;
+    }
+
+    fMeshBand band;
+    if (!fmesh_find_blocks(kernel, box_min, cell, FBRICK_CELLS, blocks, true, &band))
+        return NULL;
+
+    // the atlas is (close to) a cube of bricks
+    int n = band.num_blocks > 0 ? band.num_blocks : 1;
+    int atlas[3];
+    atlas[0] = (int)ceil(cbrt((double)n));
+    atlas[1] = (n + atlas[0] - 1)/atlas[0] < atlas[0] ? (n + atlas[0] - 1)/atlas[0] : atlas[0];
+    atlas[2] = (n + atlas[0]*atlas[1] - 1)/(atlas[0]*atlas[1]);
+
+    size_t num_index = (size_t)blocks[0]*blocks[1]*blocks[2];
+    size_t num_samples = (size_t)atlas[0]*atlas[1]*atlas[2]*FBRICK_SIZE*FBRICK_SIZE*FBRICK_SIZE;
+    float *index = (float*)malloc(num_index*4*sizeof(float));
+    float *samples = (float*)calloc(num_samples, sizeof(float));
+    fraktal_assert(index && samples && "Ran out of memory");
+
+    // blocks away from the surface get a lower bound of the distance
+    for (size_t i = 0; i < num_index; i++)
+    {
+        index[4*i + 0] = -1.0f;
+        index[4*i + 1] = 0.0f;
+        index[4*i + 2] = 0.0f;
+        index[4*i + 3] = 0.0f;
+    }
+    int num_far_blocks = 0;
+    for (int i = 0; i < band.num_far; i++)
+    {
+        const int *node = band.far + 4*i;
+        int size = node[3];
+        float radius = 0.5f*sqrtf(3.0f)*(float)(size*FBRICK_CELLS)*cell;
+        float bound = fabsf(band.far_distance[i]) - radius;
+        for (int z = node[2]*size; z < (node[2] + 1)*size && z < blocks[2]; z++)
+        for (int y = node[1]*size; y < (node[1] + 1)*size && y < blocks[1]; y++)
+        for (int x = node[0]*size; x < (node[0] + 1)*size && x < blocks[0]; x++)
+        {
+            index[4*(x + (size_t)blocks[0]*(y + (size_t)blocks[1]*z)) + 1] = bound;
+            num_far_blocks++;
+        }
+    }
+    free(band.far);
+    free(band.far_distance);
+
+    // the distance at the center of each of these blocks gives a tighter
+    // bound that varies within the block (see libf/bricks.f)
+    const int per_brick = FBRICK_SIZE*FBRICK_SIZE*FBRICK_SIZE;
+    float *points = (float*)malloc((size_t)FMESH_BATCH_BLOCKS*per_brick*3*sizeof(float));
+    float *result = (float*)malloc((size_t)FMESH_BATCH_BLOCKS*per_brick*4*sizeof(float));
+    fraktal_assert(points && result && "Ran out of memory");
+    const int max_points = FMESH_BATCH_BLOCKS*per_brick;
+    bool ok = true;
+    size_t next = 0;
+    for (int first = 0; first < num_far_blocks && ok; first += max_points)
+    {
+        int count = num_far_blocks - first < max_points ? num_far_blocks - first : max_points;
+        size_t *entries = (size_t*)malloc((size_t)count*sizeof(size_t));
+        fraktal_assert(entries && "Ran out of memory");
+        for (int i = 0; i < count; next++)
+        {
+            if (index[4*next] >= 0.0f || index[4*next + 1] <= 0.0f)
+                continue;
+            size_t x = next % blocks[0];
+            size_t y = (next / blocks[0]) % blocks[1];
+            size_t z = next / ((size_t)blocks[0]*blocks[1]);
+            points[3*i + 0] = box_min[0] + cell*((float)(x*FBRICK_CELLS) + 0.5f*FBRICK_CELLS);
+            points[3*i + 1] = box_min[1] + cell*((float)(y*FBRICK_CELLS) + 0.5f*FBRICK_CELLS);
+            points[3*i + 2] = box_min[2] + cell*((float)(z*FBRICK_CELLS) + 0.5f*FBRICK_CELLS);
+            entries[i++] = next;
+        }
+        ok = fmesh_eval(kernel, points, count, result);
+        for (int i = 0; i < count && ok; i++)
+        {
+            float *entry = index + 4*entries[i];
+            float radius = 0.5f*sqrtf(3.0f)*(float)FBRICK_CELLS*cell;
+            float d = result[4*i];
+            if (fabsf(d) - radius > entry[1])
+                entry[1] = fabsf(d) - radius;
+            entry[3] = d;
+        }
+        free(entries);
+    }
+
+    // evaluate the blocks near the surface at every corner, a batch at a time
+    for (int first = 0; first < band.num_blocks && ok; first += FMESH_BATCH_BLOCKS)
+    {
+        int count = band.num_blocks - first < FMESH_BATCH_BLOCKS ? band.num_blocks - first : FMESH_BATCH_BLOCKS;
+        float *p = points;
+        for (int i = 0; i < count; i++)
+        {
+            const int *block = band.blocks + 3*(first + i);
+            for (int k = 0; k < FBRICK_SIZE; k++)
+            for (int j = 0; j < FBRICK_SIZE; j++)
+            for (int l = 0; l < FBRICK_SIZE; l++, p += 3)
+            {
+                // same positions as the neighboring bricks on shared faces
+                p[0] = box_min[0] + cell*(float)(block[0]*FBRICK_CELLS + l);
+                p[1] = box_min[1] + cell*(float)(block[1]*FBRICK_CELLS + j);
+                p[2] = box_min[2] + cell*(float)(block[2]*FBRICK_CELLS + k);
+            }
+        }
+        ok = fmesh_eval(kernel, points, count*per_brick, result);
+        for (int i = 0; i < count && ok; i++)
+        {
+            int brick = first + i;
+            const int *block = band.blocks + 3*brick;
+            int origin[3] = {
+                FBRICK_SIZE*(brick % atlas[0]),
+                FBRICK_SIZE*((brick / atlas[0]) % atlas[1]),
+                FBRICK_SIZE*(brick / (atlas[0]*atlas[1]))
+            };
+            float *entry = index + 4*(block[0] + (size_t)blocks[0]*(block[1] + (size_t)blocks[1]*block[2]));
+            entry[0] = (float)origin[0];
+            entry[1] = (float)origin[1];
+            entry[2] = (float)origin[2];
+            entry[3] = 0.0f;
+            const float *d = result + 4*per_brick*i;
+            size_t width = (size_t)atlas[0]*FBRICK_SIZE;
+            size_t height = (size_t)atlas[1]*FBRICK_SIZE;
+            for (int k = 0; k < FBRICK_SIZE; k++)
+            for (int j = 0; j < FBRICK_SIZE; j++)
+            for (int l = 0; l < FBRICK_SIZE; l++, d += 4)
+                samples[(origin[0] + l) + width*((origin[1] + j) + height*(origin[2] + k))] = d[0];
+        }
+    }
+    free(points);
+    free(result);
+
+    fBrickMap *b = NULL;
+    if (ok)
+    {
+        b = (fBrickMap*)calloc(1, sizeof(fBrickMap));
+        fraktal_assert(b && "Ran out of memory");
+        memcpy(b->box_min, box_min, sizeof(b->box_min));
+        memcpy(b->blocks, blocks, sizeof(b->blocks));
+        b->cell = cell;
+        b->num_bricks = band.num_blocks;
+        b->atlas = fraktal_create_array_3d(samples,
+            atlas[0]*FBRICK_SIZE, atlas[1]*FBRICK_SIZE, atlas[2]*FBRICK_SIZE,
+            1, FRAKTAL_FLOAT, FRAKTAL_READ_ONLY);
+        b->index = fraktal_create_array_3d(index, blocks[0], blocks[1], blocks[2], 4, FRAKTAL_FLOAT, FRAKTAL_READ_ONLY);
+        if (!b->atlas || !b->index)
+        {
+            log_err("Failed to bake bricks: the cache does not fit in a 3D array (lower the resolution).\n");
+            fraktal_destroy_bricks(b);
+            b = NULL;
+        }
+    }
+    free(band.blocks);
+    free(index);
+    free(samples);
+    return b;
+}
+
+void fraktal_destroy_bricks(fBrickMap *b)
+{
+    if (b)
+    {
+        fraktal_destroy_array(b->atlas);
+        fraktal_destroy_array(b->index);
+        free(b);
+    }
+}
+
+int fraktal_brick_count(fBrickMap *b)
+{
+    fraktal_assert(b);
+    return b->num_bricks;
+}
+
+void fraktal_param_bricks(fBrickMap *b)
+{
+    fraktal_assert(b);
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_assert(f && "Call fraktal_use_kernel first.");
+    fraktal_param_array(fraktal_get_param_offset(f, "iBrickAtlas"), b->atlas);
+    fraktal_param_array(fraktal_get_param_offset(f, "iBrickIndex"), b->index);
+    fraktal_param_3f(fraktal_get_param_offset(f, "iBrickBoxMin"), b->box_min[0], b->box_min[1], b->box_min[2]);
+    fraktal_param_1f(fraktal_get_param_offset(f, "iBrickCell"), b->cell);
+    fraktal_param_3i(fraktal_get_param_offset(f, "iBrickGrid"), b->blocks[0], b->blocks[1], b->blocks[2]);
+}
@@ -0,0 +1,375 @@
+// Developed by Simen Haugo.
+// See LICENSE.txt for copyright and licensing details (standard MIT License).
+
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#ifdef _WIN32
+#include <process.h>
+#define fraktal_getpid _getpid
+#else
+#include <unistd.h>
+#define fraktal_getpid getpid
+#endif
+#include "reuse/log.h"
+
+/*
+Program binaries are stored in files with the following layout:
+
+    header          fKernelBinaryHeader
+    parameters      header.param_count entries of fKernelBinaryParam
+    binary          header.binary_length bytes passed to glProgramBinary
+
+The driver hash is computed from the GL vendor, renderer and version
+strings, so a binary produced by one driver is never handed to another.
+In the software backend, the binary is the kernel's shared library, and
+the driver hash is computed from the compiler command instead.
+The key is the hash of all inputs to the link (see link_hash), and is
+only used to detect collisions in the kernel cache directory.
+
+Several processes may share a cache directory, so a file is written under
+a name of its own in the same directory, and renamed to its final path
+once complete. Readers then see either a whole file or none. The header
+is checked against the size of the file before anything is allocated
+from it, as the file may still be corrupt (e.g. truncated by a full disk).
+*/
+
+enum { FRAKTAL_KERNEL_BINARY_VERSION = 3 };
+static const char fraktal_kernel_binary_magic[8] = { 'f','r','a','k','t','a','l','b' };
+
+struct fKernelBinaryHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t binary_format;
+    uint32_t binary_length;
+    int32_t param_count;
+    int32_t sampler_count;
+    uint64_t driver_hash;
+    uint64_t key;
+};
+
+struct fKernelBinaryParam
+{
+    char name[FRAKTAL_MAX_PARAM_NAME_LEN + 1];
+    int32_t type;
+    float4 mean;
+    float4 scale;
+    int32_t assigned_tex_unit;
+    int32_t std140_offset;
+    int32_t std140_size;
+};
+
+static char *fraktal_kernel_cache_dir = NULL;
+
+// Opens a new file for writing next to 'path', under a name that no other
+// thread or process uses, and writes the name into 'temp'. The file is
+// moved to 'path' by fraktal_close_binary_file.
+static FILE *fraktal_open_binary_file(const char *path, char *temp, size_t sizeof_temp)
+{
+    static std::atomic<unsigned int> counter(0);
+    int n = snprintf(temp, sizeof_temp, "%s.%d.%u.tmp", path, (int)fraktal_getpid(), counter++);
+    if (n <= 0 || (size_t)n >= sizeof_temp)
+        return NULL;
+    return fopen(temp, "wb");
+}
+
+// Closes a file opened by fraktal_open_binary_file, and replaces 'path'
+// with it if 'ok' is set, or else removes it. Returns true on success.
+static bool fraktal_close_binary_file(FILE *file, const char *temp, const char *path, bool ok)
+{
+    if (fclose(file) != 0)
+        ok = false;
+    #ifdef _WIN32
+    if (ok) remove(path); // rename does not replace existing files on Windows
+    #endif
+    if (ok && rename(temp, path) != 0)
+        ok = false;
+    if (!ok)
+        remove(temp);
+    return ok;
+}
+
+// Reads the header of a kernel binary and checks that the counts and
+// lengths in it are within limits and match the size of the file.
+static bool fraktal_read_binary_header(FILE *file, fKernelBinaryHeader *header)
+{
+    if (fseek(file, 0, SEEK_END) != 0)
+        return false;
+    long file_size = ftell(file);
+    if (file_size < 0 || fseek(file, 0, SEEK_SET) != 0)
+        return false;
+    if (fread(header, sizeof(*header), 1, file) != 1 ||
+        memcmp(header->magic, fraktal_kernel_binary_magic, sizeof(header->magic)) != 0 ||
+        header->version != FRAKTAL_KERNEL_BINARY_VERSION ||
+        header->param_count < 0 || header->param_count > FRAKTAL_MAX_PARAMS ||
+        header->sampler_count < 0 || header->sampler_count > header->param_count ||
+        header->binary_length == 0)
+        return false;
+    uint64_t expected_size =
+        (uint64_t)sizeof(fKernelBinaryHeader) +
+        (uint64_t)header->param_count*sizeof(fKernelBinaryParam) +
+        (uint64_t)header->binary_length;
+    return expected_size == (uint64_t)file_size;
+}
+
+// Reads the parameter table that follows the header into 'params', and
+// checks that the texture units and uniform block offsets are in range.
+static bool fraktal_read_binary_params(FILE *file, const fKernelBinaryHeader &header, fParams *params)
+{
+    params->count = header.param_count;
+    params->sampler_count = header.sampler_count;
+    for (int i = 0; i < header.param_count; i++)
+    {
+        fKernelBinaryParam param;
+        if (fread(&param, sizeof(param), 1, file) != 1)
+            return false;
+        bool sampler = fraktal_is_sampler_param((fParamType)param.type);
+        if ((sampler && (param.assigned_tex_unit < 0 || param.assigned_tex_unit >= header.sampler_count)) ||
+            param.std140_offset < 0 || param.std140_offset > 64*FRAKTAL_MAX_PARAMS ||
+            param.std140_size < 0 || param.std140_size > 64)
+            return false;
+        param.name[FRAKTAL_MAX_PARAM_NAME_LEN] = '\0';
+        strcpy(params->name[i], param.name);
+        params->type[i] = param.type;
+        params->mean[i] = param.mean;
+        params->scale[i] = param.scale;
+        params->assigned_tex_unit[i] = param.assigned_tex_unit;
+        params->std140_offset[i] = param.std140_offset;
+        params->std140_size[i] = param.std140_size;
+    }
+    return true;
+}
+
+// 64-bit FNV-1a
+static uint64_t fraktal_hash(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *c = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= (uint64_t)c[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t fraktal_hash_string(uint64_t hash, const char *s)
+{
+    if (!s)
+        s = "";
+    // include the NULL-terminator so that ("ab","c") and ("a","bc") differ
+    return fraktal_hash(hash, s, strlen(s) + 1);
+}
+
+static const uint64_t fraktal_hash_seed = 14695981039346656037ULL;
+
+#ifndef FRAKTAL_SOFTWARE
+static uint64_t fraktal_driver_hash()
+{
+    fraktal_ensure_context();
+    uint64_t hash = fraktal_hash_seed;
+    hash = fraktal_hash_string(hash, (const char*)glGetString(GL_VENDOR));
+    hash = fraktal_hash_string(hash, (const char*)glGetString(GL_RENDERER));
+    hash = fraktal_hash_string(hash, (const char*)glGetString(GL_VERSION));
+    return hash;
+}
+
+static bool fraktal_program_binary_supported()
+{
+    fraktal_ensure_context();
+    if (!glGetProgramBinary || !glProgramBinary || !glProgramParameteri)
+        return false;
+    GLint num_formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    while (glGetError() != GL_NO_ERROR)
+        ; // the enum is unknown to drivers without ARB_get_program_binary
+    return num_formats > 0;
+}
+
+static bool export_kernel(fKernel *f, const char *path, uint64_t key)
+{
+    fraktal_assert(f);
+    fraktal_assert(f->program);
+    fraktal_assert(path);
+    fraktal_ensure_context();
+    fraktal_check_gl_error();
+    if (!fraktal_program_binary_supported())
+        return false;
+
+    GLint length = 0;
+    glGetProgramiv(f->program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return false;
+
+    void *binary = malloc(length);
+    fraktal_assert(binary && "Ran out of memory");
+    GLenum binary_format = 0;
+    glGetProgramBinary(f->program, length, NULL, &binary_format, binary);
+    if (glGetError() != GL_NO_ERROR)
+    {
+        free(binary);
+        return false;
+    }
+
+    char temp[1200];
+    FILE *file = fraktal_open_binary_file(path, temp, sizeof(temp));
+    if (!file)
+    {
+        free(binary);
+        return false;
+    }
+
+    fKernelBinaryHeader header = {0};
+    memcpy(header.magic, fraktal_kernel_binary_magic, sizeof(header.magic));
+    header.version = FRAKTAL_KERNEL_BINARY_VERSION;
+    header.binary_format = (uint32_t)binary_format;
+    header.binary_length = (uint32_t)length;
+    header.param_count = f->params.count;
+    header.sampler_count = f->params.sampler_count;
+    header.driver_hash = fraktal_driver_hash();
+    header.key = key;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int i = 0; ok && i < f->params.count; i++)
+    {
+        fKernelBinaryParam param = {0};
+        strcpy(param.name, f->params.name[i]);
+        param.type = f->params.type[i];
+        param.mean = f->params.mean[i];
+        param.scale = f->params.scale[i];
+        param.assigned_tex_unit = f->params.assigned_tex_unit[i];
+        param.std140_offset = f->params.std140_offset[i];
+        param.std140_size = f->params.std140_size[i];
+        ok = fwrite(&param, sizeof(param), 1, file) == 1;
+    }
+    if (ok)
+        ok = fwrite(binary, 1, length, file) == (size_t)length;
+    ok = fraktal_close_binary_file(file, temp, path, ok);
+    free(binary);
+    fraktal_check_gl_error();
+    return ok;
+}
+
+// If 'key' is non-zero, the file is only accepted if it was exported with
+// the same key. Mismatches are reported to the log unless 'quiet' is set.
+static fKernel *import_kernel(const char *path, uint64_t key, bool quiet)
+{
+    fraktal_assert(path);
+    fraktal_ensure_context();
+    fraktal_check_gl_error();
+    if (!fraktal_program_binary_supported())
+    {
+        if (!quiet) log_err("Failed to import kernel (%s): driver does not support program binaries.\n", path);
+        return NULL;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        if (!quiet) log_err("Failed to import kernel (%s): could not open file.\n", path);
+        return NULL;
+    }
+
+    fKernelBinaryHeader header;
+    if (!fraktal_read_binary_header(file, &header))
+    {
+        if (!quiet) log_err("Failed to import kernel (%s): not a fraktal kernel binary.\n", path);
+        fclose(file);
+        return NULL;
+    }
+    if (header.driver_hash != fraktal_driver_hash())
+    {
+        if (!quiet) log_err("Failed to import kernel (%s): binary was created by a different driver.\n", path);
+        fclose(file);
+        return NULL;
+    }
+    if (key && header.key != key)
+    {
+        if (!quiet) log_err("Failed to import kernel (%s): binary was created from different sources.\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    fParams *params = (fParams*)malloc(sizeof(fParams));
+    fraktal_assert(params && "Ran out of memory");
+    bool ok = fraktal_read_binary_params(file, header, params);
+
+    // the length was checked against the file size by fraktal_read_binary_header
+    void *binary = malloc(header.binary_length);
+    fraktal_assert(binary && "Ran out of memory");
+    if (ok)
+        ok = fread(binary, 1, header.binary_length, file) == header.binary_length;
+    fclose(file);
+
+    fKernel *kernel = NULL;
+    if (ok)
+    {
+        GLuint program = glCreateProgram();
+        glProgramBinary(program, (GLenum)header.binary_format, binary, (GLsizei)header.binary_length);
+        GLint status = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        while (glGetError() != GL_NO_ERROR)
+            ; // binary formats may be rejected with GL_INVALID_ENUM
+        if (status)
+            kernel = fraktal_create_kernel(program, params);
+        else
+            glDeleteProgram(program);
+    }
+    if (!kernel && !quiet)
+        log_err("Failed to import kernel (%s): binary is corrupt or was rejected by the driver.\n", path);
+
+    free(binary);
+    free(params);
+    fraktal_check_gl_error();
+    return kernel;
+}
+
+#else
+// see fraktal_software_link.h
+static bool export_kernel(fKernel *f, const char *path, uint64_t key);
+static fKernel *import_kernel(const char *path, uint64_t key, bool quiet);
+#endif
+
+// Writes the path of the cache entry for 'key' into 'path'. Returns false
+// if the kernel cache is disabled.
+static bool kernel_cache_path(uint64_t key, char *path, size_t sizeof_path)
+{
+    if (!fraktal_kernel_cache_dir)
+        return false;
+    int n = snprintf(path, sizeof_path, "%s/%016llx.bin", fraktal_kernel_cache_dir, (unsigned long long)key);
+    return n > 0 && (size_t)n < sizeof_path;
+}
+
+void fraktal_set_kernel_cache_dir(const char *dir)
+{
+    free(fraktal_kernel_cache_dir);
+    fraktal_kernel_cache_dir = NULL;
+    if (dir)
+    {
+        size_t len = strlen(dir);
+        while (len > 0 && (dir[len - 1] == '/' || dir[len - 1] == '\\'))
+            len--;
+        fraktal_kernel_cache_dir = (char*)malloc(len + 1);
+        fraktal_assert(fraktal_kernel_cache_dir && "Ran out of memory");
+        memcpy(fraktal_kernel_cache_dir, dir, len);
+        fraktal_kernel_cache_dir[len] = '\0';
+    }
+}
+
+bool fraktal_export_kernel(fKernel *f, const char *path)
+{
+    if (!export_kernel(f, path, 0))
+    {
+        log_err("Failed to export kernel (%s).\n", path);
+        return false;
+    }
+    return true;
+}
+
+fKernel *fraktal_import_kernel(const char *path)
+{
+    return import_kernel(path, 0, false);
+}
@@ -2,26 +2,240 @@
 // See LICENSE.txt for copyright and licensing details (standard MIT License).
 
 #pragma once
+#include <stdlib.h>
+#include <string.h>
 #include "reuse/log.h"
+#ifdef FRAKTAL_HEADLESS
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#else
 #include "reuse/glfw/include/GLFW/glfw3.h"
 
 // Required to link with vc2010 GLFW
 #if defined(_MSC_VER) && (_MSC_VER >= 1900)
 #pragma comment(lib, "legacy_stdio_definitions")
 #endif
+#endif
+
+static const char *fraktal_glsl_version = "#version 150";
+
+struct fKernel;
+struct fShaderCache;
+struct fPixelBufferPool;
+struct fArrayPool;
+struct fTimerQueries;
+
+// GPU state that is saved by fraktal_use_kernel and restored when the
+// kernel is no longer in use.
+struct fSavedGLState
+{
+    GLint last_program;
+    GLint last_array_buffer;
+    GLint last_vertex_array;
+    GLint last_uniform_buffer;
+    GLint last_viewport[4];
+    GLint last_scissor_box[4];
+    GLint last_framebuffer;
+    GLenum last_blend_src_rgb;
+    GLenum last_blend_dst_rgb;
+    GLenum last_blend_src_alpha;
+    GLenum last_blend_dst_alpha;
+    GLenum last_blend_equation_rgb;
+    GLenum last_blend_equation_alpha;
+    GLboolean last_depth_writemask;
+    GLenum last_enable_blend;
+    GLenum last_enable_cull_face;
+    GLenum last_enable_depth_test;
+    GLenum last_enable_scissor_test;
+    GLenum last_enable_color_logic_op;
+};
+
+/*
+An fContext owns a GPU context and all state that fraktal keeps for it.
+GPU objects cannot be shared between contexts, so arrays and kernels
+remember the context that created them, and may only be used while that
+context is current on the calling thread.
+
+Each thread has its own current context. If fraktal is called on a thread
+without one, it assumes that the caller has made their own GPU context
+current, and wraps it in an fContext that does not own the GPU context.
+*/
+struct fContext
+{
+    #ifdef FRAKTAL_HEADLESS
+    EGLDisplay display;
+    EGLSurface surface;
+    EGLContext context;
+    #else
+    GLFWwindow *window;
+    #endif
+    bool owns_gpu_context;
+
+    fKernel *current_kernel;
+    fSavedGLState saved;
+    GLuint quad;
+    GLuint vao;
+    GLuint vertex_shader;
+    fShaderCache *shader_cache;
+    fPixelBufferPool *pixel_buffers;
+    fArrayPool *array_pool;
+    fTimerQueries *timer_queries; // see fraktal_enable_kernel_stats
+    float tile_budget_ms; // see fraktal_set_tile_budget
+    GLuint mrt_fbo; // see fraktal_run_kernel_mrt
+    int parallel_compile; // -1 until queried (see fraktal_parallel_compile_supported)
+};
+
+static thread_local fContext *fraktal_current_context = NULL;
+
+// These free the per-context state of the other modules. The GPU objects
+// in it are deleted as well if 'delete_gpu_objects' is set, which requires
+// the GPU context to be current (see fraktal_destroy_context).
+static void fraktal_free_array_pool(fArrayPool *pool, bool delete_gpu_objects); // see fraktal_array.h
+static void fraktal_free_pixel_buffers(fPixelBufferPool *pool, bool delete_gpu_objects); // see fraktal_array.h
+static void fraktal_free_timer_queries(fTimerQueries *t, bool delete_gpu_objects); // see fraktal_timer.h
+static void fraktal_free_shader_cache(fShaderCache *cache, bool delete_gpu_objects); // see fraktal_link.h
+
+#ifdef FRAKTAL_HEADLESS
+/*
+The headless backend creates an OpenGL context through EGL, and does not
+need a display server. The surfaceless platform (EGL_MESA_platform_surfaceless)
+is preferred, as it involves no windowing system at all. Otherwise the
+default display is used, with a 1x1 pbuffer surface if the implementation
+lacks EGL_KHR_surfaceless_context. Kernels always render into framebuffer
+objects, so the surface is never drawn to. Unlike GLFW, EGL lets contexts
+be created on any thread.
+*/
+
+static bool fraktal_egl_has_extension(EGLDisplay display, const char *name)
+{
+    const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+    if (!extensions)
+        return false;
+    size_t length = strlen(name);
+    for (const char *c = strstr(extensions, name); c; c = strstr(c + length, name))
+    {
+        bool starts = c == extensions || c[-1] == ' ';
+        bool ends = c[length] == ' ' || c[length] == '\0';
+        if (starts && ends)
+            return true;
+    }
+    return false;
+}
+
+static EGLDisplay fraktal_egl_get_display()
+{
+    if (fraktal_egl_has_extension(EGL_NO_DISPLAY, "EGL_MESA_platform_surfaceless"))
+    {
+        PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (get_platform_display)
+        {
+            EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+            if (display != EGL_NO_DISPLAY && eglInitialize(display, NULL, NULL))
+                return display;
+        }
+    }
+    EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display != EGL_NO_DISPLAY && eglInitialize(display, NULL, NULL))
+        return display;
+    return EGL_NO_DISPLAY;
+}
+
+static bool fraktal_backend_create(fContext *c)
+{
+    EGLDisplay display = fraktal_egl_get_display();
+    if (display == EGL_NO_DISPLAY)
+    {
+        fprintf(stderr, "Error creating context: failed to initialize EGL display.\n");
+        return false;
+    }
+    if (!eglBindAPI(EGL_OPENGL_API))
+    {
+        fprintf(stderr, "Error creating context: EGL display does not support OpenGL.\n");
+        return false;
+    }
+
+    bool surfaceless = fraktal_egl_has_extension(display, "EGL_KHR_surfaceless_context");
+    EGLint config_attribs[] = {
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+        EGL_NONE
+    };
+    EGLConfig config = NULL;
+    EGLint num_configs = 0;
+    if (!eglChooseConfig(display, config_attribs, &config, 1, &num_configs) || num_configs < 1)
+    {
+        fprintf(stderr, "Error creating context: no suitable EGL config.\n");
+        return false;
+    }
+
+    // Same version as the GLFW backend creates on Mac
+    EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 2,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+    if (context == EGL_NO_CONTEXT)
+    {
+        fprintf(stderr, "Error creating context: failed to create EGL context.\n");
+        return false;
+    }
+
+    EGLSurface surface = EGL_NO_SURFACE;
+    if (!surfaceless)
+    {
+        EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+        surface = eglCreatePbufferSurface(display, config, pbuffer_attribs);
+        if (surface == EGL_NO_SURFACE)
+        {
+            fprintf(stderr, "Error creating context: failed to create EGL pbuffer.\n");
+            eglDestroyContext(display, context);
+            return false;
+        }
+    }
+
+    c->display = display;
+    c->surface = surface;
+    c->context = context;
+    return true;
+}
+
+// The display is shared by all contexts in the process, and is therefore
+// not terminated here.
+static void fraktal_backend_destroy(fContext *c)
+{
+    if (eglGetCurrentContext() == c->context)
+        eglMakeCurrent(c->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (c->surface != EGL_NO_SURFACE)
+        eglDestroySurface(c->display, c->surface);
+    eglDestroyContext(c->display, c->context);
+}
+
+static void fraktal_backend_make_current(fContext *c)
+{
+    // the bound API is per-thread state in EGL
+    eglBindAPI(EGL_OPENGL_API);
+    if (eglGetCurrentContext() != c->context)
+        eglMakeCurrent(c->display, c->surface, c->surface, c->context);
+}
+
+static void fraktal_backend_release(fContext *c)
+{
+    eglMakeCurrent(c->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
 
+#else
 static void fraktal_glfw_error_callback(int error, const char* description)
 {
     fprintf(stderr, "Fraktal GLFW error %d: %s\n", error, description);
 }
 
-static GLFWwindow *fraktal_context = NULL;
-static bool fraktal_gl_symbols_loaded = false;
-static const char *fraktal_glsl_version = "#version 150";
-
-bool fraktal_create_context()
+// GLFW requires windows to be created and destroyed on the main thread,
+// but they can be made current on any thread.
+static bool fraktal_backend_create(fContext *c)
 {
-    fraktal_assert(!fraktal_context && "A context already exists.");
     glfwSetErrorCallback(fraktal_glfw_error_callback);
     if (!glfwInit())
         return false;
@@ -37,8 +251,8 @@ bool fraktal_create_context()
     #endif
     glfwWindowHint(GLFW_VISIBLE, false);
 
-    fraktal_context = glfwCreateWindow(32, 32, "fraktal", NULL, NULL);
-    if (fraktal_context == NULL)
+    c->window = glfwCreateWindow(32, 32, "fraktal", NULL, NULL);
+    if (c->window == NULL)
     {
         fprintf(stderr, "Error creating context: failed to create GLFW window.\n");
         return false;
@@ -46,38 +260,120 @@ bool fraktal_create_context()
     return true;
 }
 
-void fraktal_destroy_context()
+static void fraktal_backend_destroy(fContext *c)
+{
+    glfwDestroyWindow(c->window);
+}
+
+static void fraktal_backend_make_current(fContext *c)
+{
+    if (glfwGetCurrentContext() != c->window)
+        glfwMakeContextCurrent(c->window);
+}
+
+static void fraktal_backend_release(fContext *c)
+{
+    (void)c;
+    glfwMakeContextCurrent(NULL);
+}
+#endif
+
+static fContext *fraktal_alloc_context(bool owns_gpu_context)
+{
+    fContext *c = (fContext*)calloc(1, sizeof(fContext));
+    fraktal_assert(c && "Ran out of memory");
+    c->owns_gpu_context = owns_gpu_context;
+    c->parallel_compile = -1;
+    return c;
+}
+
+fContext *fraktal_create_context()
+{
+    fContext *c = fraktal_alloc_context(true);
+    if (!fraktal_backend_create(c))
+    {
+        free(c);
+        return NULL;
+    }
+    fraktal_set_current_context(c);
+    return c;
+}
+
+// GPU objects belonging to the context are released along with the GPU
+// context. If the GPU context is owned by the caller, it outlives us, so
+// the objects we created in it are deleted here instead, which is why the
+// caller must keep it current until this returns.
+void fraktal_destroy_context(fContext *c)
 {
-    if (fraktal_context)
-        glfwDestroyWindow(fraktal_context);
-    fraktal_context = NULL;
+    if (!c)
+        return;
+    if (fraktal_current_context == c)
+        fraktal_current_context = NULL;
+    bool delete_gpu_objects = !c->owns_gpu_context;
+    if (delete_gpu_objects)
+    {
+        if (c->quad) glDeleteBuffers(1, &c->quad);
+        if (c->vao) glDeleteVertexArrays(1, &c->vao);
+        if (c->vertex_shader) glDeleteShader(c->vertex_shader);
+        if (c->mrt_fbo) glDeleteFramebuffers(1, &c->mrt_fbo);
+    }
+    fraktal_free_shader_cache(c->shader_cache, delete_gpu_objects);
+    fraktal_free_pixel_buffers(c->pixel_buffers, delete_gpu_objects);
+    fraktal_free_array_pool(c->array_pool, delete_gpu_objects);
+    fraktal_free_timer_queries(c->timer_queries, delete_gpu_objects);
+    if (c->owns_gpu_context)
+        fraktal_backend_destroy(c);
+    free(c);
+}
+
+void fraktal_set_current_context(fContext *c)
+{
+    if (c && c->owns_gpu_context)
+        fraktal_backend_make_current(c);
+    else if (!c && fraktal_current_context && fraktal_current_context->owns_gpu_context)
+        fraktal_backend_release(fraktal_current_context);
+    fraktal_current_context = c;
+}
+
+fContext *fraktal_get_current_context()
+{
+    return fraktal_current_context;
 }
 
 void fraktal_push_current_context()
 {
-    if (fraktal_context)
-        glfwMakeContextCurrent(fraktal_context);
+    if (fraktal_current_context && fraktal_current_context->owns_gpu_context)
+        fraktal_backend_make_current(fraktal_current_context);
 }
 
 void fraktal_pop_current_context()
 {
-    if (fraktal_context)
-        glfwMakeContextCurrent(NULL);
+    if (fraktal_current_context && fraktal_current_context->owns_gpu_context)
+        fraktal_backend_release(fraktal_current_context);
 }
 
-static void fraktal_ensure_context()
+static bool fraktal_load_gl_symbols()
 {
-    if (fraktal_context)
-        glfwMakeContextCurrent(fraktal_context);
-    // else: we expect the caller to have made a context current
-    // on the thread
+    // function-local statics are initialized once, even if several
+    // threads get here at the same time
+    static bool loaded = gl3wInit() == 0;
+    return loaded;
+}
 
-    if (!fraktal_gl_symbols_loaded)
+static void fraktal_ensure_context()
+{
+    if (!fraktal_current_context)
     {
-        fraktal_gl_symbols_loaded = true;
-        if (gl3wInit() != 0)
-            fraktal_assert(false && "Failed to load OpenGL symbols.");
+        // we expect the caller to have made a context current on the thread
+        fraktal_current_context = fraktal_alloc_context(false);
     }
+    else if (fraktal_current_context->owns_gpu_context)
+    {
+        fraktal_backend_make_current(fraktal_current_context);
+    }
+
+    if (!fraktal_load_gl_symbols())
+        fraktal_assert(false && "Failed to load OpenGL symbols.");
 
     // verify that we have OpenGL symbols loaded by testing one
     // of the function pointers
@@ -0,0 +1,3194 @@
+// Developed by Simen Haugo.
+// See LICENSE.txt for copyright and licensing details (standard MIT License).
+
+#pragma once
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <thread>
+#include <atomic>
+#include "reuse/log.h"
+#include "reuse/file.h"
+
+/*
+CPU evaluation of model functions (see fraktal_create_cpu_model).
+
+The sources are compiled in a single pass over their tokens, without a
+syntax tree: each call to a function is inlined by compiling its body
+again with the arguments bound to its parameters, and each loop is
+unrolled by compiling its body once per iteration. This requires loop
+conditions to become known at compile time, as they do for the loops in
+model files and hg_sdf.f.
+
+Values that vary between points live in virtual registers (one per vector
+component) that are assigned exactly once, and values that are known at
+compile time are folded. Branches that depend on the point are compiled
+as masked code: both sides of an if-statement are compiled, and each
+assignment keeps the previous value in the lanes where the branch is not
+taken. A return or break likewise removes its lanes from the mask of the
+statements that follow.
+
+After dead code elimination and register allocation, each instruction
+runs over a batch of FRAKTAL_CPU_BATCH points as a plain loop, which the
+C++ compiler turns into SIMD code. The loops do not depend on the flags
+the library is built with: with GCC on x86-64 Linux, fcpu_run is compiled
+at -O3 once for AVX-512 (16 lanes), once for AVX2 (8 lanes) and once for
+the baseline (SSE2, 4 lanes), and the version that the CPU supports is
+picked when the library is loaded. Other compilers vectorize the loops
+as far as the build flags allow.
+*/
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define FCPU_BATCH_KERNEL __attribute__((target_clones("avx512f","avx2","default"), optimize("O3","no-math-errno")))
+#else
+#define FCPU_BATCH_KERNEL
+#endif
+
+enum { FRAKTAL_CPU_BATCH = 64 };              // points per run of the program
+enum { FRAKTAL_CPU_CHUNK = 16*FRAKTAL_CPU_BATCH }; // points per work item of a thread
+
+enum { FCPU_MAX_PARAMS = 8 };
+enum { FCPU_MAX_VARS = 1024 };
+enum { FCPU_MAX_FUNCTIONS = 1024 };
+enum { FCPU_MAX_MACROS = 256 };
+enum { FCPU_MAX_UNIFORMS = 256 };
+enum { FCPU_MAX_INLINE_DEPTH = 64 };
+enum { FCPU_MAX_EXPAND_DEPTH = 32 };
+enum { FCPU_MAX_ITERATIONS = 1024 };
+enum { FCPU_MAX_INSTRUCTIONS = 1 << 22 };
+
+// The operations of the compiled program. Each is applied per lane to the
+// operands a, b and c, both when the program runs and when the compiler
+// folds operations on constants, so that the two always agree.
+#define FCPU_OPS(X) \
+    X(ADD,    2, a + b) \
+    X(SUB,    2, a - b) \
+    X(MUL,    2, a * b) \
+    X(DIV,    2, a / b) \
+    X(NEG,    1, -a) \
+    X(MIN,    2, b < a ? b : a) \
+    X(MAX,    2, a < b ? b : a) \
+    X(ABS,    1, fabsf(a)) \
+    X(SIGN,   1, (float)((a > 0.0f) - (a < 0.0f))) \
+    X(FLOOR,  1, floorf(a)) \
+    X(CEIL,   1, ceilf(a)) \
+    X(FRACT,  1, a - floorf(a)) \
+    X(TRUNC,  1, truncf(a)) \
+    X(ROUND,  1, roundf(a)) \
+    X(MOD,    2, a - b*floorf(a/b)) \
+    X(SQRT,   1, sqrtf(a)) \
+    X(RSQRT,  1, 1.0f/sqrtf(a)) \
+    X(POW,    2, powf(a, b)) \
+    X(EXP,    1, expf(a)) \
+    X(EXP2,   1, exp2f(a)) \
+    X(LOG,    1, logf(a)) \
+    X(LOG2,   1, log2f(a)) \
+    X(SIN,    1, sinf(a)) \
+    X(COS,    1, cosf(a)) \
+    X(TAN,    1, tanf(a)) \
+    X(ASIN,   1, asinf(a)) \
+    X(ACOS,   1, acosf(a)) \
+    X(ATAN,   1, atanf(a)) \
+    X(ATAN2,  2, atan2f(a, b)) \
+    X(LT,     2, a < b ? 1.0f : 0.0f) \
+    X(LE,     2, a <= b ? 1.0f : 0.0f) \
+    X(GT,     2, a > b ? 1.0f : 0.0f) \
+    X(GE,     2, a >= b ? 1.0f : 0.0f) \
+    X(EQ,     2, a == b ? 1.0f : 0.0f) \
+    X(NE,     2, a != b ? 1.0f : 0.0f) \
+    X(AND,    2, (a != 0.0f && b != 0.0f) ? 1.0f : 0.0f) \
+    X(OR,     2, (a != 0.0f || b != 0.0f) ? 1.0f : 0.0f) \
+    X(NOT,    1, a == 0.0f ? 1.0f : 0.0f) \
+    X(SELECT, 3, a != 0.0f ? b : c)
+
+enum fCpuOp_
+{
+    #define X(name, arity, expr) FCPU_##name,
+    FCPU_OPS(X)
+    #undef X
+    FCPU_CONST, // 'a' holds the bits of the value (hoisted out of the program)
+    FCPU_INPUT, // 'a' is the index of the input coordinate (hoisted out of the program)
+};
+
+static int fcpu_arity(int op)
+{
+    switch (op)
+    {
+        #define X(name, arity, expr) case FCPU_##name: return arity;
+        FCPU_OPS(X)
+        #undef X
+    }
+    return 0;
+}
+
+static float fcpu_apply(int op, float a, float b, float c)
+{
+    (void)b; (void)c;
+    switch (op)
+    {
+        #define X(name, arity, expr) case FCPU_##name: return expr;
+        FCPU_OPS(X)
+        #undef X
+    }
+    return 0.0f;
+}
+
+struct fCpuInstruction
+{
+    int op;
+    int dst;
+    int a, b, c;
+};
+
+struct fCpuModel
+{
+    fCpuInstruction *code;
+    int num_code;
+    int num_regs;
+    int input[3];     // registers holding the point coordinates
+    int output;       // register holding the distance
+    int num_constants;
+    int *constant_reg;
+    float *constant_value;
+};
+
+//-----------------------------------------------------------------------------
+// Tokens and preprocessor
+//-----------------------------------------------------------------------------
+
+enum { FCPU_TOKEN_END, FCPU_TOKEN_NAME, FCPU_TOKEN_NUMBER, FCPU_TOKEN_PUNCT };
+
+struct fCpuToken
+{
+    int kind;
+    const char *text; // points into the source, not NULL-terminated
+    int length;
+    float number;
+    bool is_float;    // number has a decimal point or exponent
+    int source;
+    int line;
+};
+
+struct fCpuMacro
+{
+    fCpuToken name;
+    bool function_like;
+    int num_params;
+    fCpuToken params[FCPU_MAX_PARAMS];
+    int body_begin; // range in fCpuCompiler::macro_tokens
+    int body_end;
+};
+
+// Types. Booleans and integers are stored as floats, which is exact for
+// the loop counters and indices they are used for.
+enum { FCPU_VOID, FCPU_BOOL, FCPU_INT, FCPU_FLOAT, FCPU_VEC2, FCPU_VEC3, FCPU_VEC4 };
+
+struct fCpuScalar
+{
+    int reg;  // virtual register, or -1 if the value is known at compile time
+    float k;  // the value if known
+};
+
+struct fCpuValue
+{
+    int type;
+    int length;           // number of elements if the value is an array, otherwise 0
+    fCpuScalar c[4];      // components
+    fCpuValue *elements;  // array elements (see fCpuCompiler::arrays)
+};
+
+struct fCpuLvalue
+{
+    int var;
+    int element; // array element, or -1
+    int n;       // number of components written
+    int comp[4]; // component of the variable written by each component
+};
+
+struct fCpuExpr
+{
+    fCpuValue v;
+    bool is_lvalue;
+    fCpuLvalue lv;
+};
+
+struct fCpuVar
+{
+    int name;        // token index
+    fCpuValue value;
+    fCpuScalar mask; // lanes active at the declaration (see fcpu_store)
+    bool is_const;
+};
+
+enum { FCPU_IN, FCPU_OUT, FCPU_INOUT };
+
+struct fCpuFunction
+{
+    int name; // token index
+    int return_type;
+    int num_params;
+    int param_type[FCPU_MAX_PARAMS];
+    int param_qualifier[FCPU_MAX_PARAMS];
+    int param_name[FCPU_MAX_PARAMS];
+    int body; // token index of '{', or -1 for a forward-declaration
+};
+
+// An inlined function call
+struct fCpuFrame
+{
+    fCpuFunction *function;
+    int var_base;
+    fCpuValue result;
+    bool has_result;
+    fCpuScalar returned; // lanes that have returned
+};
+
+// An unrolled loop
+struct fCpuLoop
+{
+    fCpuScalar broken;    // lanes that have left the loop
+    fCpuScalar continued; // lanes that have skipped the rest of this iteration
+    int init_begin;       // variables declared in the initializer of a for-loop
+    int init_end;
+    bool in_step;         // compiling the step expression
+};
+
+struct fCpuCompiler
+{
+    const char **names;
+    bool failed;
+
+    fCpuToken *tokens;
+    int num_tokens;
+    int tokens_capacity;
+    int pos;
+
+    fCpuToken *macro_tokens;
+    int num_macro_tokens;
+    int macro_tokens_capacity;
+    fCpuMacro macros[FCPU_MAX_MACROS];
+    int num_macros;
+
+    fCpuToken uniforms[FCPU_MAX_UNIFORMS];
+    int num_uniforms;
+
+    fCpuFunction functions[FCPU_MAX_FUNCTIONS];
+    int num_functions;
+
+    fCpuVar vars[FCPU_MAX_VARS];
+    int num_vars;
+    int num_globals;
+
+    fCpuFrame *frame;
+    fCpuLoop *loop;
+    fCpuScalar mask; // lanes executing the current statement, not counting returns and breaks
+    int depth;
+
+    fCpuInstruction *code; // indexed by destination register
+    int num_code;
+    int code_capacity;
+    int *cse;              // hash table of instructions, for common subexpression elimination
+    int cse_capacity;
+
+    fCpuValue **arrays; // allocations of array elements
+    int num_arrays;
+    int arrays_capacity;
+};
+
+static void fcpu_grow(void **data, int *capacity, int count, size_t size)
+{
+    if (count < *capacity)
+        return;
+    int new_capacity = *capacity ? 2*(*capacity) : 256;
+    *data = realloc(*data, new_capacity*size);
+    fraktal_assert(*data && "Ran out of memory");
+    *capacity = new_capacity;
+}
+
+static void fcpu_error(fCpuCompiler *c, const fCpuToken *t, const char *message)
+{
+    if (c->failed)
+        return;
+    c->failed = true;
+    if (t && t->source >= 0)
+        log_err("<%s>: line %d: error: %s\n", c->names[t->source], t->line, message);
+    else
+        log_err("<cpu model>: error: %s\n", message);
+}
+
+static void fcpu_error_at(fCpuCompiler *c, int token, const char *message)
+{
+    fcpu_error(c, token < c->num_tokens ? &c->tokens[token] : NULL, message);
+}
+
+static bool fcpu_token_is(const fCpuToken *t, const char *s)
+{
+    int n = (int)strlen(s);
+    return t->kind != FCPU_TOKEN_END && t->length == n && strncmp(t->text, s, n) == 0;
+}
+
+static bool fcpu_same_name(const fCpuToken *a, const fCpuToken *b)
+{
+    return a->length == b->length && strncmp(a->text, b->text, a->length) == 0;
+}
+
+static bool fcpu_is_name_char(char ch)
+{
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_';
+}
+
+// Skips whitespace and comments, stopping at the end of the line if 'eol'.
+static const char *fcpu_skip_space(const char *s, int *line, bool stop_at_eol)
+{
+    for (;;)
+    {
+        if (*s == '\n' && stop_at_eol)
+            return s;
+        if (*s == '\n') { (*line)++; s++; }
+        else if (*s == ' ' || *s == '\t' || *s == '\r') s++;
+        else if (s[0] == '\\' && s[1] == '\n') { (*line)++; s += 2; }
+        else if (s[0] == '/' && s[1] == '/') { while (*s && *s != '\n') s++; }
+        else if (s[0] == '/' && s[1] == '*')
+        {
+            s += 2;
+            while (*s && !(s[0] == '*' && s[1] == '/'))
+            {
+                if (*s == '\n') (*line)++;
+                s++;
+            }
+            if (*s) s += 2;
+        }
+        else return s;
+    }
+}
+
+// Reads one token at 's' (which is not whitespace) and returns the end of it.
+static const char *fcpu_lex(const char *s, fCpuToken *t)
+{
+    static const char *puncts[] = {
+        "<<=", ">>=", "++", "--", "+=", "-=", "*=", "/=", "%=", "==", "!=", "<=", ">=",
+        "&&", "||", "^^", "<<", ">>", "&=", "|=", "^=", "##"
+    };
+    t->text = s;
+    t->is_float = false;
+    t->number = 0.0f;
+    if ((*s >= '0' && *s <= '9') || (*s == '.' && s[1] >= '0' && s[1] <= '9'))
+    {
+        char *end = NULL;
+        if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+        {
+            t->number = (float)strtol(s, &end, 16);
+        }
+        else
+        {
+            const char *e = s;
+            while (*e >= '0' && *e <= '9') e++;
+            t->is_float = *e == '.' || *e == 'e' || *e == 'E';
+            t->number = (float)strtod(s, &end);
+        }
+        s = end;
+        while (*s == 'f' || *s == 'F' || *s == 'u' || *s == 'U')
+            s++;
+        t->kind = FCPU_TOKEN_NUMBER;
+    }
+    else if (fcpu_is_name_char(*s))
+    {
+        while (fcpu_is_name_char(*s))
+            s++;
+        t->kind = FCPU_TOKEN_NAME;
+    }
+    else
+    {
+        t->kind = FCPU_TOKEN_PUNCT;
+        s++;
+        for (size_t i = 0; i < sizeof(puncts)/sizeof(puncts[0]); i++)
+        {
+            size_t n = strlen(puncts[i]);
+            if (strncmp(t->text, puncts[i], n) == 0)
+            {
+                s = t->text + n;
+                break;
+            }
+        }
+    }
+    t->length = (int)(s - t->text);
+    return s;
+}
+
+static fCpuMacro *fcpu_find_macro(fCpuCompiler *c, const fCpuToken *t)
+{
+    if (t->kind != FCPU_TOKEN_NAME)
+        return NULL;
+    for (int i = 0; i < c->num_macros; i++)
+        if (fcpu_same_name(&c->macros[i].name, t))
+            return &c->macros[i];
+    return NULL;
+}
+
+static void fcpu_append_token(fCpuCompiler *c, const fCpuToken *t)
+{
+    fcpu_grow((void**)&c->tokens, &c->tokens_capacity, c->num_tokens + 1, sizeof(fCpuToken));
+    c->tokens[c->num_tokens++] = *t;
+}
+
+// Appends tokens to the program, replacing macros by their expansion.
+static void fcpu_expand(fCpuCompiler *c, const fCpuToken *list, int n, int depth)
+{
+    if (depth > FCPU_MAX_EXPAND_DEPTH)
+    {
+        fcpu_error(c, n > 0 ? &list[0] : NULL, "macro expansion is too deep (is a macro recursive?).");
+        return;
+    }
+    for (int i = 0; i < n && !c->failed; i++)
+    {
+        fCpuMacro *m = fcpu_find_macro(c, &list[i]);
+        if (!m)
+        {
+            fcpu_append_token(c, &list[i]);
+        }
+        else if (!m->function_like)
+        {
+            int count = m->body_end - m->body_begin;
+            fCpuToken *body = (fCpuToken*)malloc((count + 1)*sizeof(fCpuToken));
+            fraktal_assert(body && "Ran out of memory");
+            for (int j = 0; j < count; j++)
+            {
+                body[j] = c->macro_tokens[m->body_begin + j];
+                body[j].source = list[i].source; // report errors at the use
+                body[j].line = list[i].line;
+            }
+            fcpu_expand(c, body, count, depth + 1);
+            free(body);
+        }
+        else if (i + 1 < n && fcpu_token_is(&list[i + 1], "("))
+        {
+            // collect the arguments
+            int arg_begin[FCPU_MAX_PARAMS];
+            int arg_end[FCPU_MAX_PARAMS];
+            int num_args = 0;
+            int level = 0;
+            int j = i + 2;
+            arg_begin[0] = j;
+            for (; j < n; j++)
+            {
+                if (fcpu_token_is(&list[j], "(")) level++;
+                else if (fcpu_token_is(&list[j], ")") && level > 0) level--;
+                else if (level == 0 && (fcpu_token_is(&list[j], ",") || fcpu_token_is(&list[j], ")")))
+                {
+                    if (num_args == FCPU_MAX_PARAMS)
+                        break;
+                    arg_end[num_args++] = j;
+                    if (fcpu_token_is(&list[j], ")"))
+                        break;
+                    arg_begin[num_args] = j + 1;
+                }
+            }
+            if (j == n || num_args == FCPU_MAX_PARAMS)
+            {
+                fcpu_error(c, &list[i], "unterminated macro arguments.");
+                return;
+            }
+            if (num_args == 1 && m->num_params == 0 && arg_begin[0] == arg_end[0])
+                num_args = 0;
+            if (num_args != m->num_params)
+            {
+                fcpu_error(c, &list[i], "wrong number of macro arguments.");
+                return;
+            }
+
+            // substitute the arguments into the body
+            int count = 0;
+            for (int k = m->body_begin; k < m->body_end; k++)
+            {
+                int arg = -1;
+                for (int p = 0; p < m->num_params; p++)
+                    if (c->macro_tokens[k].kind == FCPU_TOKEN_NAME && fcpu_same_name(&c->macro_tokens[k], &m->params[p]))
+                        arg = p;
+                count += arg >= 0 ? arg_end[arg] - arg_begin[arg] : 1;
+            }
+            fCpuToken *body = (fCpuToken*)malloc((count + 1)*sizeof(fCpuToken));
+            fraktal_assert(body && "Ran out of memory");
+            count = 0;
+            for (int k = m->body_begin; k < m->body_end; k++)
+            {
+                int arg = -1;
+                for (int p = 0; p < m->num_params; p++)
+                    if (c->macro_tokens[k].kind == FCPU_TOKEN_NAME && fcpu_same_name(&c->macro_tokens[k], &m->params[p]))
+                        arg = p;
+                if (arg >= 0)
+                {
+                    for (int a = arg_begin[arg]; a < arg_end[arg]; a++)
+                        body[count++] = list[a];
+                }
+                else
+                {
+                    body[count] = c->macro_tokens[k];
+                    body[count].source = list[i].source;
+                    body[count].line = list[i].line;
+                    count++;
+                }
+            }
+            fcpu_expand(c, body, count, depth + 1);
+            free(body);
+            i = j;
+        }
+        else
+        {
+            fcpu_append_token(c, &list[i]);
+        }
+    }
+}
+
+// Handles a preprocessor directive in [s, eol). Returns false on error.
+static bool fcpu_directive(fCpuCompiler *c, const char *s, const char *eol, int source, int line,
+                           bool *skipping, int *cond_depth, int *skip_depth)
+{
+    fCpuToken t;
+    t.source = source;
+    t.line = line;
+    int l = line;
+    s = fcpu_skip_space(s + 1, &l, true);
+    if (s >= eol)
+        return true;
+    s = fcpu_lex(s, &t);
+
+    bool is_if = fcpu_token_is(&t, "if");
+    bool is_ifdef = fcpu_token_is(&t, "ifdef");
+    bool is_ifndef = fcpu_token_is(&t, "ifndef");
+    if (is_if || is_ifdef || is_ifndef)
+    {
+        (*cond_depth)++;
+        if (*skipping)
+            return true;
+        bool value = false;
+        fCpuToken a;
+        a.source = source;
+        a.line = line;
+        s = fcpu_skip_space(s, &l, true);
+        bool negate = false;
+        if (is_if && *s == '!') { negate = true; s = fcpu_skip_space(s + 1, &l, true); }
+        if (s >= eol) { fcpu_error(c, &t, "expected an expression after #if."); return false; }
+        s = fcpu_lex(s, &a);
+        if (is_if && a.kind == FCPU_TOKEN_NUMBER)
+        {
+            value = a.number != 0.0f;
+        }
+        else if (is_if && fcpu_token_is(&a, "defined"))
+        {
+            s = fcpu_skip_space(s, &l, true);
+            bool paren = *s == '(';
+            if (paren) s = fcpu_skip_space(s + 1, &l, true);
+            s = fcpu_lex(s, &a);
+            value = fcpu_find_macro(c, &a) != NULL;
+        }
+        else if (!is_if && a.kind == FCPU_TOKEN_NAME)
+        {
+            value = fcpu_find_macro(c, &a) != NULL;
+            if (is_ifndef) value = !value;
+        }
+        else
+        {
+            fcpu_error(c, &t, "unsupported #if expression (only numbers and defined(NAME) are supported).");
+            return false;
+        }
+        if (negate) value = !value;
+        if (!value)
+        {
+            *skipping = true;
+            *skip_depth = *cond_depth;
+        }
+    }
+    else if (fcpu_token_is(&t, "else") || fcpu_token_is(&t, "elif"))
+    {
+        if (fcpu_token_is(&t, "elif"))
+        {
+            fcpu_error(c, &t, "#elif is not supported.");
+            return false;
+        }
+        if (*skipping && *skip_depth == *cond_depth)
+            *skipping = false;
+        else if (!*skipping)
+        {
+            *skipping = true;
+            *skip_depth = *cond_depth;
+        }
+    }
+    else if (fcpu_token_is(&t, "endif"))
+    {
+        if (*skipping && *skip_depth == *cond_depth)
+            *skipping = false;
+        (*cond_depth)--;
+    }
+    else if (*skipping)
+    {
+        return true;
+    }
+    else if (fcpu_token_is(&t, "define"))
+    {
+        if (c->num_macros == FCPU_MAX_MACROS)
+        {
+            fcpu_error(c, &t, "too many macros.");
+            return false;
+        }
+        fCpuMacro *m = &c->macros[c->num_macros];
+        m->name.source = source;
+        m->name.line = line;
+        s = fcpu_skip_space(s, &l, true);
+        s = fcpu_lex(s, &m->name);
+        m->function_like = *s == '(';
+        m->num_params = 0;
+        if (m->function_like)
+        {
+            s++;
+            for (;;)
+            {
+                s = fcpu_skip_space(s, &l, true);
+                if (s >= eol) { fcpu_error(c, &t, "unterminated macro parameters."); return false; }
+                if (*s == ')') { s++; break; }
+                if (*s == ',') { s++; continue; }
+                if (m->num_params == FCPU_MAX_PARAMS) { fcpu_error(c, &t, "too many macro parameters."); return false; }
+                s = fcpu_lex(s, &m->params[m->num_params++]);
+            }
+        }
+        m->body_begin = c->num_macro_tokens;
+        for (;;)
+        {
+            s = fcpu_skip_space(s, &l, true);
+            if (s >= eol || !*s)
+                break;
+            fCpuToken b;
+            b.source = source;
+            b.line = line;
+            s = fcpu_lex(s, &b);
+            fcpu_grow((void**)&c->macro_tokens, &c->macro_tokens_capacity, c->num_macro_tokens + 1, sizeof(fCpuToken));
+            c->macro_tokens[c->num_macro_tokens++] = b;
+        }
+        m->body_end = c->num_macro_tokens;
+
+        // a redefinition replaces the previous macro
+        fCpuMacro *existing = fcpu_find_macro(c, &m->name);
+        if (existing)
+            *existing = *m;
+        else
+            c->num_macros++;
+    }
+    else if (fcpu_token_is(&t, "undef"))
+    {
+        fCpuToken name;
+        name.source = source;
+        name.line = line;
+        s = fcpu_skip_space(s, &l, true);
+        fcpu_lex(s, &name);
+        fCpuMacro *m = fcpu_find_macro(c, &name);
+        if (m)
+            *m = c->macros[--c->num_macros];
+    }
+    // #version, #line, #extension and #pragma are ignored
+    return true;
+}
+
+static bool fcpu_tokenize(fCpuCompiler *c, const char *s, int source)
+{
+    int line = 1;
+    bool line_start = true;
+    bool skipping = false;
+    int cond_depth = 0;
+    int skip_depth = 0;
+    while (!c->failed)
+    {
+        int before = line;
+        s = fcpu_skip_space(s, &line, false);
+        if (line != before)
+            line_start = true;
+        if (!*s)
+            break;
+        if (*s == '#' && line_start)
+        {
+            const char *eol = s;
+            while (*eol && *eol != '\n')
+            {
+                if (eol[0] == '\\' && eol[1] == '\n') eol++;
+                eol++;
+            }
+            if (!fcpu_directive(c, s, eol, source, line, &skipping, &cond_depth, &skip_depth))
+                return false;
+            s = eol;
+            continue;
+        }
+        line_start = false;
+
+        fCpuToken t;
+        t.source = source;
+        t.line = line;
+        s = fcpu_lex(s, &t);
+        if (skipping)
+            continue;
+
+        fCpuMacro *m = fcpu_find_macro(c, &t);
+        if (m && m->function_like)
+        {
+            // the arguments are read from the source before expanding
+            int l = line;
+            const char *p = fcpu_skip_space(s, &l, false);
+            if (*p != '(')
+            {
+                fcpu_append_token(c, &t);
+                continue;
+            }
+            fCpuToken call[256];
+            int n = 0;
+            int level = 0;
+            call[n++] = t;
+            while (*p && n < 256)
+            {
+                p = fcpu_skip_space(p, &l, false);
+                fCpuToken a;
+                a.source = source;
+                a.line = l;
+                p = fcpu_lex(p, &a);
+                call[n++] = a;
+                if (fcpu_token_is(&a, "(")) level++;
+                if (fcpu_token_is(&a, ")") && --level == 0) break;
+            }
+            if (level != 0)
+            {
+                fcpu_error(c, &t, "unterminated macro arguments.");
+                return false;
+            }
+            s = p;
+            line = l;
+            fcpu_expand(c, call, n, 0);
+        }
+        else
+        {
+            fcpu_expand(c, &t, 1, 0);
+        }
+    }
+    return !c->failed;
+}
+
+//-----------------------------------------------------------------------------
+// Code generation
+//-----------------------------------------------------------------------------
+
+static fCpuScalar fcpu_const(float k)
+{
+    fCpuScalar s;
+    s.reg = -1;
+    s.k = k;
+    return s;
+}
+
+static fCpuScalar fcpu_reg(int reg)
+{
+    fCpuScalar s;
+    s.reg = reg;
+    s.k = 0.0f;
+    return s;
+}
+
+static bool fcpu_is_const(fCpuScalar s, float k)
+{
+    return s.reg < 0 && s.k == k;
+}
+
+static bool fcpu_same(fCpuScalar a, fCpuScalar b)
+{
+    if (a.reg >= 0 || b.reg >= 0)
+        return a.reg == b.reg;
+    return memcmp(&a.k, &b.k, sizeof(float)) == 0;
+}
+
+static unsigned int fcpu_hash(int op, int a, int b, int cc)
+{
+    unsigned int h = 2166136261u;
+    h = (h ^ (unsigned int)op)*16777619u;
+    h = (h ^ (unsigned int)a)*16777619u;
+    h = (h ^ (unsigned int)b)*16777619u;
+    h = (h ^ (unsigned int)cc)*16777619u;
+    return h;
+}
+
+// Returns the register holding the result of the instruction, reusing an
+// identical earlier instruction if there is one.
+static int fcpu_emit(fCpuCompiler *c, int op, int a, int b, int cc)
+{
+    if (2*(c->num_code + 1) > c->cse_capacity)
+    {
+        free(c->cse);
+        c->cse_capacity = c->cse_capacity ? 2*c->cse_capacity : 1024;
+        c->cse = (int*)malloc(c->cse_capacity*sizeof(int));
+        fraktal_assert(c->cse && "Ran out of memory");
+        for (int i = 0; i < c->cse_capacity; i++)
+            c->cse[i] = -1;
+        for (int i = 0; i < c->num_code; i++)
+        {
+            fCpuInstruction &in = c->code[i];
+            unsigned int h = fcpu_hash(in.op, in.a, in.b, in.c) & (c->cse_capacity - 1);
+            while (c->cse[h] >= 0)
+                h = (h + 1) & (c->cse_capacity - 1);
+            c->cse[h] = i;
+        }
+    }
+    unsigned int h = fcpu_hash(op, a, b, cc) & (c->cse_capacity - 1);
+    while (c->cse[h] >= 0)
+    {
+        fCpuInstruction &in = c->code[c->cse[h]];
+        if (in.op == op && in.a == a && in.b == b && in.c == cc)
+            return in.dst;
+        h = (h + 1) & (c->cse_capacity - 1);
+    }
+    if (c->num_code >= FCPU_MAX_INSTRUCTIONS)
+    {
+        fcpu_error_at(c, c->pos, "model is too large (are there loops with many iterations?).");
+        return 0;
+    }
+    fcpu_grow((void**)&c->code, &c->code_capacity, c->num_code + 1, sizeof(fCpuInstruction));
+    fCpuInstruction &in = c->code[c->num_code];
+    in.op = op;
+    in.dst = c->num_code;
+    in.a = a;
+    in.b = b;
+    in.c = cc;
+    c->cse[h] = c->num_code;
+    return c->num_code++;
+}
+
+static int fcpu_materialize(fCpuCompiler *c, fCpuScalar s)
+{
+    if (s.reg >= 0)
+        return s.reg;
+    int bits;
+    memcpy(&bits, &s.k, sizeof(float));
+    return fcpu_emit(c, FCPU_CONST, bits, 0, 0);
+}
+
+static fCpuScalar fcpu_op(fCpuCompiler *c, int op, fCpuScalar a, fCpuScalar b=fcpu_const(0.0f), fCpuScalar cc=fcpu_const(0.0f))
+{
+    int arity = fcpu_arity(op);
+    if (a.reg < 0 && (arity < 2 || b.reg < 0) && (arity < 3 || cc.reg < 0))
+        return fcpu_const(fcpu_apply(op, a.k, b.k, cc.k));
+
+    switch (op)
+    {
+        case FCPU_ADD: if (fcpu_is_const(a, 0.0f)) return b; if (fcpu_is_const(b, 0.0f)) return a; break;
+        case FCPU_SUB: if (fcpu_is_const(b, 0.0f)) return a; break;
+        case FCPU_MUL: if (fcpu_is_const(a, 1.0f)) return b; if (fcpu_is_const(b, 1.0f)) return a; break;
+        case FCPU_DIV: if (fcpu_is_const(b, 1.0f)) return a; break;
+        case FCPU_MIN: case FCPU_MAX: if (fcpu_same(a, b)) return a; break;
+        case FCPU_AND:
+            if (a.reg < 0) return a.k != 0.0f ? b : fcpu_const(0.0f);
+            if (b.reg < 0) return b.k != 0.0f ? a : fcpu_const(0.0f);
+            if (fcpu_same(a, b)) return a;
+            break;
+        case FCPU_OR:
+            if (a.reg < 0) return a.k != 0.0f ? fcpu_const(1.0f) : b;
+            if (b.reg < 0) return b.k != 0.0f ? fcpu_const(1.0f) : a;
+            if (fcpu_same(a, b)) return a;
+            break;
+        case FCPU_SELECT:
+            if (a.reg < 0) return a.k != 0.0f ? b : cc;
+            if (fcpu_same(b, cc)) return b;
+            break;
+    }
+
+    // commutative operations are ordered for common subexpression elimination
+    int ra = fcpu_materialize(c, a);
+    int rb = arity >= 2 ? fcpu_materialize(c, b) : 0;
+    int rc = arity >= 3 ? fcpu_materialize(c, cc) : 0;
+    bool commutative = op == FCPU_ADD || op == FCPU_MUL || op == FCPU_MIN || op == FCPU_MAX ||
+                       op == FCPU_EQ || op == FCPU_NE || op == FCPU_AND || op == FCPU_OR;
+    if (commutative && rb < ra)
+    {
+        int t = ra; ra = rb; rb = t;
+    }
+    return fcpu_reg(fcpu_emit(c, op, ra, rb, rc));
+}
+
+static int fcpu_components(int type)
+{
+    switch (type)
+    {
+        case FCPU_BOOL: case FCPU_INT: case FCPU_FLOAT: return 1;
+        case FCPU_VEC2: return 2;
+        case FCPU_VEC3: return 3;
+        case FCPU_VEC4: return 4;
+    }
+    return 0;
+}
+
+static int fcpu_vector_type(int n)
+{
+    if (n == 2) return FCPU_VEC2;
+    if (n == 3) return FCPU_VEC3;
+    if (n == 4) return FCPU_VEC4;
+    return FCPU_FLOAT;
+}
+
+static fCpuValue fcpu_value(int type)
+{
+    fCpuValue v;
+    memset(&v, 0, sizeof(v));
+    v.type = type;
+    for (int i = 0; i < 4; i++)
+        v.c[i] = fcpu_const(0.0f);
+    return v;
+}
+
+static fCpuValue *fcpu_alloc_elements(fCpuCompiler *c, int length)
+{
+    fcpu_grow((void**)&c->arrays, &c->arrays_capacity, c->num_arrays + 1, sizeof(fCpuValue*));
+    fCpuValue *e = (fCpuValue*)calloc(length > 0 ? length : 1, sizeof(fCpuValue));
+    fraktal_assert(e && "Ran out of memory");
+    c->arrays[c->num_arrays++] = e;
+    return e;
+}
+
+// Lanes that execute the current statement
+static fCpuScalar fcpu_active(fCpuCompiler *c)
+{
+    fCpuScalar m = c->mask;
+    if (c->frame)
+        m = fcpu_op(c, FCPU_AND, m, fcpu_op(c, FCPU_NOT, c->frame->returned));
+    if (c->loop)
+    {
+        m = fcpu_op(c, FCPU_AND, m, fcpu_op(c, FCPU_NOT, c->loop->broken));
+        m = fcpu_op(c, FCPU_AND, m, fcpu_op(c, FCPU_NOT, c->loop->continued));
+    }
+    return m;
+}
+
+// Whether the rest of the current block can be skipped, because all lanes
+// have returned, or left or continued the current loop.
+static bool fcpu_stopped(fCpuCompiler *c)
+{
+    if (c->failed)
+        return true;
+    return fcpu_is_const(fcpu_active(c), 0.0f);
+}
+
+//-----------------------------------------------------------------------------
+// Types and values
+//-----------------------------------------------------------------------------
+
+static fCpuToken *fcpu_tok(fCpuCompiler *c)
+{
+    static fCpuToken end = { FCPU_TOKEN_END, "", 0, 0.0f, false, -1, 0 };
+    if (c->pos < c->num_tokens)
+        return &c->tokens[c->pos];
+    end.source = c->num_tokens > 0 ? c->tokens[c->num_tokens - 1].source : -1;
+    end.line = c->num_tokens > 0 ? c->tokens[c->num_tokens - 1].line : 0;
+    return &end;
+}
+
+static bool fcpu_peek(fCpuCompiler *c, const char *s)
+{
+    return fcpu_token_is(fcpu_tok(c), s);
+}
+
+static bool fcpu_accept(fCpuCompiler *c, const char *s)
+{
+    if (!fcpu_peek(c, s))
+        return false;
+    c->pos++;
+    return true;
+}
+
+static void fcpu_expect(fCpuCompiler *c, const char *s)
+{
+    if (fcpu_accept(c, s))
+        return;
+    char message[64];
+    snprintf(message, sizeof(message), "expected '%s'.", s);
+    fcpu_error(c, fcpu_tok(c), message);
+}
+
+// Returns the type named by the token, or -1.
+static int fcpu_type_name(const fCpuToken *t)
+{
+    if (fcpu_token_is(t, "void"))  return FCPU_VOID;
+    if (fcpu_token_is(t, "bool"))  return FCPU_BOOL;
+    if (fcpu_token_is(t, "int"))   return FCPU_INT;
+    if (fcpu_token_is(t, "float")) return FCPU_FLOAT;
+    if (fcpu_token_is(t, "vec2"))  return FCPU_VEC2;
+    if (fcpu_token_is(t, "vec3"))  return FCPU_VEC3;
+    if (fcpu_token_is(t, "vec4"))  return FCPU_VEC4;
+    return -1;
+}
+
+static bool fcpu_is_precision(const fCpuToken *t)
+{
+    return fcpu_token_is(t, "highp") || fcpu_token_is(t, "mediump") || fcpu_token_is(t, "lowp");
+}
+
+// Implicit conversions (only int to float), and checks that the value has the given type.
+static fCpuValue fcpu_convert(fCpuCompiler *c, fCpuValue v, int type, int token)
+{
+    if (v.length > 0)
+    {
+        fcpu_error_at(c, token, "arrays cannot be used here.");
+        return fcpu_value(type);
+    }
+    if (v.type == type)
+        return v;
+    if (v.type == FCPU_INT && type == FCPU_FLOAT)
+    {
+        v.type = FCPU_FLOAT;
+        return v;
+    }
+    fcpu_error_at(c, token, "type mismatch.");
+    return fcpu_value(type);
+}
+
+static bool fcpu_convertible(int from, int to)
+{
+    return from == to || (from == FCPU_INT && to == FCPU_FLOAT);
+}
+
+// Keeps the previous value of 'old' in the lanes that are not in 'mask'.
+static fCpuValue fcpu_blend(fCpuCompiler *c, fCpuScalar mask, fCpuValue v, const fCpuValue &old)
+{
+    for (int i = 0; i < fcpu_components(v.type); i++)
+        v.c[i] = fcpu_op(c, FCPU_SELECT, mask, v.c[i], old.c[i]);
+    return v;
+}
+
+static fCpuValue fcpu_load(fCpuCompiler *c, const fCpuLvalue &lv)
+{
+    fCpuVar &var = c->vars[lv.var];
+    fCpuValue whole = lv.element >= 0 ? var.value.elements[lv.element] : var.value;
+    if (lv.n == fcpu_components(whole.type) && lv.n > 0)
+    {
+        bool identity = true;
+        for (int i = 0; i < lv.n; i++)
+            if (lv.comp[i] != i)
+                identity = false;
+        if (identity)
+            return whole;
+    }
+    fCpuValue v = fcpu_value(whole.type == FCPU_INT || whole.type == FCPU_BOOL ? whole.type : fcpu_vector_type(lv.n));
+    for (int i = 0; i < lv.n; i++)
+        v.c[i] = whole.c[lv.comp[i]];
+    return v;
+}
+
+// Assigns to the components of a variable. The previous value is kept in
+// lanes that are inactive, unless the variable was declared under the
+// same mask: those lanes cannot observe the variable.
+static void fcpu_store(fCpuCompiler *c, const fCpuLvalue &lv, fCpuValue v, int token)
+{
+    fCpuVar &var = c->vars[lv.var];
+    if (var.is_const)
+    {
+        fcpu_error_at(c, token, "cannot assign to a constant.");
+        return;
+    }
+    fCpuValue &whole = lv.element >= 0 ? var.value.elements[lv.element] : var.value;
+    if (whole.length > 0)
+    {
+        fcpu_error_at(c, token, "arrays cannot be assigned as a whole.");
+        return;
+    }
+    int type = lv.n == 1 && (whole.type == FCPU_INT || whole.type == FCPU_BOOL) ? whole.type : fcpu_vector_type(lv.n);
+    v = fcpu_convert(c, v, type, token);
+    fCpuScalar active = fcpu_active(c);
+    bool masked = !fcpu_same(active, var.mask);
+
+    // The counter of a for-loop is stepped in all lanes that entered the
+    // loop, so that it stays known at compile time when lanes break out of
+    // the loop. The lanes that have left cannot observe it.
+    if (c->loop && c->loop->in_step && lv.var >= c->loop->init_begin && lv.var < c->loop->init_end)
+        masked = false;
+
+    for (int i = 0; i < lv.n; i++)
+    {
+        fCpuScalar old = whole.c[lv.comp[i]];
+        whole.c[lv.comp[i]] = masked ? fcpu_op(c, FCPU_SELECT, active, v.c[i], old) : v.c[i];
+    }
+}
+
+static int fcpu_find_var(fCpuCompiler *c, const fCpuToken *name)
+{
+    int base = c->frame ? c->frame->var_base : c->num_globals;
+    for (int i = c->num_vars - 1; i >= base; i--)
+        if (fcpu_same_name(&c->tokens[c->vars[i].name], name))
+            return i;
+    for (int i = c->num_globals - 1; i >= 0; i--)
+        if (fcpu_same_name(&c->tokens[c->vars[i].name], name))
+            return i;
+    return -1;
+}
+
+static int fcpu_declare(fCpuCompiler *c, int name, fCpuValue value, bool is_const)
+{
+    if (c->num_vars == FCPU_MAX_VARS)
+    {
+        fcpu_error_at(c, name, "too many variables.");
+        return 0;
+    }
+    fCpuVar &var = c->vars[c->num_vars];
+    var.name = name;
+    var.value = value;
+    var.mask = fcpu_active(c);
+    var.is_const = is_const;
+    return c->num_vars++;
+}
+
+static fCpuExpr fcpu_rvalue(fCpuValue v)
+{
+    fCpuExpr e;
+    e.v = v;
+    e.is_lvalue = false;
+    return e;
+}
+
+//-----------------------------------------------------------------------------
+// Expressions
+//-----------------------------------------------------------------------------
+
+static fCpuExpr fcpu_expression(fCpuCompiler *c);
+static fCpuExpr fcpu_assignment(fCpuCompiler *c);
+static void fcpu_statement(fCpuCompiler *c);
+static void fcpu_skip_statement(fCpuCompiler *c);
+
+// Applies an operation per component, broadcasting scalar arguments.
+static fCpuValue fcpu_map(fCpuCompiler *c, int op, const fCpuValue *args, int num_args, int token)
+{
+    int n = 1;
+    bool is_float = false;
+    for (int i = 0; i < num_args; i++)
+    {
+        if (args[i].length > 0 || args[i].type == FCPU_BOOL || args[i].type == FCPU_VOID)
+        {
+            fcpu_error_at(c, token, "invalid operand type.");
+            return fcpu_value(FCPU_FLOAT);
+        }
+        int m = fcpu_components(args[i].type);
+        if (m > 1 && n > 1 && m != n)
+        {
+            fcpu_error_at(c, token, "vector sizes do not match.");
+            return fcpu_value(FCPU_FLOAT);
+        }
+        if (m > n) n = m;
+        if (args[i].type != FCPU_INT) is_float = true;
+    }
+    fCpuValue r = fcpu_value(n > 1 ? fcpu_vector_type(n) : (is_float ? FCPU_FLOAT : FCPU_INT));
+    for (int i = 0; i < n; i++)
+    {
+        fCpuScalar s[3] = { fcpu_const(0.0f), fcpu_const(0.0f), fcpu_const(0.0f) };
+        for (int j = 0; j < num_args; j++)
+            s[j] = args[j].c[fcpu_components(args[j].type) > 1 ? i : 0];
+        r.c[i] = fcpu_op(c, op, s[0], s[1], s[2]);
+    }
+    return r;
+}
+
+static fCpuValue fcpu_map1(fCpuCompiler *c, int op, fCpuValue a, int token)
+{
+    fCpuValue r = fcpu_map(c, op, &a, 1, token);
+    if (r.type == FCPU_INT) r.type = FCPU_FLOAT;
+    return r;
+}
+
+static fCpuValue fcpu_map2(fCpuCompiler *c, int op, fCpuValue a, fCpuValue b, int token)
+{
+    fCpuValue args[2] = { a, b };
+    return fcpu_map(c, op, args, 2, token);
+}
+
+static fCpuScalar fcpu_dot(fCpuCompiler *c, const fCpuValue &a, const fCpuValue &b)
+{
+    fCpuScalar sum = fcpu_op(c, FCPU_MUL, a.c[0], b.c[0]);
+    for (int i = 1; i < fcpu_components(a.type); i++)
+        sum = fcpu_op(c, FCPU_ADD, sum, fcpu_op(c, FCPU_MUL, a.c[i], b.c[i]));
+    return sum;
+}
+
+static fCpuValue fcpu_scalar_value(int type, fCpuScalar s)
+{
+    fCpuValue v = fcpu_value(type);
+    v.c[0] = s;
+    return v;
+}
+
+static fCpuValue fcpu_to_float(fCpuCompiler *c, fCpuValue v, int token)
+{
+    if (v.type == FCPU_INT)
+        v.type = FCPU_FLOAT;
+    if (v.length > 0 || v.type == FCPU_BOOL || v.type == FCPU_VOID)
+        fcpu_error_at(c, token, "expected a float or vector argument.");
+    return v;
+}
+
+// Built-in functions of GLSL. Returns false if there is no such function.
+static bool fcpu_builtin(fCpuCompiler *c, const fCpuToken *name, fCpuValue *args, int n, int token, fCpuValue *result)
+{
+    static const struct { const char *name; int op; } unary[] = {
+        { "abs", FCPU_ABS }, { "sign", FCPU_SIGN }, { "floor", FCPU_FLOOR }, { "ceil", FCPU_CEIL },
+        { "fract", FCPU_FRACT }, { "trunc", FCPU_TRUNC }, { "round", FCPU_ROUND }, { "sqrt", FCPU_SQRT },
+        { "inversesqrt", FCPU_RSQRT }, { "exp", FCPU_EXP }, { "exp2", FCPU_EXP2 }, { "log", FCPU_LOG },
+        { "log2", FCPU_LOG2 }, { "sin", FCPU_SIN }, { "cos", FCPU_COS }, { "tan", FCPU_TAN },
+        { "asin", FCPU_ASIN }, { "acos", FCPU_ACOS },
+    };
+    static const struct { const char *name; int op; } binary[] = {
+        { "min", FCPU_MIN }, { "max", FCPU_MAX }, { "mod", FCPU_MOD }, { "pow", FCPU_POW },
+    };
+    for (size_t i = 0; i < sizeof(unary)/sizeof(unary[0]); i++)
+    {
+        if (fcpu_token_is(name, unary[i].name) && n == 1)
+        {
+            if (unary[i].op == FCPU_ABS || unary[i].op == FCPU_SIGN)
+                *result = fcpu_map(c, unary[i].op, args, 1, token); // also for int
+            else
+                *result = fcpu_map1(c, unary[i].op, args[0], token);
+            return true;
+        }
+    }
+    for (size_t i = 0; i < sizeof(binary)/sizeof(binary[0]); i++)
+    {
+        if (fcpu_token_is(name, binary[i].name) && n == 2)
+        {
+            *result = fcpu_map2(c, binary[i].op, args[0], args[1], token);
+            if (binary[i].op == FCPU_MOD || binary[i].op == FCPU_POW)
+                if (result->type == FCPU_INT) result->type = FCPU_FLOAT;
+            return true;
+        }
+    }
+    if (fcpu_token_is(name, "atan") && n == 1)
+    {
+        *result = fcpu_map1(c, FCPU_ATAN, args[0], token);
+    }
+    else if (fcpu_token_is(name, "atan") && n == 2)
+    {
+        *result = fcpu_to_float(c, fcpu_map2(c, FCPU_ATAN2, args[0], args[1], token), token);
+    }
+    else if (fcpu_token_is(name, "radians") && n == 1)
+    {
+        *result = fcpu_map2(c, FCPU_MUL, fcpu_to_float(c, args[0], token), fcpu_scalar_value(FCPU_FLOAT, fcpu_const(3.14159265358979f/180.0f)), token);
+    }
+    else if (fcpu_token_is(name, "degrees") && n == 1)
+    {
+        *result = fcpu_map2(c, FCPU_MUL, fcpu_to_float(c, args[0], token), fcpu_scalar_value(FCPU_FLOAT, fcpu_const(180.0f/3.14159265358979f)), token);
+    }
+    else if (fcpu_token_is(name, "clamp") && n == 3)
+    {
+        *result = fcpu_map2(c, FCPU_MIN, fcpu_map2(c, FCPU_MAX, args[0], args[1], token), args[2], token);
+    }
+    else if (fcpu_token_is(name, "mix") && n == 3)
+    {
+        // x + (y - x)*a
+        fCpuValue d = fcpu_map2(c, FCPU_SUB, args[1], args[0], token);
+        *result = fcpu_to_float(c, fcpu_map2(c, FCPU_ADD, args[0], fcpu_map2(c, FCPU_MUL, d, args[2], token), token), token);
+    }
+    else if (fcpu_token_is(name, "step") && n == 2)
+    {
+        *result = fcpu_to_float(c, fcpu_map2(c, FCPU_GE, args[1], args[0], token), token);
+    }
+    else if (fcpu_token_is(name, "smoothstep") && n == 3)
+    {
+        // t = clamp((x - e0)/(e1 - e0), 0, 1); t*t*(3 - 2t)
+        fCpuValue zero = fcpu_scalar_value(FCPU_FLOAT, fcpu_const(0.0f));
+        fCpuValue one = fcpu_scalar_value(FCPU_FLOAT, fcpu_const(1.0f));
+        fCpuValue t = fcpu_map2(c, FCPU_DIV, fcpu_map2(c, FCPU_SUB, args[2], args[0], token), fcpu_map2(c, FCPU_SUB, args[1], args[0], token), token);
+        t = fcpu_map2(c, FCPU_MIN, fcpu_map2(c, FCPU_MAX, t, zero, token), one, token);
+        fCpuValue s = fcpu_map2(c, FCPU_SUB, fcpu_scalar_value(FCPU_FLOAT, fcpu_const(3.0f)), fcpu_map2(c, FCPU_MUL, fcpu_scalar_value(FCPU_FLOAT, fcpu_const(2.0f)), t, token), token);
+        *result = fcpu_to_float(c, fcpu_map2(c, FCPU_MUL, fcpu_map2(c, FCPU_MUL, t, t, token), s, token), token);
+    }
+    else if ((fcpu_token_is(name, "length") && n == 1) || (fcpu_token_is(name, "distance") && n == 2))
+    {
+        fCpuValue v = n == 2 ? fcpu_map2(c, FCPU_SUB, args[0], args[1], token) : fcpu_to_float(c, args[0], token);
+        *result = fcpu_scalar_value(FCPU_FLOAT, fcpu_op(c, FCPU_SQRT, fcpu_dot(c, v, v)));
+    }
+    else if (fcpu_token_is(name, "dot") && n == 2)
+    {
+        if (fcpu_components(args[0].type) != fcpu_components(args[1].type))
+            fcpu_error_at(c, token, "vector sizes do not match.");
+        *result = fcpu_scalar_value(FCPU_FLOAT, fcpu_dot(c, args[0], args[1]));
+    }
+    else if (fcpu_token_is(name, "normalize") && n == 1)
+    {
+        fCpuValue v = fcpu_to_float(c, args[0], token);
+        fCpuValue s = fcpu_scalar_value(FCPU_FLOAT, fcpu_op(c, FCPU_RSQRT, fcpu_dot(c, v, v)));
+        *result = fcpu_map2(c, FCPU_MUL, v, s, token);
+    }
+    else if (fcpu_token_is(name, "cross") && n == 2)
+    {
+        if (args[0].type != FCPU_VEC3 || args[1].type != FCPU_VEC3)
+            fcpu_error_at(c, token, "cross expects vec3 arguments.");
+        fCpuValue r = fcpu_value(FCPU_VEC3);
+        for (int i = 0; i < 3; i++)
+        {
+            int j = (i + 1) % 3;
+            int k = (i + 2) % 3;
+            r.c[i] = fcpu_op(c, FCPU_SUB, fcpu_op(c, FCPU_MUL, args[0].c[j], args[1].c[k]), fcpu_op(c, FCPU_MUL, args[0].c[k], args[1].c[j]));
+        }
+        *result = r;
+    }
+    else if (fcpu_token_is(name, "reflect") && n == 2)
+    {
+        // I - 2*dot(N, I)*N
+        fCpuValue d = fcpu_scalar_value(FCPU_FLOAT, fcpu_op(c, FCPU_MUL, fcpu_const(2.0f), fcpu_dot(c, args[1], args[0])));
+        *result = fcpu_map2(c, FCPU_SUB, args[0], fcpu_map2(c, FCPU_MUL, d, args[1], token), token);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// Finds the function called by the arguments, preferring an exact match of
+// the argument types to one that needs conversions.
+static fCpuFunction *fcpu_find_function(fCpuCompiler *c, const fCpuToken *name, const fCpuExpr *args, int n)
+{
+    fCpuFunction *best = NULL;
+    int best_score = -1;
+    for (int i = 0; i < c->num_functions; i++)
+    {
+        fCpuFunction *f = &c->functions[i];
+        if (f->num_params != n || !fcpu_same_name(&c->tokens[f->name], name))
+            continue;
+        int score = 2;
+        for (int j = 0; j < n; j++)
+        {
+            if (args[j].v.length > 0 || !fcpu_convertible(args[j].v.type, f->param_type[j]))
+                score = -1;
+            else if (args[j].v.type != f->param_type[j] && score > 0)
+                score = 1;
+        }
+        // a definition is preferred to a forward-declaration
+        if (score > best_score || (score == best_score && score >= 0 && best->body < 0 && f->body >= 0))
+        {
+            best = f;
+            best_score = score;
+        }
+    }
+    return best_score >= 0 ? best : NULL;
+}
+
+// Compiles the body of a function at the call site.
+static fCpuValue fcpu_inline(fCpuCompiler *c, fCpuFunction *f, fCpuExpr *args, int token)
+{
+    if (f->body < 0)
+    {
+        fcpu_error_at(c, token, "function is declared but not defined.");
+        return fcpu_value(FCPU_FLOAT);
+    }
+    if (c->depth >= FCPU_MAX_INLINE_DEPTH)
+    {
+        fcpu_error_at(c, token, "function calls are nested too deeply (is a function recursive?).");
+        return fcpu_value(FCPU_FLOAT);
+    }
+
+    fCpuFrame frame;
+    frame.function = f;
+    frame.var_base = c->num_vars;
+    frame.result = fcpu_value(f->return_type);
+    frame.has_result = false;
+    frame.returned = fcpu_const(0.0f);
+
+    fCpuFrame *saved_frame = c->frame;
+    fCpuLoop *saved_loop = c->loop;
+    fCpuScalar saved_mask = c->mask;
+    int saved_pos = c->pos;
+    c->mask = fcpu_active(c);
+    c->frame = &frame;
+    c->loop = NULL;
+    c->depth++;
+
+    for (int i = 0; i < f->num_params; i++)
+    {
+        if (f->param_qualifier[i] != FCPU_IN && !args[i].is_lvalue)
+        {
+            fcpu_error_at(c, token, "argument to an out or inout parameter must be a variable.");
+            break;
+        }
+        fcpu_declare(c, f->param_name[i], fcpu_convert(c, args[i].v, f->param_type[i], token), false);
+    }
+
+    c->pos = f->body;
+    fcpu_statement(c);
+    if (f->return_type != FCPU_VOID && !frame.has_result)
+        fcpu_error_at(c, f->name, "function does not return a value.");
+
+    c->pos = saved_pos;
+    c->frame = saved_frame;
+    c->loop = saved_loop;
+    c->mask = saved_mask;
+    c->depth--;
+
+    // out and inout parameters are copied back (in the caller's scope)
+    fCpuValue params[FCPU_MAX_PARAMS];
+    for (int i = 0; i < f->num_params; i++)
+        params[i] = c->vars[frame.var_base + i].value;
+    c->num_vars = frame.var_base;
+    for (int i = 0; i < f->num_params && !c->failed; i++)
+        if (f->param_qualifier[i] != FCPU_IN)
+            fcpu_store(c, args[i].lv, params[i], token);
+
+    return frame.result;
+}
+
+// Parses a constructor, e.g. vec3(...) or vec3[](...), after the type name.
+static fCpuValue fcpu_constructor(fCpuCompiler *c, int type, int token)
+{
+    if (fcpu_accept(c, "["))
+    {
+        int length = -1;
+        if (fcpu_tok(c)->kind == FCPU_TOKEN_NUMBER)
+        {
+            length = (int)fcpu_tok(c)->number;
+            c->pos++;
+        }
+        fcpu_expect(c, "]");
+        fcpu_expect(c, "(");
+        fCpuValue elements[256];
+        int n = 0;
+        while (!c->failed && !fcpu_peek(c, ")"))
+        {
+            if (n == 256)
+            {
+                fcpu_error_at(c, token, "array is too large.");
+                break;
+            }
+            elements[n] = fcpu_convert(c, fcpu_assignment(c).v, type, token);
+            n++;
+            if (!fcpu_accept(c, ","))
+                break;
+        }
+        fcpu_expect(c, ")");
+        if (length >= 0 && length != n)
+            fcpu_error_at(c, token, "wrong number of array elements.");
+        fCpuValue v = fcpu_value(type);
+        v.length = n;
+        v.elements = fcpu_alloc_elements(c, n);
+        for (int i = 0; i < n; i++)
+            v.elements[i] = elements[i];
+        return v;
+    }
+
+    fcpu_expect(c, "(");
+    fCpuScalar s[4];
+    int n = 0;
+    int num_args = 0;
+    fCpuValue first = fcpu_value(FCPU_FLOAT);
+    while (!c->failed && !fcpu_peek(c, ")"))
+    {
+        fCpuValue a = fcpu_assignment(c).v;
+        if (a.length > 0)
+            fcpu_error_at(c, token, "arrays cannot be used here.");
+        if (num_args == 0)
+            first = a;
+        num_args++;
+        for (int i = 0; i < fcpu_components(a.type) && n < 4; i++)
+            s[n++] = a.c[i];
+        if (!fcpu_accept(c, ","))
+            break;
+    }
+    fcpu_expect(c, ")");
+    if (num_args == 0)
+    {
+        fcpu_error_at(c, token, "constructor has no arguments.");
+        return fcpu_value(type);
+    }
+
+    fCpuValue v = fcpu_value(type);
+    int m = fcpu_components(type);
+    if (type == FCPU_INT)
+        v.c[0] = fcpu_op(c, FCPU_TRUNC, s[0]);
+    else if (type == FCPU_BOOL)
+        v.c[0] = fcpu_op(c, FCPU_NE, s[0], fcpu_const(0.0f));
+    else if (first.type == FCPU_BOOL && m == 1)
+        v.c[0] = s[0];
+    else if (num_args == 1 && fcpu_components(first.type) == 1)
+        for (int i = 0; i < m; i++) v.c[i] = s[0];
+    else if (n < m)
+        fcpu_error_at(c, token, "not enough values in constructor.");
+    else
+        for (int i = 0; i < m; i++) v.c[i] = s[i];
+    return v;
+}
+
+static bool fcpu_swizzle(const fCpuToken *t, int *comp, int *n)
+{
+    static const char *sets[] = { "xyzw", "rgba", "stpq" };
+    if (t->kind != FCPU_TOKEN_NAME || t->length > 4)
+        return false;
+    for (int s = 0; s < 3; s++)
+    {
+        bool ok = true;
+        for (int i = 0; i < t->length && ok; i++)
+        {
+            const char *p = strchr(sets[s], t->text[i]);
+            if (!p) ok = false;
+            else comp[i] = (int)(p - sets[s]);
+        }
+        if (ok)
+        {
+            *n = t->length;
+            return true;
+        }
+    }
+    return false;
+}
+
+static fCpuExpr fcpu_primary(fCpuCompiler *c)
+{
+    fCpuToken *t = fcpu_tok(c);
+    int token = c->pos;
+    if (t->kind == FCPU_TOKEN_NUMBER)
+    {
+        c->pos++;
+        return fcpu_rvalue(fcpu_scalar_value(t->is_float ? FCPU_FLOAT : FCPU_INT, fcpu_const(t->number)));
+    }
+    if (fcpu_accept(c, "("))
+    {
+        fCpuExpr e = fcpu_expression(c);
+        fcpu_expect(c, ")");
+        e.is_lvalue = false;
+        return e;
+    }
+    if (fcpu_accept(c, "true"))
+        return fcpu_rvalue(fcpu_scalar_value(FCPU_BOOL, fcpu_const(1.0f)));
+    if (fcpu_accept(c, "false"))
+        return fcpu_rvalue(fcpu_scalar_value(FCPU_BOOL, fcpu_const(0.0f)));
+    if (t->kind != FCPU_TOKEN_NAME)
+    {
+        fcpu_error(c, t, "expected an expression.");
+        return fcpu_rvalue(fcpu_value(FCPU_FLOAT));
+    }
+
+    c->pos++;
+    int type = fcpu_type_name(t);
+    if (type > FCPU_VOID)
+        return fcpu_rvalue(fcpu_constructor(c, type, token));
+
+    if (fcpu_accept(c, "("))
+    {
+        fCpuExpr args[FCPU_MAX_PARAMS];
+        int n = 0;
+        while (!c->failed && !fcpu_peek(c, ")"))
+        {
+            if (n == FCPU_MAX_PARAMS)
+            {
+                fcpu_error_at(c, token, "too many arguments.");
+                break;
+            }
+            args[n++] = fcpu_assignment(c);
+            if (!fcpu_accept(c, ","))
+                break;
+        }
+        fcpu_expect(c, ")");
+        if (c->failed)
+            return fcpu_rvalue(fcpu_value(FCPU_FLOAT));
+        if (fCpuFunction *f = fcpu_find_function(c, t, args, n))
+            return fcpu_rvalue(fcpu_inline(c, f, args, token));
+        fCpuValue values[FCPU_MAX_PARAMS];
+        for (int i = 0; i < n; i++)
+            values[i] = args[i].v;
+        fCpuValue result;
+        if (fcpu_builtin(c, t, values, n, token, &result))
+            return fcpu_rvalue(result);
+        fcpu_error(c, t, "no matching function for call.");
+        return fcpu_rvalue(fcpu_value(FCPU_FLOAT));
+    }
+
+    int var = fcpu_find_var(c, t);
+    if (var < 0)
+    {
+        for (int i = 0; i < c->num_uniforms; i++)
+        {
+            if (fcpu_same_name(&c->uniforms[i], t))
+            {
+                fcpu_error(c, t, "uniform parameters are not supported by the CPU evaluator.");
+                return fcpu_rvalue(fcpu_value(FCPU_FLOAT));
+            }
+        }
+        fcpu_error(c, t, "undeclared identifier.");
+        return fcpu_rvalue(fcpu_value(FCPU_FLOAT));
+    }
+    fCpuExpr e;
+    e.v = c->vars[var].value;
+    e.is_lvalue = true;
+    e.lv.var = var;
+    e.lv.element = -1;
+    e.lv.n = e.v.length > 0 ? 0 : fcpu_components(e.v.type);
+    for (int i = 0; i < 4; i++)
+        e.lv.comp[i] = i;
+    return e;
+}
+
+static int fcpu_constant_index(fCpuCompiler *c, int limit, int token)
+{
+    fCpuValue index = fcpu_expression(c).v;
+    fcpu_expect(c, "]");
+    if (index.length > 0 || fcpu_components(index.type) != 1 || index.c[0].reg >= 0)
+    {
+        fcpu_error_at(c, token, "index must be a compile-time constant.");
+        return 0;
+    }
+    int i = (int)index.c[0].k;
+    if (i < 0 || i >= limit)
+    {
+        fcpu_error_at(c, token, "index is out of range.");
+        return 0;
+    }
+    return i;
+}
+
+static fCpuExpr fcpu_postfix(fCpuCompiler *c)
+{
+    fCpuExpr e = fcpu_primary(c);
+    while (!c->failed)
+    {
+        int token = c->pos;
+        if (fcpu_accept(c, "."))
+        {
+            int comp[4];
+            int n = 0;
+            if (!fcpu_swizzle(fcpu_tok(c), comp, &n))
+            {
+                fcpu_error(c, fcpu_tok(c), "invalid swizzle.");
+                break;
+            }
+            c->pos++;
+            int m = fcpu_components(e.v.type);
+            for (int i = 0; i < n; i++)
+                if (comp[i] >= m || e.v.length > 0)
+                    fcpu_error_at(c, token, "swizzle is out of range.");
+            if (c->failed)
+                break;
+            fCpuValue v = fcpu_value(n == 1 ? (e.v.type == FCPU_INT || e.v.type == FCPU_BOOL ? e.v.type : FCPU_FLOAT) : fcpu_vector_type(n));
+            for (int i = 0; i < n; i++)
+                v.c[i] = e.v.c[comp[i]];
+            if (e.is_lvalue)
+            {
+                fCpuLvalue lv = e.lv;
+                for (int i = 0; i < n; i++)
+                    lv.comp[i] = e.lv.comp[comp[i]];
+                lv.n = n;
+                e.lv = lv;
+            }
+            e.v = v;
+        }
+        else if (fcpu_accept(c, "["))
+        {
+            if (e.v.length > 0)
+            {
+                int i = fcpu_constant_index(c, e.v.length, token);
+                if (e.is_lvalue && e.lv.element < 0)
+                {
+                    e.lv.element = i;
+                    e.lv.n = fcpu_components(e.v.elements[i].type);
+                }
+                else
+                {
+                    e.is_lvalue = false;
+                }
+                e.v = e.v.elements[i];
+            }
+            else
+            {
+                int m = fcpu_components(e.v.type);
+                if (m < 2)
+                    fcpu_error_at(c, token, "only vectors and arrays can be indexed.");
+                int i = fcpu_constant_index(c, m, token);
+                e.v = fcpu_scalar_value(FCPU_FLOAT, e.v.c[i]);
+                if (e.is_lvalue)
+                {
+                    e.lv.comp[0] = e.lv.comp[i];
+                    e.lv.n = 1;
+                }
+            }
+        }
+        else if (fcpu_peek(c, "++") || fcpu_peek(c, "--"))
+        {
+            int op = fcpu_peek(c, "++") ? FCPU_ADD : FCPU_SUB;
+            c->pos++;
+            if (!e.is_lvalue)
+            {
+                fcpu_error_at(c, token, "operand of ++ or -- must be a variable.");
+                break;
+            }
+            fCpuValue one = fcpu_scalar_value(FCPU_INT, fcpu_const(1.0f));
+            fcpu_store(c, e.lv, fcpu_map2(c, op, e.v, one, token), token);
+            e.is_lvalue = false;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return e;
+}
+
+static fCpuExpr fcpu_unary(fCpuCompiler *c)
+{
+    int token = c->pos;
+    if (fcpu_accept(c, "-"))
+    {
+        fCpuExpr e = fcpu_unary(c);
+        return fcpu_rvalue(fcpu_map(c, FCPU_NEG, &e.v, 1, token));
+    }
+    if (fcpu_accept(c, "+"))
+    {
+        fCpuExpr e = fcpu_unary(c);
+        e.is_lvalue = false;
+        return e;
+    }
+    if (fcpu_accept(c, "!"))
+    {
+        fCpuExpr e = fcpu_unary(c);
+        if (e.v.type != FCPU_BOOL || e.v.length > 0)
+            fcpu_error_at(c, token, "operand of ! must be a bool.");
+        return fcpu_rvalue(fcpu_scalar_value(FCPU_BOOL, fcpu_op(c, FCPU_NOT, e.v.c[0])));
+    }
+    if (fcpu_peek(c, "++") || fcpu_peek(c, "--"))
+    {
+        int op = fcpu_peek(c, "++") ? FCPU_ADD : FCPU_SUB;
+        c->pos++;
+        fCpuExpr e = fcpu_unary(c);
+        if (!e.is_lvalue)
+        {
+            fcpu_error_at(c, token, "operand of ++ or -- must be a variable.");
+            return e;
+        }
+        fCpuValue one = fcpu_scalar_value(FCPU_INT, fcpu_const(1.0f));
+        fCpuValue v = fcpu_map2(c, op, e.v, one, token);
+        if (e.v.type == FCPU_FLOAT) v.type = FCPU_FLOAT;
+        fcpu_store(c, e.lv, v, token);
+        return fcpu_rvalue(fcpu_load(c, e.lv));
+    }
+    return fcpu_postfix(c);
+}
+
+// Arithmetic on ints is done in floats, and truncated after division.
+static fCpuValue fcpu_arithmetic(fCpuCompiler *c, int op, fCpuValue a, fCpuValue b, int token)
+{
+    fCpuValue r = fcpu_map2(c, op, a, b, token);
+    if (r.type == FCPU_INT && op == FCPU_DIV)
+        r.c[0] = fcpu_op(c, FCPU_TRUNC, r.c[0]);
+    return r;
+}
+
+static fCpuValue fcpu_compare(fCpuCompiler *c, int op, fCpuValue a, fCpuValue b, int token)
+{
+    if (a.length > 0 || b.length > 0)
+    {
+        fcpu_error_at(c, token, "arrays cannot be compared.");
+        return fcpu_value(FCPU_BOOL);
+    }
+    int n = fcpu_components(a.type);
+    if (n != fcpu_components(b.type) ||
+        ((a.type == FCPU_BOOL) != (b.type == FCPU_BOOL)) ||
+        (n > 1 && op != FCPU_EQ && op != FCPU_NE))
+    {
+        fcpu_error_at(c, token, "invalid operands to comparison.");
+        return fcpu_value(FCPU_BOOL);
+    }
+    // vectors are equal if all components are
+    fCpuScalar r = fcpu_op(c, op == FCPU_NE ? FCPU_EQ : op, a.c[0], b.c[0]);
+    for (int i = 1; i < n; i++)
+        r = fcpu_op(c, FCPU_AND, r, fcpu_op(c, FCPU_EQ, a.c[i], b.c[i]));
+    if (op == FCPU_NE)
+        r = fcpu_op(c, FCPU_NOT, r);
+    return fcpu_scalar_value(FCPU_BOOL, r);
+}
+
+// Binary operators by increasing precedence
+static fCpuExpr fcpu_binary(fCpuCompiler *c, int level)
+{
+    static const struct { const char *s; int op; int level; } ops[] = {
+        { "||", FCPU_OR, 0 }, { "^^", FCPU_NE, 1 }, { "&&", FCPU_AND, 2 },
+        { "==", FCPU_EQ, 3 }, { "!=", FCPU_NE, 3 },
+        { "<", FCPU_LT, 4 }, { ">", FCPU_GT, 4 }, { "<=", FCPU_LE, 4 }, { ">=", FCPU_GE, 4 },
+        { "+", FCPU_ADD, 5 }, { "-", FCPU_SUB, 5 },
+        { "*", FCPU_MUL, 6 }, { "/", FCPU_DIV, 6 }, { "%", FCPU_MOD, 6 },
+    };
+    if (level > 6)
+        return fcpu_unary(c);
+    fCpuExpr e = fcpu_binary(c, level + 1);
+    while (!c->failed)
+    {
+        int op = -1;
+        int token = c->pos;
+        for (size_t i = 0; i < sizeof(ops)/sizeof(ops[0]); i++)
+            if (ops[i].level == level && fcpu_peek(c, ops[i].s))
+                op = ops[i].op;
+        if (op < 0)
+            break;
+        c->pos++;
+        fCpuValue b = fcpu_binary(c, level + 1).v;
+        fCpuValue a = e.v;
+        if (level <= 2)
+        {
+            if (a.type != FCPU_BOOL || b.type != FCPU_BOOL || a.length > 0 || b.length > 0)
+                fcpu_error_at(c, token, "operands of logical operators must be bools.");
+            e = fcpu_rvalue(fcpu_scalar_value(FCPU_BOOL, fcpu_op(c, op, a.c[0], b.c[0])));
+        }
+        else if (level <= 4)
+        {
+            e = fcpu_rvalue(fcpu_compare(c, op, a, b, token));
+        }
+        else if (op == FCPU_MOD)
+        {
+            // integer remainder: a - b*trunc(a/b)
+            if (a.type != FCPU_INT || b.type != FCPU_INT)
+                fcpu_error_at(c, token, "operands of % must be ints.");
+            fCpuScalar q = fcpu_op(c, FCPU_TRUNC, fcpu_op(c, FCPU_DIV, a.c[0], b.c[0]));
+            e = fcpu_rvalue(fcpu_scalar_value(FCPU_INT, fcpu_op(c, FCPU_SUB, a.c[0], fcpu_op(c, FCPU_MUL, b.c[0], q))));
+        }
+        else
+        {
+            e = fcpu_rvalue(fcpu_arithmetic(c, op, a, b, token));
+        }
+    }
+    return e;
+}
+
+static fCpuExpr fcpu_ternary(fCpuCompiler *c)
+{
+    fCpuExpr e = fcpu_binary(c, 0);
+    int token = c->pos;
+    if (!fcpu_accept(c, "?"))
+        return e;
+    fCpuValue a = fcpu_assignment(c).v;
+    fcpu_expect(c, ":");
+    fCpuValue b = fcpu_assignment(c).v;
+    if (e.v.type != FCPU_BOOL || e.v.length > 0)
+    {
+        fcpu_error_at(c, token, "condition must be a bool.");
+        return e;
+    }
+    int type = a.type;
+    if (a.type == FCPU_INT && b.type == FCPU_FLOAT) type = FCPU_FLOAT;
+    a = fcpu_convert(c, a, type, token);
+    b = fcpu_convert(c, b, type, token);
+    fCpuValue r = fcpu_value(type);
+    for (int i = 0; i < fcpu_components(type); i++)
+        r.c[i] = fcpu_op(c, FCPU_SELECT, e.v.c[0], a.c[i], b.c[i]);
+    return fcpu_rvalue(r);
+}
+
+static fCpuExpr fcpu_assignment(fCpuCompiler *c)
+{
+    static const struct { const char *s; int op; } ops[] = {
+        { "=", -1 }, { "+=", FCPU_ADD }, { "-=", FCPU_SUB }, { "*=", FCPU_MUL }, { "/=", FCPU_DIV },
+    };
+    fCpuExpr e = fcpu_ternary(c);
+    int token = c->pos;
+    for (size_t i = 0; i < sizeof(ops)/sizeof(ops[0]); i++)
+    {
+        if (!fcpu_accept(c, ops[i].s))
+            continue;
+        if (!e.is_lvalue)
+        {
+            fcpu_error_at(c, token, "left side of assignment must be a variable.");
+            return e;
+        }
+        fCpuValue v = fcpu_assignment(c).v;
+        if (ops[i].op >= 0)
+        {
+            v = fcpu_arithmetic(c, ops[i].op, e.v, v, token);
+            if (e.v.type == FCPU_FLOAT && v.type == FCPU_INT)
+                v.type = FCPU_FLOAT;
+        }
+        fcpu_store(c, e.lv, v, token);
+        return fcpu_rvalue(fcpu_load(c, e.lv));
+    }
+    return e;
+}
+
+static fCpuExpr fcpu_expression(fCpuCompiler *c)
+{
+    return fcpu_assignment(c);
+}
+
+//-----------------------------------------------------------------------------
+// Statements
+//-----------------------------------------------------------------------------
+
+// Skips tokens up to (not including) the given token at nesting level 0.
+static void fcpu_skip_until(fCpuCompiler *c, const char *s)
+{
+    int level = 0;
+    while (c->pos < c->num_tokens)
+    {
+        if (level == 0 && fcpu_peek(c, s))
+            return;
+        if (fcpu_peek(c, "(") || fcpu_peek(c, "[") || fcpu_peek(c, "{")) level++;
+        if (fcpu_peek(c, ")") || fcpu_peek(c, "]") || fcpu_peek(c, "}")) level--;
+        if (level < 0)
+            return;
+        c->pos++;
+    }
+}
+
+static void fcpu_skip_statement(fCpuCompiler *c)
+{
+    if (fcpu_accept(c, "{"))
+    {
+        fcpu_skip_until(c, "}");
+        fcpu_expect(c, "}");
+    }
+    else if (fcpu_accept(c, "if"))
+    {
+        fcpu_expect(c, "(");
+        fcpu_skip_until(c, ")");
+        fcpu_expect(c, ")");
+        fcpu_skip_statement(c);
+        if (fcpu_accept(c, "else"))
+            fcpu_skip_statement(c);
+    }
+    else if (fcpu_accept(c, "for") || fcpu_accept(c, "while"))
+    {
+        fcpu_expect(c, "(");
+        fcpu_skip_until(c, ")");
+        fcpu_expect(c, ")");
+        fcpu_skip_statement(c);
+    }
+    else
+    {
+        fcpu_skip_until(c, ";");
+        fcpu_expect(c, ";");
+    }
+}
+
+static bool fcpu_is_declaration(fCpuCompiler *c)
+{
+    fCpuToken *t = fcpu_tok(c);
+    if (fcpu_token_is(t, "const") || fcpu_is_precision(t))
+        return true;
+    if (fcpu_type_name(t) <= FCPU_VOID)
+        return false;
+    // a constructor starts an expression statement
+    return c->pos + 1 < c->num_tokens && c->tokens[c->pos + 1].kind == FCPU_TOKEN_NAME;
+}
+
+// Declares one or more variables: [const] type name [= value] {, name [= value]};
+static void fcpu_declaration(fCpuCompiler *c)
+{
+    bool is_const = false;
+    while (fcpu_token_is(fcpu_tok(c), "const") || fcpu_is_precision(fcpu_tok(c)))
+    {
+        if (fcpu_accept(c, "const")) is_const = true;
+        else c->pos++;
+    }
+    int type = fcpu_type_name(fcpu_tok(c));
+    if (type <= FCPU_VOID)
+    {
+        fcpu_error(c, fcpu_tok(c), "expected a type.");
+        return;
+    }
+    c->pos++;
+    int type_length = -1;
+    if (fcpu_accept(c, "["))
+    {
+        type_length = fcpu_constant_index(c, 1 << 16, c->pos);
+    }
+    do
+    {
+        int name = c->pos;
+        if (fcpu_tok(c)->kind != FCPU_TOKEN_NAME)
+        {
+            fcpu_error(c, fcpu_tok(c), "expected a variable name.");
+            return;
+        }
+        c->pos++;
+        int length = type_length;
+        if (fcpu_accept(c, "["))
+        {
+            if (fcpu_accept(c, "]")) length = 0; // sized by the initializer
+            else length = fcpu_constant_index(c, 1 << 16, name);
+        }
+        fCpuValue v = fcpu_value(type);
+        if (fcpu_accept(c, "="))
+        {
+            fCpuValue init = fcpu_assignment(c).v;
+            if (length >= 0)
+            {
+                if (init.length == 0 || init.type != type || (length > 0 && init.length != length))
+                    fcpu_error_at(c, name, "array initializer does not match the declaration.");
+                v = init;
+            }
+            else
+            {
+                v = fcpu_convert(c, init, type, name);
+            }
+        }
+        else if (length > 0)
+        {
+            v.length = length;
+            v.elements = fcpu_alloc_elements(c, length);
+            for (int i = 0; i < length; i++)
+                v.elements[i] = fcpu_value(type);
+        }
+        else if (length == 0 || is_const)
+        {
+            fcpu_error_at(c, name, "declaration needs an initializer.");
+        }
+        // arrays are copied, so that assigning to an element does not
+        // change the array it was initialized from
+        if (v.length > 0)
+        {
+            fCpuValue *elements = fcpu_alloc_elements(c, v.length);
+            memcpy(elements, v.elements, v.length*sizeof(fCpuValue));
+            v.elements = elements;
+        }
+        fcpu_declare(c, name, v, is_const);
+    } while (!c->failed && fcpu_accept(c, ","));
+    fcpu_expect(c, ";");
+}
+
+static void fcpu_block(fCpuCompiler *c)
+{
+    int scope = c->num_vars;
+    while (!c->failed && !fcpu_peek(c, "}"))
+    {
+        if (c->pos >= c->num_tokens)
+        {
+            fcpu_error(c, fcpu_tok(c), "expected '}'.");
+            return;
+        }
+        fcpu_statement(c);
+    }
+    fcpu_expect(c, "}");
+    c->num_vars = scope;
+}
+
+static void fcpu_if(fCpuCompiler *c)
+{
+    int token = c->pos;
+    fcpu_expect(c, "(");
+    fCpuValue cond = fcpu_expression(c).v;
+    fcpu_expect(c, ")");
+    if (cond.type != FCPU_BOOL || cond.length > 0)
+    {
+        fcpu_error_at(c, token, "condition must be a bool.");
+        return;
+    }
+    if (cond.c[0].reg < 0)
+    {
+        // only the branch that is taken is compiled
+        bool taken = cond.c[0].k != 0.0f;
+        if (taken) fcpu_statement(c); else fcpu_skip_statement(c);
+        if (fcpu_accept(c, "else"))
+        {
+            if (taken) fcpu_skip_statement(c); else fcpu_statement(c);
+        }
+        return;
+    }
+    fCpuScalar saved = c->mask;
+    c->mask = fcpu_op(c, FCPU_AND, saved, cond.c[0]);
+    fcpu_statement(c);
+    if (fcpu_accept(c, "else"))
+    {
+        c->mask = fcpu_op(c, FCPU_AND, saved, fcpu_op(c, FCPU_NOT, cond.c[0]));
+        fcpu_statement(c);
+    }
+    c->mask = saved;
+}
+
+// Unrolls a for or while loop. Lanes that fail the condition leave the
+// loop, and the loop ends when the condition fails in all lanes, or
+// becomes false at compile time.
+static void fcpu_loop(fCpuCompiler *c, bool is_for)
+{
+    int token = c->pos - 1;
+    int scope = c->num_vars;
+    fCpuLoop loop;
+    loop.broken = fcpu_const(0.0f);
+    loop.continued = fcpu_const(0.0f);
+    loop.init_begin = c->num_vars;
+    loop.in_step = false;
+    fcpu_expect(c, "(");
+    if (is_for)
+    {
+        if (fcpu_is_declaration(c))
+            fcpu_declaration(c);
+        else
+        {
+            if (!fcpu_peek(c, ";"))
+                fcpu_expression(c);
+            fcpu_expect(c, ";");
+        }
+    }
+    loop.init_end = c->num_vars;
+    int cond_pos = c->pos;
+    fcpu_skip_until(c, is_for ? ";" : ")");
+    int step_pos = -1;
+    if (is_for)
+    {
+        fcpu_expect(c, ";");
+        step_pos = c->pos;
+        fcpu_skip_until(c, ")");
+    }
+    fcpu_expect(c, ")");
+    int body_pos = c->pos;
+
+    fCpuLoop *saved_loop = c->loop;
+    fCpuScalar saved_mask = c->mask;
+    c->mask = fcpu_active(c);
+    c->loop = &loop;
+    for (int iteration = 0; !c->failed; iteration++)
+    {
+        if (iteration == FCPU_MAX_ITERATIONS)
+        {
+            fcpu_error_at(c, token, "loop does not end after a bounded number of iterations.");
+            break;
+        }
+        c->pos = cond_pos;
+        if (!fcpu_peek(c, is_for ? ";" : ")"))
+        {
+            fCpuValue cond = fcpu_expression(c).v;
+            if (cond.type != FCPU_BOOL || cond.length > 0)
+            {
+                fcpu_error_at(c, cond_pos, "condition must be a bool.");
+                break;
+            }
+            if (fcpu_is_const(cond.c[0], 0.0f))
+                break;
+            fCpuScalar failed = fcpu_op(c, FCPU_AND, fcpu_active(c), fcpu_op(c, FCPU_NOT, cond.c[0]));
+            loop.broken = fcpu_op(c, FCPU_OR, loop.broken, failed);
+        }
+        if (fcpu_stopped(c))
+            break;
+        c->pos = body_pos;
+        fcpu_statement(c);
+        loop.continued = fcpu_const(0.0f);
+        if (fcpu_stopped(c))
+            break;
+        if (is_for)
+        {
+            c->pos = step_pos;
+            loop.in_step = true;
+            if (!fcpu_peek(c, ")"))
+                fcpu_expression(c);
+            loop.in_step = false;
+        }
+    }
+    c->loop = saved_loop;
+    c->mask = saved_mask;
+    c->num_vars = scope;
+    c->pos = body_pos;
+    fcpu_skip_statement(c);
+}
+
+static void fcpu_statement(fCpuCompiler *c)
+{
+    if (c->failed)
+        return;
+    if (fcpu_stopped(c))
+    {
+        fcpu_skip_statement(c);
+        return;
+    }
+    int token = c->pos;
+    if (fcpu_accept(c, "{"))
+    {
+        fcpu_block(c);
+    }
+    else if (fcpu_accept(c, "if"))
+    {
+        fcpu_if(c);
+    }
+    else if (fcpu_accept(c, "for"))
+    {
+        fcpu_loop(c, true);
+    }
+    else if (fcpu_accept(c, "while"))
+    {
+        fcpu_loop(c, false);
+    }
+    else if (fcpu_accept(c, "return"))
+    {
+        fCpuFrame *f = c->frame;
+        if (!f)
+        {
+            fcpu_error_at(c, token, "return outside of a function.");
+            return;
+        }
+        fCpuValue v = fcpu_value(FCPU_VOID);
+        if (!fcpu_peek(c, ";"))
+            v = fcpu_convert(c, fcpu_expression(c).v, f->function->return_type, token);
+        fcpu_expect(c, ";");
+        // lanes that returned earlier are not active, so the result only
+        // needs to be blended after the first return
+        fCpuScalar active = fcpu_active(c);
+        f->result = f->has_result ? fcpu_blend(c, active, v, f->result) : v;
+        f->has_result = true;
+        f->returned = fcpu_op(c, FCPU_OR, f->returned, active);
+    }
+    else if (fcpu_accept(c, "break") || fcpu_accept(c, "continue"))
+    {
+        bool is_break = fcpu_token_is(&c->tokens[token], "break");
+        if (!c->loop)
+        {
+            fcpu_error_at(c, token, "break or continue outside of a loop.");
+            return;
+        }
+        fcpu_expect(c, ";");
+        fCpuScalar active = fcpu_active(c);
+        if (is_break) c->loop->broken = fcpu_op(c, FCPU_OR, c->loop->broken, active);
+        else c->loop->continued = fcpu_op(c, FCPU_OR, c->loop->continued, active);
+    }
+    else if (fcpu_accept(c, ";"))
+    {
+    }
+    else if (fcpu_peek(c, "discard") || fcpu_peek(c, "do") || fcpu_peek(c, "switch"))
+    {
+        fcpu_error_at(c, token, "statement is not supported by the CPU evaluator.");
+    }
+    else if (fcpu_is_declaration(c))
+    {
+        fcpu_declaration(c);
+    }
+    else
+    {
+        fcpu_expression(c);
+        fcpu_expect(c, ";");
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Global declarations
+//-----------------------------------------------------------------------------
+
+static void fcpu_function(fCpuCompiler *c, int return_type, int name)
+{
+    if (c->num_functions == FCPU_MAX_FUNCTIONS)
+    {
+        fcpu_error_at(c, name, "too many functions.");
+        return;
+    }
+    fCpuFunction *f = &c->functions[c->num_functions];
+    f->name = name;
+    f->return_type = return_type;
+    f->num_params = 0;
+    f->body = -1;
+    if (fcpu_peek(c, "void") && c->pos + 1 < c->num_tokens && fcpu_token_is(&c->tokens[c->pos + 1], ")"))
+        c->pos++;
+    while (!c->failed && !fcpu_peek(c, ")"))
+    {
+        if (f->num_params == FCPU_MAX_PARAMS)
+        {
+            fcpu_error_at(c, name, "too many parameters.");
+            return;
+        }
+        int qualifier = FCPU_IN;
+        for (;;)
+        {
+            if (fcpu_accept(c, "in")) qualifier = FCPU_IN;
+            else if (fcpu_accept(c, "out")) qualifier = FCPU_OUT;
+            else if (fcpu_accept(c, "inout")) qualifier = FCPU_INOUT;
+            else if (fcpu_accept(c, "const") || fcpu_is_precision(fcpu_tok(c))) { if (fcpu_is_precision(fcpu_tok(c))) c->pos++; }
+            else break;
+        }
+        int type = fcpu_type_name(fcpu_tok(c));
+        if (type <= FCPU_VOID)
+        {
+            fcpu_error(c, fcpu_tok(c), "unsupported parameter type.");
+            return;
+        }
+        c->pos++;
+        if (fcpu_tok(c)->kind != FCPU_TOKEN_NAME)
+        {
+            fcpu_error(c, fcpu_tok(c), "expected a parameter name.");
+            return;
+        }
+        f->param_type[f->num_params] = type;
+        f->param_qualifier[f->num_params] = qualifier;
+        f->param_name[f->num_params] = c->pos;
+        f->num_params++;
+        c->pos++;
+        if (fcpu_peek(c, "["))
+        {
+            fcpu_error(c, fcpu_tok(c), "array parameters are not supported.");
+            return;
+        }
+        if (!fcpu_accept(c, ","))
+            break;
+    }
+    fcpu_expect(c, ")");
+    if (fcpu_peek(c, "{"))
+    {
+        f->body = c->pos;
+        c->pos++;
+        fcpu_skip_until(c, "}");
+        fcpu_expect(c, "}");
+    }
+    else
+    {
+        fcpu_expect(c, ";");
+    }
+    c->num_functions++;
+}
+
+static void fcpu_globals(fCpuCompiler *c)
+{
+    c->pos = 0;
+    while (!c->failed && c->pos < c->num_tokens)
+    {
+        fCpuToken *t = fcpu_tok(c);
+        if (fcpu_accept(c, ";"))
+            continue;
+        if (fcpu_token_is(t, "uniform"))
+        {
+            // recorded for a better error message if a uniform is used
+            int start = c->pos;
+            fcpu_skip_until(c, ";");
+            if (c->pos - 1 > start && c->num_uniforms < FCPU_MAX_UNIFORMS)
+                c->uniforms[c->num_uniforms++] = c->tokens[c->pos - 1];
+            fcpu_expect(c, ";");
+            continue;
+        }
+        if (fcpu_token_is(t, "in") || fcpu_token_is(t, "out") || fcpu_token_is(t, "varying") ||
+            fcpu_token_is(t, "attribute") || fcpu_token_is(t, "layout") || fcpu_token_is(t, "precision") ||
+            fcpu_token_is(t, "flat") || fcpu_token_is(t, "smooth") || fcpu_token_is(t, "noperspective"))
+        {
+            fcpu_skip_until(c, ";");
+            fcpu_expect(c, ";");
+            continue;
+        }
+        if (fcpu_token_is(t, "struct"))
+        {
+            fcpu_error(c, t, "structs are not supported by the CPU evaluator.");
+            return;
+        }
+
+        // function or global variable
+        int start = c->pos;
+        while (fcpu_token_is(fcpu_tok(c), "const") || fcpu_is_precision(fcpu_tok(c)))
+            c->pos++;
+        int type = fcpu_type_name(fcpu_tok(c));
+        if (type < 0)
+        {
+            fcpu_error(c, fcpu_tok(c), "unsupported declaration.");
+            return;
+        }
+        c->pos++;
+        int name = c->pos;
+        if (fcpu_tok(c)->kind == FCPU_TOKEN_NAME && c->pos + 1 < c->num_tokens && fcpu_token_is(&c->tokens[c->pos + 1], "("))
+        {
+            c->pos += 2;
+            fcpu_function(c, type, name);
+        }
+        else
+        {
+            c->pos = start;
+            fcpu_declaration(c);
+            c->num_globals = c->num_vars;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Dead code elimination and register allocation
+//-----------------------------------------------------------------------------
+
+static fCpuModel *fcpu_finalize(fCpuCompiler *c, fCpuScalar result)
+{
+    int output = fcpu_materialize(c, result);
+    int n = c->num_code;
+    bool *live = (bool*)calloc(n, sizeof(bool));
+    int *last_use = (int*)malloc(n*sizeof(int));
+    int *phys = (int*)malloc(n*sizeof(int));
+    fraktal_assert(live && last_use && phys && "Ran out of memory");
+
+    // instructions are in order of their destination register
+    live[output] = true;
+    for (int i = n - 1; i >= 0; i--)
+    {
+        fCpuInstruction &in = c->code[i];
+        if (!live[i] || in.op == FCPU_CONST || in.op == FCPU_INPUT)
+            continue;
+        int arity = fcpu_arity(in.op);
+        live[in.a] = true;
+        if (arity >= 2) live[in.b] = true;
+        if (arity >= 3) live[in.c] = true;
+    }
+
+    fCpuModel *m = (fCpuModel*)calloc(1, sizeof(fCpuModel));
+    fraktal_assert(m && "Ran out of memory");
+    int num_constants = 0;
+    int num_code = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (!live[i]) continue;
+        if (c->code[i].op == FCPU_CONST) num_constants++;
+        else if (c->code[i].op != FCPU_INPUT) num_code++;
+    }
+    m->code = (fCpuInstruction*)malloc((num_code + 1)*sizeof(fCpuInstruction));
+    m->constant_reg = (int*)malloc((num_constants + 1)*sizeof(int));
+    m->constant_value = (float*)malloc((num_constants + 1)*sizeof(float));
+    fraktal_assert(m->code && m->constant_reg && m->constant_value && "Ran out of memory");
+
+    // constants and inputs get registers of their own, which are filled
+    // before the program runs
+    int num_regs = 3;
+    for (int i = 0; i < 3; i++)
+        m->input[i] = i;
+    for (int i = 0; i < n; i++)
+    {
+        phys[i] = -1;
+        last_use[i] = -1;
+        if (!live[i]) continue;
+        if (c->code[i].op == FCPU_INPUT)
+        {
+            phys[i] = m->input[c->code[i].a];
+        }
+        else if (c->code[i].op == FCPU_CONST)
+        {
+            phys[i] = num_regs++;
+            m->constant_reg[m->num_constants] = phys[i];
+            memcpy(&m->constant_value[m->num_constants], &c->code[i].a, sizeof(float));
+            m->num_constants++;
+        }
+    }
+    for (int i = 0; i < n; i++)
+    {
+        fCpuInstruction &in = c->code[i];
+        if (!live[i] || in.op == FCPU_CONST || in.op == FCPU_INPUT)
+            continue;
+        int arity = fcpu_arity(in.op);
+        last_use[in.a] = i;
+        if (arity >= 2) last_use[in.b] = i;
+        if (arity >= 3) last_use[in.c] = i;
+    }
+    last_use[output] = n;
+
+    // registers of other values are reused after their last use
+    int *free_regs = (int*)malloc((n + 1)*sizeof(int));
+    fraktal_assert(free_regs && "Ran out of memory");
+    int num_free = 0;
+    for (int i = 0; i < n; i++)
+    {
+        fCpuInstruction in = c->code[i];
+        if (!live[i] || in.op == FCPU_CONST || in.op == FCPU_INPUT)
+            continue;
+        int arity = fcpu_arity(in.op);
+        int operands[3] = { in.a, arity >= 2 ? in.b : -1, arity >= 3 ? in.c : -1 };
+        fCpuInstruction &out = m->code[m->num_code++];
+        out.op = in.op;
+        out.a = phys[in.a];
+        out.b = arity >= 2 ? phys[in.b] : 0;
+        out.c = arity >= 3 ? phys[in.c] : 0;
+        for (int j = 0; j < 3; j++)
+        {
+            int r = operands[j];
+            if (r < 0 || last_use[r] != i || c->code[r].op == FCPU_CONST)
+                continue;
+            if ((j >= 1 && r == operands[0]) || (j == 2 && r == operands[1]))
+                continue; // freed already
+            free_regs[num_free++] = phys[r];
+        }
+        phys[i] = num_free > 0 ? free_regs[--num_free] : num_regs++;
+        out.dst = phys[i];
+    }
+    m->output = phys[output];
+    m->num_regs = num_regs;
+
+    free(free_regs);
+    free(live);
+    free(last_use);
+    free(phys);
+    return m;
+}
+
+static fCpuModel *fcpu_compile(const char **sources, const char **names, int num_sources)
+{
+    fCpuCompiler *c = (fCpuCompiler*)calloc(1, sizeof(fCpuCompiler));
+    fraktal_assert(c && "Ran out of memory");
+    c->names = names;
+    c->mask = fcpu_const(1.0f);
+
+    static const char *predefined = "#define FRAKTAL_CPU\n#define ZERO 0\n";
+    fcpu_tokenize(c, predefined, -1);
+    for (int i = 0; i < num_sources && !c->failed; i++)
+    {
+        fraktal_assert(sources[i]);
+        fcpu_tokenize(c, sources[i], i);
+    }
+    if (!c->failed)
+        fcpu_globals(c);
+
+    fCpuModel *m = NULL;
+    if (!c->failed)
+    {
+        fCpuFunction *model = NULL;
+        for (int i = 0; i < c->num_functions; i++)
+        {
+            fCpuFunction *f = &c->functions[i];
+            if (fcpu_token_is(&c->tokens[f->name], "model") && f->num_params == 1 &&
+                f->param_type[0] == FCPU_VEC3 && f->return_type == FCPU_FLOAT && f->body >= 0)
+                model = f;
+        }
+        if (!model)
+        {
+            fcpu_error(c, NULL, "the sources do not define 'float model(vec3 p)'.");
+        }
+        else
+        {
+            fCpuExpr p;
+            p.v = fcpu_value(FCPU_VEC3);
+            for (int i = 0; i < 3; i++)
+                p.v.c[i] = fcpu_reg(fcpu_emit(c, FCPU_INPUT, i, 0, 0));
+            p.is_lvalue = false;
+            fCpuValue d = fcpu_inline(c, model, &p, model->name);
+            if (!c->failed)
+                m = fcpu_finalize(c, d.c[0]);
+        }
+    }
+
+    for (int i = 0; i < c->num_arrays; i++)
+        free(c->arrays[i]);
+    free(c->arrays);
+    free(c->tokens);
+    free(c->macro_tokens);
+    free(c->code);
+    free(c->cse);
+    free(c);
+    return m;
+}
+
+//-----------------------------------------------------------------------------
+// Evaluation
+//-----------------------------------------------------------------------------
+
+static int fraktal_cpu_threads = 0; // 0 means one per hardware thread
+
+FCPU_BATCH_KERNEL
+static void fcpu_run(const fCpuModel *m, float *regs)
+{
+    for (int pc = 0; pc < m->num_code; pc++)
+    {
+        const fCpuInstruction &in = m->code[pc];
+        float *d = regs + in.dst*FRAKTAL_CPU_BATCH;
+        const float *ra = regs + in.a*FRAKTAL_CPU_BATCH;
+        const float *rb = regs + in.b*FRAKTAL_CPU_BATCH;
+        const float *rc = regs + in.c*FRAKTAL_CPU_BATCH;
+        switch (in.op)
+        {
+            #define X(name, arity, expr) \
+            case FCPU_##name: \
+                for (int i = 0; i < FRAKTAL_CPU_BATCH; i++) \
+                { \
+                    float a = ra[i]; float b = rb[i]; float c = rc[i]; \
+                    (void)b; (void)c; \
+                    d[i] = expr; \
+                } \
+                break;
+            FCPU_OPS(X)
+            #undef X
+        }
+    }
+}
+
+// Evaluates chunks of points until there are none left.
+static void fcpu_worker(const fCpuModel *m, const float *x, const float *y, const float *z, float *d,
+                        int count, std::atomic<int> *next)
+{
+    float *regs = (float*)malloc((size_t)m->num_regs*FRAKTAL_CPU_BATCH*sizeof(float));
+    fraktal_assert(regs && "Ran out of memory");
+    for (int i = 0; i < m->num_constants; i++)
+        for (int j = 0; j < FRAKTAL_CPU_BATCH; j++)
+            regs[m->constant_reg[i]*FRAKTAL_CPU_BATCH + j] = m->constant_value[i];
+    const float *inputs[3] = { x, y, z };
+    for (;;)
+    {
+        int begin = next->fetch_add(FRAKTAL_CPU_CHUNK);
+        if (begin >= count)
+            break;
+        int end = begin + FRAKTAL_CPU_CHUNK < count ? begin + FRAKTAL_CPU_CHUNK : count;
+        for (int b = begin; b < end; b += FRAKTAL_CPU_BATCH)
+        {
+            // a partial batch is padded with the last point
+            int n = end - b < FRAKTAL_CPU_BATCH ? end - b : FRAKTAL_CPU_BATCH;
+            for (int k = 0; k < 3; k++)
+            {
+                float *r = regs + m->input[k]*FRAKTAL_CPU_BATCH;
+                memcpy(r, inputs[k] + b, n*sizeof(float));
+                for (int j = n; j < FRAKTAL_CPU_BATCH; j++)
+                    r[j] = inputs[k][b + n - 1];
+            }
+            fcpu_run(m, regs);
+            memcpy(d + b, regs + m->output*FRAKTAL_CPU_BATCH, n*sizeof(float));
+        }
+    }
+    free(regs);
+}
+
+//-----------------------------------------------------------------------------
+// Interval evaluation
+//-----------------------------------------------------------------------------
+
+/*
+The program can also be run on intervals instead of points, to bound the
+model over a box (see fraktal_eval_cpu_model_bounds). Each register then
+holds a range [lo, hi] that contains every value the register takes for
+points in the box, and each operation maps the ranges of its operands to
+a range that contains all of its results. Comparisons that are decided
+over the whole box give 0 or 1, and undecided ones give [0,1], in which
+case SELECT (which implements branches) returns the union of both sides.
+
+The bounds are conservative but not tight: an operand that appears twice
+(as in p.x*p.x, or through a variable) is treated as two independent
+ranges. Results are rounded outwards, by one ulp after arithmetic and by
+a few after the functions of the C library.
+*/
+
+struct fCpuInterval
+{
+    float lo;
+    float hi;
+};
+
+static const double fcpu_pi = 3.14159265358979323846;
+
+static fCpuInterval fcpu_interval(float lo, float hi)
+{
+    fCpuInterval r = { lo, hi };
+    return r;
+}
+
+static fCpuInterval fcpu_everything()
+{
+    return fcpu_interval(-INFINITY, INFINITY);
+}
+
+static fCpuInterval fcpu_outward(fCpuInterval r, int ulps)
+{
+    if (r.lo != r.lo || r.hi != r.hi)
+        return fcpu_everything();
+    for (int i = 0; i < ulps; i++)
+    {
+        r.lo = nextafterf(r.lo, -INFINITY);
+        r.hi = nextafterf(r.hi, INFINITY);
+    }
+    return r;
+}
+
+static fCpuInterval fcpu_hull(fCpuInterval a, fCpuInterval b)
+{
+    return fcpu_interval(b.lo < a.lo ? b.lo : a.lo, a.hi < b.hi ? b.hi : a.hi);
+}
+
+// Range of four candidate values (e.g. the corners of a product)
+static fCpuInterval fcpu_corners(float v0, float v1, float v2, float v3)
+{
+    if (v0 != v0 || v1 != v1 || v2 != v2 || v3 != v3)
+        return fcpu_everything();
+    return fcpu_interval(fminf(fminf(v0, v1), fminf(v2, v3)), fmaxf(fmaxf(v0, v1), fmaxf(v2, v3)));
+}
+
+// Whether every value in the range is true (non-zero), or every value is false
+static bool fcpu_all_true(fCpuInterval a) { return a.lo > 0.0f || a.hi < 0.0f; }
+static bool fcpu_all_false(fCpuInterval a) { return a.lo == 0.0f && a.hi == 0.0f; }
+
+static fCpuInterval fcpu_truth(bool all_true, bool all_false)
+{
+    return fcpu_interval(all_true ? 1.0f : 0.0f, all_false ? 0.0f : 1.0f);
+}
+
+// Whether the range contains offset + k*period for some integer k
+static bool fcpu_contains_periodic(fCpuInterval a, double offset, double period)
+{
+    double k = ceil((a.lo - offset)/period);
+    return offset + k*period <= a.hi;
+}
+
+// Range of a function with period 2pi, such as sin and cos, whose maxima
+// are at 'peak' + 2pi*k and minima at 'peak' + pi + 2pi*k.
+static fCpuInterval fcpu_periodic(fCpuInterval a, float (*f)(float), double peak)
+{
+    if (!(a.hi - a.lo < 2.0*fcpu_pi))
+        return fcpu_interval(-1.0f, 1.0f);
+    float f_lo = f(a.lo);
+    float f_hi = f(a.hi);
+    fCpuInterval r = fcpu_outward(fcpu_interval(fminf(f_lo, f_hi), fmaxf(f_lo, f_hi)), 4);
+    if (fcpu_contains_periodic(a, peak, 2.0*fcpu_pi))
+        r.hi = 1.0f;
+    if (fcpu_contains_periodic(a, peak + fcpu_pi, 2.0*fcpu_pi))
+        r.lo = -1.0f;
+    return r;
+}
+
+static fCpuInterval fcpu_mul_interval(fCpuInterval a, fCpuInterval b)
+{
+    // 0*inf comes from an unbounded range of finite values, whose product with 0 is 0
+    float v[4] = { a.lo*b.lo, a.lo*b.hi, a.hi*b.lo, a.hi*b.hi };
+    for (int i = 0; i < 4; i++)
+        if (v[i] != v[i]) v[i] = 0.0f;
+    return fcpu_outward(fcpu_corners(v[0], v[1], v[2], v[3]), 1);
+}
+
+static fCpuInterval fcpu_div_interval(fCpuInterval a, fCpuInterval b)
+{
+    if (!(b.lo > 0.0f || b.hi < 0.0f))
+        return fcpu_everything();
+    return fcpu_outward(fcpu_corners(a.lo/b.lo, a.lo/b.hi, a.hi/b.lo, a.hi/b.hi), 1);
+}
+
+// a - b*floor(a/b)
+static fCpuInterval fcpu_mod_interval(fCpuInterval a, fCpuInterval b)
+{
+    if (b.lo == b.hi && b.lo != 0.0f)
+    {
+        float q = floorf(a.lo/b.lo);
+        if (floorf(a.hi/b.lo) == q && q == q)
+            return fcpu_outward(fcpu_interval(a.lo - b.lo*q, a.hi - b.lo*q), 2);
+    }
+    if (b.lo > 0.0f)
+        return fcpu_interval(0.0f, b.hi);
+    if (b.hi < 0.0f)
+        return fcpu_interval(b.lo, 0.0f);
+    return fcpu_everything();
+}
+
+// Both arguments are clamped to the domain of the function, as the result
+// is undefined outside of it.
+static fCpuInterval fcpu_pow_interval(fCpuInterval a, fCpuInterval b)
+{
+    // x^y = exp(y*log(x)) is bilinear in y and log(x), so its extrema are at the corners
+    float x0 = fmaxf(a.lo, 0.0f);
+    float x1 = fmaxf(a.hi, 0.0f);
+    return fcpu_outward(fcpu_corners(powf(x0, b.lo), powf(x0, b.hi), powf(x1, b.lo), powf(x1, b.hi)), 4);
+}
+
+static fCpuInterval fcpu_atan2_interval(fCpuInterval y, fCpuInterval x)
+{
+    // atan2 is monotonic in each argument away from the branch cut (y = 0, x <= 0)
+    if (x.lo > 0.0f || y.lo > 0.0f || y.hi < 0.0f)
+        return fcpu_outward(fcpu_corners(atan2f(y.lo, x.lo), atan2f(y.lo, x.hi), atan2f(y.hi, x.lo), atan2f(y.hi, x.hi)), 4);
+    return fcpu_outward(fcpu_interval(-(float)fcpu_pi, (float)fcpu_pi), 1);
+}
+
+static fCpuInterval fcpu_apply_interval(int op, fCpuInterval a, fCpuInterval b, fCpuInterval c)
+{
+    switch (op)
+    {
+        case FCPU_ADD: return fcpu_outward(fcpu_interval(a.lo + b.lo, a.hi + b.hi), 1);
+        case FCPU_SUB: return fcpu_outward(fcpu_interval(a.lo - b.hi, a.hi - b.lo), 1);
+        case FCPU_MUL: return fcpu_mul_interval(a, b);
+        case FCPU_DIV: return fcpu_div_interval(a, b);
+        case FCPU_NEG: return fcpu_interval(-a.hi, -a.lo);
+        case FCPU_MIN: return fcpu_interval(fminf(a.lo, b.lo), fminf(a.hi, b.hi));
+        case FCPU_MAX: return fcpu_interval(fmaxf(a.lo, b.lo), fmaxf(a.hi, b.hi));
+        case FCPU_ABS:
+            if (a.lo >= 0.0f) return a;
+            if (a.hi <= 0.0f) return fcpu_interval(-a.hi, -a.lo);
+            return fcpu_interval(0.0f, fmaxf(-a.lo, a.hi));
+        case FCPU_SIGN:
+        case FCPU_FLOOR:
+        case FCPU_CEIL:
+        case FCPU_TRUNC:
+        case FCPU_ROUND:
+            // monotonic and exact
+            return fcpu_interval(fcpu_apply(op, a.lo, 0.0f, 0.0f), fcpu_apply(op, a.hi, 0.0f, 0.0f));
+        case FCPU_FRACT:
+        {
+            float k = floorf(a.lo);
+            if (floorf(a.hi) == k && k == k)
+                return fcpu_outward(fcpu_interval(a.lo - k, a.hi - k), 1);
+            return fcpu_interval(0.0f, 1.0f);
+        }
+        case FCPU_MOD: return fcpu_mod_interval(a, b);
+        case FCPU_SQRT: return fcpu_outward(fcpu_interval(sqrtf(fmaxf(a.lo, 0.0f)), sqrtf(fmaxf(a.hi, 0.0f))), 1);
+        case FCPU_RSQRT: return fcpu_outward(fcpu_interval(1.0f/sqrtf(fmaxf(a.hi, 0.0f)), 1.0f/sqrtf(fmaxf(a.lo, 0.0f))), 2);
+        case FCPU_POW: return fcpu_pow_interval(a, b);
+        case FCPU_EXP: return fcpu_outward(fcpu_interval(expf(a.lo), expf(a.hi)), 4);
+        case FCPU_EXP2: return fcpu_outward(fcpu_interval(exp2f(a.lo), exp2f(a.hi)), 4);
+        case FCPU_LOG: return fcpu_outward(fcpu_interval(logf(fmaxf(a.lo, 0.0f)), logf(fmaxf(a.hi, 0.0f))), 4);
+        case FCPU_LOG2: return fcpu_outward(fcpu_interval(log2f(fmaxf(a.lo, 0.0f)), log2f(fmaxf(a.hi, 0.0f))), 4);
+        case FCPU_SIN: return fcpu_periodic(a, sinf, 0.5*fcpu_pi);
+        case FCPU_COS: return fcpu_periodic(a, cosf, 0.0);
+        case FCPU_TAN:
+            if (!(a.hi - a.lo < fcpu_pi) || fcpu_contains_periodic(a, 0.5*fcpu_pi, fcpu_pi))
+                return fcpu_everything();
+            return fcpu_outward(fcpu_interval(tanf(a.lo), tanf(a.hi)), 4);
+        case FCPU_ASIN: return fcpu_outward(fcpu_interval(asinf(fmaxf(a.lo, -1.0f)), asinf(fminf(a.hi, 1.0f))), 4);
+        case FCPU_ACOS: return fcpu_outward(fcpu_interval(acosf(fminf(a.hi, 1.0f)), acosf(fmaxf(a.lo, -1.0f))), 4);
+        case FCPU_ATAN: return fcpu_outward(fcpu_interval(atanf(a.lo), atanf(a.hi)), 4);
+        case FCPU_ATAN2: return fcpu_atan2_interval(a, b);
+        case FCPU_LT: return fcpu_truth(a.hi < b.lo, a.lo >= b.hi);
+        case FCPU_LE: return fcpu_truth(a.hi <= b.lo, a.lo > b.hi);
+        case FCPU_GT: return fcpu_truth(a.lo > b.hi, a.hi <= b.lo);
+        case FCPU_GE: return fcpu_truth(a.lo >= b.hi, a.hi < b.lo);
+        case FCPU_EQ: return fcpu_truth(a.lo == a.hi && b.lo == b.hi && a.lo == b.lo, a.hi < b.lo || b.hi < a.lo);
+        case FCPU_NE: return fcpu_truth(a.hi < b.lo || b.hi < a.lo, a.lo == a.hi && b.lo == b.hi && a.lo == b.lo);
+        case FCPU_AND: return fcpu_truth(fcpu_all_true(a) && fcpu_all_true(b), fcpu_all_false(a) || fcpu_all_false(b));
+        case FCPU_OR: return fcpu_truth(fcpu_all_true(a) || fcpu_all_true(b), fcpu_all_false(a) && fcpu_all_false(b));
+        case FCPU_NOT: return fcpu_truth(fcpu_all_false(a), fcpu_all_true(a));
+        case FCPU_SELECT:
+            if (fcpu_all_true(a)) return b;
+            if (fcpu_all_false(a)) return c;
+            return fcpu_hull(b, c);
+    }
+    return fcpu_everything();
+}
+
+static void fcpu_run_bounds(const fCpuModel *m, fCpuInterval *regs)
+{
+    for (int pc = 0; pc < m->num_code; pc++)
+    {
+        const fCpuInstruction &in = m->code[pc];
+        fCpuInterval *d = regs + in.dst*FRAKTAL_CPU_BATCH;
+        const fCpuInterval *ra = regs + in.a*FRAKTAL_CPU_BATCH;
+        const fCpuInterval *rb = regs + in.b*FRAKTAL_CPU_BATCH;
+        const fCpuInterval *rc = regs + in.c*FRAKTAL_CPU_BATCH;
+        for (int i = 0; i < FRAKTAL_CPU_BATCH; i++)
+            d[i] = fcpu_apply_interval(in.op, ra[i], rb[i], rc[i]);
+    }
+}
+
+// Bounds batches of boxes until there are none left. Boxes are taken one
+// batch at a time, as each costs far more than a point.
+static void fcpu_bounds_worker(const fCpuModel *m, const float *box_min, const float *box_max,
+                               float *d_min, float *d_max, int count, std::atomic<int> *next)
+{
+    fCpuInterval *regs = (fCpuInterval*)malloc((size_t)m->num_regs*FRAKTAL_CPU_BATCH*sizeof(fCpuInterval));
+    fraktal_assert(regs && "Ran out of memory");
+    for (int i = 0; i < m->num_constants; i++)
+        for (int j = 0; j < FRAKTAL_CPU_BATCH; j++)
+            regs[m->constant_reg[i]*FRAKTAL_CPU_BATCH + j] = fcpu_interval(m->constant_value[i], m->constant_value[i]);
+    for (;;)
+    {
+        int b = next->fetch_add(FRAKTAL_CPU_BATCH);
+        if (b >= count)
+            break;
+        int n = count - b < FRAKTAL_CPU_BATCH ? count - b : FRAKTAL_CPU_BATCH;
+        for (int k = 0; k < 3; k++)
+        {
+            fCpuInterval *r = regs + m->input[k]*FRAKTAL_CPU_BATCH;
+            for (int j = 0; j < FRAKTAL_CPU_BATCH; j++)
+            {
+                int box = b + (j < n ? j : n - 1);
+                r[j] = fcpu_interval(box_min[3*box + k], box_max[3*box + k]);
+            }
+        }
+        fcpu_run_bounds(m, regs);
+        for (int j = 0; j < n; j++)
+        {
+            fCpuInterval d = regs[m->output*FRAKTAL_CPU_BATCH + j];
+            d_min[b + j] = d.lo;
+            d_max[b + j] = d.hi;
+        }
+    }
+    free(regs);
+}
+
+// Number of threads to use for 'count' work items (including the calling thread)
+static int fcpu_num_threads(int count)
+{
+    int num_threads = fraktal_cpu_threads;
+    if (num_threads == 0)
+        num_threads = (int)std::thread::hardware_concurrency();
+    if (num_threads > count) num_threads = count;
+    if (num_threads < 1) num_threads = 1;
+    return num_threads;
+}
+
+fCpuModel *fraktal_create_cpu_model(const char **sources, int num_sources)
+{
+    fraktal_assert(sources);
+    fraktal_assert(num_sources > 0);
+    const char **names = (const char**)malloc(num_sources*sizeof(const char*));
+    char (*numbers)[32] = (char(*)[32])malloc(num_sources*32);
+    fraktal_assert(names && numbers && "Ran out of memory");
+    for (int i = 0; i < num_sources; i++)
+    {
+        snprintf(numbers[i], 32, "source %d", i);
+        names[i] = numbers[i];
+    }
+    fCpuModel *m = fcpu_compile(sources, names, num_sources);
+    free(names);
+    free(numbers);
+    return m;
+}
+
+fCpuModel *fraktal_load_cpu_model(const char **paths, int num_paths)
+{
+    fraktal_assert(paths);
+    fraktal_assert(num_paths > 0);
+    char **sources = (char**)calloc(num_paths, sizeof(char*));
+    fraktal_assert(sources && "Ran out of memory");
+    fCpuModel *m = NULL;
+    bool ok = true;
+    for (int i = 0; i < num_paths && ok; i++)
+    {
+        sources[i] = read_file(paths[i]);
+        if (!sources[i])
+        {
+            log_err("Failed to load model: could not read file '%s'.\n", paths[i]);
+            ok = false;
+        }
+    }
+    if (ok)
+        m = fcpu_compile((const char**)sources, paths, num_paths);
+    for (int i = 0; i < num_paths; i++)
+        delete[] sources[i]; // allocated by read_file
+    free(sources);
+    return m;
+}
+
+void fraktal_destroy_cpu_model(fCpuModel *m)
+{
+    if (m)
+    {
+        free(m->code);
+        free(m->constant_reg);
+        free(m->constant_value);
+        free(m);
+    }
+}
+
+void fraktal_set_cpu_threads(int count)
+{
+    fraktal_assert(count >= 0);
+    fraktal_cpu_threads = count;
+}
+
+void fraktal_eval_cpu_model(fCpuModel *m, const float *x, const float *y, const float *z, float *d, int count)
+{
+    fraktal_assert(m);
+    fraktal_assert(x && y && z && d);
+    fraktal_assert(count >= 0);
+    if (count == 0)
+        return;
+    int num_threads = fcpu_num_threads((count + FRAKTAL_CPU_CHUNK - 1) / FRAKTAL_CPU_CHUNK);
+
+    // the calling thread is one of the workers
+    std::atomic<int> next(0);
+    std::thread *threads = num_threads > 1 ? new std::thread[num_threads - 1] : NULL;
+    for (int i = 0; i < num_threads - 1; i++)
+        threads[i] = std::thread(fcpu_worker, m, x, y, z, d, count, &next);
+    fcpu_worker(m, x, y, z, d, count, &next);
+    for (int i = 0; i < num_threads - 1; i++)
+        threads[i].join();
+    delete[] threads;
+}
+
+void fraktal_eval_cpu_model_bounds(fCpuModel *m, const float *box_min, const float *box_max, float *d_min, float *d_max, int count)
+{
+    fraktal_assert(m);
+    fraktal_assert(box_min && box_max && d_min && d_max);
+    fraktal_assert(count >= 0);
+    if (count == 0)
+        return;
+    int num_threads = fcpu_num_threads((count + FRAKTAL_CPU_BATCH - 1) / FRAKTAL_CPU_BATCH);
+
+    // the calling thread is one of the workers
+    std::atomic<int> next(0);
+    std::thread *threads = num_threads > 1 ? new std::thread[num_threads - 1] : NULL;
+    for (int i = 0; i < num_threads - 1; i++)
+        threads[i] = std::thread(fcpu_bounds_worker, m, box_min, box_max, d_min, d_max, count, &next);
+    fcpu_bounds_worker(m, box_min, box_max, d_min, d_max, count, &next);
+    for (int i = 0; i < num_threads - 1; i++)
+        threads[i].join();
+    delete[] threads;
+}
+
+//-----------------------------------------------------------------------------
+// Octree
+//-----------------------------------------------------------------------------
+
+/*
+The octree is built one level at a time: the cells of a level are bounded
+together with fraktal_eval_cpu_model_bounds, and each ambiguous cell above
+the maximum depth is split into eight children for the next level. Nodes
+are stored in one array, with the children of a node next to each other,
+ordered by x, then y, then z (child index = x + 2y + 4z).
+*/
+
+enum { FRAKTAL_MAX_OCTREE_DEPTH = 16 };
+
+struct fOctreeNode
+{
+    int children; // index of the first child, or -1 for a leaf
+    fEnum state;
+};
+
+struct fOctree
+{
+    float box_min[3];
+    float box_max[3];
+    int depth;
+    fOctreeNode *nodes;
+    int num_nodes;
+};
+
+// Coordinate of the boundary 'i' of 'n' cells along 'axis'. Neighboring
+// cells use the same value for their shared boundary, so that no point
+// falls between them.
+static float fcpu_octree_coord(const fOctree *o, int axis, int i, int n)
+{
+    if (i == n)
+        return o->box_max[axis];
+    return o->box_min[axis] + (o->box_max[axis] - o->box_min[axis])*((float)i/(float)n);
+}
+
+fOctree *fraktal_create_octree(fCpuModel *m, const float box_min[3], const float box_max[3], int depth)
+{
+    fraktal_assert(m);
+    fraktal_assert(box_min && box_max);
+    fraktal_assert(depth >= 0 && depth <= FRAKTAL_MAX_OCTREE_DEPTH);
+    for (int k = 0; k < 3; k++)
+        fraktal_assert(box_min[k] <= box_max[k]);
+
+    fOctree *o = (fOctree*)calloc(1, sizeof(fOctree));
+    fraktal_assert(o && "Ran out of memory");
+    memcpy(o->box_min, box_min, sizeof(o->box_min));
+    memcpy(o->box_max, box_max, sizeof(o->box_max));
+    o->depth = depth;
+
+    // cells of the current level, as node indices and integer coordinates
+    int num_cells = 1;
+    int *cells = (int*)malloc(4*sizeof(int));
+    o->nodes = (fOctreeNode*)malloc(sizeof(fOctreeNode));
+    fraktal_assert(cells && o->nodes && "Ran out of memory");
+    o->nodes[0].children = -1;
+    o->num_nodes = 1;
+    cells[0] = 0;
+    cells[1] = cells[2] = cells[3] = 0;
+
+    float *bounds = NULL; // box_min, box_max, d_min and d_max of each cell
+    int bounds_capacity = 0;
+    for (int level = 0; num_cells > 0; level++)
+    {
+        if (num_cells > bounds_capacity)
+        {
+            bounds_capacity = num_cells;
+            free(bounds);
+            bounds = (float*)malloc((size_t)bounds_capacity*8*sizeof(float));
+            fraktal_assert(bounds && "Ran out of memory");
+        }
+        float *cell_min = bounds;
+        float *cell_max = bounds + 3*num_cells;
+        float *d_min = bounds + 6*num_cells;
+        float *d_max = bounds + 7*num_cells;
+        int n = 1 << level;
+        for (int i = 0; i < num_cells; i++)
+        for (int k = 0; k < 3; k++)
+        {
+            cell_min[3*i + k] = fcpu_octree_coord(o, k, cells[4*i + 1 + k], n);
+            cell_max[3*i + k] = fcpu_octree_coord(o, k, cells[4*i + 1 + k] + 1, n);
+        }
+        fraktal_eval_cpu_model_bounds(m, cell_min, cell_max, d_min, d_max, num_cells);
+
+        int num_split = 0;
+        for (int i = 0; i < num_cells; i++)
+        {
+            fOctreeNode &node = o->nodes[cells[4*i]];
+            if (d_min[i] > 0.0f)
+                node.state = FRAKTAL_EMPTY;
+            else if (d_max[i] < 0.0f)
+                node.state = FRAKTAL_FULL;
+            else
+                node.state = FRAKTAL_AMBIGUOUS;
+            if (node.state == FRAKTAL_AMBIGUOUS && level < depth)
+                num_split++;
+        }
+
+        int num_children = 8*num_split;
+        fOctreeNode *nodes = (fOctreeNode*)realloc(o->nodes, (o->num_nodes + num_children)*sizeof(fOctreeNode));
+        int *children = (int*)malloc((num_children > 0 ? num_children : 1)*4*sizeof(int));
+        fraktal_assert(nodes && children && "Ran out of memory");
+        o->nodes = nodes;
+        int num_next = 0;
+        for (int i = 0; i < num_cells; i++)
+        {
+            fOctreeNode &node = o->nodes[cells[4*i]];
+            if (node.state != FRAKTAL_AMBIGUOUS || level == depth)
+                continue;
+            node.children = o->num_nodes;
+            for (int c = 0; c < 8; c++)
+            {
+                o->nodes[o->num_nodes].children = -1;
+                children[4*num_next + 0] = o->num_nodes++;
+                children[4*num_next + 1] = 2*cells[4*i + 1] + ((c >> 0) & 1);
+                children[4*num_next + 2] = 2*cells[4*i + 2] + ((c >> 1) & 1);
+                children[4*num_next + 3] = 2*cells[4*i + 3] + ((c >> 2) & 1);
+                num_next++;
+            }
+        }
+        free(cells);
+        cells = children;
+        num_cells = num_next;
+    }
+    free(cells);
+    free(bounds);
+    return o;
+}
+
+void fraktal_destroy_octree(fOctree *o)
+{
+    if (o)
+    {
+        free(o->nodes);
+        free(o);
+    }
+}
+
+fEnum fraktal_octree_cell(fOctree *o, float x, float y, float z)
+{
+    fraktal_assert(o);
+    float p[3] = { x, y, z };
+    for (int k = 0; k < 3; k++)
+        if (!(p[k] >= o->box_min[k] && p[k] <= o->box_max[k]))
+            return FRAKTAL_AMBIGUOUS;
+
+    int node = 0;
+    int cell[3] = { 0, 0, 0 };
+    for (int level = 1; o->nodes[node].children >= 0; level++)
+    {
+        // descend to the child on the same side of each midpoint as the point
+        int n = 1 << level;
+        int c = 0;
+        for (int k = 0; k < 3; k++)
+        {
+            cell[k] *= 2;
+            if (p[k] >= fcpu_octree_coord(o, k, cell[k] + 1, n))
+            {
+                cell[k]++;
+                c |= 1 << k;
+            }
+        }
+        node = o->nodes[node].children + c;
+    }
+    return o->nodes[node].state;
+}
+
+static void fcpu_octree_cells(fOctree *o, int node, int level, int x, int y, int z, fEnum state,
+                              float *box_min, float *box_max, int max_count, int *count)
+{
+    const fOctreeNode &n = o->nodes[node];
+    if (n.children >= 0)
+    {
+        for (int c = 0; c < 8; c++)
+            fcpu_octree_cells(o, n.children + c, level + 1, 2*x + (c & 1), 2*y + ((c >> 1) & 1), 2*z + ((c >> 2) & 1),
+                              state, box_min, box_max, max_count, count);
+        return;
+    }
+    if (n.state != state)
+        return;
+    if (*count < max_count)
+    {
+        int cell[3] = { x, y, z };
+        for (int k = 0; k < 3; k++)
+        {
+            box_min[3*(*count) + k] = fcpu_octree_coord(o, k, cell[k], 1 << level);
+            box_max[3*(*count) + k] = fcpu_octree_coord(o, k, cell[k] + 1, 1 << level);
+        }
+    }
+    (*count)++;
+}
+
+int fraktal_octree_cells(fOctree *o, fEnum state, float *box_min, float *box_max, int max_count)
+{
+    fraktal_assert(o);
+    fraktal_assert(state == FRAKTAL_EMPTY || state == FRAKTAL_FULL || state == FRAKTAL_AMBIGUOUS);
+    fraktal_assert(max_count == 0 || (box_min && box_max));
+    int count = 0;
+    fcpu_octree_cells(o, 0, 0, 0, 0, 0, state, box_min, box_max, max_count, &count);
+    return count;
+}
@@ -0,0 +1,545 @@
+// Developed by Simen Haugo.
+// See LICENSE.txt for copyright and licensing details (standard MIT License).
+
+#pragma once
+
+/*
+GLSL types and built-in functions for kernels compiled by the software
+backend (see fraktal_software_link.h). Kernel sources are translated to
+C++ by translate_source, which keeps most of the code as it is: vectors,
+matrices and samplers are classes with the GLSL names, and built-in
+functions are overloaded for each type, so that arguments convert the
+same way as in GLSL. This text is written next to the translated sources
+before they are compiled.
+
+Swizzles of several components are translated to calls of sw<...>(). On
+a variable, the call returns a proxy that holds a copy of the selected
+components, and writes them back at the end of the full-expression if
+they were changed, e.g. by an assignment or by passing the proxy to an
+inout parameter. Vector inout parameters are declared as finout<T>,
+which writes the value of the parameter back to the argument when the
+call returns.
+
+The layouts of fsampler and frun must match fSoftwareSampler and
+fSoftwareRun in fraktal_software.h.
+*/
+static const char *fraktal_glsl_header = R"GLSL(
+#include <cmath>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+#define FRAKTAL_SOFTWARE 1
+#define FRAKTAL_GLSL_VERSION 150
+#define ZERO 0
+
+namespace fraktal_glsl {
+
+typedef unsigned int uint;
+
+template <class T, int N> struct fvec;
+template <class V, int... I> struct fswizzle;
+template <int N> struct fmat;
+
+// Stores the components of 's' at d[i], d[i+1], ..., up to d[n-1]
+template <class T, class S>
+inline typename std::enable_if<std::is_arithmetic<S>::value>::type
+fput(T *d, int &i, int n, const S &s) { if (i < n) d[i++] = (T)s; }
+
+template <class T, class U, int M>
+inline void fput(T *d, int &i, int n, const fvec<U,M> &v) { for (int k = 0; k < M; k++) fput(d, i, n, v[k]); }
+
+template <class T, int M>
+inline void fput(T *d, int &i, int n, const fmat<M> &m) { for (int k = 0; k < M; k++) fput(d, i, n, m.c[k]); }
+
+// Returns the number of components that were stored
+template <class T, class... A>
+inline int ffill(T *d, int n, const A&... a)
+{
+    int i = 0;
+    int unused[] = { 0, (fput(d, i, n, a), 0)... };
+    (void)unused;
+    return i;
+}
+
+// A single scalar argument sets all components
+#define FRAKTAL_VEC_MEMBERS(N) \
+    typedef T value_type; \
+    enum { size = N }; \
+    fvec() = default; \
+    template <class... A> explicit fvec(const A&... a) \
+    { \
+        if (ffill(&x, N, a...) == 1 && sizeof...(A) == 1) \
+            for (int k = 1; k < N; k++) (&x)[k] = x; \
+    } \
+    T &operator[](int i) { return (&x)[i]; } \
+    const T &operator[](int i) const { return (&x)[i]; } \
+    template <int... I> fswizzle<fvec, I...> sw() & { return fswizzle<fvec, I...>(*this); } \
+    template <int... I> fvec<T, sizeof...(I)> sw() const & { return fvec<T, sizeof...(I)>((&x)[I]...); } \
+    template <int... I> fvec<T, sizeof...(I)> sw() && { return fvec<T, sizeof...(I)>((&x)[I]...); }
+
+// Single components can be named by any of the three sets of letters
+template <class T> struct fvec<T,2> { union { struct { T x, y; }; struct { T r, g; }; struct { T s, t; }; }; FRAKTAL_VEC_MEMBERS(2) };
+template <class T> struct fvec<T,3> { union { struct { T x, y, z; }; struct { T r, g, b; }; struct { T s, t, p; }; }; FRAKTAL_VEC_MEMBERS(3) };
+template <class T> struct fvec<T,4> { union { struct { T x, y, z, w; }; struct { T r, g, b, a; }; struct { T s, t, p, q; }; }; FRAKTAL_VEC_MEMBERS(4) };
+
+typedef fvec<float,2> vec2;
+typedef fvec<float,3> vec3;
+typedef fvec<float,4> vec4;
+typedef fvec<int,2> ivec2;
+typedef fvec<int,3> ivec3;
+typedef fvec<int,4> ivec4;
+typedef fvec<uint,2> uvec2;
+typedef fvec<uint,3> uvec3;
+typedef fvec<uint,4> uvec4;
+typedef fvec<bool,2> bvec2;
+typedef fvec<bool,3> bvec3;
+typedef fvec<bool,4> bvec4;
+
+template <class V, int... I>
+struct fswizzle : fvec<typename V::value_type, sizeof...(I)>
+{
+    typedef fvec<typename V::value_type, sizeof...(I)> R;
+    V &v;
+    R original;
+    explicit fswizzle(V &v) : R(v[I]...), v(v), original(*this) {}
+    ~fswizzle()
+    {
+        const R &r = *this;
+        if (memcmp(&r, &original, sizeof(R)) != 0)
+        {
+            int k = 0;
+            int unused[] = { (v[I] = r[k++], 0)... };
+            (void)unused;
+        }
+    }
+    fswizzle &operator=(const R &r) { R::operator=(r); return *this; }
+    fswizzle &operator=(const fswizzle &s) { R::operator=(s); return *this; }
+    template <class U> fswizzle &operator+=(const U &u) { R &r = *this; r += u; return *this; }
+    template <class U> fswizzle &operator-=(const U &u) { R &r = *this; r -= u; return *this; }
+    template <class U> fswizzle &operator*=(const U &u) { R &r = *this; r *= u; return *this; }
+    template <class U> fswizzle &operator/=(const U &u) { R &r = *this; r /= u; return *this; }
+};
+
+template <class T>
+struct finout : T
+{
+    T *target;
+    finout(T &t) : T(t), target(&t) {}
+    finout(finout &t) : T(t), target(&t) {}
+    finout(finout &&t) : T(t), target(t.target) { t.target = &t; }
+    template <class V, int... I> finout(fswizzle<V, I...> &&s) : T(s), target(&s) {}
+    ~finout() { *target = *this; }
+    using T::operator=;
+    finout &operator=(const finout &t) { T::operator=(t); return *this; }
+};
+
+template <int N>
+struct fmat
+{
+    fvec<float,N> c[N];
+    fmat() = default;
+    // A single scalar argument sets the diagonal
+    template <class... A> explicit fmat(const A&... a)
+    {
+        if (ffill(&c[0].x, N*N, a...) == 1 && sizeof...(A) == 1)
+        {
+            float s = c[0].x;
+            for (int i = 0; i < N; i++)
+            for (int j = 0; j < N; j++)
+                c[i][j] = i == j ? s : 0.0f;
+        }
+    }
+    template <int M> explicit fmat(const fmat<M> &m)
+    {
+        for (int i = 0; i < N; i++)
+        for (int j = 0; j < N; j++)
+            c[i][j] = i < M && j < M ? m.c[i][j] : i == j ? 1.0f : 0.0f;
+    }
+    fvec<float,N> &operator[](int i) { return c[i]; }
+    const fvec<float,N> &operator[](int i) const { return c[i]; }
+};
+
+typedef fmat<2> mat2;
+typedef fmat<3> mat3;
+typedef fmat<4> mat4;
+typedef fmat<2> mat2x2;
+typedef fmat<3> mat3x3;
+typedef fmat<4> mat4x4;
+
+//
+// Operators
+//
+
+#define FRAKTAL_VEC_BINARY(V, S, op) \
+    inline V operator op(const V &a, const V &b) { V r; for (int i = 0; i < V::size; i++) r[i] = a[i] op b[i]; return r; } \
+    inline V operator op(const V &a, S b) { V r; for (int i = 0; i < V::size; i++) r[i] = a[i] op b; return r; } \
+    inline V operator op(S a, const V &b) { V r; for (int i = 0; i < V::size; i++) r[i] = a op b[i]; return r; } \
+    inline V &operator op##=(V &a, const V &b) { for (int i = 0; i < V::size; i++) a[i] op##= b[i]; return a; } \
+    inline V &operator op##=(V &a, S b) { for (int i = 0; i < V::size; i++) a[i] op##= b; return a; }
+
+#define FRAKTAL_VEC_COMPARE(V) \
+    inline bool operator==(const V &a, const V &b) { for (int i = 0; i < V::size; i++) if (!(a[i] == b[i])) return false; return true; } \
+    inline bool operator!=(const V &a, const V &b) { return !(a == b); }
+
+#define FRAKTAL_VEC_ARITHMETIC(V, S) \
+    inline V operator+(const V &a) { return a; } \
+    inline V operator-(const V &a) { V r; for (int i = 0; i < V::size; i++) r[i] = -a[i]; return r; } \
+    FRAKTAL_VEC_BINARY(V, S, +) \
+    FRAKTAL_VEC_BINARY(V, S, -) \
+    FRAKTAL_VEC_BINARY(V, S, *) \
+    FRAKTAL_VEC_BINARY(V, S, /) \
+    FRAKTAL_VEC_COMPARE(V)
+
+#define FRAKTAL_VEC_INTEGER(V, S) \
+    FRAKTAL_VEC_ARITHMETIC(V, S) \
+    FRAKTAL_VEC_BINARY(V, S, %) \
+    FRAKTAL_VEC_BINARY(V, S, &) \
+    FRAKTAL_VEC_BINARY(V, S, |) \
+    FRAKTAL_VEC_BINARY(V, S, ^) \
+    FRAKTAL_VEC_BINARY(V, S, <<) \
+    FRAKTAL_VEC_BINARY(V, S, >>) \
+    inline V operator~(const V &a) { V r; for (int i = 0; i < V::size; i++) r[i] = ~a[i]; return r; }
+
+FRAKTAL_VEC_ARITHMETIC(vec2, float)
+FRAKTAL_VEC_ARITHMETIC(vec3, float)
+FRAKTAL_VEC_ARITHMETIC(vec4, float)
+FRAKTAL_VEC_INTEGER(ivec2, int)
+FRAKTAL_VEC_INTEGER(ivec3, int)
+FRAKTAL_VEC_INTEGER(ivec4, int)
+FRAKTAL_VEC_INTEGER(uvec2, uint)
+FRAKTAL_VEC_INTEGER(uvec3, uint)
+FRAKTAL_VEC_INTEGER(uvec4, uint)
+FRAKTAL_VEC_COMPARE(bvec2)
+FRAKTAL_VEC_COMPARE(bvec3)
+FRAKTAL_VEC_COMPARE(bvec4)
+
+//
+// Built-in functions
+//
+
+inline float radians(float x) { return x*(3.14159265358979f/180.0f); }
+inline float degrees(float x) { return x*(180.0f/3.14159265358979f); }
+inline float sin(float x) { return std::sin(x); }
+inline float cos(float x) { return std::cos(x); }
+inline float tan(float x) { return std::tan(x); }
+inline float asin(float x) { return std::asin(x); }
+inline float acos(float x) { return std::acos(x); }
+inline float atan(float x) { return std::atan(x); }
+inline float atan(float y, float x) { return std::atan2(y, x); }
+inline float sinh(float x) { return std::sinh(x); }
+inline float cosh(float x) { return std::cosh(x); }
+inline float tanh(float x) { return std::tanh(x); }
+inline float asinh(float x) { return std::asinh(x); }
+inline float acosh(float x) { return std::acosh(x); }
+inline float atanh(float x) { return std::atanh(x); }
+inline float pow(float x, float y) { return std::pow(x, y); }
+inline float exp(float x) { return std::exp(x); }
+inline float log(float x) { return std::log(x); }
+inline float exp2(float x) { return std::exp2(x); }
+inline float log2(float x) { return std::log2(x); }
+inline float sqrt(float x) { return std::sqrt(x); }
+inline float inversesqrt(float x) { return 1.0f/std::sqrt(x); }
+inline float abs(float x) { return std::fabs(x); }
+inline int abs(int x) { return x < 0 ? -x : x; }
+inline float sign(float x) { return x > 0.0f ? 1.0f : x < 0.0f ? -1.0f : 0.0f; }
+inline int sign(int x) { return x > 0 ? 1 : x < 0 ? -1 : 0; }
+inline float floor(float x) { return std::floor(x); }
+inline float ceil(float x) { return std::ceil(x); }
+inline float trunc(float x) { return std::trunc(x); }
+inline float round(float x) { return std::round(x); }
+inline float roundEven(float x) { return std::nearbyint(x); }
+inline float fract(float x) { return x - std::floor(x); }
+inline float mod(float x, float y) { return x - y*std::floor(x/y); }
+inline float modf(float x, float &i) { return std::modf(x, &i); }
+inline float min(float a, float b) { return b < a ? b : a; }
+inline float max(float a, float b) { return a < b ? b : a; }
+inline float clamp(float x, float a, float b) { return min(max(x, a), b); }
+inline float mix(float a, float b, float t) { return a*(1.0f - t) + b*t; }
+inline float step(float e, float x) { return x < e ? 0.0f : 1.0f; }
+inline float smoothstep(float e0, float e1, float x) { float t = clamp((x - e0)/(e1 - e0), 0.0f, 1.0f); return t*t*(3.0f - 2.0f*t); }
+inline bool isnan(float x) { return std::isnan(x); }
+inline bool isinf(float x) { return std::isinf(x); }
+inline int floatBitsToInt(float x) { int i; memcpy(&i, &x, 4); return i; }
+inline uint floatBitsToUint(float x) { uint i; memcpy(&i, &x, 4); return i; }
+inline float intBitsToFloat(int i) { float x; memcpy(&x, &i, 4); return x; }
+inline float uintBitsToFloat(uint i) { float x; memcpy(&x, &i, 4); return x; }
+
+// The integer overloads of min, max and clamp only accept arguments that
+// are all int or all uint, so that e.g. clamp(x, 0, 1) with a float x
+// selects the float overload, as it does in GLSL.
+template <class T> struct fint {};
+template <> struct fint<int> { typedef int type; };
+template <> struct fint<uint> { typedef uint type; };
+template <class T> inline typename fint<T>::type min(T a, T b) { return b < a ? b : a; }
+template <class T> inline typename fint<T>::type max(T a, T b) { return a < b ? b : a; }
+template <class T> inline typename fint<T>::type clamp(T x, T a, T b) { return min(max(x, a), b); }
+
+#define FRAKTAL_MAP1(R, V, f) \
+    inline R f(const V &a) { R r; for (int i = 0; i < V::size; i++) r[i] = f(a[i]); return r; }
+#define FRAKTAL_MAP2(V, S, f) \
+    inline V f(const V &a, const V &b) { V r; for (int i = 0; i < V::size; i++) r[i] = f(a[i], b[i]); return r; } \
+    inline V f(const V &a, S b) { V r; for (int i = 0; i < V::size; i++) r[i] = f(a[i], b); return r; }
+#define FRAKTAL_MAP3(V, S, f) \
+    inline V f(const V &a, const V &b, const V &c) { V r; for (int i = 0; i < V::size; i++) r[i] = f(a[i], b[i], c[i]); return r; } \
+    inline V f(const V &a, S b, S c) { V r; for (int i = 0; i < V::size; i++) r[i] = f(a[i], b, c); return r; }
+
+#define FRAKTAL_FLOAT_FUNCTIONS(V, B, I, U) \
+    FRAKTAL_MAP1(V, V, radians) FRAKTAL_MAP1(V, V, degrees) \
+    FRAKTAL_MAP1(V, V, sin) FRAKTAL_MAP1(V, V, cos) FRAKTAL_MAP1(V, V, tan) \
+    FRAKTAL_MAP1(V, V, asin) FRAKTAL_MAP1(V, V, acos) FRAKTAL_MAP1(V, V, atan) \
+    FRAKTAL_MAP1(V, V, sinh) FRAKTAL_MAP1(V, V, cosh) FRAKTAL_MAP1(V, V, tanh) \
+    FRAKTAL_MAP1(V, V, asinh) FRAKTAL_MAP1(V, V, acosh) FRAKTAL_MAP1(V, V, atanh) \
+    FRAKTAL_MAP1(V, V, exp) FRAKTAL_MAP1(V, V, log) FRAKTAL_MAP1(V, V, exp2) FRAKTAL_MAP1(V, V, log2) \
+    FRAKTAL_MAP1(V, V, sqrt) FRAKTAL_MAP1(V, V, inversesqrt) \
+    FRAKTAL_MAP1(V, V, abs) FRAKTAL_MAP1(V, V, sign) \
+    FRAKTAL_MAP1(V, V, floor) FRAKTAL_MAP1(V, V, ceil) FRAKTAL_MAP1(V, V, trunc) \
+    FRAKTAL_MAP1(V, V, round) FRAKTAL_MAP1(V, V, roundEven) FRAKTAL_MAP1(V, V, fract) \
+    FRAKTAL_MAP1(B, V, isnan) FRAKTAL_MAP1(B, V, isinf) \
+    FRAKTAL_MAP1(I, V, floatBitsToInt) FRAKTAL_MAP1(U, V, floatBitsToUint) \
+    FRAKTAL_MAP2(V, float, atan) FRAKTAL_MAP2(V, float, pow) FRAKTAL_MAP2(V, float, mod) \
+    FRAKTAL_MAP2(V, float, min) FRAKTAL_MAP2(V, float, max) \
+    FRAKTAL_MAP3(V, float, clamp) \
+    inline V mix(const V &a, const V &b, const V &t) { V r; for (int i = 0; i < V::size; i++) r[i] = mix(a[i], b[i], t[i]); return r; } \
+    inline V mix(const V &a, const V &b, float t) { V r; for (int i = 0; i < V::size; i++) r[i] = mix(a[i], b[i], t); return r; } \
+    inline V step(const V &e, const V &x) { V r; for (int i = 0; i < V::size; i++) r[i] = step(e[i], x[i]); return r; } \
+    inline V step(float e, const V &x) { V r; for (int i = 0; i < V::size; i++) r[i] = step(e, x[i]); return r; } \
+    inline V smoothstep(const V &e0, const V &e1, const V &x) { V r; for (int i = 0; i < V::size; i++) r[i] = smoothstep(e0[i], e1[i], x[i]); return r; } \
+    inline V smoothstep(float e0, float e1, const V &x) { V r; for (int i = 0; i < V::size; i++) r[i] = smoothstep(e0, e1, x[i]); return r; } \
+    inline V modf(const V &x, V &i) { V r; for (int k = 0; k < V::size; k++) r[k] = modf(x[k], i[k]); return r; } \
+    inline V intBitsToFloat(const I &a) { V r; for (int i = 0; i < V::size; i++) r[i] = intBitsToFloat(a[i]); return r; } \
+    inline V uintBitsToFloat(const U &a) { V r; for (int i = 0; i < V::size; i++) r[i] = uintBitsToFloat(a[i]); return r; } \
+    inline float dot(const V &a, const V &b) { float s = 0.0f; for (int i = 0; i < V::size; i++) s += a[i]*b[i]; return s; } \
+    inline float length(const V &a) { return std::sqrt(dot(a, a)); } \
+    inline float distance(const V &a, const V &b) { return length(a - b); } \
+    inline V normalize(const V &a) { return a/length(a); } \
+    inline V faceforward(const V &n, const V &i, const V &nref) { return dot(nref, i) < 0.0f ? n : -n; } \
+    inline V reflect(const V &i, const V &n) { return i - 2.0f*dot(n, i)*n; } \
+    inline V refract(const V &i, const V &n, float eta) \
+    { \
+        float k = 1.0f - eta*eta*(1.0f - dot(n, i)*dot(n, i)); \
+        return k < 0.0f ? V(0.0f) : eta*i - (eta*dot(n, i) + std::sqrt(k))*n; \
+    }
+
+#define FRAKTAL_INT_FUNCTIONS(V, S) \
+    FRAKTAL_MAP2(V, S, min) FRAKTAL_MAP2(V, S, max) FRAKTAL_MAP3(V, S, clamp)
+
+#define FRAKTAL_RELATIONAL(B, V) \
+    inline B lessThan(const V &a, const V &b) { B r; for (int i = 0; i < V::size; i++) r[i] = a[i] < b[i]; return r; } \
+    inline B lessThanEqual(const V &a, const V &b) { B r; for (int i = 0; i < V::size; i++) r[i] = a[i] <= b[i]; return r; } \
+    inline B greaterThan(const V &a, const V &b) { B r; for (int i = 0; i < V::size; i++) r[i] = a[i] > b[i]; return r; } \
+    inline B greaterThanEqual(const V &a, const V &b) { B r; for (int i = 0; i < V::size; i++) r[i] = a[i] >= b[i]; return r; } \
+    inline B equal(const V &a, const V &b) { B r; for (int i = 0; i < V::size; i++) r[i] = a[i] == b[i]; return r; } \
+    inline B notEqual(const V &a, const V &b) { B r; for (int i = 0; i < V::size; i++) r[i] = a[i] != b[i]; return r; }
+
+#define FRAKTAL_BOOL_FUNCTIONS(B) \
+    inline bool any(const B &a) { for (int i = 0; i < B::size; i++) if (a[i]) return true; return false; } \
+    inline bool all(const B &a) { for (int i = 0; i < B::size; i++) if (!a[i]) return false; return true; } \
+    inline B not_(const B &a) { B r; for (int i = 0; i < B::size; i++) r[i] = !a[i]; return r; } \
+    inline B equal(const B &a, const B &b) { B r; for (int i = 0; i < B::size; i++) r[i] = a[i] == b[i]; return r; } \
+    inline B notEqual(const B &a, const B &b) { B r; for (int i = 0; i < B::size; i++) r[i] = a[i] != b[i]; return r; }
+
+FRAKTAL_FLOAT_FUNCTIONS(vec2, bvec2, ivec2, uvec2)
+FRAKTAL_FLOAT_FUNCTIONS(vec3, bvec3, ivec3, uvec3)
+FRAKTAL_FLOAT_FUNCTIONS(vec4, bvec4, ivec4, uvec4)
+FRAKTAL_MAP1(ivec2, ivec2, abs) FRAKTAL_MAP1(ivec2, ivec2, sign) FRAKTAL_INT_FUNCTIONS(ivec2, int)
+FRAKTAL_MAP1(ivec3, ivec3, abs) FRAKTAL_MAP1(ivec3, ivec3, sign) FRAKTAL_INT_FUNCTIONS(ivec3, int)
+FRAKTAL_MAP1(ivec4, ivec4, abs) FRAKTAL_MAP1(ivec4, ivec4, sign) FRAKTAL_INT_FUNCTIONS(ivec4, int)
+FRAKTAL_INT_FUNCTIONS(uvec2, uint)
+FRAKTAL_INT_FUNCTIONS(uvec3, uint)
+FRAKTAL_INT_FUNCTIONS(uvec4, uint)
+FRAKTAL_RELATIONAL(bvec2, vec2) FRAKTAL_RELATIONAL(bvec2, ivec2) FRAKTAL_RELATIONAL(bvec2, uvec2)
+FRAKTAL_RELATIONAL(bvec3, vec3) FRAKTAL_RELATIONAL(bvec3, ivec3) FRAKTAL_RELATIONAL(bvec3, uvec3)
+FRAKTAL_RELATIONAL(bvec4, vec4) FRAKTAL_RELATIONAL(bvec4, ivec4) FRAKTAL_RELATIONAL(bvec4, uvec4)
+FRAKTAL_BOOL_FUNCTIONS(bvec2)
+FRAKTAL_BOOL_FUNCTIONS(bvec3)
+FRAKTAL_BOOL_FUNCTIONS(bvec4)
+
+inline float dot(float a, float b) { return a*b; }
+inline float length(float a) { return std::fabs(a); }
+inline float distance(float a, float b) { return std::fabs(a - b); }
+inline float normalize(float a) { return sign(a); }
+inline vec3 cross(const vec3 &a, const vec3 &b) { return vec3(a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x); }
+
+//
+// Matrices (stored as columns)
+//
+
+#define FRAKTAL_MAT(M, V) \
+    inline V operator*(const M &m, const V &v) { V r(0.0f); for (int i = 0; i < V::size; i++) r += m.c[i]*v[i]; return r; } \
+    inline V operator*(const V &v, const M &m) { V r; for (int i = 0; i < V::size; i++) r[i] = dot(v, m.c[i]); return r; } \
+    inline M operator*(const M &a, const M &b) { M r; for (int i = 0; i < V::size; i++) r.c[i] = a*b.c[i]; return r; } \
+    inline M operator*(const M &a, float s) { M r; for (int i = 0; i < V::size; i++) r.c[i] = a.c[i]*s; return r; } \
+    inline M operator*(float s, const M &a) { return a*s; } \
+    inline M operator/(const M &a, float s) { M r; for (int i = 0; i < V::size; i++) r.c[i] = a.c[i]/s; return r; } \
+    inline M operator+(const M &a, const M &b) { M r; for (int i = 0; i < V::size; i++) r.c[i] = a.c[i] + b.c[i]; return r; } \
+    inline M operator-(const M &a, const M &b) { M r; for (int i = 0; i < V::size; i++) r.c[i] = a.c[i] - b.c[i]; return r; } \
+    inline M operator-(const M &a) { M r; for (int i = 0; i < V::size; i++) r.c[i] = -a.c[i]; return r; } \
+    inline M &operator*=(M &a, const M &b) { a = a*b; return a; } \
+    inline M &operator*=(M &a, float s) { a = a*s; return a; } \
+    inline M &operator/=(M &a, float s) { a = a/s; return a; } \
+    inline M &operator+=(M &a, const M &b) { a = a + b; return a; } \
+    inline M &operator-=(M &a, const M &b) { a = a - b; return a; } \
+    inline V &operator*=(V &v, const M &m) { v = v*m; return v; } \
+    inline bool operator==(const M &a, const M &b) { for (int i = 0; i < V::size; i++) if (a.c[i] != b.c[i]) return false; return true; } \
+    inline bool operator!=(const M &a, const M &b) { return !(a == b); } \
+    inline M matrixCompMult(const M &a, const M &b) { M r; for (int i = 0; i < V::size; i++) r.c[i] = a.c[i]*b.c[i]; return r; } \
+    inline M outerProduct(const V &c, const V &r) { M m; for (int i = 0; i < V::size; i++) m.c[i] = c*r[i]; return m; } \
+    inline M transpose(const M &a) \
+    { \
+        M r; \
+        for (int i = 0; i < V::size; i++) \
+        for (int j = 0; j < V::size; j++) \
+            r.c[i][j] = a.c[j][i]; \
+        return r; \
+    }
+
+FRAKTAL_MAT(mat2, vec2)
+FRAKTAL_MAT(mat3, vec3)
+FRAKTAL_MAT(mat4, vec4)
+
+inline float determinant(const mat2 &m) { return m.c[0].x*m.c[1].y - m.c[1].x*m.c[0].y; }
+inline float determinant(const mat3 &m) { return dot(m.c[0], cross(m.c[1], m.c[2])); }
+inline mat2 inverse(const mat2 &m)
+{
+    return mat2(m.c[1].y, -m.c[0].y, -m.c[1].x, m.c[0].x)/determinant(m);
+}
+inline mat3 inverse(const mat3 &m)
+{
+    vec3 a = cross(m.c[1], m.c[2]);
+    vec3 b = cross(m.c[2], m.c[0]);
+    vec3 c = cross(m.c[0], m.c[1]);
+    return transpose(mat3(a, b, c))/dot(m.c[0], a);
+}
+inline float determinant(const mat4 &m)
+{
+    float d = 0.0f;
+    for (int i = 0; i < 4; i++)
+    {
+        mat3 minor;
+        for (int c = 1; c < 4; c++)
+        for (int r = 0, k = 0; r < 4; r++)
+            if (r != i) minor.c[c - 1][k++] = m.c[c][r];
+        d += ((i & 1) ? -1.0f : 1.0f)*m.c[0][i]*determinant(minor);
+    }
+    return d;
+}
+inline mat4 inverse(const mat4 &m)
+{
+    mat4 r;
+    for (int i = 0; i < 4; i++)
+    for (int j = 0; j < 4; j++)
+    {
+        // cofactor of element (row i, column j), stored transposed
+        mat3 minor;
+        for (int c = 0, mc = 0; c < 4; c++)
+        {
+            if (c == j) continue;
+            for (int row = 0, k = 0; row < 4; row++)
+                if (row != i) minor.c[mc][k++] = m.c[c][row];
+            mc++;
+        }
+        r.c[i][j] = (((i + j) & 1) ? -1.0f : 1.0f)*determinant(minor);
+    }
+    return r/determinant(m);
+}
+
+//
+// Samplers (arrays are sampled with nearest filtering and clamped coordinates)
+//
+
+struct fsampler
+{
+    const void *data; // 4-byte values (float, or int32 for integer formats); NULL if unbound
+    int width;
+    int height;
+    int depth; // 0 unless the array is a 3D array
+    int channels;
+};
+struct sampler1D : fsampler {};
+struct sampler2D : fsampler {};
+struct sampler3D : fsampler {};
+struct isampler1D : fsampler {};
+struct isampler2D : fsampler {};
+struct isampler3D : fsampler {};
+struct usampler1D : fsampler {};
+struct usampler2D : fsampler {};
+struct usampler3D : fsampler {};
+
+template <class T>
+inline fvec<T,4> ffetch(const fsampler &s, int x, int y, int z)
+{
+    fvec<T,4> r((T)0, (T)0, (T)0, (T)1);
+    int depth = s.depth > 0 ? s.depth : 1;
+    if (!s.data || x < 0 || y < 0 || z < 0 || x >= s.width || y >= s.height || z >= depth)
+        return r;
+    const T *p = (const T*)s.data + (((size_t)z*s.height + y)*s.width + x)*s.channels;
+    for (int c = 0; c < s.channels; c++)
+        r[c] = p[c];
+    return r;
+}
+
+inline int fnearest(float u, int n)
+{
+    float x = std::floor(u*n);
+    return x < 0.0f ? 0 : x >= (float)n ? n - 1 : (int)x;
+}
+
+#define FRAKTAL_SAMPLERS(P, T, V) \
+    inline V texture(const P##sampler1D &s, float u) { return ffetch<T>(s, fnearest(u, s.width), 0, 0); } \
+    inline V texture(const P##sampler2D &s, const vec2 &u) { return ffetch<T>(s, fnearest(u.x, s.width), fnearest(u.y, s.height), 0); } \
+    inline V texture(const P##sampler3D &s, const vec3 &u) { return ffetch<T>(s, fnearest(u.x, s.width), fnearest(u.y, s.height), fnearest(u.z, s.depth)); } \
+    inline V textureLod(const P##sampler1D &s, float u, float) { return texture(s, u); } \
+    inline V textureLod(const P##sampler2D &s, const vec2 &u, float) { return texture(s, u); } \
+    inline V textureLod(const P##sampler3D &s, const vec3 &u, float) { return texture(s, u); } \
+    inline V texelFetch(const P##sampler1D &s, int x, int) { return ffetch<T>(s, x, 0, 0); } \
+    inline V texelFetch(const P##sampler2D &s, const ivec2 &x, int) { return ffetch<T>(s, x.x, x.y, 0); } \
+    inline V texelFetch(const P##sampler3D &s, const ivec3 &x, int) { return ffetch<T>(s, x.x, x.y, x.z); } \
+    inline int textureSize(const P##sampler1D &s, int) { return s.width; } \
+    inline ivec2 textureSize(const P##sampler2D &s, int) { return ivec2(s.width, s.height); } \
+    inline ivec3 textureSize(const P##sampler3D &s, int) { return ivec3(s.width, s.height, s.depth); }
+
+FRAKTAL_SAMPLERS(, float, vec4)
+FRAKTAL_SAMPLERS(i, int, ivec4)
+FRAKTAL_SAMPLERS(u, uint, uvec4)
+
+//
+// Built-in variables (defined by the generated kernel module)
+//
+
+struct frun
+{
+    int points_width;
+    fsampler points;
+    fsampler batch_table;
+};
+extern frun fraktal_run;
+extern thread_local vec4 gl_FragCoord;
+extern thread_local int fraktal_slice;
+extern thread_local int fraktal_batch;
+extern thread_local vec2 fraktal_batch_origin;
+struct fdiscard {};
+
+#define fraktal_slice_index() fraktal_slice
+#define fraktal_points_width (fraktal_run.points_width)
+#define fraktal_point_index() (int(gl_FragCoord.y)*fraktal_run.points_width + int(gl_FragCoord.x))
+#define fraktal_point() ffetch<float>(fraktal_run.points, int(gl_FragCoord.x), int(gl_FragCoord.y), 0)
+#define fraktal_batch_index() fraktal_batch
+#define fraktal_batch_coord() (vec2(gl_FragCoord.x, gl_FragCoord.y) - fraktal_batch_origin)
+#define fraktal_batch_param(i) ffetch<float>(fraktal_run.batch_table, (i), fraktal_batch, 0)
+
+// Outputs are stored as four 4-byte values, padded like texture fetches
+template <class T, int N>
+inline void foutput(uint32_t *d, const fvec<T,N> &v)
+{
+    fvec<T,4> r((T)0, (T)0, (T)0, (T)1);
+    for (int k = 0; k < N; k++)
+        r[k] = v[k];
+    memcpy(d, &r, sizeof(r));
+}
+inline void foutput(uint32_t *d, float v) { foutput(d, vec2(v, 0.0f)); }
+inline void foutput(uint32_t *d, int v) { foutput(d, ivec2(v, 0)); }
+inline void foutput(uint32_t *d, uint v) { foutput(d, uvec2(v, 0u)); }
+
+}
+)GLSL";
@@ -3,14 +3,159 @@
 #include <string.h>
 #include "reuse/log.h"
 
+struct fPendingLink;
 struct fKernel
 {
     GLuint program;
     int loc_iPosition;
     fParams params;
+    fPendingLink *pending; // non-NULL until an asynchronous link has finished
+    fContext *context;
+
+    // CPU copy of all parameters except samplers, in std140 layout. Bytes
+    // in [dirty_begin, dirty_end) have changed since the last upload.
+    unsigned char *param_data;
+    int param_data_size;
+    int dirty_begin;
+    int dirty_end;
+    GLuint param_buffer; // 0 if parameters are plain uniforms (see link_param_declarations)
+
+    // built-in uniforms used by fraktal_run_kernel_slices, _batch and
+    // fraktal_eval_points
+    int loc_slice;
+    int loc_batch_tiles;
+    int loc_batch_viewport;
+    int loc_batch_single;
+    int loc_points_width;
+
+    fKernelStats stats; // see fraktal_enable_kernel_stats
+    double tile_cost; // GPU milliseconds per pixel of recent tiles, 0 until measured (see fraktal_set_tile_budget)
 };
 
-static fKernel *fraktal_current_kernel = NULL;
+static const char *fraktal_param_block_name = "FraktalParams";
+
+static int fraktal_param_data_size(fParams *p)
+{
+    int size = 0;
+    for (int i = 0; i < p->count; i++)
+        if (p->std140_offset[i] + p->std140_size[i] > size)
+            size = p->std140_offset[i] + p->std140_size[i];
+    return ((size + 15)/16)*16;
+}
+
+static fKernel *fraktal_get_current_kernel()
+{
+    return fraktal_current_context ? fraktal_current_context->current_kernel : NULL;
+}
+
+// Takes ownership of 'program' (a successfully linked program object)
+// and copies parameter information from 'params'.
+static void fraktal_init_kernel(fKernel *kernel, GLuint program, fParams *params)
+{
+    fraktal_assert(kernel);
+    fraktal_assert(program);
+    fraktal_assert(params);
+    kernel->program = program;
+    kernel->pending = NULL;
+    kernel->context = fraktal_current_context;
+    kernel->params.count = params->count;
+    kernel->params.sampler_count = params->sampler_count;
+    kernel->loc_iPosition = 0;
+    for (int i = 0; i < params->count; i++)
+    {
+        strcpy(kernel->params.name[i], params->name[i]);
+        kernel->params.type[i] = params->type[i];
+        kernel->params.mean[i] = params->mean[i];
+        kernel->params.scale[i] = params->scale[i];
+        kernel->params.location[i] = glGetUniformLocation(program, params->name[i]);
+        kernel->params.assigned_tex_unit[i] = params->assigned_tex_unit[i];
+        kernel->params.std140_offset[i] = params->std140_offset[i];
+        kernel->params.std140_size[i] = params->std140_size[i];
+        if (fraktal_is_sampler_param(params->type[i]))
+            kernel->params.offset[i] = kernel->params.location[i];
+        else
+            kernel->params.offset[i] = params->std140_offset[i];
+    }
+
+    kernel->param_data_size = fraktal_param_data_size(&kernel->params);
+    kernel->param_data = NULL;
+    if (kernel->param_data_size > 0)
+    {
+        kernel->param_data = (unsigned char*)calloc(kernel->param_data_size, 1);
+        fraktal_assert(kernel->param_data && "Ran out of memory");
+    }
+    kernel->dirty_begin = 0;
+    kernel->dirty_end = 0;
+    kernel->param_buffer = 0;
+    memset(&kernel->stats, 0, sizeof(kernel->stats));
+    kernel->tile_cost = 0.0;
+
+    // The batch parameter table and the points get the texture units
+    // following those assigned to the kernel's own samplers.
+    kernel->loc_slice = glGetUniformLocation(program, "fraktal_slice");
+    kernel->loc_batch_tiles = glGetUniformLocation(program, "fraktal_batch_tiles");
+    kernel->loc_batch_viewport = glGetUniformLocation(program, "fraktal_batch_viewport");
+    kernel->loc_batch_single = glGetUniformLocation(program, "fraktal_batch_single");
+    kernel->loc_points_width = glGetUniformLocation(program, "fraktal_points_width");
+    {
+        GLint last_program;
+        glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "fraktal_batch_table"), params->sampler_count);
+        glUniform1i(glGetUniformLocation(program, "fraktal_batch_row"), params->sampler_count + 1);
+        glUniform1i(glGetUniformLocation(program, "fraktal_points"), params->sampler_count + 2);
+
+        // Samplers that are never set would otherwise all read unit 0,
+        // which is an error if they have different types.
+        for (int i = 0; i < params->count; i++)
+            if (fraktal_is_sampler_param(params->type[i]))
+                glUniform1i(kernel->params.location[i], params->assigned_tex_unit[i]);
+        glUseProgram(last_program);
+    }
+
+    GLuint block = glGetUniformBlockIndex(program, fraktal_param_block_name);
+    if (block != GL_INVALID_INDEX)
+    {
+        // std140 fixes the member offsets, but drivers may pad the block
+        GLint block_size = 0;
+        glGetActiveUniformBlockiv(program, block, GL_UNIFORM_BLOCK_DATA_SIZE, &block_size);
+        if (block_size < kernel->param_data_size)
+            block_size = kernel->param_data_size;
+        glUniformBlockBinding(program, block, 0);
+        glGenBuffers(1, &kernel->param_buffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, kernel->param_buffer);
+        glBufferData(GL_UNIFORM_BUFFER, block_size, NULL, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, kernel->param_data_size, kernel->param_data);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+    // print kernel information
+    #if 0
+    {
+        for (int i = 0; i < kernel->params.count; i++)
+        {
+            printf("%s: ", kernel->params.name[i]);
+            printf("%d: ", kernel->params.offset[i]);
+            printf("%d: ", kernel->params.type[i]);
+            printf("%f: ", kernel->params.mean[i].x);
+            printf("%f: ", kernel->params.scale[i].x);
+            printf("%d: ", kernel->params.assigned_tex_unit[i]);
+            printf("%d: ", kernel->params.std140_offset[i]);
+            printf("%d: ", kernel->params.std140_size[i]);
+            printf("\n");
+        }
+        printf("num_params: %d\n", kernel->params.count);
+        printf("num_samplers: %d\n", kernel->params.sampler_count);
+    }
+    #endif
+}
+
+static fKernel *fraktal_create_kernel(GLuint program, fParams *params)
+{
+    fKernel *kernel = (fKernel*)malloc(sizeof(fKernel));
+    fraktal_assert(kernel && "Ran out of memory");
+    fraktal_init_kernel(kernel, program, params);
+    return kernel;
+}
 
 int fraktal_get_param_offset(fKernel *f, const char *name)
 {
@@ -28,48 +173,33 @@ void fraktal_use_kernel(fKernel *f)
 {
     fraktal_ensure_context();
     fraktal_check_gl_error();
-    static GLint last_program;
-    static GLint last_array_buffer;
-    static GLint last_vertex_array;
-    static GLint last_viewport[4];
-    static GLint last_scissor_box[4];
-    static GLint last_framebuffer;
-    static GLenum last_blend_src_rgb;
-    static GLenum last_blend_dst_rgb;
-    static GLenum last_blend_src_alpha;
-    static GLenum last_blend_dst_alpha;
-    static GLenum last_blend_equation_rgb;
-    static GLenum last_blend_equation_alpha;
-    static GLboolean last_depth_writemask;
-    static GLenum last_enable_blend;
-    static GLenum last_enable_cull_face;
-    static GLenum last_enable_depth_test;
-    static GLenum last_enable_scissor_test;
-    static GLenum last_enable_color_logic_op;
-    static GLuint vao = 0;
-
-    static GLuint quad = 0;
-    if (!quad)
+    fContext *c = fraktal_current_context;
+    fSavedGLState &s = c->saved;
+
+    if (!c->quad)
     {
         static const float data[] = { -1,-1, +1,-1, +1,+1, +1,+1, -1,+1, -1,-1 };
-        glGenBuffers(1, &quad);
-        glBindBuffer(GL_ARRAY_BUFFER, quad);
+        glGenBuffers(1, &c->quad);
+        glBindBuffer(GL_ARRAY_BUFFER, c->quad);
         glBufferData(GL_ARRAY_BUFFER, sizeof(data), data, GL_STATIC_DRAW);
         glBindBuffer(GL_ARRAY_BUFFER, 0);
     }
-    fraktal_assert(quad && "Failed to create vertex buffer");
+    fraktal_assert(c->quad && "Failed to create vertex buffer");
 
     if (f)
     {
+        fraktal_assert(!f->pending && "f must be ready (see fraktal_kernel_ready)");
+        fraktal_assert(f->context == c && "f was created in a different context");
         fraktal_assert(glIsProgram(f->program) && "f must be a valid kernel object");
     }
 
-    if (fraktal_current_kernel)
+    if (c->current_kernel)
     {
         if (f)
         {
-            fraktal_current_kernel = f;
+            c->current_kernel = f;
             glUseProgram(f->program);
+            glBindBufferBase(GL_UNIFORM_BUFFER, 0, f->param_buffer);
             if (!f->loc_iPosition)
                 f->loc_iPosition = glGetAttribLocation(f->program, "iPosition");
             fraktal_assert(f->loc_iPosition >= 0);
@@ -78,24 +208,25 @@ void fraktal_use_kernel(fKernel *f)
         }
         else
         {
-            glDisableVertexAttribArray(fraktal_current_kernel->loc_iPosition);
-            glDeleteVertexArrays(1, &vao);
-            fraktal_current_kernel = NULL;
+            glDisableVertexAttribArray(c->current_kernel->loc_iPosition);
+            glDeleteVertexArrays(1, &c->vao);
+            c->current_kernel = NULL;
 
             // Restore GL state
-            glUseProgram(last_program);
-            glBindVertexArray(last_vertex_array);
-            glBindBuffer(GL_ARRAY_BUFFER, last_array_buffer);
-            glBlendEquationSeparate(last_blend_equation_rgb, last_blend_equation_alpha);
-            glBlendFuncSeparate(last_blend_src_rgb, last_blend_dst_rgb, last_blend_src_alpha, last_blend_dst_alpha);
-            glBindFramebuffer(GL_FRAMEBUFFER, last_framebuffer);
-            if (last_enable_blend) glEnable(GL_BLEND); else glDisable(GL_BLEND);
-            if (last_enable_cull_face) glEnable(GL_CULL_FACE); else glDisable(GL_CULL_FACE);
-            if (last_enable_depth_test) glEnable(GL_DEPTH_TEST); else glDisable(GL_DEPTH_TEST);
-            if (last_enable_scissor_test) glEnable(GL_SCISSOR_TEST); else glDisable(GL_SCISSOR_TEST);
-            if (last_enable_color_logic_op) glEnable(GL_COLOR_LOGIC_OP); else glDisable(GL_COLOR_LOGIC_OP);
-            glViewport(last_viewport[0], last_viewport[1], (GLsizei)last_viewport[2], (GLsizei)last_viewport[3]);
-            glScissor(last_scissor_box[0], last_scissor_box[1], (GLsizei)last_scissor_box[2], (GLsizei)last_scissor_box[3]);
+            glUseProgram(s.last_program);
+            glBindVertexArray(s.last_vertex_array);
+            glBindBuffer(GL_ARRAY_BUFFER, s.last_array_buffer);
+            glBindBufferBase(GL_UNIFORM_BUFFER, 0, s.last_uniform_buffer);
+            glBlendEquationSeparate(s.last_blend_equation_rgb, s.last_blend_equation_alpha);
+            glBlendFuncSeparate(s.last_blend_src_rgb, s.last_blend_dst_rgb, s.last_blend_src_alpha, s.last_blend_dst_alpha);
+            glBindFramebuffer(GL_FRAMEBUFFER, s.last_framebuffer);
+            if (s.last_enable_blend) glEnable(GL_BLEND); else glDisable(GL_BLEND);
+            if (s.last_enable_cull_face) glEnable(GL_CULL_FACE); else glDisable(GL_CULL_FACE);
+            if (s.last_enable_depth_test) glEnable(GL_DEPTH_TEST); else glDisable(GL_DEPTH_TEST);
+            if (s.last_enable_scissor_test) glEnable(GL_SCISSOR_TEST); else glDisable(GL_SCISSOR_TEST);
+            if (s.last_enable_color_logic_op) glEnable(GL_COLOR_LOGIC_OP); else glDisable(GL_COLOR_LOGIC_OP);
+            glViewport(s.last_viewport[0], s.last_viewport[1], (GLsizei)s.last_viewport[2], (GLsizei)s.last_viewport[3]);
+            glScissor(s.last_scissor_box[0], s.last_scissor_box[1], (GLsizei)s.last_scissor_box[2], (GLsizei)s.last_scissor_box[3]);
             glActiveTexture(GL_TEXTURE0);
         }
     }
@@ -104,26 +235,27 @@ void fraktal_use_kernel(fKernel *f)
         if (f)
         {
             // Back-up GL state
-            glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
-            glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &last_array_buffer);
-            glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &last_vertex_array);
-            glGetIntegerv(GL_VIEWPORT, last_viewport);
-            glGetIntegerv(GL_SCISSOR_BOX, last_scissor_box);
-            glGetIntegerv(GL_FRAMEBUFFER_BINDING, &last_framebuffer);
-            glGetIntegerv(GL_BLEND_SRC_RGB, (GLint*)&last_blend_src_rgb);
-            glGetIntegerv(GL_BLEND_DST_RGB, (GLint*)&last_blend_dst_rgb);
-            glGetIntegerv(GL_BLEND_SRC_ALPHA, (GLint*)&last_blend_src_alpha);
-            glGetIntegerv(GL_BLEND_DST_ALPHA, (GLint*)&last_blend_dst_alpha);
-            glGetIntegerv(GL_BLEND_EQUATION_RGB, (GLint*)&last_blend_equation_rgb);
-            glGetIntegerv(GL_BLEND_EQUATION_ALPHA, (GLint*)&last_blend_equation_alpha);
-            glGetBooleanv(GL_DEPTH_WRITEMASK, (GLboolean*)&last_depth_writemask);
-            last_enable_blend = glIsEnabled(GL_BLEND);
-            last_enable_cull_face = glIsEnabled(GL_CULL_FACE);
-            last_enable_depth_test = glIsEnabled(GL_DEPTH_TEST);
-            last_enable_scissor_test = glIsEnabled(GL_SCISSOR_TEST);
-            last_enable_color_logic_op = glIsEnabled(GL_COLOR_LOGIC_OP);
-
-            fraktal_current_kernel = f;
+            glGetIntegerv(GL_CURRENT_PROGRAM, &s.last_program);
+            glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &s.last_array_buffer);
+            glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &s.last_vertex_array);
+            glGetIntegeri_v(GL_UNIFORM_BUFFER_BINDING, 0, &s.last_uniform_buffer);
+            glGetIntegerv(GL_VIEWPORT, s.last_viewport);
+            glGetIntegerv(GL_SCISSOR_BOX, s.last_scissor_box);
+            glGetIntegerv(GL_FRAMEBUFFER_BINDING, &s.last_framebuffer);
+            glGetIntegerv(GL_BLEND_SRC_RGB, (GLint*)&s.last_blend_src_rgb);
+            glGetIntegerv(GL_BLEND_DST_RGB, (GLint*)&s.last_blend_dst_rgb);
+            glGetIntegerv(GL_BLEND_SRC_ALPHA, (GLint*)&s.last_blend_src_alpha);
+            glGetIntegerv(GL_BLEND_DST_ALPHA, (GLint*)&s.last_blend_dst_alpha);
+            glGetIntegerv(GL_BLEND_EQUATION_RGB, (GLint*)&s.last_blend_equation_rgb);
+            glGetIntegerv(GL_BLEND_EQUATION_ALPHA, (GLint*)&s.last_blend_equation_alpha);
+            glGetBooleanv(GL_DEPTH_WRITEMASK, (GLboolean*)&s.last_depth_writemask);
+            s.last_enable_blend = glIsEnabled(GL_BLEND);
+            s.last_enable_cull_face = glIsEnabled(GL_CULL_FACE);
+            s.last_enable_depth_test = glIsEnabled(GL_DEPTH_TEST);
+            s.last_enable_scissor_test = glIsEnabled(GL_SCISSOR_TEST);
+            s.last_enable_color_logic_op = glIsEnabled(GL_COLOR_LOGIC_OP);
+
+            c->current_kernel = f;
             glDisable(GL_CULL_FACE);
             glDisable(GL_DEPTH_TEST);
             glDisable(GL_SCISSOR_TEST);
@@ -131,11 +263,12 @@ void fraktal_use_kernel(fKernel *f)
             glEnable(GL_BLEND);
             glBlendFunc(GL_ONE, GL_ONE);
             glBlendEquation(GL_FUNC_ADD);
-            glGenVertexArrays(1, &vao);
-            glBindVertexArray(vao);
-            glBindBuffer(GL_ARRAY_BUFFER, quad);
+            glGenVertexArrays(1, &c->vao);
+            glBindVertexArray(c->vao);
+            glBindBuffer(GL_ARRAY_BUFFER, c->quad);
 
             glUseProgram(f->program);
+            glBindBufferBase(GL_UNIFORM_BUFFER, 0, f->param_buffer);
             if (!f->loc_iPosition)
                 f->loc_iPosition = glGetAttribLocation(f->program, "iPosition");
             fraktal_assert(f->loc_iPosition >= 0);
@@ -150,57 +283,409 @@ void fraktal_use_kernel(fKernel *f)
     fraktal_check_gl_error();
 }
 
-void fraktal_param_1f(int offset, float x)                            { fraktal_assert(fraktal_current_kernel); if (offset < 0) return; glUniform1f(offset, x); }
-void fraktal_param_2f(int offset, float x, float y)                   { fraktal_assert(fraktal_current_kernel); if (offset < 0) return; glUniform2f(offset, x, y); }
-void fraktal_param_3f(int offset, float x, float y, float z)          { fraktal_assert(fraktal_current_kernel); if (offset < 0) return; glUniform3f(offset, x, y, z); }
-void fraktal_param_4f(int offset, float x, float y, float z, float w) { fraktal_assert(fraktal_current_kernel); if (offset < 0) return; glUniform4f(offset, x, y, z, w); }
-void fraktal_param_1i(int offset, int x)                              { fraktal_assert(fraktal_current_kernel); if (offset < 0) return; glUniform1i(offset, x); }
-void fraktal_param_2i(int offset, int x, int y)                       { fraktal_assert(fraktal_current_kernel); if (offset < 0) return; glUniform2i(offset, x, y); }
-void fraktal_param_3i(int offset, int x, int y, int z)                { fraktal_assert(fraktal_current_kernel); if (offset < 0) return; glUniform3i(offset, x, y, z); }
-void fraktal_param_4i(int offset, int x, int y, int z, int w)         { fraktal_assert(fraktal_current_kernel); if (offset < 0) return; glUniform4i(offset, x, y, z, w); }
-void fraktal_param_matrix4f(int offset, float m[4*4])                 { fraktal_assert(fraktal_current_kernel); if (offset < 0) return; glUniformMatrix4fv(offset, 1, false, m); }
-void fraktal_param_transpose_matrix4f(int offset, float m[4*4])       { fraktal_assert(fraktal_current_kernel); if (offset < 0) return; glUniformMatrix4fv(offset, 1, true, m); }
+// Parameter values are staged in the kernel's CPU copy of the parameter
+// block, and uploaded by fraktal_run_kernel. Writes that do not change the
+// value do not grow the dirty range.
+static void fraktal_param_data(int offset, const void *data, int size)
+{
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_assert(f && "Call fraktal_use_kernel first.");
+    if (offset < 0)
+        return;
+    fraktal_assert(offset + size <= f->param_data_size && "Parameter offset is out of bounds.");
+    unsigned char *dst = f->param_data + offset;
+    if (memcmp(dst, data, size) == 0)
+        return;
+    memcpy(dst, data, size);
+    if (f->dirty_begin == f->dirty_end)
+    {
+        f->dirty_begin = offset;
+        f->dirty_end = offset + size;
+    }
+    else
+    {
+        if (offset < f->dirty_begin) f->dirty_begin = offset;
+        if (offset + size > f->dirty_end) f->dirty_end = offset + size;
+    }
+}
+
+void fraktal_param_1f(int offset, float x)                            { float v[] = { x };          fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_2f(int offset, float x, float y)                   { float v[] = { x, y };       fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_3f(int offset, float x, float y, float z)          { float v[] = { x, y, z };    fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_4f(int offset, float x, float y, float z, float w) { float v[] = { x, y, z, w }; fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_1i(int offset, int x)                              { int v[] = { x };            fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_2i(int offset, int x, int y)                       { int v[] = { x, y };         fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_3i(int offset, int x, int y, int z)                { int v[] = { x, y, z };      fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_4i(int offset, int x, int y, int z, int w)         { int v[] = { x, y, z, w };   fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_matrix4f(int offset, float m[4*4])                 { fraktal_param_data(offset, m, 4*4*sizeof(float)); }
+void fraktal_param_transpose_matrix4f(int offset, float m[4*4])
+{
+    float t[4*4];
+    for (int row = 0; row < 4; row++)
+    for (int col = 0; col < 4; col++)
+        t[col*4 + row] = m[row*4 + col];
+    fraktal_param_data(offset, t, sizeof(t));
+}
 
 void fraktal_param_array(int offset, fArray *a)
 {
     fraktal_assert(a);
     fraktal_assert(a->color0);
     fraktal_assert(a->width > 0 && a->height > 0 && "Array has invalid dimensions.");
-    fraktal_assert(fraktal_current_kernel);
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_assert(f);
+    fraktal_assert(a->context == f->context && "Array was created in a different context");
     if (offset < 0)
         return;
     int tex_unit = -1;
     {
-        fParams *p = &fraktal_current_kernel->params;
+        fParams *p = &f->params;
         for (int i = 0; i < p->count; i++)
-            if (p->offset[i] == offset)
+            if (fraktal_is_sampler_param(p->type[i]) && p->offset[i] == offset)
                 tex_unit = p->assigned_tex_unit[i];
         fraktal_assert(tex_unit >= 0 && "Array parameter with unassigned texture unit.");
     }
-    glUniform1i(offset, tex_unit);
+    glUniform1i(offset, tex_unit); // samplers are addressed by their uniform location
     glActiveTexture(GL_TEXTURE0 + tex_unit);
-    if (a->height == 1)
-        glBindTexture(GL_TEXTURE_1D, a->color0);
+    glBindTexture(fraktal_array_target(a), a->color0);
+}
+
+// Uploads the dirty range of the parameter block: with one buffer update if
+// the kernel has a uniform block, or else by setting each uniform in range.
+static void fraktal_upload_params(fKernel *f)
+{
+    if (f->dirty_begin == f->dirty_end)
+        return;
+    if (f->param_buffer)
+    {
+        glBindBuffer(GL_UNIFORM_BUFFER, f->param_buffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, f->dirty_begin, f->dirty_end - f->dirty_begin, f->param_data + f->dirty_begin);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
     else
-        glBindTexture(GL_TEXTURE_2D, a->color0);
+    {
+        fParams *p = &f->params;
+        for (int i = 0; i < p->count; i++)
+        {
+            if (fraktal_is_sampler_param(p->type[i]) || p->location[i] < 0)
+                continue;
+            int begin = p->std140_offset[i];
+            int end = begin + p->std140_size[i];
+            if (end <= f->dirty_begin || begin >= f->dirty_end)
+                continue;
+            GLint loc = p->location[i];
+            float *v = (float*)(f->param_data + begin);
+            int *iv = (int*)(f->param_data + begin);
+            switch (p->type[i])
+            {
+                case FRAKTAL_PARAM_FLOAT: glUniform1fv(loc, 1, v); break;
+                case FRAKTAL_PARAM_FLOAT_VEC2: glUniform2fv(loc, 1, v); break;
+                case FRAKTAL_PARAM_FLOAT_VEC3: glUniform3fv(loc, 1, v); break;
+                case FRAKTAL_PARAM_FLOAT_VEC4: glUniform4fv(loc, 1, v); break;
+                case FRAKTAL_PARAM_INT: glUniform1iv(loc, 1, iv); break;
+                case FRAKTAL_PARAM_INT_VEC2: glUniform2iv(loc, 1, iv); break;
+                case FRAKTAL_PARAM_INT_VEC3: glUniform3iv(loc, 1, iv); break;
+                case FRAKTAL_PARAM_INT_VEC4: glUniform4iv(loc, 1, iv); break;
+                case FRAKTAL_PARAM_FLOAT_MAT4: glUniformMatrix4fv(loc, 1, false, v); break;
+                case FRAKTAL_PARAM_FLOAT_MAT2:
+                {
+                    // std140 pads each column to a vec4
+                    float m[2*2] = { v[0], v[1], v[4], v[5] };
+                    glUniformMatrix2fv(loc, 1, false, m);
+                } break;
+                case FRAKTAL_PARAM_FLOAT_MAT3:
+                {
+                    float m[3*3] = { v[0], v[1], v[2], v[4], v[5], v[6], v[8], v[9], v[10] };
+                    glUniformMatrix3fv(loc, 1, false, m);
+                } break;
+                default: break;
+            }
+        }
+    }
+    f->dirty_begin = 0;
+    f->dirty_end = 0;
+}
+
+enum { FRAKTAL_FIRST_TILE_SIZE = 64 }; // side of the first tile of a kernel
+
+// Draws the quad over the viewport in tiles that are cut out of the given
+// rectangle with the scissor test, and sent to the GPU one at a time. The
+// rectangle is covered in rows of tiles from the bottom, and each row and
+// tile is sized to take tile_budget_ms by the kernel's latest tile cost.
+// Until the cost has been measured, the first tile of a run is waited for
+// to measure it.
+static void fraktal_draw_tiles(fKernel *f, int x0, int y0, int x1, int y1)
+{
+    fTimerQueries &t = fraktal_timer_queries();
+    double budget = (double)fraktal_current_context->tile_budget_ms;
+    bool first = true;
+    glEnable(GL_SCISSOR_TEST);
+    for (int y = y0; y < y1; )
+    {
+        double pixels = FRAKTAL_FIRST_TILE_SIZE*FRAKTAL_FIRST_TILE_SIZE;
+        if (f->tile_cost > 0.0)
+            pixels = budget/f->tile_cost;
+        int rows = (int)fmin(fmax(sqrt(pixels), 1.0), (double)(y1 - y));
+        for (int x = x0; x < x1; )
+        {
+            if (f->tile_cost > 0.0)
+                pixels = budget/f->tile_cost;
+            int columns = (int)fmin(fmax(pixels/rows, 1.0), (double)(x1 - x));
+
+            bool measured = f->tile_cost > 0.0;
+            glScissor(x, y, columns, rows);
+            bool timed = fraktal_begin_timer(&f->stats, (long long)columns*rows, &f->tile_cost);
+            glDrawArrays(GL_TRIANGLES, 0, 6);
+            if (timed)
+                fraktal_end_timer();
+            glFlush();
+            if (timed && !measured && first)
+                fraktal_poll_timer_queries(t, true);
+            first = false;
+            x += columns;
+        }
+        y += rows;
+    }
+    glDisable(GL_SCISSOR_TEST);
 }
 
 void fraktal_run_kernel(fArray *out)
 {
-    fraktal_assert(fraktal_current_kernel && "Call fraktal_use_kernel first.");
+    fraktal_assert(fraktal_get_current_kernel() && "Call fraktal_use_kernel first.");
     fraktal_assert(out);
+    fraktal_assert(out->context == fraktal_current_context && "Array was created in a different context");
     fraktal_assert(out->width > 0);
     fraktal_assert(out->height > 0);
     fraktal_assert(out->fbo && "The output array's access mode cannot be read-only.");
     fraktal_assert(out->color0);
+    if (out->depth > 0)
+    {
+        fraktal_run_kernel_slices(out, 0, out->depth);
+        return;
+    }
+    fraktal_ensure_context();
+    fraktal_check_gl_error();
+
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_upload_params(f);
+    glBindFramebuffer(GL_FRAMEBUFFER, out->fbo);
+    glViewport(0, 0, out->width, out->height);
+    if (fraktal_current_context->tile_budget_ms > 0.0f)
+    {
+        fraktal_draw_tiles(f, 0, 0, out->width, out->height);
+    }
+    else
+    {
+        bool timed = fraktal_begin_timer(&f->stats, (long long)out->width*out->height);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        if (timed)
+            fraktal_end_timer();
+    }
+    fraktal_check_gl_error();
+}
+
+void fraktal_run_kernel_region(fArray *out, int x, int y, int width, int height)
+{
+    fraktal_assert(fraktal_get_current_kernel() && "Call fraktal_use_kernel first.");
+    fraktal_assert(out);
+    fraktal_assert(out->context == fraktal_current_context && "Array was created in a different context");
+    fraktal_assert(out->fbo && "The output array's access mode cannot be read-only.");
+    fraktal_assert(out->color0);
+    fraktal_assert(out->depth == 0 && "3D arrays are not supported.");
+    fraktal_assert(x >= 0 && y >= 0 && width >= 0 && height >= 0);
+    fraktal_assert(x + width <= out->width && y + height <= out->height && "Region is outside the output array.");
+    if (width == 0 || height == 0)
+        return;
+    fraktal_ensure_context();
+    fraktal_check_gl_error();
+
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_upload_params(f);
+    glBindFramebuffer(GL_FRAMEBUFFER, out->fbo);
+    glViewport(0, 0, out->width, out->height);
+    if (fraktal_current_context->tile_budget_ms > 0.0f)
+    {
+        fraktal_draw_tiles(f, x, y, x + width, y + height);
+    }
+    else
+    {
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(x, y, width, height);
+        bool timed = fraktal_begin_timer(&f->stats, (long long)width*height);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        if (timed)
+            fraktal_end_timer();
+        glDisable(GL_SCISSOR_TEST);
+    }
+    fraktal_check_gl_error();
+}
+
+// Each slice is attached to the output framebuffer in turn. Rendering all
+// slices in one draw would need a geometry shader to select the layer,
+// which OpenGL 3.1 does not have.
+void fraktal_run_kernel_slices(fArray *out, int first_slice, int num_slices)
+{
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_assert(f && "Call fraktal_use_kernel first.");
+    fraktal_assert(out);
+    fraktal_assert(out->context == fraktal_current_context && "Array was created in a different context");
+    fraktal_assert(out->depth > 0 && "The output array must be a 3D array.");
+    fraktal_assert(out->fbo && "The output array's access mode cannot be read-only.");
+    fraktal_assert(first_slice >= 0 && num_slices >= 0 && first_slice + num_slices <= out->depth);
     fraktal_ensure_context();
     fraktal_check_gl_error();
 
+    fraktal_upload_params(f);
     glBindFramebuffer(GL_FRAMEBUFFER, out->fbo);
-    if (out->height == 0)
-        glViewport(0, 0, out->width, 1);
+    glViewport(0, 0, out->width, out->height);
+    bool timed = fraktal_begin_timer(&f->stats, (long long)out->width*out->height*num_slices);
+    for (int slice = first_slice; slice < first_slice + num_slices; slice++)
+    {
+        fraktal_attach_array(GL_FRAMEBUFFER, out, slice);
+        glUniform1i(f->loc_slice, slice);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+    }
+    if (timed)
+        fraktal_end_timer();
+    glUniform1i(f->loc_slice, 0);
+    fraktal_check_gl_error();
+}
+
+void fraktal_eval_points(fKernel *kernel, fArray *points, fArray *out)
+{
+    fraktal_assert(kernel);
+    fraktal_assert(out);
+    fraktal_assert(out->context == fraktal_current_context && "Array was created in a different context");
+    fraktal_assert(out->count > 0 && "The output array must be created with fraktal_create_points.");
+    fraktal_assert(out->fbo && "The output array's access mode cannot be read-only.");
+    if (points)
+    {
+        fraktal_assert(points->context == fraktal_current_context && "Array was created in a different context");
+        fraktal_assert(points->count == out->count && "The input and output must have the same number of points.");
+        fraktal_assert(points != out && "The points cannot also be the output.");
+        fraktal_assert(!fraktal_is_integer_format(points->format) && "Points must have a floating-point or normalized format.");
+    }
+    fraktal_ensure_context();
+    fraktal_check_gl_error();
+
+    fKernel *previous = fraktal_get_current_kernel();
+    if (previous != kernel)
+        fraktal_use_kernel(kernel);
+    glActiveTexture(GL_TEXTURE0 + kernel->params.sampler_count + 2);
+    glBindTexture(GL_TEXTURE_2D, points ? points->color0 : 0);
+    glUniform1i(kernel->loc_points_width, out->width);
+    fraktal_run_kernel(out);
+    glUniform1i(kernel->loc_points_width, 0);
+    if (previous != kernel)
+        fraktal_use_kernel(previous);
+    fraktal_check_gl_error();
+}
+
+// The outputs are attached to a framebuffer owned by the context, and
+// detached again afterwards so that it does not keep destroyed arrays alive.
+void fraktal_run_kernel_mrt(fArray **outs, int n)
+{
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_assert(f && "Call fraktal_use_kernel first.");
+    fraktal_assert(outs);
+    fraktal_assert(n >= 1 && n <= FRAKTAL_MAX_OUTPUTS);
+    for (int i = 0; i < n; i++)
+    {
+        fraktal_assert(outs[i]);
+        fraktal_assert(outs[i]->context == fraktal_current_context && "Array was created in a different context");
+        fraktal_assert(outs[i]->fbo && "The output array's access mode cannot be read-only.");
+        fraktal_assert(outs[i]->depth == 0 && "3D arrays are not supported.");
+        fraktal_assert(outs[i]->width == outs[0]->width && outs[i]->height == outs[0]->height && "Output arrays must have the same dimensions.");
+    }
+    fraktal_ensure_context();
+    fraktal_check_gl_error();
+
+    fContext *c = fraktal_current_context;
+    if (!c->mrt_fbo)
+        glGenFramebuffers(1, &c->mrt_fbo);
+    fraktal_upload_params(f);
+    glBindFramebuffer(GL_FRAMEBUFFER, c->mrt_fbo);
+    GLenum draw_buffers[FRAKTAL_MAX_OUTPUTS];
+    for (int i = 0; i < n; i++)
+    {
+        fraktal_attach_array(GL_FRAMEBUFFER, outs[i], 0, GL_COLOR_ATTACHMENT0 + i);
+        draw_buffers[i] = GL_COLOR_ATTACHMENT0 + i;
+    }
+    glDrawBuffers(n, draw_buffers);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        log_err("Output arrays cannot be rendered to together.\n");
     else
-        glViewport(0, 0, out->width, out->height);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+    {
+        glViewport(0, 0, outs[0]->width, outs[0]->height);
+        bool timed = fraktal_begin_timer(&f->stats, (long long)outs[0]->width*outs[0]->height);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        if (timed)
+            fraktal_end_timer();
+    }
+    for (int i = 0; i < n; i++)
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, 0, 0);
+    fraktal_check_gl_error();
+}
+
+void fraktal_run_kernel_batch(fArray *out, fArray *params, int tile_width, int tile_height)
+{
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_assert(f && "Call fraktal_use_kernel first.");
+    fraktal_assert(out);
+    fraktal_assert(out->context == fraktal_current_context && "Array was created in a different context");
+    fraktal_assert(out->fbo && "The output array's access mode cannot be read-only.");
+    fraktal_assert(out->color0);
+    fraktal_assert(params);
+    fraktal_assert(params->context == fraktal_current_context && "Array was created in a different context");
+    fraktal_assert(params->color0);
+    fraktal_assert(params != out && "The parameter array cannot also be the output.");
+    fraktal_assert(out->depth == 0 && params->depth == 0 && "3D arrays are not supported.");
+    fraktal_assert(tile_width > 0 && tile_height > 0);
+    int count = params->height;
+    int columns = out->width / tile_width;
+    fraktal_assert(columns > 0 && "Tiles are wider than the output array.");
+    int rows = (count + columns - 1) / columns;
+    fraktal_assert(rows*tile_height <= out->height && "Output array is too small to hold a tile for each parameter set.");
+    fraktal_ensure_context();
+    fraktal_check_gl_error();
+
+    fraktal_upload_params(f);
+    bool single = params->height == 1;
+    int tex_unit = f->params.sampler_count + (single ? 1 : 0);
+    glActiveTexture(GL_TEXTURE0 + tex_unit);
+    glBindTexture(single ? GL_TEXTURE_1D : GL_TEXTURE_2D, params->color0);
+    glUniform1i(f->loc_batch_single, single ? 1 : 0);
+    glUniform3i(f->loc_batch_tiles, tile_width, tile_height, columns);
+    glUniform2f(f->loc_batch_viewport, (float)out->width, (float)out->height);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, out->fbo);
+    glViewport(0, 0, out->width, out->height);
+    bool timed = fraktal_begin_timer(&f->stats, (long long)tile_width*tile_height*count);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, count);
+    if (timed)
+        fraktal_end_timer();
+
+    // fraktal_run_kernel expects the quad to cover the whole output
+    glUniform3i(f->loc_batch_tiles, 0, 0, 0);
     fraktal_check_gl_error();
 }
+
+void fraktal_get_kernel_stats(fKernel *f, fKernelStats *stats)
+{
+    fraktal_assert(stats);
+    fraktal_ensure_context();
+    fTimerQueries &t = fraktal_timer_queries();
+    if (t.supported)
+        fraktal_poll_timer_queries(t);
+    *stats = f ? f->stats : t.transfers;
+    fraktal_check_gl_error();
+}
+
+void fraktal_reset_kernel_stats(fKernel *f)
+{
+    fraktal_ensure_context();
+    fTimerQueries &t = fraktal_timer_queries();
+    fKernelStats *stats = f ? &f->stats : &t.transfers;
+    fraktal_forget_timer_queries(stats, NULL);
+    memset(stats, 0, sizeof(fKernelStats));
+}
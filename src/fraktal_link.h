@@ -7,12 +7,94 @@ enum { MAX_LINK_STATE_ITEMS = 1024 };
 struct fLinkState
 {
     const char *glsl_version;
-    GLuint shaders[MAX_LINK_STATE_ITEMS];
-    int num_shaders;
+    char *sources[MAX_LINK_STATE_ITEMS];
+    char *names[MAX_LINK_STATE_ITEMS];
+    size_t header_lengths[MAX_LINK_STATE_ITEMS]; // part of 'header' seen by each input
+    bool uses_params[MAX_LINK_STATE_ITEMS]; // whether the input or its header declares parameters
+    int num_sources;
+
+    // declarations of all libraries added so far (see parse_library_interface)
+    char *header;
+    size_t header_length;
+    size_t header_capacity;
+    bool header_uses_params;
+
+    // declarations of all parameters (see link_param_declarations)
+    char *declarations;
+
     fParams params;
+    fOutputs outputs;
 };
 
-static GLuint compile_shader(const char *name, const char **sources, int num_sources, GLenum type)
+#ifndef FRAKTAL_SOFTWARE
+// This is inserted between the GLSL version and the source of each input,
+// followed by the declarations of preceding libraries and a #line directive.
+static const char *fraktal_kernel_prelude =
+    "\nuniform int Dummy;\n"
+    "#define ZERO (min(0, Dummy))\n"
+    // see fraktal_run_kernel_slices
+    "uniform int fraktal_slice;\n"
+    "#define fraktal_slice_index() fraktal_slice\n"
+    // see fraktal_run_kernel_batch
+    "flat in int fraktal_batch;\n"
+    "flat in vec2 fraktal_batch_origin;\n"
+    "uniform sampler2D fraktal_batch_table;\n"
+    "uniform sampler1D fraktal_batch_row;\n"
+    "uniform bool fraktal_batch_single;\n"
+    "#define fraktal_batch_index() fraktal_batch\n"
+    "#define fraktal_batch_coord() (gl_FragCoord.xy - fraktal_batch_origin)\n"
+    "#define fraktal_batch_param(i) (fraktal_batch_single ? "
+        "texelFetch(fraktal_batch_row, (i), 0) : "
+        "texelFetch(fraktal_batch_table, ivec2((i), fraktal_batch), 0))\n"
+    // see fraktal_eval_points
+    "uniform sampler2D fraktal_points;\n"
+    "uniform int fraktal_points_width;\n" // 0 unless run by fraktal_eval_points
+    "#define fraktal_point_index() (int(gl_FragCoord.y)*fraktal_points_width + int(gl_FragCoord.x))\n"
+    "#define fraktal_point() texelFetch(fraktal_points, ivec2(gl_FragCoord.xy), 0)\n"
+    #ifdef FRAKTAL_GUI
+    "#define FRAKTAL_GUI\n"
+    #endif
+    ;
+
+// Batched runs draw one instance of the quad per parameter set, each
+// covering its own tile of the output (see fraktal_run_kernel_batch).
+static const char *fraktal_vertex_shader_source =
+    "in vec2 iPosition;\n"
+    "uniform ivec3 fraktal_batch_tiles;\n" // tile width, height and columns (0 if not batched)
+    "uniform vec2 fraktal_batch_viewport;\n"
+    "flat out int fraktal_batch;\n"
+    "flat out vec2 fraktal_batch_origin;\n"
+    "void main()\n"
+    "{\n"
+    "    fraktal_batch = gl_InstanceID;\n"
+    "    fraktal_batch_origin = vec2(0.0);\n"
+    "    vec2 position = iPosition;\n"
+    "    if (fraktal_batch_tiles.z > 0)\n"
+    "    {\n"
+    "        vec2 tile = vec2(fraktal_batch_tiles.xy);\n"
+    "        fraktal_batch_origin = tile*vec2(gl_InstanceID % fraktal_batch_tiles.z, gl_InstanceID / fraktal_batch_tiles.z);\n"
+    "        position = 2.0*(fraktal_batch_origin + tile*(0.5 + 0.5*iPosition))/fraktal_batch_viewport - 1.0;\n"
+    "    }\n"
+    "    gl_Position = vec4(position, 0.0, 1.0);\n"
+    "}\n";
+
+#endif
+
+static char *copy_string(const char *s)
+{
+    if (!s)
+        return NULL;
+    size_t len = strlen(s);
+    char *copy = (char*)malloc(len + 1);
+    fraktal_assert(copy && "Ran out of memory");
+    memcpy(copy, s, len + 1);
+    return copy;
+}
+
+#ifndef FRAKTAL_SOFTWARE
+// Issues the compile without waiting for its result (see end_compile_shader).
+// 'lengths' may be NULL if all sources are NULL-terminated.
+static GLuint begin_compile_shader(const char *name, const char **sources, const GLint *lengths, int num_sources, GLenum type)
 {
     fraktal_ensure_context();
     fraktal_check_gl_error();
@@ -29,9 +111,18 @@ static GLuint compile_shader(const char *name, const char **sources, int num_sou
         return 0;
     }
 
-    glShaderSource(shader, num_sources, (const GLchar **)sources, 0);
+    glShaderSource(shader, num_sources, (const GLchar **)sources, lengths);
     glCompileShader(shader);
+    fraktal_check_gl_error();
+    return shader;
+}
 
+// Returns false and deletes 'shader' if it failed to compile.
+static bool end_compile_shader(const char *name, GLuint shader)
+{
+    fraktal_check_gl_error();
+    if (!name)
+        name = "unnamed";
     GLint status = 0;
     glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
     if (!status)
@@ -42,12 +133,147 @@ static GLuint compile_shader(const char *name, const char **sources, int num_sou
         log_err("Failed to compile shader (%s):\n%s", name, info);
         free(info);
         glDeleteShader(shader);
-        return 0;
+        return false;
     }
     fraktal_check_gl_error();
+    return true;
+}
+
+static GLuint compile_shader(const char *name, const char **sources, const GLint *lengths, int num_sources, GLenum type)
+{
+    GLuint shader = begin_compile_shader(name, sources, lengths, num_sources, type);
+    if (!shader || !end_compile_shader(name, shader))
+        return 0;
     return shader;
 }
 
+/*
+Compiled shader objects are kept in a per-context cache keyed by a hash of
+their complete source, so that inputs shared by several links (libraries,
+renderers) are only compiled once. Pending links attach the shaders they
+use to their program right away, so evicting the least recently used entry
+is always safe: GL defers deleting a shader until it is detached.
+*/
+enum { FRAKTAL_MAX_CACHED_SHADERS = 64 };
+struct fShaderCache
+{
+    uint64_t hash[FRAKTAL_MAX_CACHED_SHADERS];
+    GLuint shader[FRAKTAL_MAX_CACHED_SHADERS];
+    unsigned int last_used[FRAKTAL_MAX_CACHED_SHADERS];
+    unsigned int clock;
+    int count;
+};
+
+static fShaderCache &fraktal_shader_cache()
+{
+    fraktal_assert(fraktal_current_context);
+    fContext *c = fraktal_current_context;
+    if (!c->shader_cache)
+    {
+        c->shader_cache = (fShaderCache*)calloc(1, sizeof(fShaderCache));
+        fraktal_assert(c->shader_cache && "Ran out of memory");
+    }
+    return *c->shader_cache;
+}
+
+static void fraktal_free_shader_cache(fShaderCache *cache, bool delete_gpu_objects)
+{
+    if (!cache)
+        return;
+    if (delete_gpu_objects)
+        for (int i = 0; i < cache->count; i++)
+            glDeleteShader(cache->shader[i]);
+    free(cache);
+}
+
+static uint64_t shader_hash(const char **sources, const GLint *lengths, int num_sources, GLenum type)
+{
+    uint64_t hash = fraktal_hash(fraktal_hash_seed, &type, sizeof(type));
+    for (int i = 0; i < num_sources; i++)
+    {
+        size_t length = (lengths && lengths[i] >= 0) ? (size_t)lengths[i] : strlen(sources[i]);
+        hash = fraktal_hash(hash, sources[i], length);
+        hash = fraktal_hash(hash, "", 1);
+    }
+    return hash;
+}
+
+// Returns 0 if no shader with the given hash is cached.
+static GLuint find_cached_shader(uint64_t hash)
+{
+    fShaderCache &cache = fraktal_shader_cache();
+    cache.clock++;
+    for (int i = 0; i < cache.count; i++)
+    {
+        if (cache.hash[i] == hash)
+        {
+            cache.last_used[i] = cache.clock;
+            return cache.shader[i];
+        }
+    }
+    return 0;
+}
+
+// The cache takes ownership of 'shader', which must have compiled successfully.
+static void insert_cached_shader(uint64_t hash, GLuint shader)
+{
+    fShaderCache &cache = fraktal_shader_cache();
+    cache.clock++;
+    int slot = cache.count;
+    if (cache.count == FRAKTAL_MAX_CACHED_SHADERS)
+    {
+        slot = 0;
+        for (int i = 1; i < cache.count; i++)
+            if (cache.last_used[i] < cache.last_used[slot])
+                slot = i;
+        glDeleteShader(cache.shader[slot]);
+    }
+    else
+    {
+        cache.count++;
+    }
+    cache.hash[slot] = hash;
+    cache.shader[slot] = shader;
+    cache.last_used[slot] = cache.clock;
+}
+
+// GL_KHR_parallel_shader_compile (also exposed as GL_ARB_parallel_shader_compile)
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+typedef void (*fMaxShaderCompilerThreadsKHR)(GLuint count);
+
+// Returns true if the driver compiles and links in the background, in which
+// case compile and link status queries should be preceded by a query of
+// GL_COMPLETION_STATUS_KHR to avoid blocking.
+static bool fraktal_parallel_compile_supported()
+{
+    fraktal_ensure_context();
+    int &supported = fraktal_current_context->parallel_compile;
+    if (supported >= 0)
+        return supported == 1;
+    supported = 0;
+    GLint num_extensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+    for (GLint i = 0; i < num_extensions; i++)
+    {
+        const char *name = (const char*)glGetStringi(GL_EXTENSIONS, (GLuint)i);
+        if (name && (strcmp(name, "GL_KHR_parallel_shader_compile") == 0 ||
+                     strcmp(name, "GL_ARB_parallel_shader_compile") == 0))
+            supported = 1;
+    }
+    if (supported)
+    {
+        fMaxShaderCompilerThreadsKHR max_threads = (fMaxShaderCompilerThreadsKHR)gl3wGetProcAddress("glMaxShaderCompilerThreadsKHR");
+        if (!max_threads)
+            max_threads = (fMaxShaderCompilerThreadsKHR)gl3wGetProcAddress("glMaxShaderCompilerThreadsARB");
+        if (max_threads)
+            max_threads(0xFFFFFFFF); // let the driver decide
+    }
+    fraktal_check_gl_error();
+    return supported == 1;
+}
+
 static bool program_link_status(GLuint program)
 {
     fraktal_ensure_context();
@@ -67,46 +293,152 @@ static bool program_link_status(GLuint program)
     return true;
 }
 
-static bool add_link_data(fLinkState *link, char *data, const char *name)
+#endif
+
+// Compilation is deferred until fraktal_link_kernel, so that it can be
+// skipped entirely if the linked program is found in the kernel cache.
+static bool add_link_data(fLinkState *link, char *data, const char *name, bool is_library=false)
 {
     fraktal_assert(link);
-    fraktal_assert(link->num_shaders < MAX_LINK_STATE_ITEMS);
+    fraktal_assert(link->num_sources < MAX_LINK_STATE_ITEMS);
     fraktal_assert(link->glsl_version);
     fraktal_assert(data && "'data' must be a non-NULL pointer to a buffer containing kernel source text.");
-    fraktal_ensure_context();
-    fraktal_check_gl_error();
-    if (!parse_fraktal_source(data, &link->params, name))
+    int num_declarations = 0;
+    if (!parse_fraktal_source(data, &link->params, name, &num_declarations, &link->outputs))
     {
         log_err("Error parsing kernel source\n");
         return false;
     }
-    const char *sources[] = {
-        link->glsl_version,
-        "\nuniform int Dummy;\n"
-        "#define ZERO (min(0, Dummy))\n"
-        #ifdef FRAKTAL_GUI
-        "#define FRAKTAL_GUI\n"
-        #endif
-        "\n#line 0\n",
-        (const char*)data,
-    };
-    int num_sources = sizeof(sources)/sizeof(sources[0]);
-    GLuint shader = compile_shader(name, sources, num_sources, GL_FRAGMENT_SHADER);
-    if (!shader)
-        return false;
-    link->shaders[link->num_shaders++] = shader;
-    fraktal_check_gl_error();
+    link->sources[link->num_sources] = copy_string(data);
+    link->names[link->num_sources] = copy_string(name ? name : "unnamed");
+    link->header_lengths[link->num_sources] = link->header_length;
+    link->uses_params[link->num_sources] = num_declarations > 0 || link->header_uses_params;
+    link->num_sources++;
+    if (is_library)
+    {
+        parse_library_interface(data, &link->header, &link->header_length, &link->header_capacity);
+        if (num_declarations > 0)
+            link->header_uses_params = true;
+    }
     return true;
 }
 
+#ifndef FRAKTAL_SOFTWARE
+/*
+Parameters other than samplers are declared as members of a std140 uniform
+block, so that fraktal_param_* can write them into a CPU-side copy of the
+block that is uploaded with one call before each dispatch. Member offsets
+equal the std140_offset computed by the parser. Blocks have a size limit
+(at least 16 KB), and larger parameter sets are declared as plain uniforms.
+
+The declarations are only inserted into inputs that declare parameters
+(or whose libraries do), so that inputs like hg_sdf compile to the same
+shader regardless of what they are linked with.
+*/
+static void link_param_declarations(fLinkState *link)
+{
+    fParams *p = &link->params;
+    GLint max_block_size = 0;
+    glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &max_block_size);
+    int data_size = fraktal_param_data_size(p);
+    bool use_block = data_size > 0 && data_size <= max_block_size;
+
+    char *buffer = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    char line[256];
+    if (use_block)
+    {
+        snprintf(line, sizeof(line), "layout(std140) uniform %s\n{\n", fraktal_param_block_name);
+        parse_append(&buffer, &length, &capacity, line, strlen(line));
+    }
+    for (int i = 0; i < p->count; i++)
+    {
+        if (fraktal_is_sampler_param(p->type[i]))
+            continue;
+        snprintf(line, sizeof(line), "%s%s %s;\n", use_block ? "    " : "uniform ", parse_param_type_name(p->type[i]), p->name[i]);
+        parse_append(&buffer, &length, &capacity, line, strlen(line));
+    }
+    if (use_block)
+        parse_append(&buffer, &length, &capacity, "};\n", 3);
+    for (int i = 0; i < p->count; i++)
+    {
+        if (!fraktal_is_sampler_param(p->type[i]))
+            continue;
+        snprintf(line, sizeof(line), "uniform %s %s;\n", parse_param_type_name(p->type[i]), p->name[i]);
+        parse_append(&buffer, &length, &capacity, line, strlen(line));
+    }
+    free(link->declarations);
+    link->declarations = buffer;
+}
+
+// Fills 'sources' and 'lengths' with the strings that make up the shader
+// for input 'i' and returns their count.
+enum { MAX_INPUT_SOURCES = 6 };
+static int link_input_sources(fLinkState *link, int i, const char **sources, GLint *lengths)
+{
+    fraktal_assert(i >= 0 && i < link->num_sources);
+    const char *declarations = "";
+    if (link->uses_params[i] && link->declarations)
+        declarations = link->declarations;
+    sources[0] = link->glsl_version;               lengths[0] = -1;
+    sources[1] = fraktal_kernel_prelude;           lengths[1] = -1;
+    sources[2] = declarations;                     lengths[2] = -1;
+    sources[3] = link->header ? link->header : ""; lengths[3] = (GLint)link->header_lengths[i];
+    sources[4] = "\n#line 0\n";                    lengths[4] = -1;
+    sources[5] = link->sources[i];                 lengths[5] = -1;
+    return MAX_INPUT_SOURCES;
+}
+
+// The hash covers everything that determines the resulting program binary.
+static uint64_t link_hash(fLinkState *link)
+{
+    uint64_t hash = fraktal_driver_hash();
+    hash = fraktal_hash_string(hash, fraktal_vertex_shader_source);
+    for (int i = 0; i < link->num_sources; i++)
+    {
+        const char *sources[MAX_INPUT_SOURCES];
+        GLint lengths[MAX_INPUT_SOURCES];
+        int num_sources = link_input_sources(link, i, sources, lengths);
+        hash ^= shader_hash(sources, lengths, num_sources, GL_FRAGMENT_SHADER);
+        hash = fraktal_hash(hash, &i, sizeof(i));
+    }
+    return hash;
+}
+
+// Makes a private copy of the link inputs for a pending link.
+static fLinkState *copy_link(fLinkState *link)
+{
+    fLinkState *copy = (fLinkState*)malloc(sizeof(fLinkState));
+    fraktal_assert(copy && "Ran out of memory");
+    memcpy(copy, link, sizeof(fLinkState));
+    for (int i = 0; i < link->num_sources; i++)
+    {
+        copy->sources[i] = copy_string(link->sources[i]);
+        copy->names[i] = copy_string(link->names[i]);
+    }
+    copy->header = copy_string(link->header);
+    copy->header_capacity = link->header ? link->header_length + 1 : 0;
+    copy->declarations = copy_string(link->declarations);
+    return copy;
+}
+
+#endif
+
 fLinkState *fraktal_create_link()
 {
     fraktal_ensure_context();
     fLinkState *link = (fLinkState*)malloc(sizeof(fLinkState));
-    link->num_shaders = 0;
+    link->num_sources = 0;
+    link->header = NULL;
+    link->header_length = 0;
+    link->header_capacity = 0;
+    link->header_uses_params = false;
+    link->declarations = NULL;
     link->glsl_version = "#version 150";
     link->params.count = 0;
     link->params.sampler_count = 0;
+    link->outputs.count = 0;
     return link;
 }
 
@@ -114,13 +446,14 @@ void fraktal_destroy_link(fLinkState *link)
 {
     if (link)
     {
-        fraktal_ensure_context();
-        fraktal_check_gl_error();
-        for (int i = 0; i < link->num_shaders; i++)
-            if (link->shaders[i])
-                glDeleteShader(link->shaders[i]);
+        for (int i = 0; i < link->num_sources; i++)
+        {
+            free(link->sources[i]);
+            free(link->names[i]);
+        }
+        free(link->header);
+        free(link->declarations);
         free(link);
-        fraktal_check_gl_error();
     }
 }
 
@@ -136,6 +469,18 @@ bool fraktal_add_link_data(fLinkState *link, const char *data, unsigned int size
     return result;
 }
 
+bool fraktal_add_link_library(fLinkState *link, const char *data, unsigned int size, const char *name)
+{
+    if (size == 0) size = (unsigned int)strlen(data);
+    char *copy = (char*)malloc(size + 1);
+    fraktal_assert(copy && "Ran out of memory");
+    memcpy(copy, data, size);
+    copy[size] = '\0';
+    bool result = add_link_data(link, copy, name, true);
+    free(copy);
+    return result;
+}
+
 bool fraktal_add_link_file(fLinkState *link, const char *path)
 {
     char *data = read_file(path);
@@ -149,85 +494,256 @@ bool fraktal_add_link_file(fLinkState *link, const char *path)
     return result;
 }
 
-fKernel *fraktal_link_kernel(fLinkState *link)
+#ifndef FRAKTAL_SOFTWARE
+/*
+A kernel returned by fraktal_link_kernel_async holds an fPendingLink until
+its program has linked. Each input goes through the following steps:
+
+    begin_compile_shader (or find_cached_shader)
+    glAttachShader
+    end_compile_shader and insert_cached_shader (only if not cached)
+
+With parallel compilation, all inputs begin compiling immediately, and
+the remaining steps are done once the driver reports completion. Without
+it, fraktal_kernel_ready compiles one input per call so that the caller
+can keep drawing frames in between.
+*/
+struct fPendingLink
 {
-    fraktal_assert(link);
-    fraktal_ensure_context();
-    fraktal_check_gl_error();
-    if (link->num_shaders <= 0)
-        return NULL;
+    fLinkState *link;
+    GLuint program;
+    GLuint shaders[MAX_LINK_STATE_ITEMS];
+    uint64_t hashes[MAX_LINK_STATE_ITEMS];
+    bool from_cache[MAX_LINK_STATE_ITEMS];
+    int num_compiled; // inputs that have compiled and are attached to 'program'
+    bool parallel;
+    bool linking;
+    bool failed;
+
+    bool use_cache;
+    uint64_t key;
+    char cache_path[1024];
+};
+
+static void free_pending_link(fPendingLink *p)
+{
+    if (!p)
+        return;
+    if (p->program)
+    {
+        // shaders that are not yet owned by the shader cache are ours to delete
+        for (int i = p->num_compiled; i < p->link->num_sources; i++)
+            if (p->shaders[i] && !p->from_cache[i])
+                glDeleteShader(p->shaders[i]);
+        glDeleteProgram(p->program);
+    }
+    fraktal_destroy_link(p->link);
+    free(p);
+}
 
-    static GLuint vs = 0;
+static GLuint fraktal_vertex_shader(const char *glsl_version)
+{
+    GLuint &vs = fraktal_current_context->vertex_shader;
     if (!vs)
     {
-        static const char *source =
-            "in vec2 iPosition;\n"
-            "void main()\n"
-            "{\n"
-            "    gl_Position = vec4(iPosition, 0.0, 1.0);\n"
-            "}\n"
-        ;
-        const char *sources[] = { link->glsl_version, "\n#line 0\n", source };
-        vs = compile_shader("built-in vertex shader", sources, sizeof(sources)/sizeof(char*), GL_VERTEX_SHADER);
+        const char *sources[] = { glsl_version, "\n#line 0\n", fraktal_vertex_shader_source };
+        vs = compile_shader("built-in vertex shader", sources, NULL, sizeof(sources)/sizeof(char*), GL_VERTEX_SHADER);
     }
+    return vs;
+}
+
+static bool begin_link(fPendingLink *p)
+{
+    fLinkState *link = p->link;
+    GLuint vs = fraktal_vertex_shader(link->glsl_version);
     if (!vs)
+        return false;
+
+    p->program = glCreateProgram();
+    if (p->use_cache)
+        glProgramParameteri(p->program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glAttachShader(p->program, vs);
+    for (int i = 0; i < link->outputs.count; i++)
+        glBindFragDataLocation(p->program, i, link->outputs.name[i]);
+    for (int i = 0; i < link->num_sources; i++)
     {
-        log_err("Failed to link kernel\n");
-        return NULL;
+        const char *sources[MAX_INPUT_SOURCES];
+        GLint lengths[MAX_INPUT_SOURCES];
+        int num_sources = link_input_sources(link, i, sources, lengths);
+        p->hashes[i] = shader_hash(sources, lengths, num_sources, GL_FRAGMENT_SHADER);
+        p->shaders[i] = find_cached_shader(p->hashes[i]);
+        p->from_cache[i] = p->shaders[i] != 0;
+        if (!p->shaders[i] && p->parallel)
+        {
+            p->shaders[i] = begin_compile_shader(link->names[i], sources, lengths, num_sources, GL_FRAGMENT_SHADER);
+            if (!p->shaders[i])
+                return false;
+        }
+        if (p->shaders[i])
+            glAttachShader(p->program, p->shaders[i]);
     }
+    return true;
+}
 
-    GLuint program = glCreateProgram();
-    glAttachShader(program, vs);
-    for (int i = 0; i < link->num_shaders; i++)
-        glAttachShader(program, link->shaders[i]);
-    glLinkProgram(program);
-    glDetachShader(program, vs);
-    for (int i = 0; i < link->num_shaders; i++)
-        glDetachShader(program, link->shaders[i]);
+// Advances a pending link. If 'block' is false, the function returns 0
+// instead of waiting for the driver, or after compiling one input if the
+// driver compiles synchronously. Returns 1 once the program is linked and
+// -1 on failure.
+static int step_link(fKernel *f, bool block)
+{
+    fPendingLink *p = f->pending;
+    fraktal_assert(p);
+    fraktal_assert(f->context == fraktal_current_context && "Kernel was created in a different context");
+    fLinkState *link = p->link;
+    if (p->failed)
+        return -1;
 
-    if (!program_link_status(program))
+    while (!p->linking && p->num_compiled < link->num_sources)
     {
-        glDeleteProgram(program);
-        log_err("Failed to link kernel\n");
-        return NULL;
+        int i = p->num_compiled;
+        if (p->from_cache[i])
+        {
+            p->num_compiled++;
+            continue;
+        }
+        if (p->parallel)
+        {
+            GLint done = GL_TRUE;
+            if (!block)
+                glGetShaderiv(p->shaders[i], GL_COMPLETION_STATUS_KHR, &done);
+            if (!done)
+                return 0;
+            if (!end_compile_shader(link->names[i], p->shaders[i]))
+            {
+                p->num_compiled++; // deleted by end_compile_shader
+                p->failed = true;
+                return -1;
+            }
+        }
+        else
+        {
+            const char *sources[MAX_INPUT_SOURCES];
+            GLint lengths[MAX_INPUT_SOURCES];
+            int num_sources = link_input_sources(link, i, sources, lengths);
+            p->shaders[i] = compile_shader(link->names[i], sources, lengths, num_sources, GL_FRAGMENT_SHADER);
+            if (!p->shaders[i])
+            {
+                p->failed = true;
+                return -1;
+            }
+            glAttachShader(p->program, p->shaders[i]);
+        }
+        insert_cached_shader(p->hashes[i], p->shaders[i]);
+        p->num_compiled++;
+        if (!block && !p->parallel && p->num_compiled < link->num_sources)
+            return 0;
+    }
+
+    if (!p->linking)
+    {
+        glLinkProgram(p->program);
+        p->linking = true;
+    }
+
+    if (p->parallel && !block)
+    {
+        GLint done = GL_TRUE;
+        glGetProgramiv(p->program, GL_COMPLETION_STATUS_KHR, &done);
+        if (!done)
+            return 0;
+    }
+
+    GLuint attached[MAX_LINK_STATE_ITEMS + 1];
+    GLsizei num_attached = 0;
+    glGetAttachedShaders(p->program, MAX_LINK_STATE_ITEMS + 1, &num_attached, attached);
+    for (GLsizei i = 0; i < num_attached; i++)
+        glDetachShader(p->program, attached[i]);
+
+    if (!program_link_status(p->program))
+    {
+        p->failed = true;
+        return -1;
     }
 
-    fKernel *kernel = (fKernel*)malloc(sizeof(fKernel));
-    kernel->program = program;
-    kernel->params.count = link->params.count;
-    kernel->params.sampler_count = link->params.sampler_count;
-    kernel->loc_iPosition = 0;
-    for (int i = 0; i < link->params.count; i++)
+    GLuint program = p->program;
+    p->program = 0;
+    fraktal_init_kernel(f, program, &link->params);
+    if (p->use_cache)
+        export_kernel(f, p->cache_path, p->key);
+    free_pending_link(p);
+    f->pending = NULL;
+    return 1;
+}
+
+fKernel *fraktal_link_kernel_async(fLinkState *link)
+{
+    fraktal_assert(link);
+    fraktal_ensure_context();
+    fraktal_check_gl_error();
+    if (link->num_sources <= 0)
+        return NULL;
+
+    link_param_declarations(link);
+
+    fPendingLink *p = (fPendingLink*)calloc(1, sizeof(fPendingLink));
+    fraktal_assert(p && "Ran out of memory");
+    if (fraktal_kernel_cache_dir && fraktal_program_binary_supported())
     {
-        strcpy(kernel->params.name[i], link->params.name[i]);
-        kernel->params.type[i] = link->params.type[i];
-        kernel->params.mean[i] = link->params.mean[i];
-        kernel->params.scale[i] = link->params.scale[i];
-        kernel->params.offset[i] = glGetUniformLocation(program, link->params.name[i]);
-        kernel->params.assigned_tex_unit[i] = link->params.assigned_tex_unit[i];
-        kernel->params.std140_offset[i] = link->params.std140_offset[i];
-        kernel->params.std140_size[i] = link->params.std140_size[i];
+        p->key = link_hash(link);
+        p->use_cache = kernel_cache_path(p->key, p->cache_path, sizeof(p->cache_path));
     }
-    // print kernel information
-    #if 0
+    if (p->use_cache)
     {
-        for (int i = 0; i < kernel->params.count; i++)
+        fKernel *kernel = import_kernel(p->cache_path, p->key, true);
+        if (kernel)
         {
-            printf("%s: ", kernel->params.name[i]);
-            printf("%d: ", kernel->params.offset[i]);
-            printf("%d: ", kernel->params.type[i]);
-            printf("%f: ", kernel->params.mean[i].x);
-            printf("%f: ", kernel->params.scale[i].x);
-            printf("%d: ", kernel->params.assigned_tex_unit[i]);
-            printf("%d: ", kernel->params.std140_offset[i]);
-            printf("%d: ", kernel->params.std140_size[i]);
-            printf("\n");
+            free(p);
+            return kernel;
         }
-        printf("num_params: %d\n", kernel->params.count);
-        printf("num_samplers: %d\n", kernel->params.sampler_count);
     }
-    #endif
+
+    p->link = copy_link(link);
+    p->parallel = fraktal_parallel_compile_supported();
+    if (!begin_link(p))
+    {
+        free_pending_link(p);
+        log_err("Failed to link kernel\n");
+        return NULL;
+    }
+
+    fKernel *kernel = (fKernel*)calloc(1, sizeof(fKernel));
+    fraktal_assert(kernel && "Ran out of memory");
+    kernel->pending = p;
+    kernel->context = fraktal_current_context;
+    fraktal_check_gl_error();
+    return kernel;
+}
+
+int fraktal_kernel_ready(fKernel *f)
+{
+    fraktal_assert(f);
+    if (!f->pending)
+        return 1;
+    if (f->pending->failed)
+        return -1;
+    fraktal_ensure_context();
+    fraktal_check_gl_error();
+    int status = step_link(f, false);
+    if (status < 0)
+        log_err("Failed to link kernel\n");
     fraktal_check_gl_error();
+    return status;
+}
+
+fKernel *fraktal_link_kernel(fLinkState *link)
+{
+    fKernel *kernel = fraktal_link_kernel_async(link);
+    if (kernel && kernel->pending && step_link(kernel, true) != 1)
+    {
+        log_err("Failed to link kernel\n");
+        fraktal_destroy_kernel(kernel);
+        return NULL;
+    }
     return kernel;
 }
 
@@ -237,13 +753,21 @@ void fraktal_destroy_kernel(fKernel *f)
     {
         fraktal_ensure_context();
         fraktal_check_gl_error();
+        fraktal_assert(f->context == fraktal_current_context && "Kernel was created in a different context");
+        free_pending_link(f->pending);
+        fraktal_forget_timer_queries(&f->stats, &f->tile_cost);
         if (f->program)
             glDeleteProgram(f->program);
+        if (f->param_buffer)
+            glDeleteBuffers(1, &f->param_buffer);
+        free(f->param_data);
         free(f);
         fraktal_check_gl_error();
     }
 }
 
+#endif
+
 fKernel *fraktal_load_kernel(const char *path)
 {
     fraktal_assert(path);
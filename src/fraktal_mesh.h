@@ -0,0 +1,688 @@
+// Developed by Simen Haugo.
+// See LICENSE.txt for copyright and licensing details (standard MIT License).
+
+#pragma once
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include "reuse/log.h"
+
+/*
+Mesh extraction (see fraktal_extract_mesh).
+
+The box is divided into cubic cells, which are grouped into blocks of
+FMESH_BLOCK^3 cells. The blocks that may contain surface are found by
+refining a tree of blocks from the top down: the kernel is evaluated at
+the center of each node of a level, and a node is split into eight only
+if the distance there is within the radius of the node. Only the blocks
+that are left at the bottom are evaluated at every cell corner, so the
+work and memory grow with the area of the surface rather than the volume
+of the box.
+
+Vertices are placed by dual contouring: each cell whose corners differ
+in sign gets one vertex, at the point that best fits the planes given by
+the crossings on its edges and the normals there, and each edge with a
+sign change connects the vertices of the four cells around it by a quad.
+The cells with a vertex are kept in a hash table, which also records the
+sign changes on the three edges that start at the lower corner of each
+cell, so that quads can be made once every block has been processed.
+*/
+
+enum { FMESH_BLOCK = 8 };                    // cells along each side of a block
+enum { FMESH_CORNERS = FMESH_BLOCK + 1 };    // corners along each side of a block
+enum { FMESH_BATCH_BLOCKS = 256 };           // blocks evaluated per call to fraktal_eval_points
+enum { FMESH_BATCH_POINTS = 1 << 18 };       // points per call otherwise
+enum { FRAKTAL_MAX_MESH_RESOLUTION = 1 << 16 };
+
+struct fMesh
+{
+    float *vertices;          // xyz
+    float *normals;           // xyz
+    unsigned int *indices;    // three per triangle
+    int num_vertices;
+    int num_triangles;
+};
+
+struct fMeshCell
+{
+    uint64_t key;   // 0 if the slot is free
+    int vertex;
+    int edges;      // bit k: sign change along axis k from the lower corner, bit 3: lower corner inside
+};
+
+struct fMeshCells
+{
+    fMeshCell *slots;
+    int capacity;   // power of two
+    int count;
+};
+
+struct fMeshBuilder
+{
+    float box_min[3];
+    float cell;
+    int cells[3];       // along each axis
+    fMeshCells table;
+    float *vertices;
+    int num_vertices;
+    int vertex_capacity;
+    unsigned int *indices;
+    int num_triangles;
+    int triangle_capacity;
+};
+
+static uint64_t fmesh_key(int x, int y, int z)
+{
+    return (((uint64_t)x << 42) | ((uint64_t)y << 21) | (uint64_t)z) + 1;
+}
+
+static fMeshCell *fmesh_slot(fMeshCells *t, uint64_t key)
+{
+    uint64_t i = (key*0x9E3779B97F4A7C15ull) >> 32;
+    for (;;)
+    {
+        fMeshCell *s = &t->slots[i & (t->capacity - 1)];
+        if (s->key == key || s->key == 0)
+            return s;
+        i++;
+    }
+}
+
+static fMeshCell *fmesh_find_cell(fMeshCells *t, int x, int y, int z)
+{
+    if (x < 0 || y < 0 || z < 0)
+        return NULL;
+    fMeshCell *s = fmesh_slot(t, fmesh_key(x, y, z));
+    return s->key ? s : NULL;
+}
+
+static void fmesh_insert_cell(fMeshCells *t, int x, int y, int z, int vertex, int edges)
+{
+    if (2*(t->count + 1) > t->capacity)
+    {
+        fMeshCells grown;
+        grown.capacity = t->capacity ? 2*t->capacity : 1024;
+        grown.count = t->count;
+        grown.slots = (fMeshCell*)calloc(grown.capacity, sizeof(fMeshCell));
+        fraktal_assert(grown.slots && "Ran out of memory");
+        for (int i = 0; i < t->capacity; i++)
+            if (t->slots[i].key)
+                *fmesh_slot(&grown, t->slots[i].key) = t->slots[i];
+        free(t->slots);
+        *t = grown;
+    }
+    fMeshCell *s = fmesh_slot(t, fmesh_key(x, y, z));
+    fraktal_assert(s->key == 0);
+    s->key = fmesh_key(x, y, z);
+    s->vertex = vertex;
+    s->edges = edges;
+    t->count++;
+}
+
+// Evaluates the kernel at 'count' points (xyz triples) and writes the
+// distance and normal at each (four values per point) to 'result'.
+static bool fmesh_eval(fKernel *kernel, const float *points, int count, float *result)
+{
+    // arrays have 1, 2 or 4 channels, so upload the points as xyzw
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(result + 4*i, points + 3*i, 3*sizeof(float));
+        result[4*i + 3] = 1.0f;
+    }
+    fArray *in = fraktal_create_points(result, count, 4, FRAKTAL_FLOAT, FRAKTAL_READ_ONLY);
+    fArray *out = fraktal_create_points(NULL, count, 4, FRAKTAL_FLOAT, FRAKTAL_READ_WRITE);
+    bool ok = in && out;
+    if (ok)
+    {
+        fraktal_eval_points(kernel, in, out);
+        fraktal_to_cpu(result, out);
+    }
+    fraktal_destroy_array(in);
+    fraktal_destroy_array(out);
+    return ok;
+}
+
+// Blocks of cells that may contain surface (see fmesh_find_blocks).
+struct fMeshBand
+{
+    int *blocks;            // xyz of each block near the surface
+    int num_blocks;
+    int *far;               // xyz and size (in blocks) of each node away from the surface
+    float *far_distance;    // distance at the center of each such node
+    int num_far;
+};
+
+// Refines a tree over a grid of 'blocks' blocks, with 'block' cells of
+// size 'cell' along each side, and returns the blocks near the surface.
+// The nodes that were found to be away from the surface are also returned
+// if 'keep_far' is set. The caller frees the arrays of the band.
+static bool fmesh_find_blocks(fKernel *kernel, const float box_min[3], float cell, int block,
+                              const int blocks[3], bool keep_far, fMeshBand *band)
+{
+    memset(band, 0, sizeof(fMeshBand));
+    int levels = 0;
+    for (int k = 0; k < 3; k++)
+        while ((1 << levels) < blocks[k])
+            levels++;
+
+    // refine the tree one level at a time; nodes are stored as xyz triples
+    // in units of their own size
+    float *points = (float*)malloc((size_t)FMESH_BATCH_POINTS*3*sizeof(float));
+    float *result = (float*)malloc((size_t)FMESH_BATCH_POINTS*4*sizeof(float));
+    int num_nodes = 1;
+    int *nodes = (int*)calloc(3, sizeof(int));
+    fraktal_assert(points && result && nodes && "Ran out of memory");
+    int far_capacity = 0;
+    bool ok = true;
+    for (int level = 0; level <= levels && ok; level++)
+    {
+        int size = 1 << (levels - level); // in blocks
+        float half = 0.5f*(float)(size*block)*cell;
+        float radius = sqrtf(3.0f)*half + cell;
+        int *children = (int*)malloc((size_t)num_nodes*(level < levels ? 8 : 1)*3*sizeof(int));
+        fraktal_assert(children && "Ran out of memory");
+        int num_children = 0;
+        for (int first = 0; first < num_nodes && ok; first += FMESH_BATCH_POINTS)
+        {
+            int count = num_nodes - first < FMESH_BATCH_POINTS ? num_nodes - first : FMESH_BATCH_POINTS;
+            for (int i = 0; i < count; i++)
+            for (int k = 0; k < 3; k++)
+                points[3*i + k] = box_min[k] + (float)(nodes[3*(first + i) + k]*size*block)*cell + half;
+            ok = fmesh_eval(kernel, points, count, result);
+            for (int i = 0; i < count && ok; i++)
+            {
+                const int *node = nodes + 3*(first + i);
+
+                // the model is assumed to not overestimate the distance to
+                // the surface, as when rendering it with sphere tracing
+                if (!(fabsf(result[4*i]) <= radius))
+                {
+                    if (!keep_far)
+                        continue;
+                    if (band->num_far == far_capacity)
+                    {
+                        far_capacity = far_capacity ? 2*far_capacity : 1024;
+                        band->far = (int*)realloc(band->far, (size_t)far_capacity*4*sizeof(int));
+                        band->far_distance = (float*)realloc(band->far_distance, (size_t)far_capacity*sizeof(float));
+                        fraktal_assert(band->far && band->far_distance && "Ran out of memory");
+                    }
+                    memcpy(band->far + 4*band->num_far, node, 3*sizeof(int));
+                    band->far[4*band->num_far + 3] = size;
+                    band->far_distance[band->num_far] = result[4*i];
+                    band->num_far++;
+                    continue;
+                }
+                if (level == levels)
+                {
+                    memcpy(children + 3*num_children++, node, 3*sizeof(int));
+                    continue;
+                }
+                for (int c = 0; c < 8; c++)
+                {
+                    int child[3] = { 2*node[0] + (c & 1), 2*node[1] + ((c >> 1) & 1), 2*node[2] + ((c >> 2) & 1) };
+                    int child_size = size/2;
+                    if (child[0]*child_size < blocks[0] && child[1]*child_size < blocks[1] && child[2]*child_size < blocks[2])
+                        memcpy(children + 3*num_children++, child, 3*sizeof(int));
+                }
+            }
+        }
+        free(nodes);
+        nodes = children;
+        num_nodes = num_children;
+    }
+    free(points);
+    free(result);
+    band->blocks = nodes;
+    band->num_blocks = num_nodes;
+    if (!ok)
+    {
+        free(band->blocks);
+        free(band->far);
+        free(band->far_distance);
+        memset(band, 0, sizeof(fMeshBand));
+    }
+    return ok;
+}
+
+// Position of the cell corner (i,j,k). Neighboring blocks compute the same
+// position for their shared corners, so that the kernel gives the same
+// value and the sign changes on their shared edges agree.
+static void fmesh_corner(const fMeshBuilder *b, int i, int j, int k, float *p)
+{
+    p[0] = b->box_min[0] + b->cell*(float)i;
+    p[1] = b->box_min[1] + b->cell*(float)j;
+    p[2] = b->box_min[2] + b->cell*(float)k;
+}
+
+static int fmesh_add_vertex(fMeshBuilder *b, const float *p)
+{
+    if (b->num_vertices == b->vertex_capacity)
+    {
+        b->vertex_capacity = b->vertex_capacity ? 2*b->vertex_capacity : 1024;
+        b->vertices = (float*)realloc(b->vertices, (size_t)b->vertex_capacity*3*sizeof(float));
+        fraktal_assert(b->vertices && "Ran out of memory");
+    }
+    memcpy(b->vertices + 3*b->num_vertices, p, 3*sizeof(float));
+    return b->num_vertices++;
+}
+
+static void fmesh_add_triangle(fMeshBuilder *b, int v0, int v1, int v2)
+{
+    if (b->num_triangles == b->triangle_capacity)
+    {
+        b->triangle_capacity = b->triangle_capacity ? 2*b->triangle_capacity : 1024;
+        b->indices = (unsigned int*)realloc(b->indices, (size_t)b->triangle_capacity*3*sizeof(unsigned int));
+        fraktal_assert(b->indices && "Ran out of memory");
+    }
+    b->indices[3*b->num_triangles + 0] = (unsigned int)v0;
+    b->indices[3*b->num_triangles + 1] = (unsigned int)v1;
+    b->indices[3*b->num_triangles + 2] = (unsigned int)v2;
+    b->num_triangles++;
+}
+
+// Returns the point that minimizes the squared distances to the planes
+// through p[i] with normal n[i], plus a small penalty on the distance to
+// their mean. The penalty keeps the solution unique when the planes are
+// (nearly) parallel, as on flat and curved parts of the surface.
+static void fmesh_fit_vertex(const float (*p)[3], const float (*n)[3], int count, float *x)
+{
+    const double lambda = 0.05;
+    double mean[3] = { 0.0, 0.0, 0.0 };
+    for (int i = 0; i < count; i++)
+        for (int k = 0; k < 3; k++)
+            mean[k] += p[i][k]/count;
+
+    // normal equations relative to the mean: (A^T A + lambda I) y = A^T r
+    double A[3][3] = { { lambda, 0.0, 0.0 }, { 0.0, lambda, 0.0 }, { 0.0, 0.0, lambda } };
+    double r[3] = { 0.0, 0.0, 0.0 };
+    for (int i = 0; i < count; i++)
+    {
+        double d = 0.0;
+        for (int k = 0; k < 3; k++)
+            d += n[i][k]*(p[i][k] - mean[k]);
+        for (int u = 0; u < 3; u++)
+        {
+            r[u] += n[i][u]*d;
+            for (int v = 0; v < 3; v++)
+                A[u][v] += n[i][u]*n[i][v];
+        }
+    }
+    double det =
+        A[0][0]*(A[1][1]*A[2][2] - A[1][2]*A[2][1]) -
+        A[0][1]*(A[1][0]*A[2][2] - A[1][2]*A[2][0]) +
+        A[0][2]*(A[1][0]*A[2][1] - A[1][1]*A[2][0]);
+    for (int k = 0; k < 3; k++)
+    {
+        // Cramer's rule: replace column k by r
+        double M[3][3];
+        memcpy(M, A, sizeof(M));
+        for (int u = 0; u < 3; u++)
+            M[u][k] = r[u];
+        double det_k =
+            M[0][0]*(M[1][1]*M[2][2] - M[1][2]*M[2][1]) -
+            M[0][1]*(M[1][0]*M[2][2] - M[1][2]*M[2][0]) +
+            M[0][2]*(M[1][0]*M[2][1] - M[1][1]*M[2][0]);
+        x[k] = (float)(mean[k] + det_k/det);
+    }
+}
+
+// Places vertices in the cells of a block that have a sign change. 'data'
+// holds the distance and normal at each corner of the block, ordered by x,
+// then y, then z.
+static void fmesh_block_vertices(fMeshBuilder *b, const int *block, const float *data)
+{
+    static const int edges[12][2] = {
+        {0,1}, {2,3}, {4,5}, {6,7}, // along x
+        {0,2}, {1,3}, {4,6}, {5,7}, // along y
+        {0,4}, {1,5}, {2,6}, {3,7}, // along z
+    };
+    for (int k = 0; k < FMESH_BLOCK; k++)
+    for (int j = 0; j < FMESH_BLOCK; j++)
+    for (int i = 0; i < FMESH_BLOCK; i++)
+    {
+        int x = block[0]*FMESH_BLOCK + i;
+        int y = block[1]*FMESH_BLOCK + j;
+        int z = block[2]*FMESH_BLOCK + k;
+        if (x >= b->cells[0] || y >= b->cells[1] || z >= b->cells[2])
+            continue;
+
+        const float *corner[8];
+        int inside = 0;
+        for (int c = 0; c < 8; c++)
+        {
+            int ci = i + (c & 1);
+            int cj = j + ((c >> 1) & 1);
+            int ck = k + ((c >> 2) & 1);
+            corner[c] = data + 4*(ci + FMESH_CORNERS*(cj + FMESH_CORNERS*ck));
+            if (corner[c][0] < 0.0f)
+                inside |= 1 << c;
+        }
+        if (inside == 0 || inside == 0xff)
+            continue;
+
+        float p[12][3];
+        float n[12][3];
+        int count = 0;
+        for (int e = 0; e < 12; e++)
+        {
+            int c0 = edges[e][0];
+            int c1 = edges[e][1];
+            if (((inside >> c0) & 1) == ((inside >> c1) & 1))
+                continue;
+            float d0 = corner[c0][0];
+            float d1 = corner[c1][0];
+            float t = d0/(d0 - d1);
+            float p0[3], p1[3];
+            fmesh_corner(b, x + (c0 & 1), y + ((c0 >> 1) & 1), z + ((c0 >> 2) & 1), p0);
+            fmesh_corner(b, x + (c1 & 1), y + ((c1 >> 1) & 1), z + ((c1 >> 2) & 1), p1);
+            float length2 = 0.0f;
+            for (int a = 0; a < 3; a++)
+            {
+                p[count][a] = p0[a] + t*(p1[a] - p0[a]);
+                n[count][a] = corner[c0][1 + a] + t*(corner[c1][1 + a] - corner[c0][1 + a]);
+                length2 += n[count][a]*n[count][a];
+            }
+            // the normal is undefined where the gradient vanishes
+            float scale = (length2 > 0.0f && isfinite(length2)) ? 1.0f/sqrtf(length2) : 0.0f;
+            for (int a = 0; a < 3; a++)
+                n[count][a] *= scale;
+            count++;
+        }
+
+        // keep the vertex inside the cell, so that quads do not fold over
+        float v[3];
+        float lo[3], hi[3];
+        fmesh_fit_vertex(p, n, count, v);
+        fmesh_corner(b, x, y, z, lo);
+        fmesh_corner(b, x + 1, y + 1, z + 1, hi);
+        for (int a = 0; a < 3; a++)
+            v[a] = v[a] < lo[a] ? lo[a] : (v[a] > hi[a] ? hi[a] : v[a]);
+
+        int flags = (inside & 1) ? 8 : 0;
+        for (int a = 0; a < 3; a++)
+            if (((inside >> (1 << a)) & 1) != (inside & 1))
+                flags |= 1 << a;
+        fmesh_insert_cell(&b->table, x, y, z, fmesh_add_vertex(b, v), flags);
+    }
+}
+
+// Connects the vertices around each edge with a sign change by two
+// triangles, facing the outside (where the model is positive).
+static void fmesh_quads(fMeshBuilder *b)
+{
+    for (int s = 0; s < b->table.capacity; s++)
+    {
+        fMeshCell *cell = &b->table.slots[s];
+        if (!cell->key)
+            continue;
+        uint64_t key = cell->key - 1;
+        int v[3] = { (int)((key >> 42) & 0x1fffff), (int)((key >> 21) & 0x1fffff), (int)(key & 0x1fffff) };
+        for (int a = 0; a < 3; a++)
+        {
+            if (!(cell->edges & (1 << a)))
+                continue;
+
+            // the four cells around the edge, counter-clockwise seen from +a
+            int u = (a + 1) % 3;
+            int w = (a + 2) % 3;
+            int q[4][3];
+            for (int c = 0; c < 4; c++)
+                memcpy(q[c], v, sizeof(v));
+            q[0][u]--; q[0][w]--;
+            q[1][w]--;
+            q[3][u]--;
+            int index[4];
+            bool complete = true;
+            for (int c = 0; c < 4 && complete; c++)
+            {
+                fMeshCell *other = fmesh_find_cell(&b->table, q[c][0], q[c][1], q[c][2]);
+                complete = other != NULL;
+                if (other)
+                    index[c] = other->vertex;
+            }
+            if (!complete) // the edge lies on the boundary of the box
+                continue;
+
+            // split the quad along its shorter diagonal
+            float d02 = 0.0f, d13 = 0.0f;
+            for (int k = 0; k < 3; k++)
+            {
+                float e02 = b->vertices[3*index[0] + k] - b->vertices[3*index[2] + k];
+                float e13 = b->vertices[3*index[1] + k] - b->vertices[3*index[3] + k];
+                d02 += e02*e02;
+                d13 += e13*e13;
+            }
+            if (!(cell->edges & 8)) // the normal points towards -a
+            {
+                int t = index[1];
+                index[1] = index[3];
+                index[3] = t;
+            }
+            if (d02 <= d13)
+            {
+                fmesh_add_triangle(b, index[0], index[1], index[2]);
+                fmesh_add_triangle(b, index[0], index[2], index[3]);
+            }
+            else
+            {
+                fmesh_add_triangle(b, index[0], index[1], index[3]);
+                fmesh_add_triangle(b, index[1], index[2], index[3]);
+            }
+        }
+    }
+}
+
+static void fmesh_free_builder(fMeshBuilder *b)
+{
+    free(b->table.slots);
+    free(b->vertices);
+    free(b->indices);
+}
+
+fMesh *fraktal_extract_mesh(fKernel *kernel, const float box_min[3], const float box_max[3], int resolution)
+{
+    fraktal_assert(kernel);
+    fraktal_assert(box_min && box_max);
+    fraktal_assert(resolution > 0 && resolution <= FRAKTAL_MAX_MESH_RESOLUTION);
+
+    fMeshBuilder b = {0};
+    float extent = 0.0f;
+    for (int k = 0; k < 3; k++)
+    {
+        fraktal_assert(box_min[k] < box_max[k]);
+        if (box_max[k] - box_min[k] > extent)
+            extent = box_max[k] - box_min[k];
+    }
+    memcpy(b.box_min, box_min, sizeof(b.box_min));
+    b.cell = extent/(float)resolution;
+
+    int blocks[3];
+    for (int k = 0; k < 3; k++)
+    {
+        b.cells[k] = (int)ceilf((box_max[k] - box_min[k])/b.cell);
+        if (b.cells[k] < 1) b.cells[k] = 1;
+        if (b.cells[k] > resolution) b.cells[k] = resolution;
+        blocks[k] = (b.cells[k] + FMESH_BLOCK - 1)/FMESH_BLOCK;
+    }
+
+    fMeshBand band;
+    bool ok = fmesh_find_blocks(kernel, box_min, b.cell, FMESH_BLOCK, blocks, false, &band);
+    int num_nodes = band.num_blocks;
+    int *nodes = band.blocks;
+
+    // evaluate the remaining blocks at every corner, a batch at a time
+    const int corners = FMESH_CORNERS*FMESH_CORNERS*FMESH_CORNERS;
+    float *block_points = (float*)malloc((size_t)FMESH_BATCH_BLOCKS*corners*3*sizeof(float));
+    float *block_result = (float*)malloc((size_t)FMESH_BATCH_BLOCKS*corners*4*sizeof(float));
+    fraktal_assert(block_points && block_result && "Ran out of memory");
+    for (int first = 0; first < num_nodes && ok; first += FMESH_BATCH_BLOCKS)
+    {
+        int count = num_nodes - first < FMESH_BATCH_BLOCKS ? num_nodes - first : FMESH_BATCH_BLOCKS;
+        float *p = block_points;
+        for (int i = 0; i < count; i++)
+        {
+            const int *block = nodes + 3*(first + i);
+            for (int ck = 0; ck < FMESH_CORNERS; ck++)
+            for (int cj = 0; cj < FMESH_CORNERS; cj++)
+            for (int ci = 0; ci < FMESH_CORNERS; ci++, p += 3)
+                fmesh_corner(&b, block[0]*FMESH_BLOCK + ci, block[1]*FMESH_BLOCK + cj, block[2]*FMESH_BLOCK + ck, p);
+        }
+        ok = fmesh_eval(kernel, block_points, count*corners, block_result);
+        for (int i = 0; i < count && ok; i++)
+            fmesh_block_vertices(&b, nodes + 3*(first + i), block_result + 4*corners*i);
+    }
+    free(block_points);
+    free(block_result);
+    free(nodes);
+
+    if (ok)
+        fmesh_quads(&b);
+
+    // take the vertex normals from the kernel as well
+    float *normals = (float*)malloc((size_t)(b.num_vertices > 0 ? b.num_vertices : 1)*3*sizeof(float));
+    float *result = (float*)malloc((size_t)FMESH_BATCH_POINTS*4*sizeof(float));
+    fraktal_assert(normals && result && "Ran out of memory");
+    for (int first = 0; first < b.num_vertices && ok; first += FMESH_BATCH_POINTS)
+    {
+        int count = b.num_vertices - first < FMESH_BATCH_POINTS ? b.num_vertices - first : FMESH_BATCH_POINTS;
+        ok = fmesh_eval(kernel, b.vertices + 3*first, count, result);
+        for (int i = 0; i < count && ok; i++)
+            memcpy(normals + 3*(first + i), result + 4*i + 1, 3*sizeof(float));
+    }
+    free(result);
+
+    if (!ok)
+    {
+        free(normals);
+        fmesh_free_builder(&b);
+        return NULL;
+    }
+
+    fMesh *m = (fMesh*)calloc(1, sizeof(fMesh));
+    fraktal_assert(m && "Ran out of memory");
+    m->vertices = b.vertices;
+    m->normals = normals;
+    m->indices = b.indices;
+    m->num_vertices = b.num_vertices;
+    m->num_triangles = b.num_triangles;
+    b.vertices = NULL;
+    b.indices = NULL;
+    fmesh_free_builder(&b);
+    return m;
+}
+
+void fraktal_destroy_mesh(fMesh *m)
+{
+    if (m)
+    {
+        free(m->vertices);
+        free(m->normals);
+        free(m->indices);
+        free(m);
+    }
+}
+
+int fraktal_mesh_vertex_count(fMesh *m) { fraktal_assert(m); return m->num_vertices; }
+int fraktal_mesh_triangle_count(fMesh *m) { fraktal_assert(m); return m->num_triangles; }
+const float *fraktal_mesh_vertices(fMesh *m) { fraktal_assert(m); return m->vertices; }
+const float *fraktal_mesh_normals(fMesh *m) { fraktal_assert(m); return m->normals; }
+const unsigned int *fraktal_mesh_indices(fMesh *m) { fraktal_assert(m); return m->indices; }
+
+static bool fmesh_has_extension(const char *path, const char *extension)
+{
+    size_t n = strlen(path);
+    size_t e = strlen(extension);
+    if (n < e)
+        return false;
+    for (size_t i = 0; i < e; i++)
+        if (tolower((unsigned char)path[n - e + i]) != extension[i])
+            return false;
+    return true;
+}
+
+static bool fmesh_write_ply(fMesh *m, FILE *f)
+{
+    // binary PLY stores values in the byte order given by the header
+    uint32_t one = 1;
+    bool little_endian = *(unsigned char*)&one == 1;
+    if (fprintf(f,
+        "ply\n"
+        "format %s 1.0\n"
+        "element vertex %d\n"
+        "property float x\n"
+        "property float y\n"
+        "property float z\n"
+        "property float nx\n"
+        "property float ny\n"
+        "property float nz\n"
+        "element face %d\n"
+        "property list uchar uint vertex_indices\n"
+        "end_header\n",
+        little_endian ? "binary_little_endian" : "binary_big_endian",
+        m->num_vertices, m->num_triangles) < 0)
+        return false;
+    bool ok = true;
+    for (int i = 0; i < m->num_vertices && ok; i++)
+    {
+        float vertex[6];
+        memcpy(vertex, m->vertices + 3*i, 3*sizeof(float));
+        memcpy(vertex + 3, m->normals + 3*i, 3*sizeof(float));
+        ok = fwrite(vertex, sizeof(vertex), 1, f) == 1;
+    }
+    for (int i = 0; i < m->num_triangles && ok; i++)
+    {
+        unsigned char n = 3;
+        ok = fwrite(&n, 1, 1, f) == 1 &&
+             fwrite(m->indices + 3*i, sizeof(unsigned int), 3, f) == 3;
+    }
+    return ok;
+}
+
+static bool fmesh_write_obj(fMesh *m, FILE *f)
+{
+    bool ok = true;
+    for (int i = 0; i < m->num_vertices && ok; i++)
+    {
+        const float *v = m->vertices + 3*i;
+        const float *n = m->normals + 3*i;
+        ok = fprintf(f, "v %g %g %g\nvn %g %g %g\n", v[0], v[1], v[2], n[0], n[1], n[2]) >= 0;
+    }
+    for (int i = 0; i < m->num_triangles && ok; i++)
+    {
+        // indices start at 1
+        unsigned int a = m->indices[3*i + 0] + 1;
+        unsigned int b = m->indices[3*i + 1] + 1;
+        unsigned int c = m->indices[3*i + 2] + 1;
+        ok = fprintf(f, "f %u//%u %u//%u %u//%u\n", a, a, b, b, c, c) >= 0;
+    }
+    return ok;
+}
+
+bool fraktal_save_mesh(fMesh *m, const char *path)
+{
+    fraktal_assert(m);
+    fraktal_assert(path);
+    bool ply = fmesh_has_extension(path, ".ply");
+    if (!ply && !fmesh_has_extension(path, ".obj"))
+    {
+        log_err("Unknown mesh format '%s': the path must end in .ply or .obj\n", path);
+        return false;
+    }
+    FILE *f = fopen(path, "wb");
+    if (!f)
+    {
+        log_err("Failed to open file '%s'\n", path);
+        return false;
+    }
+    bool ok = ply ? fmesh_write_ply(m, f) : fmesh_write_obj(m, f);
+    ok = fclose(f) == 0 && ok;
+    if (!ok)
+    {
+        log_err("Failed to write mesh to '%s'\n", path);
+        remove(path);
+    }
+    return ok;
+}
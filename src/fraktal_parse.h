@@ -6,8 +6,8 @@
 #include <stdio.h>
 #include "reuse/log.h"
 
-static const char *parse_error_start = NULL;
-static const char *parse_error_name = NULL;
+static thread_local const char *parse_error_start = NULL;
+static thread_local const char *parse_error_name = NULL;
 
 static void parse_error(const char *at, const char *message)
 {
@@ -303,9 +303,9 @@ static bool parse_float4(const char **c, float4 *v)
     return true;
 }
 
-static bool parse_inside_list = false;
-static bool parse_list_first = false;
-static bool parse_list_error = false;
+static thread_local bool parse_inside_list = false;
+static thread_local bool parse_list_first = false;
+static thread_local bool parse_list_error = false;
 
 static bool parse_begin_list(const char **c)
 {
@@ -471,25 +471,33 @@ static bool parse_param(const char **c, fParams *p, int param)
         return false;
     }
 
-    // Get type
+    // Get type. Sizes and alignments are in bytes, following the std140
+    // rules (matrices are stored as arrays of vec4-aligned columns).
     int base_alignment = 0;
     int type_size = 0;
     {
         fParamType type;
         parse_blank(c);
-        if      (parse_match(c, "float"))     { type = FRAKTAL_PARAM_FLOAT;      type_size = 1;  base_alignment = 1; }
-        else if (parse_match(c, "vec2"))      { type = FRAKTAL_PARAM_FLOAT_VEC2; type_size = 2;  base_alignment = 2; }
-        else if (parse_match(c, "vec3"))      { type = FRAKTAL_PARAM_FLOAT_VEC3; type_size = 3;  base_alignment = 4; }
-        else if (parse_match(c, "vec4"))      { type = FRAKTAL_PARAM_FLOAT_VEC4; type_size = 4;  base_alignment = 4; }
-        else if (parse_match(c, "mat2"))      { type = FRAKTAL_PARAM_FLOAT_MAT2; type_size = 4;  base_alignment = 2; }
-        else if (parse_match(c, "mat3"))      { type = FRAKTAL_PARAM_FLOAT_MAT3; type_size = 12; base_alignment = 4; }
-        else if (parse_match(c, "mat4"))      { type = FRAKTAL_PARAM_FLOAT_MAT4; type_size = 16; base_alignment = 4; }
-        else if (parse_match(c, "int"))       { type = FRAKTAL_PARAM_INT;        type_size = 1; base_alignment = 1; }
-        else if (parse_match(c, "ivec2"))     { type = FRAKTAL_PARAM_INT_VEC2;   type_size = 2; base_alignment = 2; }
-        else if (parse_match(c, "ivec3"))     { type = FRAKTAL_PARAM_INT_VEC3;   type_size = 4; base_alignment = 4; }
-        else if (parse_match(c, "ivec4"))     { type = FRAKTAL_PARAM_INT_VEC4;   type_size = 4; base_alignment = 4; }
+        if      (parse_match(c, "float"))     { type = FRAKTAL_PARAM_FLOAT;      type_size = 4;  base_alignment = 4; }
+        else if (parse_match(c, "vec2"))      { type = FRAKTAL_PARAM_FLOAT_VEC2; type_size = 8;  base_alignment = 8; }
+        else if (parse_match(c, "vec3"))      { type = FRAKTAL_PARAM_FLOAT_VEC3; type_size = 12; base_alignment = 16; }
+        else if (parse_match(c, "vec4"))      { type = FRAKTAL_PARAM_FLOAT_VEC4; type_size = 16; base_alignment = 16; }
+        else if (parse_match(c, "mat2"))      { type = FRAKTAL_PARAM_FLOAT_MAT2; type_size = 32; base_alignment = 16; }
+        else if (parse_match(c, "mat3"))      { type = FRAKTAL_PARAM_FLOAT_MAT3; type_size = 48; base_alignment = 16; }
+        else if (parse_match(c, "mat4"))      { type = FRAKTAL_PARAM_FLOAT_MAT4; type_size = 64; base_alignment = 16; }
+        else if (parse_match(c, "int"))       { type = FRAKTAL_PARAM_INT;        type_size = 4;  base_alignment = 4; }
+        else if (parse_match(c, "ivec2"))     { type = FRAKTAL_PARAM_INT_VEC2;   type_size = 8;  base_alignment = 8; }
+        else if (parse_match(c, "ivec3"))     { type = FRAKTAL_PARAM_INT_VEC3;   type_size = 12; base_alignment = 16; }
+        else if (parse_match(c, "ivec4"))     { type = FRAKTAL_PARAM_INT_VEC4;   type_size = 16; base_alignment = 16; }
         else if (parse_match(c, "sampler1D")) { type = FRAKTAL_PARAM_SAMPLER1D; p->assigned_tex_unit[param] = p->sampler_count++; }
         else if (parse_match(c, "sampler2D")) { type = FRAKTAL_PARAM_SAMPLER2D; p->assigned_tex_unit[param] = p->sampler_count++; }
+        else if (parse_match(c, "isampler1D")) { type = FRAKTAL_PARAM_ISAMPLER1D; p->assigned_tex_unit[param] = p->sampler_count++; }
+        else if (parse_match(c, "isampler2D")) { type = FRAKTAL_PARAM_ISAMPLER2D; p->assigned_tex_unit[param] = p->sampler_count++; }
+        else if (parse_match(c, "usampler1D")) { type = FRAKTAL_PARAM_USAMPLER1D; p->assigned_tex_unit[param] = p->sampler_count++; }
+        else if (parse_match(c, "usampler2D")) { type = FRAKTAL_PARAM_USAMPLER2D; p->assigned_tex_unit[param] = p->sampler_count++; }
+        else if (parse_match(c, "sampler3D")) { type = FRAKTAL_PARAM_SAMPLER3D; p->assigned_tex_unit[param] = p->sampler_count++; }
+        else if (parse_match(c, "isampler3D")) { type = FRAKTAL_PARAM_ISAMPLER3D; p->assigned_tex_unit[param] = p->sampler_count++; }
+        else if (parse_match(c, "usampler3D")) { type = FRAKTAL_PARAM_USAMPLER3D; p->assigned_tex_unit[param] = p->sampler_count++; }
         else
         {
             parse_error(*c, "invalid parameter type.\n");
@@ -509,16 +517,16 @@ static bool parse_param(const char **c, fParams *p, int param)
         }
         if (type_size > 0)
         {
-            int offset = prev_offset;
-            offset += prev_size;
-            if (base_alignment > 1)
-                offset += base_alignment - (offset % base_alignment);
+            int offset = prev_offset + prev_size;
+            offset = ((offset + base_alignment - 1) / base_alignment)*base_alignment;
             p->std140_offset[param] = offset;
             p->std140_size[param] = type_size;
         }
         else
         {
-            p->std140_offset[param] = prev_offset;
+            // samplers are not in the block, but the next parameter
+            // must still be placed after the previous one
+            p->std140_offset[param] = prev_offset + prev_size;
             p->std140_size[param] = 0;
         }
     }
@@ -580,35 +588,307 @@ static bool parse_param(const char **c, fParams *p, int param)
     return true;
 }
 
-static bool parse_fraktal_source(char *fs, fParams *p, const char *name)
+static const char *parse_param_type_name(fParamType type)
+{
+    switch (type)
+    {
+        case FRAKTAL_PARAM_FLOAT:      return "float";
+        case FRAKTAL_PARAM_FLOAT_VEC2: return "vec2";
+        case FRAKTAL_PARAM_FLOAT_VEC3: return "vec3";
+        case FRAKTAL_PARAM_FLOAT_VEC4: return "vec4";
+        case FRAKTAL_PARAM_FLOAT_MAT2: return "mat2";
+        case FRAKTAL_PARAM_FLOAT_MAT3: return "mat3";
+        case FRAKTAL_PARAM_FLOAT_MAT4: return "mat4";
+        case FRAKTAL_PARAM_INT:        return "int";
+        case FRAKTAL_PARAM_INT_VEC2:   return "ivec2";
+        case FRAKTAL_PARAM_INT_VEC3:   return "ivec3";
+        case FRAKTAL_PARAM_INT_VEC4:   return "ivec4";
+        case FRAKTAL_PARAM_SAMPLER1D:  return "sampler1D";
+        case FRAKTAL_PARAM_SAMPLER2D:  return "sampler2D";
+        case FRAKTAL_PARAM_ISAMPLER1D: return "isampler1D";
+        case FRAKTAL_PARAM_ISAMPLER2D: return "isampler2D";
+        case FRAKTAL_PARAM_USAMPLER1D: return "usampler1D";
+        case FRAKTAL_PARAM_USAMPLER2D: return "usampler2D";
+        case FRAKTAL_PARAM_SAMPLER3D:  return "sampler3D";
+        case FRAKTAL_PARAM_ISAMPLER3D: return "isampler3D";
+        case FRAKTAL_PARAM_USAMPLER3D: return "usampler3D";
+    }
+    return NULL;
+}
+
+/*
+Parameter declarations are blanked out of 'fs' (keeping line breaks, so
+that line numbers in compiler errors are unchanged), as the linker emits
+a single declaration of each parameter (see link_param_declarations).
+A parameter that is declared more than once, e.g. by a model and by a
+renderer, is only added to 'p' once.
+
+Global 'out' variables are appended to 'outputs' (if given), so that the
+linker can assign them consecutive color attachments. Function arguments
+qualified with 'out' are skipped by tracking the nesting depth.
+*/
+static bool parse_output(const char **c, fOutputs *outputs)
+{
+    const char *declaration = *c;
+    parse_blank(c);
+    parse_alpha(c); // type
+    parse_blank(c);
+    const char *name_start = *c;
+    parse_alpha(c);
+    size_t name_len = *c - name_start;
+    if (name_len == 0)
+    {
+        parse_error(declaration, "missing output name\n");
+        return false;
+    }
+    if (name_len > FRAKTAL_MAX_PARAM_NAME_LEN)
+    {
+        parse_error(name_start, "output name is too long.\n");
+        return false;
+    }
+    for (int i = 0; i < outputs->count; i++)
+        if (strncmp(outputs->name[i], name_start, name_len) == 0 && outputs->name[i][name_len] == '\0')
+            return true;
+    if (outputs->count == FRAKTAL_MAX_OUTPUTS)
+    {
+        parse_error(declaration, "exceeded maximum number of outputs in kernel.\n");
+        return false;
+    }
+    memcpy(outputs->name[outputs->count], name_start, name_len);
+    outputs->name[outputs->count][name_len] = '\0';
+    outputs->count++;
+    return true;
+}
+
+static bool parse_fraktal_source(char *fs, fParams *p, const char *name, int *num_declarations=NULL, fOutputs *outputs=NULL)
 {
     parse_error_start = fs;
     parse_error_name = name;
+    if (num_declarations)
+        *num_declarations = 0;
+    int depth = 0;
     char *cw = fs;
     while (*cw)
     {
         const char **c = (const char**)&cw;
-        parse_comment(c);
-        parse_blank(c);
+        while (parse_comment(c) || parse_blank(c))
+            ;
         if (parse_is_alpha(**c))
         {
+            char *declaration = cw;
             if (parse_match(c, "uniform"))
             {
                 int param = p->count;
                 if (!parse_param(c, p, param))
                     return false;
 
-                p->count++;
+                for (char *d = declaration; d < cw; d++)
+                    if (*d != '\n' && *d != '\r')
+                        *d = ' ';
+                if (num_declarations)
+                    (*num_declarations)++;
+
+                int existing = -1;
+                for (int i = 0; i < param; i++)
+                    if (strcmp(p->name[i], p->name[param]) == 0)
+                        existing = i;
+                if (existing < 0)
+                {
+                    p->count++;
+                }
+                else if (p->type[existing] != p->type[param])
+                {
+                    parse_error(declaration, "parameter was previously declared with a different type.\n");
+                    return false;
+                }
+                else if (fraktal_is_sampler_param(p->type[param]))
+                {
+                    p->sampler_count--; // was assigned a texture unit
+                }
+            }
+            else if (depth == 0 && outputs && parse_match(c, "out"))
+            {
+                if (!parse_output(c, outputs))
+                    return false;
             }
             else
             {
                 parse_alpha(c);
             }
         }
-        else
+        else if (*cw)
         {
+            if (*cw == '{' || *cw == '(') depth++;
+            if (*cw == '}' || *cw == ')') depth--;
             cw++;
         }
     }
     return true;
 }
+
+// Appends 'n' characters of 's' to a growing NULL-terminated buffer.
+static void parse_append(char **buffer, size_t *length, size_t *capacity, const char *s, size_t n)
+{
+    if (*length + n + 1 > *capacity)
+    {
+        size_t new_capacity = *capacity ? *capacity : 1024;
+        while (*length + n + 1 > new_capacity)
+            new_capacity *= 2;
+        *buffer = (char*)realloc(*buffer, new_capacity);
+        assert(*buffer && "Ran out of memory");
+        *capacity = new_capacity;
+    }
+    memcpy(*buffer + *length, s, n);
+    *length += n;
+    (*buffer)[*length] = '\0';
+}
+
+static const char *parse_skip_blank_and_comments(const char *c)
+{
+    while (parse_comment(&c) || parse_blank(&c))
+        ;
+    return c;
+}
+
+static bool parse_starts_with_word(const char *c, const char *word)
+{
+    c = parse_skip_blank_and_comments(c);
+    return parse_match(&c, word);
+}
+
+// Skips a {...} block starting at 'c' and returns a pointer past its end.
+static const char *parse_skip_block(const char *c)
+{
+    assert(*c == '{');
+    int depth = 0;
+    while (*c)
+    {
+        if (parse_comment(&c))
+            continue;
+        if (*c == '{') depth++;
+        else if (*c == '}' && --depth == 0)
+            return c + 1;
+        c++;
+    }
+    return c;
+}
+
+/*
+Extracts the declarations that other kernel inputs need in order to use a
+library compiled as a separate shader: preprocessor directives (except
+#version and #line), function prototypes, struct definitions, constants
+and uniforms. Function bodies and non-constant global variables are left
+out. The result is appended to 'buffer'.
+*/
+static void parse_library_interface(const char *src, char **buffer, size_t *length, size_t *capacity)
+{
+    const char *c = src;
+    const char *stmt = src;         // start of the current top-level statement
+    const char *close_paren = NULL; // last ')' at parenthesis depth 0 in the statement
+    bool stmt_empty = true;
+    bool has_assign = false;
+    bool line_start = true;
+    int parens = 0;
+    while (*c)
+    {
+        if (c[0] == '/' && c[1] == '/')
+        {
+            parse_comment(&c);
+            line_start = true;
+            continue;
+        }
+        if (parse_comment(&c))
+            continue;
+        if (*c == '\n' || *c == '\r')
+        {
+            line_start = true;
+            c++;
+            continue;
+        }
+        if (*c == ' ' || *c == '\t')
+        {
+            c++;
+            continue;
+        }
+        if (*c == '#' && line_start)
+        {
+            // directives continue onto the next line if it ends with '\'
+            const char *begin = c;
+            for (;;)
+            {
+                while (*c && *c != '\n' && *c != '\r')
+                    c++;
+                const char *end = c;
+                while (end > begin && (end[-1] == ' ' || end[-1] == '\t'))
+                    end--;
+                if (*c && end[-1] == '\\')
+                {
+                    if (*c == '\r') c++;
+                    if (*c == '\n') c++;
+                    continue;
+                }
+                break;
+            }
+            const char *directive = begin + 1;
+            parse_blank(&directive);
+            if (!parse_match(&directive, "version") && !parse_match(&directive, "line"))
+            {
+                parse_append(buffer, length, capacity, begin, c - begin);
+                parse_append(buffer, length, capacity, "\n", 1);
+            }
+            if (stmt_empty)
+                stmt = c;
+            continue;
+        }
+
+        line_start = false;
+        stmt_empty = false;
+        if (*c == '(')
+        {
+            parens++;
+        }
+        else if (*c == ')')
+        {
+            parens--;
+            if (parens == 0)
+                close_paren = c;
+        }
+        else if (*c == '=' && parens == 0)
+        {
+            has_assign = true;
+        }
+        else if (*c == '{' && parens == 0)
+        {
+            bool is_function = close_paren && parse_skip_blank_and_comments(close_paren + 1) == c;
+            c = parse_skip_block(c);
+            if (is_function)
+            {
+                parse_append(buffer, length, capacity, stmt, close_paren + 1 - stmt);
+                parse_append(buffer, length, capacity, ";\n", 2);
+                stmt = c;
+                stmt_empty = true;
+                close_paren = NULL;
+                has_assign = false;
+            }
+            // else: a struct definition or uniform block, ended by ';'
+            continue;
+        }
+        else if (*c == ';' && parens == 0)
+        {
+            bool is_prototype = close_paren && !has_assign;
+            if (is_prototype ||
+                parse_starts_with_word(stmt, "const") ||
+                parse_starts_with_word(stmt, "struct") ||
+                parse_starts_with_word(stmt, "uniform"))
+            {
+                parse_append(buffer, length, capacity, stmt, c + 1 - stmt);
+                parse_append(buffer, length, capacity, "\n", 1);
+            }
+            stmt = c + 1;
+            stmt_empty = true;
+            close_paren = NULL;
+            has_assign = false;
+        }
+        c++;
+    }
+}
@@ -0,0 +1,1164 @@
+// Developed by Simen Haugo.
+// See LICENSE.txt for copyright and licensing details (standard MIT License).
+
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "reuse/log.h"
+
+/*
+The software backend (compiled with -D FRAKTAL_SOFTWARE) implements the
+core library without a GPU. Kernels are translated to C++, compiled by
+the system compiler into a shared library and loaded with dlopen (see
+fraktal_software_link.h), and their pixels are shaded in tiles by a pool
+of threads. Arrays live in CPU memory, with each value stored as 32 bits:
+as a float for floating-point and normalized formats, and as an int for
+integer formats. Values are rounded to the precision of the array format
+when they are written, so results match those of the OpenGL backend up
+to floating-point differences.
+*/
+
+#if defined(_WIN32)
+#error "The software backend needs dlopen and is not supported on Windows."
+#endif
+
+struct fKernel;
+struct fPendingLink;
+
+struct fContext
+{
+    fKernel *current_kernel;
+    bool kernel_stats; // see fraktal_enable_kernel_stats
+    fKernelStats transfers;
+};
+
+// Runs are synchronous, so kernel statistics are measured on the CPU
+static double fraktal_timer_ms()
+{
+    using namespace std::chrono;
+    return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+static thread_local fContext *fraktal_current_context = NULL;
+
+fContext *fraktal_create_context()
+{
+    fContext *c = (fContext*)calloc(1, sizeof(fContext));
+    fraktal_assert(c && "Ran out of memory");
+    fraktal_set_current_context(c);
+    return c;
+}
+
+void fraktal_destroy_context(fContext *c)
+{
+    if (!c)
+        return;
+    if (fraktal_current_context == c)
+        fraktal_current_context = NULL;
+    free(c);
+}
+
+void fraktal_set_current_context(fContext *c)
+{
+    fraktal_current_context = c;
+}
+
+fContext *fraktal_get_current_context()
+{
+    return fraktal_current_context;
+}
+
+// There is no GPU context to make current
+void fraktal_push_current_context() { }
+void fraktal_pop_current_context() { }
+
+static void fraktal_ensure_context()
+{
+    if (!fraktal_current_context)
+    {
+        fraktal_current_context = (fContext*)calloc(1, sizeof(fContext));
+        fraktal_assert(fraktal_current_context && "Ran out of memory");
+    }
+}
+
+//
+// Arrays
+//
+
+struct fArray
+{
+    void *data; // 32-bit values, see above
+    int width;
+    int height;
+    int depth; // 0 unless the array is a 3D array
+    int count; // number of points if created by fraktal_create_points, otherwise 0
+    int channels;
+    fEnum format;
+    fEnum access;
+    fContext *context;
+};
+
+// Same as the smallest GL_MAX_TEXTURE_SIZE of common drivers, so that
+// points are folded the same way by both backends.
+enum { FRAKTAL_SOFTWARE_MAX_ARRAY_SIZE = 16384 };
+
+static int fraktal_format_size(fEnum format)
+{
+    if (format == FRAKTAL_FLOAT)  return 4;
+    if (format == FRAKTAL_HALF)   return 2;
+    if (format == FRAKTAL_UINT8)  return 1;
+    if (format == FRAKTAL_UINT16) return 2;
+    if (format == FRAKTAL_UINT32) return 4;
+    if (format == FRAKTAL_INT32)  return 4;
+    return 0;
+}
+
+static bool fraktal_is_integer_format(fEnum format)
+{
+    return format == FRAKTAL_UINT32 || format == FRAKTAL_INT32;
+}
+
+static size_t fraktal_array_values(fArray *a)
+{
+    size_t slices = a->depth > 0 ? a->depth : 1;
+    return (size_t)a->width*a->height*slices*a->channels;
+}
+
+// Number of values as they are laid out in CPU memory. This is less than
+// fraktal_array_values for points, as the last row of the fold is padded.
+static size_t fraktal_array_data_values(fArray *a)
+{
+    if (a->count > 0)
+        return (size_t)a->count*a->channels;
+    return fraktal_array_values(a);
+}
+
+// IEEE 754 half precision, rounded to nearest even
+static uint16_t fraktal_float_to_half(float f)
+{
+    uint32_t x; memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mantissa = x & 0x7fffff;
+    int exponent = (int)((x >> 23) & 0xff);
+    if (exponent == 255)
+        return (uint16_t)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+    exponent = exponent - 127 + 15;
+    if (exponent >= 31)
+        return (uint16_t)(sign | 0x7c00);
+    int shift = 13;
+    uint32_t h = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    if (exponent <= 0)
+    {
+        if (exponent < -10)
+            return (uint16_t)sign;
+        mantissa |= 0x800000;
+        shift = 14 - exponent;
+        h = mantissa >> shift;
+    }
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t half = 1u << (shift - 1);
+    if (rest > half || (rest == half && (h & 1)))
+        h++; // may carry into the exponent, which is the correct result
+    return (uint16_t)(sign | h);
+}
+
+static float fraktal_half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    if (exponent == 0)
+    {
+        float f = ldexpf((float)mantissa, -24);
+        return sign ? -f : f;
+    }
+    uint32_t x;
+    if (exponent == 31)
+        x = sign | 0x7f800000 | (mantissa << 13);
+    else
+        x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    float f; memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+static float fraktal_unorm(float x, float max)
+{
+    x = x < 0.0f ? 0.0f : x > 1.0f ? 1.0f : x;
+    return floorf(x*max + 0.5f)/max;
+}
+
+// Converts 'n' packed values from CPU memory to their 32-bit representation
+static void fraktal_unpack_values(fArray *a, size_t first, size_t n, const void *src)
+{
+    float *dst = (float*)a->data + first;
+    if (a->format == FRAKTAL_FLOAT || fraktal_is_integer_format(a->format))
+        memcpy(dst, src, n*4);
+    else if (a->format == FRAKTAL_HALF)
+        for (size_t i = 0; i < n; i++) dst[i] = fraktal_half_to_float(((const uint16_t*)src)[i]);
+    else if (a->format == FRAKTAL_UINT8)
+        for (size_t i = 0; i < n; i++) dst[i] = ((const uint8_t*)src)[i]/255.0f;
+    else if (a->format == FRAKTAL_UINT16)
+        for (size_t i = 0; i < n; i++) dst[i] = ((const uint16_t*)src)[i]/65535.0f;
+}
+
+static void fraktal_pack_values(fArray *a, size_t first, size_t n, void *dst)
+{
+    const float *src = (const float*)a->data + first;
+    if (a->format == FRAKTAL_FLOAT || fraktal_is_integer_format(a->format))
+        memcpy(dst, src, n*4);
+    else if (a->format == FRAKTAL_HALF)
+        for (size_t i = 0; i < n; i++) ((uint16_t*)dst)[i] = fraktal_float_to_half(src[i]);
+    else if (a->format == FRAKTAL_UINT8)
+        for (size_t i = 0; i < n; i++) ((uint8_t*)dst)[i] = (uint8_t)(fraktal_unorm(src[i], 255.0f)*255.0f + 0.5f);
+    else if (a->format == FRAKTAL_UINT16)
+        for (size_t i = 0; i < n; i++) ((uint16_t*)dst)[i] = (uint16_t)(fraktal_unorm(src[i], 65535.0f)*65535.0f + 0.5f);
+}
+
+static fArray *fraktal_create_array_nd(
+    const void *data,
+    int width,
+    int height,
+    int depth,
+    int channels,
+    fEnum format,
+    fEnum access,
+    int count=0)
+{
+    fraktal_ensure_context();
+    fraktal_assert(channels > 0 && channels <= 4);
+    fraktal_assert(width > 0 && height > 0 && depth >= 0);
+    fraktal_assert(access == FRAKTAL_READ_ONLY || access == FRAKTAL_READ_WRITE);
+    fraktal_assert(channels == 1 || channels == 2 || channels == 4);
+    fraktal_assert(fraktal_format_size(format) > 0 && "Invalid array format");
+
+    fArray *a = (fArray*)calloc(1, sizeof(fArray));
+    fraktal_assert(a && "Ran out of memory");
+    a->width = width;
+    a->height = height;
+    a->depth = depth;
+    a->count = count;
+    a->channels = channels;
+    a->format = format;
+    a->access = access;
+    a->context = fraktal_current_context;
+    a->data = calloc(fraktal_array_values(a), 4);
+    if (!a->data)
+    {
+        free(a);
+        log_err("Failed to allocate array.\n");
+        return NULL;
+    }
+    if (data)
+        fraktal_unpack_values(a, 0, fraktal_array_data_values(a), data);
+    return a;
+}
+
+fArray *fraktal_create_array(
+    const void *data,
+    int width,
+    int height,
+    int channels,
+    fEnum format,
+    fEnum access)
+{
+    return fraktal_create_array_nd(data, width, height, 0, channels, format, access);
+}
+
+fArray *fraktal_create_array_3d(
+    const void *data,
+    int width,
+    int height,
+    int depth,
+    int channels,
+    fEnum format,
+    fEnum access)
+{
+    fraktal_assert(depth > 0);
+    return fraktal_create_array_nd(data, width, height, depth, channels, format, access);
+}
+
+fArray *fraktal_create_points(
+    const void *data,
+    int count,
+    int channels,
+    fEnum format,
+    fEnum access)
+{
+    fraktal_ensure_context();
+    fraktal_assert(count > 0);
+    int max_size = FRAKTAL_SOFTWARE_MAX_ARRAY_SIZE;
+    int width = count < max_size ? count : max_size;
+    int height = (count + width - 1) / width;
+    if (height > max_size)
+    {
+        log_err("Too many points: at most %d x %d are supported.\n", max_size, max_size);
+        return NULL;
+    }
+    return fraktal_create_array_nd(data, width, height, 0, channels, format, access, count);
+}
+
+void fraktal_destroy_array(fArray *a)
+{
+    if (a)
+    {
+        fraktal_ensure_context();
+        fraktal_assert(a->context == fraktal_current_context && "Array was created in a different context");
+        free(a->data);
+        free(a);
+    }
+}
+
+// Arrays are plain CPU allocations, which are not worth pooling
+void fraktal_set_array_pool_budget(size_t max_bytes) { (void)max_bytes; }
+void fraktal_trim_array_pool(size_t max_bytes) { (void)max_bytes; }
+
+void fraktal_zero_array(fArray *a)
+{
+    fraktal_assert(a);
+    fraktal_assert(a->access == FRAKTAL_READ_WRITE);
+    fraktal_ensure_context();
+    fraktal_assert(a->context == fraktal_current_context && "Array was created in a different context");
+    double begin = fraktal_timer_ms();
+    memset(a->data, 0, fraktal_array_values(a)*4);
+    if (fraktal_current_context->kernel_stats)
+        fraktal_add_kernel_time(&fraktal_current_context->transfers, fraktal_timer_ms() - begin, (long long)fraktal_array_values(a)/a->channels);
+}
+
+void fraktal_to_cpu(void *cpu_memory, fArray *a)
+{
+    fraktal_assert(cpu_memory);
+    fraktal_assert(a);
+    fraktal_ensure_context();
+    fraktal_assert(a->context == fraktal_current_context && "Array was created in a different context");
+    double begin = fraktal_timer_ms();
+    fraktal_pack_values(a, 0, fraktal_array_data_values(a), cpu_memory);
+    if (fraktal_current_context->kernel_stats)
+        fraktal_add_kernel_time(&fraktal_current_context->transfers, fraktal_timer_ms() - begin, (long long)fraktal_array_data_values(a)/a->channels);
+}
+
+void fraktal_to_cpu_region(fArray *a, int x, int y, int width, int height, void *cpu_memory)
+{
+    fraktal_assert(cpu_memory);
+    fraktal_assert(a);
+    fraktal_assert(width > 0 && height > 0);
+    fraktal_assert(x >= 0 && y >= 0 && x + width <= a->width && y + height <= a->height && "Region is outside the array.");
+    fraktal_assert(a->depth == 0 && "3D arrays are not supported.");
+    fraktal_ensure_context();
+    fraktal_assert(a->context == fraktal_current_context && "Array was created in a different context");
+    size_t row_bytes = (size_t)width*a->channels*fraktal_format_size(a->format);
+    for (int row = 0; row < height; row++)
+    {
+        size_t first = ((size_t)(y + row)*a->width + x)*a->channels;
+        fraktal_pack_values(a, first, (size_t)width*a->channels, (char*)cpu_memory + row*row_bytes);
+    }
+}
+
+void fraktal_upload_region(fArray *a, int x, int y, int width, int height, const void *cpu_memory)
+{
+    fraktal_assert(cpu_memory);
+    fraktal_assert(a);
+    fraktal_assert(width > 0 && height > 0);
+    fraktal_assert(x >= 0 && y >= 0 && x + width <= a->width && y + height <= a->height && "Region is outside the array.");
+    fraktal_assert(a->depth == 0 && "3D arrays are not supported.");
+    fraktal_ensure_context();
+    fraktal_assert(a->context == fraktal_current_context && "Array was created in a different context");
+    size_t row_bytes = (size_t)width*a->channels*fraktal_format_size(a->format);
+    for (int row = 0; row < height; row++)
+    {
+        size_t first = ((size_t)(y + row)*a->width + x)*a->channels;
+        fraktal_unpack_values(a, first, (size_t)width*a->channels, (const char*)cpu_memory + row*row_bytes);
+    }
+}
+
+void fraktal_update_array(fArray *a, const void *cpu_memory)
+{
+    fraktal_assert(cpu_memory);
+    fraktal_assert(a);
+    fraktal_ensure_context();
+    fraktal_assert(a->context == fraktal_current_context && "Array was created in a different context");
+    fraktal_unpack_values(a, 0, fraktal_array_data_values(a), cpu_memory);
+}
+
+// Kernels have finished by the time fraktal_run_kernel returns, so the
+// values are copied immediately.
+struct fTransfer
+{
+    fContext *context;
+};
+
+fTransfer *fraktal_to_cpu_async(void *cpu_memory, fArray *a)
+{
+    fraktal_to_cpu(cpu_memory, a);
+    fTransfer *t = (fTransfer*)calloc(1, sizeof(fTransfer));
+    fraktal_assert(t && "Ran out of memory");
+    t->context = fraktal_current_context;
+    return t;
+}
+
+bool fraktal_poll(fTransfer *t)
+{
+    fraktal_assert(t);
+    fraktal_ensure_context();
+    fraktal_assert(t->context == fraktal_current_context && "Transfer was started in a different context");
+    free(t);
+    return true;
+}
+
+void fraktal_wait(fTransfer *t)
+{
+    fraktal_poll(t);
+}
+
+void fraktal_array_size(fArray *a, int *width, int *height)
+{
+    if (a)
+    {
+        if (width) *width = a->width;
+        if (height) *height = a->height;
+    }
+}
+
+int fraktal_array_depth(fArray *a)
+{
+    if (a) return a->depth;
+    return 0;
+}
+
+int fraktal_array_count(fArray *a)
+{
+    if (a) return a->count;
+    return 0;
+}
+
+int fraktal_array_channels(fArray *a)
+{
+    if (a) return a->channels;
+    return 0;
+}
+
+fEnum fraktal_array_format(fArray *a)
+{
+    if (a) return a->format;
+    return -1;
+}
+
+bool fraktal_is_valid_array(fArray *a)
+{
+    return a &&
+           a->data &&
+           a->width > 0 &&
+           a->height > 0 &&
+           a->depth >= 0 &&
+           a->count >= 0 &&
+           (a->channels == 1 || a->channels == 2 || a->channels == 4) &&
+           (a->access == FRAKTAL_READ_ONLY || a->access == FRAKTAL_READ_WRITE) &&
+           fraktal_format_size(a->format) > 0;
+}
+
+unsigned int fraktal_get_gl_handle(fArray *a)
+{
+    (void)a;
+    return 0;
+}
+
+//
+// Thread pool
+//
+
+/*
+Kernels are run by a pool of threads that is shared by all contexts, and
+that is resized when fraktal_set_cpu_threads is called. A job is a number
+of units (tiles of pixels) that are split evenly between the workers
+up front. Each worker takes units from the front of its own range, and
+when it runs out, steals the back half of the largest remaining range.
+This balances the load when some tiles are much more expensive than
+others (e.g. tiles of sky next to tiles of detailed geometry). The thread
+that submits the job takes part as worker 0.
+*/
+typedef void (*fSoftwareTask)(void *data, int unit);
+
+struct fSoftwareWorker
+{
+    // first and one-past-last unit of the range, packed as (begin << 32) | end
+    std::atomic<uint64_t> range;
+    char padding[64 - sizeof(std::atomic<uint64_t>)]; // one cache line per worker
+};
+
+struct fSoftwarePool
+{
+    std::mutex submit; // held while a job is running
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::thread *threads; // num_workers - 1 helper threads
+    fSoftwareWorker *workers;
+    int num_workers;
+    uint64_t generation; // incremented for each job
+    int running; // helper threads that have not finished the current job
+    bool quit;
+    fSoftwareTask task;
+    void *data;
+};
+
+static uint64_t fraktal_pack_range(uint32_t begin, uint32_t end)
+{
+    return ((uint64_t)begin << 32) | end;
+}
+
+static void fraktal_software_work(fSoftwarePool *pool, int index)
+{
+    fSoftwareWorker *self = &pool->workers[index];
+    for (;;)
+    {
+        uint64_t range = self->range.load();
+        uint32_t begin = (uint32_t)(range >> 32);
+        uint32_t end = (uint32_t)range;
+        if (begin < end)
+        {
+            if (self->range.compare_exchange_weak(range, fraktal_pack_range(begin + 1, end)))
+                pool->task(pool->data, (int)begin);
+            continue;
+        }
+
+        int victim = -1;
+        uint32_t most = 0;
+        uint64_t victim_range = 0;
+        for (int i = 0; i < pool->num_workers; i++)
+        {
+            uint64_t r = pool->workers[i].range.load();
+            uint32_t b = (uint32_t)(r >> 32);
+            uint32_t e = (uint32_t)r;
+            if (b < e && e - b > most)
+            {
+                most = e - b;
+                victim = i;
+                victim_range = r;
+            }
+        }
+        if (victim < 0)
+            return;
+
+        // the victim keeps [b, mid) and the thief takes [mid, e). Other
+        // threads only modify a range that is non-empty, and ours is empty.
+        uint32_t b = (uint32_t)(victim_range >> 32);
+        uint32_t e = (uint32_t)victim_range;
+        uint32_t mid = b + (e - b)/2;
+        if (pool->workers[victim].range.compare_exchange_strong(victim_range, fraktal_pack_range(b, mid)))
+            self->range.store(fraktal_pack_range(mid, e));
+    }
+}
+
+static void fraktal_software_helper(fSoftwarePool *pool, int index)
+{
+    uint64_t seen = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            while (!pool->quit && pool->generation == seen)
+                pool->wake.wait(lock);
+            if (pool->quit)
+                return;
+            seen = pool->generation;
+        }
+        fraktal_software_work(pool, index);
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            if (--pool->running == 0)
+                pool->done.notify_one();
+        }
+    }
+}
+
+// The pool is never destroyed, so that no threads are joined at exit
+static fSoftwarePool &fraktal_software_pool()
+{
+    static fSoftwarePool *pool = new fSoftwarePool();
+    return *pool;
+}
+
+// Called with the submit lock held
+static void fraktal_resize_software_pool(fSoftwarePool &pool, int num_workers)
+{
+    if (pool.num_workers == num_workers)
+        return;
+    if (pool.threads)
+    {
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            pool.quit = true;
+        }
+        pool.wake.notify_all();
+        for (int i = 0; i < pool.num_workers - 1; i++)
+            pool.threads[i].join();
+        delete[] pool.threads;
+        pool.threads = NULL;
+        pool.quit = false;
+    }
+    delete[] pool.workers;
+    pool.workers = new fSoftwareWorker[num_workers];
+    for (int i = 0; i < num_workers; i++)
+        pool.workers[i].range.store(0);
+    pool.num_workers = num_workers;
+    pool.generation = 0;
+    if (num_workers > 1)
+    {
+        pool.threads = new std::thread[num_workers - 1];
+        for (int i = 0; i < num_workers - 1; i++)
+            pool.threads[i] = std::thread(fraktal_software_helper, &pool, i + 1);
+    }
+}
+
+// Calls task(data, unit) for each unit in [0, count) and returns when all
+// calls have returned. Jobs submitted by different threads run one at a time.
+static void fraktal_software_parallel(int count, fSoftwareTask task, void *data)
+{
+    if (count <= 0)
+        return;
+    int num_workers = fraktal_cpu_threads;
+    if (num_workers <= 0)
+        num_workers = (int)std::thread::hardware_concurrency();
+    if (num_workers <= 0)
+        num_workers = 1;
+
+    fSoftwarePool &pool = fraktal_software_pool();
+    std::lock_guard<std::mutex> submit(pool.submit);
+    fraktal_resize_software_pool(pool, num_workers);
+    if (num_workers == 1 || count == 1)
+    {
+        for (int unit = 0; unit < count; unit++)
+            task(data, unit);
+        return;
+    }
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        uint32_t begin = (uint32_t)((int64_t)count*i/num_workers);
+        uint32_t end = (uint32_t)((int64_t)count*(i + 1)/num_workers);
+        pool.workers[i].range.store(fraktal_pack_range(begin, end));
+    }
+    pool.task = task;
+    pool.data = data;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.running = num_workers - 1;
+        pool.generation++;
+    }
+    pool.wake.notify_all();
+    fraktal_software_work(&pool, 0);
+    {
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        while (pool.running > 0)
+            pool.done.wait(lock);
+    }
+}
+
+//
+// Kernels
+//
+
+// Must match fsampler and frun in fraktal_glsl.h
+struct fSoftwareSampler
+{
+    const void *data;
+    int width;
+    int height;
+    int depth;
+    int channels;
+};
+
+struct fSoftwareRun
+{
+    int points_width;
+    fSoftwareSampler points;
+    fSoftwareSampler batch_table;
+};
+
+// Shades pixels [x0, x1) of row y, and writes four 32-bit values per output
+// and pixel to 'out'. keep[x - x0] is set to 0 if the pixel was discarded.
+typedef void (*fSoftwareShade)(int x0, int x1, int y, int slice, int batch, float origin_x, float origin_y, uint32_t *out, unsigned char *keep);
+
+struct fKernel
+{
+    void *module; // handle returned by dlopen (NULL until linked)
+    fParams params;
+    fPendingLink *pending; // non-NULL until an asynchronous link has finished
+    fContext *context;
+
+    // parameters except samplers, in std140 layout, which are copied into
+    // the module before each run (see fraktal_prepare_software_run)
+    unsigned char *param_data;
+    int param_data_size;
+    void *param_addresses[FRAKTAL_MAX_PARAMS]; // variables in the module
+    fArray *arrays[FRAKTAL_MAX_PARAMS]; // indexed by assigned texture unit
+
+    fSoftwareRun *run;
+    fSoftwareShade shade;
+    int num_outputs;
+
+    fKernelStats stats; // see fraktal_enable_kernel_stats
+
+    // the module file, kept for fraktal_export_kernel
+    unsigned char *binary;
+    size_t binary_length;
+};
+
+static int fraktal_param_data_size(fParams *p)
+{
+    int size = 0;
+    for (int i = 0; i < p->count; i++)
+        if (p->std140_offset[i] + p->std140_size[i] > size)
+            size = p->std140_offset[i] + p->std140_size[i];
+    return ((size + 15)/16)*16;
+}
+
+static fKernel *fraktal_get_current_kernel()
+{
+    return fraktal_current_context ? fraktal_current_context->current_kernel : NULL;
+}
+
+// Array parameters are addressed by their texture unit, as there are no
+// uniform locations.
+static void fraktal_init_kernel_params(fKernel *kernel, fParams *params)
+{
+    kernel->params.count = params->count;
+    kernel->params.sampler_count = params->sampler_count;
+    for (int i = 0; i < params->count; i++)
+    {
+        strcpy(kernel->params.name[i], params->name[i]);
+        kernel->params.type[i] = params->type[i];
+        kernel->params.mean[i] = params->mean[i];
+        kernel->params.scale[i] = params->scale[i];
+        kernel->params.location[i] = -1;
+        kernel->params.assigned_tex_unit[i] = params->assigned_tex_unit[i];
+        kernel->params.std140_offset[i] = params->std140_offset[i];
+        kernel->params.std140_size[i] = params->std140_size[i];
+        if (fraktal_is_sampler_param(params->type[i]))
+            kernel->params.offset[i] = params->assigned_tex_unit[i];
+        else
+            kernel->params.offset[i] = params->std140_offset[i];
+    }
+    kernel->param_data_size = fraktal_param_data_size(&kernel->params);
+    kernel->param_data = NULL;
+    if (kernel->param_data_size > 0)
+    {
+        kernel->param_data = (unsigned char*)calloc(kernel->param_data_size, 1);
+        fraktal_assert(kernel->param_data && "Ran out of memory");
+    }
+}
+
+int fraktal_get_param_offset(fKernel *f, const char *name)
+{
+    fraktal_assert(name);
+    fraktal_assert(f);
+    fraktal_assert(f->module);
+    fraktal_ensure_context();
+    for (int i = 0; i < f->params.count; i++)
+        if (strcmp(f->params.name[i], name) == 0)
+            return f->params.offset[i];
+    return -1;
+}
+
+void fraktal_use_kernel(fKernel *f)
+{
+    fraktal_ensure_context();
+    if (f)
+    {
+        fraktal_assert(!f->pending && "f must be ready (see fraktal_kernel_ready)");
+        fraktal_assert(f->context == fraktal_current_context && "f was created in a different context");
+        fraktal_assert(f->module && "f must be a valid kernel object");
+    }
+    fraktal_current_context->current_kernel = f;
+}
+
+static void fraktal_param_data(int offset, const void *data, int size)
+{
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_assert(f && "Call fraktal_use_kernel first.");
+    if (offset < 0)
+        return;
+    fraktal_assert(offset + size <= f->param_data_size && "Parameter offset is out of bounds.");
+    memcpy(f->param_data + offset, data, size);
+}
+
+void fraktal_param_1f(int offset, float x)                            { float v[] = { x };          fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_2f(int offset, float x, float y)                   { float v[] = { x, y };       fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_3f(int offset, float x, float y, float z)          { float v[] = { x, y, z };    fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_4f(int offset, float x, float y, float z, float w) { float v[] = { x, y, z, w }; fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_1i(int offset, int x)                              { int v[] = { x };            fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_2i(int offset, int x, int y)                       { int v[] = { x, y };         fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_3i(int offset, int x, int y, int z)                { int v[] = { x, y, z };      fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_4i(int offset, int x, int y, int z, int w)         { int v[] = { x, y, z, w };   fraktal_param_data(offset, v, sizeof(v)); }
+void fraktal_param_matrix4f(int offset, float m[4*4])                 { fraktal_param_data(offset, m, 4*4*sizeof(float)); }
+void fraktal_param_transpose_matrix4f(int offset, float m[4*4])
+{
+    float t[4*4];
+    for (int row = 0; row < 4; row++)
+    for (int col = 0; col < 4; col++)
+        t[col*4 + row] = m[row*4 + col];
+    fraktal_param_data(offset, t, sizeof(t));
+}
+
+void fraktal_param_array(int offset, fArray *a)
+{
+    fraktal_assert(a);
+    fraktal_assert(a->width > 0 && a->height > 0 && "Array has invalid dimensions.");
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_assert(f);
+    fraktal_assert(a->context == f->context && "Array was created in a different context");
+    if (offset < 0)
+        return;
+    int tex_unit = -1;
+    {
+        fParams *p = &f->params;
+        for (int i = 0; i < p->count; i++)
+            if (fraktal_is_sampler_param(p->type[i]) && p->offset[i] == offset)
+                tex_unit = p->assigned_tex_unit[i];
+        fraktal_assert(tex_unit >= 0 && "Array parameter with unassigned texture unit.");
+    }
+    f->arrays[tex_unit] = a;
+}
+
+static fSoftwareSampler fraktal_software_sampler(fArray *a)
+{
+    fSoftwareSampler s = { 0 };
+    if (a)
+    {
+        s.data = a->data;
+        s.width = a->width;
+        s.height = a->height;
+        s.depth = a->depth;
+        s.channels = a->channels;
+    }
+    return s;
+}
+
+// Copies the parameter values into the variables of the module. std140
+// pads each column of a mat2 or mat3 to a vec4, which the module does not.
+static void fraktal_prepare_software_run(fKernel *f, fArray *points, int points_width, fArray *batch_table)
+{
+    fParams *p = &f->params;
+    for (int i = 0; i < p->count; i++)
+    {
+        void *dst = f->param_addresses[i];
+        if (!dst)
+            continue;
+        const float *src = (const float*)(f->param_data + p->std140_offset[i]);
+        if (fraktal_is_sampler_param(p->type[i]))
+        {
+            fSoftwareSampler s = fraktal_software_sampler(f->arrays[p->assigned_tex_unit[i]]);
+            memcpy(dst, &s, sizeof(s));
+        }
+        else if (p->type[i] == FRAKTAL_PARAM_FLOAT_MAT2)
+        {
+            for (int col = 0; col < 2; col++)
+                memcpy((float*)dst + col*2, src + col*4, 2*sizeof(float));
+        }
+        else if (p->type[i] == FRAKTAL_PARAM_FLOAT_MAT3)
+        {
+            for (int col = 0; col < 3; col++)
+                memcpy((float*)dst + col*3, src + col*4, 3*sizeof(float));
+        }
+        else
+        {
+            memcpy(dst, src, p->std140_size[i]);
+        }
+    }
+    f->run->points_width = points_width;
+    f->run->points = fraktal_software_sampler(points);
+    f->run->batch_table = fraktal_software_sampler(batch_table);
+}
+
+//
+// Runs
+//
+
+enum { FRAKTAL_SOFTWARE_TILE = 16 };
+
+// A run shades groups of pixels (the slices of a 3D array, or the tiles
+// of a batched run) that are split into square tiles.
+struct fSoftwareDispatch
+{
+    fKernel *kernel;
+    fArray *outs[FRAKTAL_MAX_OUTPUTS];
+    int num_outs;
+    int width;
+    int height;
+    int region_x; // pixels in [region_x, width) x [region_y, height) are
+    int region_y; // shaded (see fraktal_run_kernel_region)
+    int first_slice;
+    int tiles_x; // tiles per group
+    int tiles_y;
+
+    // see fraktal_run_kernel_batch
+    bool batched;
+    int tile_width;
+    int tile_height;
+    int columns;
+};
+
+// Writes the shaded values of a row of pixels to an array with the same
+// result as additive blending into a texture of the array's format.
+static void fraktal_software_blend(fArray *a, int x0, int x1, int y, int slice,
+                                   const uint32_t *values, int stride, const unsigned char *keep)
+{
+    int channels = a->channels;
+    size_t first = (((size_t)slice*a->height + y)*a->width + x0)*channels;
+    for (int x = x0; x < x1; x++, values += stride, keep++)
+    {
+        if (!*keep)
+            continue;
+        size_t i = first + (size_t)(x - x0)*channels;
+        if (fraktal_is_integer_format(a->format))
+        {
+            // integer formats are not blended
+            memcpy((uint32_t*)a->data + i, values, channels*sizeof(uint32_t));
+            continue;
+        }
+        float *dst = (float*)a->data + i;
+        const float *src = (const float*)values;
+        for (int c = 0; c < channels; c++)
+        {
+            if (a->format == FRAKTAL_FLOAT)
+                dst[c] += src[c];
+            else if (a->format == FRAKTAL_HALF)
+                dst[c] = fraktal_half_to_float(fraktal_float_to_half(dst[c] + src[c]));
+            else if (a->format == FRAKTAL_UINT8)
+                dst[c] = fraktal_unorm(dst[c] + fraktal_unorm(src[c], 255.0f), 255.0f);
+            else if (a->format == FRAKTAL_UINT16)
+                dst[c] = fraktal_unorm(dst[c] + fraktal_unorm(src[c], 65535.0f), 65535.0f);
+        }
+    }
+}
+
+static void fraktal_software_shade_tile(void *data, int unit)
+{
+    fSoftwareDispatch *d = (fSoftwareDispatch*)data;
+    int tiles = d->tiles_x*d->tiles_y;
+    int group = unit / tiles;
+    int tile = unit % tiles;
+    int x0 = d->region_x + (tile % d->tiles_x)*FRAKTAL_SOFTWARE_TILE;
+    int y0 = d->region_y + (tile / d->tiles_x)*FRAKTAL_SOFTWARE_TILE;
+    int x_end = d->width;
+    int y_end = d->height;
+    int slice = 0;
+    int batch = 0;
+    float origin_x = 0.0f;
+    float origin_y = 0.0f;
+    if (d->batched)
+    {
+        batch = group;
+        origin_x = (float)(d->tile_width*(batch % d->columns));
+        origin_y = (float)(d->tile_height*(batch / d->columns));
+        x0 += (int)origin_x;
+        y0 += (int)origin_y;
+        if ((int)origin_x + d->tile_width < x_end) x_end = (int)origin_x + d->tile_width;
+        if ((int)origin_y + d->tile_height < y_end) y_end = (int)origin_y + d->tile_height;
+    }
+    else
+    {
+        slice = d->first_slice + group;
+    }
+    int x1 = x0 + FRAKTAL_SOFTWARE_TILE < x_end ? x0 + FRAKTAL_SOFTWARE_TILE : x_end;
+    int y1 = y0 + FRAKTAL_SOFTWARE_TILE < y_end ? y0 + FRAKTAL_SOFTWARE_TILE : y_end;
+    if (x0 >= x1)
+        return;
+
+    fKernel *f = d->kernel;
+    int stride = 4*f->num_outputs;
+    int num_outs = d->num_outs < f->num_outputs ? d->num_outs : f->num_outputs;
+    uint32_t values[FRAKTAL_SOFTWARE_TILE*FRAKTAL_MAX_OUTPUTS*4];
+    unsigned char keep[FRAKTAL_SOFTWARE_TILE];
+    for (int y = y0; y < y1; y++)
+    {
+        f->shade(x0, x1, y, slice, batch, origin_x, origin_y, values, keep);
+        for (int k = 0; k < num_outs; k++)
+            fraktal_software_blend(d->outs[k], x0, x1, y, d->outs[k]->depth > 0 ? slice : 0, values + 4*k, stride, keep);
+    }
+}
+
+static void fraktal_software_dispatch(fSoftwareDispatch *d, int num_groups)
+{
+    int tile = FRAKTAL_SOFTWARE_TILE;
+    int group_width = d->batched ? d->tile_width : d->width - d->region_x;
+    int group_height = d->batched ? d->tile_height : d->height - d->region_y;
+    d->tiles_x = (group_width + tile - 1)/tile;
+    d->tiles_y = (group_height + tile - 1)/tile;
+    int count = num_groups*d->tiles_x*d->tiles_y;
+    double begin = fraktal_timer_ms();
+    fraktal_software_parallel(count, fraktal_software_shade_tile, d);
+    if (fraktal_current_context->kernel_stats)
+        fraktal_add_kernel_time(&d->kernel->stats, fraktal_timer_ms() - begin, (long long)num_groups*group_width*group_height);
+}
+
+void fraktal_enable_kernel_stats(bool enable)
+{
+    fraktal_ensure_context();
+    fraktal_current_context->kernel_stats = enable;
+}
+
+void fraktal_get_kernel_stats(fKernel *f, fKernelStats *stats)
+{
+    fraktal_assert(stats);
+    fraktal_ensure_context();
+    *stats = f ? f->stats : fraktal_current_context->transfers;
+}
+
+void fraktal_reset_kernel_stats(fKernel *f)
+{
+    fraktal_ensure_context();
+    fKernelStats *stats = f ? &f->stats : &fraktal_current_context->transfers;
+    memset(stats, 0, sizeof(fKernelStats));
+}
+
+// Runs are already split into tiles for the threads, and do not hold up
+// a GPU, so the budget is not used.
+void fraktal_set_tile_budget(float budget_ms)
+{
+    fraktal_assert(budget_ms >= 0.0f);
+    fraktal_ensure_context();
+}
+
+static fSoftwareDispatch fraktal_software_single_output(fKernel *f, fArray *out)
+{
+    fSoftwareDispatch d = { 0 };
+    d.kernel = f;
+    d.outs[0] = out;
+    d.num_outs = 1;
+    d.width = out->width;
+    d.height = out->height;
+    return d;
+}
+
+void fraktal_run_kernel(fArray *out)
+{
+    fraktal_assert(fraktal_get_current_kernel() && "Call fraktal_use_kernel first.");
+    fraktal_assert(out);
+    fraktal_assert(out->context == fraktal_current_context && "Array was created in a different context");
+    fraktal_assert(out->width > 0);
+    fraktal_assert(out->height > 0);
+    fraktal_assert(out->access == FRAKTAL_READ_WRITE && "The output array's access mode cannot be read-only.");
+    if (out->depth > 0)
+    {
+        fraktal_run_kernel_slices(out, 0, out->depth);
+        return;
+    }
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_prepare_software_run(f, NULL, 0, NULL);
+    fSoftwareDispatch d = fraktal_software_single_output(f, out);
+    fraktal_software_dispatch(&d, 1);
+}
+
+void fraktal_run_kernel_region(fArray *out, int x, int y, int width, int height)
+{
+    fraktal_assert(fraktal_get_current_kernel() && "Call fraktal_use_kernel first.");
+    fraktal_assert(out);
+    fraktal_assert(out->context == fraktal_current_context && "Array was created in a different context");
+    fraktal_assert(out->access == FRAKTAL_READ_WRITE && "The output array's access mode cannot be read-only.");
+    fraktal_assert(out->depth == 0 && "3D arrays are not supported.");
+    fraktal_assert(x >= 0 && y >= 0 && width >= 0 && height >= 0);
+    fraktal_assert(x + width <= out->width && y + height <= out->height && "Region is outside the output array.");
+    if (width == 0 || height == 0)
+        return;
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_prepare_software_run(f, NULL, 0, NULL);
+    fSoftwareDispatch d = fraktal_software_single_output(f, out);
+    d.region_x = x;
+    d.region_y = y;
+    d.width = x + width;
+    d.height = y + height;
+    fraktal_software_dispatch(&d, 1);
+}
+
+void fraktal_run_kernel_slices(fArray *out, int first_slice, int num_slices)
+{
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_assert(f && "Call fraktal_use_kernel first.");
+    fraktal_assert(out);
+    fraktal_assert(out->context == fraktal_current_context && "Array was created in a different context");
+    fraktal_assert(out->depth > 0 && "The output array must be a 3D array.");
+    fraktal_assert(out->access == FRAKTAL_READ_WRITE && "The output array's access mode cannot be read-only.");
+    fraktal_assert(first_slice >= 0 && num_slices >= 0 && first_slice + num_slices <= out->depth);
+    fraktal_prepare_software_run(f, NULL, 0, NULL);
+    fSoftwareDispatch d = fraktal_software_single_output(f, out);
+    d.first_slice = first_slice;
+    fraktal_software_dispatch(&d, num_slices);
+}
+
+void fraktal_eval_points(fKernel *kernel, fArray *points, fArray *out)
+{
+    fraktal_assert(kernel);
+    fraktal_assert(out);
+    fraktal_assert(out->context == fraktal_current_context && "Array was created in a different context");
+    fraktal_assert(out->count > 0 && "The output array must be created with fraktal_create_points.");
+    fraktal_assert(out->access == FRAKTAL_READ_WRITE && "The output array's access mode cannot be read-only.");
+    if (points)
+    {
+        fraktal_assert(points->context == fraktal_current_context && "Array was created in a different context");
+        fraktal_assert(points->count == out->count && "The input and output must have the same number of points.");
+        fraktal_assert(points != out && "The points cannot also be the output.");
+        fraktal_assert(!fraktal_is_integer_format(points->format) && "Points must have a floating-point or normalized format.");
+    }
+    fraktal_ensure_context();
+    fraktal_assert(!kernel->pending && "kernel must be ready (see fraktal_kernel_ready)");
+    fraktal_assert(kernel->context == fraktal_current_context && "kernel was created in a different context");
+    fraktal_prepare_software_run(kernel, points, out->width, NULL);
+    fSoftwareDispatch d = fraktal_software_single_output(kernel, out);
+    fraktal_software_dispatch(&d, 1);
+}
+
+void fraktal_run_kernel_mrt(fArray **outs, int n)
+{
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_assert(f && "Call fraktal_use_kernel first.");
+    fraktal_assert(outs);
+    fraktal_assert(n >= 1 && n <= FRAKTAL_MAX_OUTPUTS);
+    for (int i = 0; i < n; i++)
+    {
+        fraktal_assert(outs[i]);
+        fraktal_assert(outs[i]->context == fraktal_current_context && "Array was created in a different context");
+        fraktal_assert(outs[i]->access == FRAKTAL_READ_WRITE && "The output array's access mode cannot be read-only.");
+        fraktal_assert(outs[i]->depth == 0 && "3D arrays are not supported.");
+        fraktal_assert(outs[i]->width == outs[0]->width && outs[i]->height == outs[0]->height && "Output arrays must have the same dimensions.");
+    }
+    fraktal_prepare_software_run(f, NULL, 0, NULL);
+    fSoftwareDispatch d = fraktal_software_single_output(f, outs[0]);
+    for (int i = 0; i < n; i++)
+        d.outs[i] = outs[i];
+    d.num_outs = n;
+    fraktal_software_dispatch(&d, 1);
+}
+
+void fraktal_run_kernel_batch(fArray *out, fArray *params, int tile_width, int tile_height)
+{
+    fKernel *f = fraktal_get_current_kernel();
+    fraktal_assert(f && "Call fraktal_use_kernel first.");
+    fraktal_assert(out);
+    fraktal_assert(out->context == fraktal_current_context && "Array was created in a different context");
+    fraktal_assert(out->access == FRAKTAL_READ_WRITE && "The output array's access mode cannot be read-only.");
+    fraktal_assert(params);
+    fraktal_assert(params->context == fraktal_current_context && "Array was created in a different context");
+    fraktal_assert(params != out && "The parameter array cannot also be the output.");
+    fraktal_assert(out->depth == 0 && params->depth == 0 && "3D arrays are not supported.");
+    fraktal_assert(tile_width > 0 && tile_height > 0);
+    int count = params->height;
+    int columns = out->width / tile_width;
+    fraktal_assert(columns > 0 && "Tiles are wider than the output array.");
+    int rows = (count + columns - 1) / columns;
+    fraktal_assert(rows*tile_height <= out->height && "Output array is too small to hold a tile for each parameter set.");
+
+    fraktal_prepare_software_run(f, NULL, 0, params);
+    fSoftwareDispatch d = fraktal_software_single_output(f, out);
+    d.batched = true;
+    d.tile_width = tile_width;
+    d.tile_height = tile_height;
+    d.columns = columns;
+    fraktal_software_dispatch(&d, count);
+}
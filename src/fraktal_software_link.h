@@ -0,0 +1,1508 @@
+// Developed by Simen Haugo.
+// See LICENSE.txt for copyright and licensing details (standard MIT License).
+
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <thread>
+#include <atomic>
+#include "reuse/log.h"
+#include "fraktal_glsl.h"
+
+/*
+Kernels are linked by the software backend as follows:
+
+    1. The sources of each input (along with the declarations of preceding
+       libraries) are translated to a C++ translation unit by translate_source.
+    2. A module translation unit is generated, which defines the parameters,
+       outputs and built-in variables, and the functions that the backend
+       calls through dlsym (see translate_module).
+    3. The translation units are compiled in parallel by the system compiler
+       on a background thread, and linked into a shared library.
+    4. The library is loaded with dlopen once fraktal_kernel_ready sees that
+       the compiler has finished.
+
+The compiler is given by the FRAKTAL_CXX environment variable (default c++),
+and FRAKTAL_CXXFLAGS is appended to its flags. Compiler errors are reported
+with the line numbers of the kernel sources, as the translation keeps all
+line breaks in place.
+
+The translation is done token by token, and keeps everything except:
+
+    * qualifiers that C++ lacks (in, precision, layout, interpolation)
+      are removed, and out/inout parameters become references
+    * swizzles of several components become calls of sw<...>()
+    * float literals get an 'f' suffix
+    * array constructors T[N](...) and struct constructors S(...) become
+      braced initializer lists
+    * global outputs are removed (the module defines them)
+    * non-constant global variables become thread_local, and their
+      initializers are moved into a function that is called before each
+      pixel, since GLSL initializes them for each invocation
+    * main becomes fraktal_main, discard throws, and identifiers that are
+      keywords in C++ get a trailing underscore
+
+Kernels that use features outside this subset (e.g. the length() method
+of arrays, or derivatives) fail to compile, with a compiler error that
+points to the line in the kernel source.
+*/
+
+enum { FRAKTAL_MAX_TRANSLATE_NAMES = 256 };
+enum { FRAKTAL_MAX_TRANSLATE_DEPTH = 256 };
+
+struct fNameSet
+{
+    char name[FRAKTAL_MAX_TRANSLATE_NAMES][FRAKTAL_MAX_PARAM_NAME_LEN + 1];
+    int count;
+};
+
+// Nesting state, which is saved while a preprocessor directive is translated
+struct fTranslateState
+{
+    char parens[FRAKTAL_MAX_TRANSLATE_DEPTH]; // ')' or '}' (constructor) for each open paren
+    int num_parens;
+    int braces;
+    bool statement_start; // at the start of a statement at global scope
+    bool member_allowed; // a '.' here accesses a member
+    bool after_dot;
+    bool pending_out; // the next type is that of an out or inout parameter
+
+    // see translate_global
+    bool global;
+    bool global_array;
+    bool global_expect_name;
+    char global_name[FRAKTAL_MAX_PARAM_NAME_LEN + 1];
+};
+
+struct fTranslator
+{
+    const char *name; // input name for #line directives
+    int line;
+    char *out;
+    size_t out_length;
+    size_t out_capacity;
+    char *init; // body of the per-pixel initialization function
+    size_t init_length;
+    size_t init_capacity;
+    bool to_init; // whether tokens are written to 'init' instead of 'out'
+    fTranslateState s;
+
+    fNameSet *structs; // struct names in all inputs
+    fNameSet *fields; // struct member names in all inputs
+
+    // global outputs of all inputs, and which were declared by this input
+    fOutputs outputs;
+    char output_types[FRAKTAL_MAX_OUTPUTS][FRAKTAL_MAX_PARAM_NAME_LEN + 1];
+    bool declared_output[FRAKTAL_MAX_OUTPUTS];
+};
+
+static bool translate_is_ident_start(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool translate_is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static bool translate_equals(const char *c, size_t n, const char *word)
+{
+    return strlen(word) == n && strncmp(c, word, n) == 0;
+}
+
+static bool translate_is_any(const char *c, size_t n, const char **words)
+{
+    for (const char **w = words; *w; w++)
+        if (translate_equals(c, n, *w))
+            return true;
+    return false;
+}
+
+static bool translate_has_name(fNameSet *set, const char *c, size_t n)
+{
+    for (int i = 0; i < set->count; i++)
+        if (translate_equals(c, n, set->name[i]))
+            return true;
+    return false;
+}
+
+static void translate_add_name(fNameSet *set, const char *c, size_t n)
+{
+    if (n > FRAKTAL_MAX_PARAM_NAME_LEN || set->count == FRAKTAL_MAX_TRANSLATE_NAMES || translate_has_name(set, c, n))
+        return;
+    memcpy(set->name[set->count], c, n);
+    set->name[set->count][n] = '\0';
+    set->count++;
+}
+
+// Returns a pointer past the whitespace, comments and line continuations at 'c'
+static const char *translate_skip_gap(const char *c, const char *end)
+{
+    for (;;)
+    {
+        if (c < end && (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r' || *c == '\f' || *c == '\v'))
+            c++;
+        else if (c + 1 < end && c[0] == '\\' && (c[1] == '\n' || c[1] == '\r'))
+            c += 2;
+        else if (c + 1 < end && c[0] == '/' && c[1] == '/')
+            while (c < end && *c != '\n') c++;
+        else if (c + 1 < end && c[0] == '/' && c[1] == '*')
+        {
+            c += 2;
+            while (c + 1 < end && !(c[0] == '*' && c[1] == '/')) c++;
+            c = c + 2 <= end ? c + 2 : end;
+        }
+        else
+            return c;
+    }
+}
+
+// Returns a pointer past the number at 'c'. 'digits_end' is set to the end
+// of the number without its suffix.
+static const char *translate_number(const char *c, const char *end, bool *is_float, const char **digits_end)
+{
+    const char *d = c;
+    *is_float = false;
+    if (d + 1 < end && d[0] == '0' && (d[1] == 'x' || d[1] == 'X'))
+    {
+        d += 2;
+        while (d < end && (translate_is_digit(*d) || (*d >= 'a' && *d <= 'f') || (*d >= 'A' && *d <= 'F')))
+            d++;
+        *digits_end = d;
+        if (d < end && (*d == 'u' || *d == 'U'))
+            d++;
+        return d;
+    }
+    while (d < end && (translate_is_digit(*d) || *d == '.'))
+    {
+        if (*d == '.')
+            *is_float = true;
+        d++;
+    }
+    if (d < end && (*d == 'e' || *d == 'E'))
+    {
+        const char *e = d + 1;
+        if (e < end && (*e == '+' || *e == '-'))
+            e++;
+        if (e < end && translate_is_digit(*e))
+        {
+            *is_float = true;
+            d = e;
+            while (d < end && translate_is_digit(*d))
+                d++;
+        }
+    }
+    *digits_end = d;
+    if (d < end && (*d == 'f' || *d == 'F'))
+    {
+        *is_float = true;
+        d++;
+    }
+    else if (d + 1 < end && ((d[0] == 'l' && d[1] == 'f') || (d[0] == 'L' && d[1] == 'F')))
+    {
+        *is_float = true;
+        d += 2;
+    }
+    else if (d < end && (*d == 'u' || *d == 'U'))
+    {
+        d++;
+    }
+    return d;
+}
+
+// Returns a pointer past the token at 'c'
+static const char *translate_token_end(const char *c, const char *end)
+{
+    if (translate_is_ident_start(*c))
+    {
+        while (c < end && (translate_is_ident_start(*c) || translate_is_digit(*c)))
+            c++;
+        return c;
+    }
+    if (translate_is_digit(*c) || (*c == '.' && c + 1 < end && translate_is_digit(c[1])))
+    {
+        bool is_float;
+        const char *digits_end;
+        return translate_number(c, end, &is_float, &digits_end);
+    }
+    static const char *operators[] = {
+        "<<=", ">>=", "==", "!=", "<=", ">=", "+=", "-=", "*=", "/=", "%=",
+        "&=", "|=", "^=", "&&", "||", "^^", "++", "--", "<<", ">>", "##", NULL
+    };
+    for (const char **op = operators; *op; op++)
+    {
+        size_t n = strlen(*op);
+        if (c + n <= end && strncmp(c, *op, n) == 0)
+            return c + n;
+    }
+    return c + 1;
+}
+
+// Returns the next token after 'c' and sets 'token' to its start
+static const char *translate_peek(const char *c, const char *end, const char **token)
+{
+    *token = translate_skip_gap(c, end);
+    if (*token >= end)
+        return *token;
+    return translate_token_end(*token, end);
+}
+
+static bool translate_is_ident(const char *c, const char *e)
+{
+    return e > c && translate_is_ident_start(*c);
+}
+
+static const char *fraktal_glsl_vector_types[] = {
+    "vec2", "vec3", "vec4", "ivec2", "ivec3", "ivec4",
+    "uvec2", "uvec3", "uvec4", "bvec2", "bvec3", "bvec4", NULL
+};
+
+static const char *fraktal_glsl_types[] = {
+    "void", "bool", "int", "uint", "float",
+    "vec2", "vec3", "vec4", "ivec2", "ivec3", "ivec4",
+    "uvec2", "uvec3", "uvec4", "bvec2", "bvec3", "bvec4",
+    "mat2", "mat3", "mat4", "mat2x2", "mat3x3", "mat4x4",
+    "sampler1D", "sampler2D", "sampler3D",
+    "isampler1D", "isampler2D", "isampler3D",
+    "usampler1D", "usampler2D", "usampler3D", NULL
+};
+
+static bool translate_is_type(fTranslator *t, const char *c, size_t n)
+{
+    return translate_is_any(c, n, fraktal_glsl_types) || translate_has_name(t->structs, c, n);
+}
+
+// Identifiers that are keywords in C++ but not in GLSL are renamed
+static const char *fraktal_cpp_keywords[] = {
+    "and", "and_eq", "bitand", "bitor", "compl", "not", "not_eq", "or", "or_eq", "xor", "xor_eq",
+    "alignas", "alignof", "asm", "auto", "catch", "char", "char16_t", "char32_t", "class",
+    "const_cast", "constexpr", "decltype", "delete", "double", "dynamic_cast", "enum",
+    "explicit", "export", "extern", "friend", "goto", "inline", "long", "mutable",
+    "namespace", "new", "noexcept", "nullptr", "operator", "private", "protected", "public",
+    "register", "reinterpret_cast", "short", "signed", "sizeof", "static", "static_assert",
+    "static_cast", "template", "this", "thread_local", "throw", "try", "typedef", "typeid",
+    "typename", "union", "unsigned", "using", "virtual", "volatile", "wchar_t", NULL
+};
+
+// Appends the identifier to 'buffer', renamed if needed
+static void translate_append_name(char **buffer, size_t *length, size_t *capacity, const char *c, size_t n)
+{
+    if (translate_equals(c, n, "main"))
+    {
+        parse_append(buffer, length, capacity, "fraktal_main", 12);
+    }
+    else if (translate_equals(c, n, "__VERSION__"))
+    {
+        parse_append(buffer, length, capacity, "FRAKTAL_GLSL_VERSION", 20);
+    }
+    else if (translate_is_any(c, n, fraktal_cpp_keywords))
+    {
+        parse_append(buffer, length, capacity, c, n);
+        parse_append(buffer, length, capacity, "_", 1);
+    }
+    else
+    {
+        parse_append(buffer, length, capacity, c, n);
+    }
+}
+
+static void translate_emit(fTranslator *t, const char *s, size_t n)
+{
+    if (t->to_init)
+        parse_append(&t->init, &t->init_length, &t->init_capacity, s, n);
+    else
+        parse_append(&t->out, &t->out_length, &t->out_capacity, s, n);
+}
+
+static void translate_emit_name(fTranslator *t, const char *c, size_t n)
+{
+    if (t->to_init)
+        translate_append_name(&t->init, &t->init_length, &t->init_capacity, c, n);
+    else
+        translate_append_name(&t->out, &t->out_length, &t->out_capacity, c, n);
+}
+
+static void translate_emit_line(fTranslator *t, char **buffer, size_t *length, size_t *capacity)
+{
+    char line[64];
+    snprintf(line, sizeof(line), "\n#line %d \"", t->line);
+    parse_append(buffer, length, capacity, line, strlen(line));
+    for (const char *c = t->name; *c; c++)
+        parse_append(buffer, length, capacity, (*c == '"' || *c == '\\') ? "_" : c, 1);
+    parse_append(buffer, length, capacity, "\"\n", 2);
+}
+
+// Copies whitespace and comments. While an initializer is moved into the
+// init function, its line breaks are kept in the output as well.
+static void translate_gap(fTranslator *t, const char *from, const char *to)
+{
+    translate_emit(t, from, to - from);
+    for (const char *c = from; c < to; c++)
+    {
+        if (*c != '\n')
+            continue;
+        if (t->to_init)
+            parse_append(&t->out, &t->out_length, &t->out_capacity, "\n", 1);
+        t->line++;
+    }
+}
+
+// Removes text from the output, keeping its line breaks
+static void translate_blank(fTranslator *t, const char *from, const char *to)
+{
+    for (const char *c = from; c < to; c++)
+    {
+        if (*c != '\n')
+            continue;
+        parse_append(&t->out, &t->out_length, &t->out_capacity, "\n", 1);
+        t->line++;
+    }
+}
+
+// Returns a pointer past the ')', ']' or ';' that ends the text at 'c'
+static const char *translate_find(const char *c, const char *end, char open, char close)
+{
+    int depth = 0;
+    while (c < end)
+    {
+        const char *gap = translate_skip_gap(c, end);
+        if (gap > c)
+        {
+            c = gap;
+            continue;
+        }
+        if (*c == open)
+            depth++;
+        else if (*c == close && --depth <= 0)
+            return c + 1;
+        c++;
+    }
+    return end;
+}
+
+static bool translate_is_swizzle(const char *c, size_t n)
+{
+    static const char *sets[] = { "xyzw", "rgba", "stpq" };
+    if (n < 2 || n > 4)
+        return false;
+    for (int s = 0; s < 3; s++)
+    {
+        size_t i = 0;
+        while (i < n && strchr(sets[s], c[i]))
+            i++;
+        if (i == n)
+            return true;
+    }
+    return false;
+}
+
+static void translate_emit_swizzle(fTranslator *t, const char *c, size_t n)
+{
+    static const char *sets[] = { "xyzw", "rgba", "stpq" };
+    translate_emit(t, ".sw<", 4);
+    for (size_t i = 0; i < n; i++)
+    {
+        char index[4];
+        for (int s = 0; s < 3; s++)
+            if (const char *found = strchr(sets[s], c[i]))
+                snprintf(index, sizeof(index), i + 1 < n ? "%d," : "%d", (int)(found - sets[s]));
+        translate_emit(t, index, strlen(index));
+    }
+    translate_emit(t, ">()", 3);
+}
+
+// 'out TYPE NAME;' at global scope is recorded and removed
+static const char *translate_global_output(fTranslator *t, const char *c, const char *e, const char *end)
+{
+    static const char *qualifiers[] = { "highp", "mediump", "lowp", "flat", "smooth", "noperspective", "centroid", "invariant", NULL };
+    const char *type;
+    const char *type_end = translate_peek(e, end, &type);
+    while (translate_is_any(type, type_end - type, qualifiers))
+        type_end = translate_peek(type_end, end, &type);
+    const char *name;
+    const char *name_end = translate_peek(type_end, end, &name);
+    const char *stop = translate_find(c, end, 0, ';');
+    size_t n = name_end - name;
+    if (translate_is_ident(type, type_end) && translate_is_ident(name, name_end) && n <= FRAKTAL_MAX_PARAM_NAME_LEN)
+    {
+        int i = 0;
+        while (i < t->outputs.count && !translate_equals(name, n, t->outputs.name[i]))
+            i++;
+        if (i == t->outputs.count && i < FRAKTAL_MAX_OUTPUTS && (size_t)(type_end - type) <= FRAKTAL_MAX_PARAM_NAME_LEN)
+        {
+            memcpy(t->outputs.name[i], name, n);
+            t->outputs.name[i][n] = '\0';
+            memcpy(t->output_types[i], type, type_end - type);
+            t->output_types[i][type_end - type] = '\0';
+            t->outputs.count++;
+        }
+        if (i < FRAKTAL_MAX_OUTPUTS)
+            t->declared_output[i] = true;
+    }
+    translate_blank(t, c, stop);
+    return stop;
+}
+
+// Non-constant global variables are declared thread_local, and their
+// initializers are moved into the init function (see translate_punctuation).
+static bool translate_global(fTranslator *t, const char *c, const char *end)
+{
+    const char *name;
+    const char *name_end = translate_peek(c, end, &name);
+    if (!translate_is_ident(name, name_end))
+        return false;
+    const char *next;
+    translate_peek(name_end, end, &next);
+    if (next >= end || !strchr("=;,[", *next))
+        return false;
+    translate_emit(t, "static thread_local ", 20);
+    t->s.global = true;
+    t->s.global_array = false;
+    t->s.global_expect_name = true;
+    return true;
+}
+
+static const char *translate_range(fTranslator *t, const char *c, const char *end, bool directive);
+
+static const char *translate_identifier(fTranslator *t, const char *c, const char *e, const char *end, bool directive)
+{
+    static const char *removed[] = {
+        "in", "uniform", "highp", "mediump", "lowp", "flat", "smooth",
+        "noperspective", "centroid", "invariant", NULL
+    };
+    size_t n = e - c;
+    fTranslateState &s = t->s;
+    if (s.after_dot)
+    {
+        s.after_dot = false;
+        s.member_allowed = true;
+        translate_emit_name(t, c, n);
+        return e;
+    }
+    if (translate_is_any(c, n, removed))
+    {
+        translate_blank(t, c, e);
+        return e;
+    }
+    if (translate_equals(c, n, "precision"))
+    {
+        const char *stop = translate_find(c, end, 0, ';');
+        translate_blank(t, c, stop);
+        return stop;
+    }
+    if (translate_equals(c, n, "layout"))
+    {
+        const char *stop = translate_find(e, end, '(', ')');
+        translate_blank(t, c, stop);
+        return stop;
+    }
+    if (translate_equals(c, n, "out") || translate_equals(c, n, "inout"))
+    {
+        if (s.num_parens > 0)
+        {
+            s.pending_out = true;
+            translate_blank(t, c, e);
+            return e;
+        }
+        if (!directive && s.braces == 0)
+        {
+            const char *stop = translate_global_output(t, c, e, end);
+            s.statement_start = true;
+            return stop;
+        }
+    }
+    if (translate_equals(c, n, "discard"))
+    {
+        translate_emit(t, "throw fdiscard()", 16);
+        s.statement_start = false;
+        s.member_allowed = false;
+        return e;
+    }
+
+    bool is_type = translate_is_type(t, c, n);
+    if (is_type && s.pending_out)
+    {
+        s.pending_out = false;
+        s.member_allowed = false;
+        if (translate_is_any(c, n, fraktal_glsl_vector_types))
+        {
+            translate_emit(t, "finout<", 7);
+            translate_emit(t, c, n);
+            translate_emit(t, ">", 1);
+        }
+        else
+        {
+            translate_emit_name(t, c, n);
+            translate_emit(t, " &", 2);
+        }
+        return e;
+    }
+    if (is_type)
+    {
+        // T[N](...) and S(...) become {...}
+        const char *open = translate_skip_gap(e, end);
+        if (open < end && *open == '[')
+        {
+            const char *close = translate_find(open, end, '[', ']');
+            const char *paren = translate_skip_gap(close, end);
+            if (paren < end && *paren == '(' && s.num_parens < FRAKTAL_MAX_TRANSLATE_DEPTH)
+            {
+                s.parens[s.num_parens++] = '}';
+                translate_emit(t, "{", 1);
+                translate_blank(t, c, paren + 1);
+                s.statement_start = false;
+                s.member_allowed = false;
+                return paren + 1;
+            }
+        }
+        if (open < end && *open == '(' && translate_has_name(t->structs, c, n) && s.num_parens < FRAKTAL_MAX_TRANSLATE_DEPTH)
+        {
+            s.parens[s.num_parens++] = '}';
+            translate_emit_name(t, c, n);
+            translate_emit(t, "{", 1);
+            translate_blank(t, e, open + 1);
+            s.statement_start = false;
+            s.member_allowed = false;
+            return open + 1;
+        }
+        if (!directive && s.statement_start && s.braces == 0 && s.num_parens == 0)
+            translate_global(t, e, end);
+    }
+    else if (s.global && s.global_expect_name)
+    {
+        s.global_expect_name = false;
+        if (n <= FRAKTAL_MAX_PARAM_NAME_LEN)
+        {
+            memcpy(s.global_name, c, n);
+            s.global_name[n] = '\0';
+        }
+    }
+    translate_emit_name(t, c, n);
+    s.statement_start = false;
+    s.member_allowed = true;
+    return e;
+}
+
+static const char *translate_punctuation(fTranslator *t, const char *c, const char *end, bool directive)
+{
+    const char *e = translate_token_end(c, end);
+    size_t n = e - c;
+    fTranslateState &s = t->s;
+    bool global_scope = !directive && s.braces == 0 && s.num_parens == 0;
+    if (n == 1 && *c == '.')
+    {
+        const char *name = e;
+        const char *name_end = translate_token_end(name, end);
+        if (s.member_allowed && translate_is_ident(name, name_end) &&
+            translate_is_swizzle(name, name_end - name) &&
+            !translate_has_name(t->fields, name, name_end - name))
+        {
+            translate_emit_swizzle(t, name, name_end - name);
+            s.member_allowed = true;
+            return name_end;
+        }
+        translate_emit(t, ".", 1);
+        s.after_dot = true;
+        return e;
+    }
+
+    s.after_dot = false;
+    s.member_allowed = false;
+    if (n == 1 && *c == '(')
+    {
+        if (s.num_parens < FRAKTAL_MAX_TRANSLATE_DEPTH)
+            s.parens[s.num_parens++] = ')';
+        translate_emit(t, "(", 1);
+    }
+    else if (n == 1 && *c == ')')
+    {
+        char close = s.num_parens > 0 ? s.parens[--s.num_parens] : ')';
+        translate_emit(t, &close, 1);
+        s.pending_out = false;
+        s.member_allowed = true;
+    }
+    else if (n == 1 && *c == ']')
+    {
+        translate_emit(t, "]", 1);
+        s.member_allowed = true;
+    }
+    else if (n == 1 && *c == '[')
+    {
+        if (s.global && global_scope && !t->to_init)
+            s.global_array = true;
+        translate_emit(t, "[", 1);
+    }
+    else if (n == 1 && *c == '{')
+    {
+        s.braces++;
+        translate_emit(t, "{", 1);
+    }
+    else if (n == 1 && *c == '}')
+    {
+        s.braces--;
+        translate_emit(t, "}", 1);
+        if (!directive && s.braces == 0 && s.num_parens == 0)
+            s.statement_start = true;
+    }
+    else if (n == 1 && (*c == ';' || *c == ',') && s.global && global_scope)
+    {
+        if (t->to_init)
+        {
+            parse_append(&t->init, &t->init_length, &t->init_capacity, ";", 1);
+            t->to_init = false;
+        }
+        translate_emit(t, c, 1);
+        s.global_expect_name = *c == ',';
+        s.global_array = false;
+        if (*c == ';')
+        {
+            s.global = false;
+            s.statement_start = true;
+        }
+    }
+    else if (n == 1 && *c == '=' && s.global && global_scope && !s.global_array && !t->to_init && !s.global_expect_name)
+    {
+        translate_emit_line(t, &t->init, &t->init_length, &t->init_capacity);
+        parse_append(&t->init, &t->init_length, &t->init_capacity, s.global_name, strlen(s.global_name));
+        parse_append(&t->init, &t->init_length, &t->init_capacity, " =", 2);
+        t->to_init = true;
+    }
+    else
+    {
+        translate_emit(t, c, n);
+        if (n == 1 && *c == ';' && global_scope)
+            s.statement_start = true;
+    }
+    return e;
+}
+
+// Directives are kept, with their tokens translated, except for those that
+// have no meaning in C++. Conditionals are repeated in the init function, so
+// that it only initializes the globals that were declared.
+static const char *translate_directive(fTranslator *t, const char *c, const char *end)
+{
+    const char *e = c;
+    while (e < end && *e != '\n')
+    {
+        if (e[0] == '\\' && e + 1 < end && (e[1] == '\n' || e[1] == '\r'))
+            e += e[1] == '\r' && e + 2 < end && e[2] == '\n' ? 3 : 2;
+        else
+            e++;
+    }
+    const char *name = translate_skip_gap(c + 1, e);
+    const char *name_end = name < e ? translate_token_end(name, e) : name;
+    size_t n = name_end - name;
+    static const char *removed[] = { "version", "extension", "line", "pragma", NULL };
+    static const char *conditionals[] = { "if", "ifdef", "ifndef", "elif", "else", "endif", NULL };
+    if (translate_is_any(name, n, removed))
+    {
+        translate_blank(t, c, e);
+        return e;
+    }
+
+    size_t begin = t->out_length;
+    fTranslateState saved = t->s;
+    memset(&t->s, 0, sizeof(t->s));
+    translate_emit(t, "#", 1);
+    translate_emit(t, name, name_end - name);
+    translate_range(t, name_end, e, true);
+    t->s = saved;
+    if (translate_is_any(name, n, conditionals))
+    {
+        parse_append(&t->init, &t->init_length, &t->init_capacity, "\n", 1);
+        parse_append(&t->init, &t->init_length, &t->init_capacity, t->out + begin, t->out_length - begin);
+        parse_append(&t->init, &t->init_length, &t->init_capacity, "\n", 1);
+    }
+    return e;
+}
+
+static const char *translate_range(fTranslator *t, const char *c, const char *end, bool directive)
+{
+    bool line_start = !directive;
+    while (c < end)
+    {
+        const char *gap = translate_skip_gap(c, end);
+        if (gap > c)
+        {
+            if (memchr(c, '\n', gap - c))
+                line_start = !directive;
+            translate_gap(t, c, gap);
+            c = gap;
+            continue;
+        }
+        if (line_start && *c == '#')
+        {
+            c = translate_directive(t, c, end);
+            continue;
+        }
+        line_start = false;
+        if (translate_is_ident_start(*c))
+        {
+            c = translate_identifier(t, c, translate_token_end(c, end), end, directive);
+        }
+        else if (translate_is_digit(*c) || (*c == '.' && c + 1 < end && translate_is_digit(c[1])))
+        {
+            bool is_float;
+            const char *digits_end;
+            const char *e = translate_number(c, end, &is_float, &digits_end);
+            if (is_float)
+            {
+                translate_emit(t, c, digits_end - c);
+                translate_emit(t, "f", 1);
+            }
+            else
+            {
+                translate_emit(t, c, e - c);
+            }
+            t->s.statement_start = false;
+            t->s.member_allowed = false;
+            t->s.after_dot = false;
+            c = e;
+        }
+        else
+        {
+            c = translate_punctuation(t, c, end, directive);
+        }
+    }
+    return c;
+}
+
+// Translates 'length' characters of 'source' and appends the result to
+// t->out. Initializers of globals are appended to t->init.
+static void translate_source(fTranslator *t, const char *source, size_t length, const char *name)
+{
+    t->name = name;
+    t->line = 1;
+    t->to_init = false;
+    memset(&t->s, 0, sizeof(t->s));
+    t->s.statement_start = true;
+    translate_emit_line(t, &t->out, &t->out_length, &t->out_capacity);
+    translate_range(t, source, source + length, false);
+    if (t->to_init)
+    {
+        parse_append(&t->init, &t->init_length, &t->init_capacity, ";", 1);
+        t->to_init = false;
+    }
+}
+
+// Collects the names of structs and of their members
+static void translate_collect_structs(fTranslator *t, const char *c)
+{
+    const char *end = c + strlen(c);
+    const char *token;
+    const char *e = translate_peek(c, end, &token);
+    while (token < end)
+    {
+        if (translate_equals(token, e - token, "struct"))
+        {
+            e = translate_peek(e, end, &token);
+            if (translate_is_ident(token, e))
+                translate_add_name(t->structs, token, e - token);
+            while (token < end && *token != '{' && *token != ';')
+                e = translate_peek(e, end, &token);
+            while (token < end && *token != '}' && *token != ';')
+            {
+                const char *name = token;
+                const char *name_end = e;
+                e = translate_peek(e, end, &token);
+                if (translate_is_ident(name, name_end) && token < end && strchr(";,[", *token))
+                    translate_add_name(t->fields, name, name_end - name);
+                if (token < end && *token == ';')
+                    e = translate_peek(e, end, &token);
+            }
+        }
+        e = translate_peek(e, end, &token);
+    }
+}
+
+//
+// Compilation
+//
+
+static const char *fraktal_software_flags = "-std=c++11 -O3 -march=native -fno-math-errno -fPIC -fvisibility=hidden -w";
+
+static const char *fraktal_software_cxx()
+{
+    const char *cxx = getenv("FRAKTAL_CXX");
+    return cxx && *cxx ? cxx : "c++";
+}
+
+static const char *fraktal_software_cxxflags()
+{
+    const char *flags = getenv("FRAKTAL_CXXFLAGS");
+    return flags ? flags : "";
+}
+
+// A compiled kernel is only reused with the same compiler and flags
+static uint64_t fraktal_driver_hash()
+{
+    uint64_t hash = fraktal_hash_seed;
+    hash = fraktal_hash_string(hash, fraktal_software_cxx());
+    hash = fraktal_hash_string(hash, fraktal_software_flags);
+    hash = fraktal_hash_string(hash, fraktal_software_cxxflags());
+    hash = fraktal_hash_string(hash, fraktal_glsl_header);
+    return hash;
+}
+
+struct fPendingLink
+{
+    fParams params;
+    int num_units; // translation units, the last of which is the module
+    char **units;
+    char dir[1024]; // temporary directory for the compiler's files
+    std::thread thread;
+    std::atomic<int> status; // 0 while compiling, then 1 or -1 on failure
+    char *errors; // compiler output, if it failed
+    bool failed;
+
+    bool use_cache;
+    uint64_t key;
+    char cache_path[1024];
+};
+
+static void fraktal_append_path(char **buffer, size_t *length, size_t *capacity, const char *dir, const char *file)
+{
+    parse_append(buffer, length, capacity, "\"", 1);
+    parse_append(buffer, length, capacity, dir, strlen(dir));
+    parse_append(buffer, length, capacity, "/", 1);
+    parse_append(buffer, length, capacity, file, strlen(file));
+    parse_append(buffer, length, capacity, "\"", 1);
+}
+
+static void fraktal_append_command(char **buffer, size_t *length, size_t *capacity)
+{
+    const char *cxx = fraktal_software_cxx();
+    const char *flags = fraktal_software_cxxflags();
+    parse_append(buffer, length, capacity, cxx, strlen(cxx));
+    parse_append(buffer, length, capacity, " ", 1);
+    parse_append(buffer, length, capacity, fraktal_software_flags, strlen(fraktal_software_flags));
+    parse_append(buffer, length, capacity, " ", 1);
+    parse_append(buffer, length, capacity, flags, strlen(flags));
+}
+
+static bool fraktal_write_file(const char *dir, const char *file, const void *data, size_t size)
+{
+    char path[1200];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data, 1, size, f) == size;
+    fclose(f);
+    return ok;
+}
+
+// Returns the contents of a file in a malloc'd buffer (NULL-terminated)
+static unsigned char *fraktal_read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    rewind(f);
+    unsigned char *data = (unsigned char*)malloc(length > 0 ? length + 1 : 1);
+    fraktal_assert(data && "Ran out of memory");
+    size_t n = length > 0 ? fread(data, 1, length, f) : 0;
+    fclose(f);
+    data[n] = '\0';
+    if (size)
+        *size = n;
+    return data;
+}
+
+static bool fraktal_make_temp_dir(char *dir, size_t sizeof_dir)
+{
+    const char *tmp = getenv("TMPDIR");
+    snprintf(dir, sizeof_dir, "%s/fraktal-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    return mkdtemp(dir) != NULL;
+}
+
+// Removes the files that the compiler may have created, and the directory
+static void fraktal_remove_temp_dir(const char *dir, int num_units)
+{
+    char path[1200];
+    const char *files[] = { "fraktal_glsl.h", "kernel.so", "link.log" };
+    for (int i = 0; i < 3; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        remove(path);
+    }
+    static const char *extensions[] = { "cpp", "o", "log" };
+    for (int i = 0; i < num_units; i++)
+    for (int j = 0; j < 3; j++)
+    {
+        snprintf(path, sizeof(path), "%s/unit%d.%s", dir, i, extensions[j]);
+        remove(path);
+    }
+    rmdir(dir);
+}
+
+static void fraktal_compile_unit(fPendingLink *p, int i, bool *ok)
+{
+    char file[64];
+    char *cmd = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    fraktal_append_command(&cmd, &length, &capacity);
+    snprintf(file, sizeof(file), "unit%d.cpp", i);
+    parse_append(&cmd, &length, &capacity, " -c ", 4);
+    fraktal_append_path(&cmd, &length, &capacity, p->dir, file);
+    snprintf(file, sizeof(file), "unit%d.o", i);
+    parse_append(&cmd, &length, &capacity, " -o ", 4);
+    fraktal_append_path(&cmd, &length, &capacity, p->dir, file);
+    snprintf(file, sizeof(file), "unit%d.log", i);
+    parse_append(&cmd, &length, &capacity, " 2> ", 4);
+    fraktal_append_path(&cmd, &length, &capacity, p->dir, file);
+    *ok = system(cmd) == 0;
+    free(cmd);
+}
+
+// Runs on a background thread, and leaves kernel.so in p->dir if successful
+static void fraktal_compile_kernel(fPendingLink *p)
+{
+    bool ok = fraktal_write_file(p->dir, "fraktal_glsl.h", fraktal_glsl_header, strlen(fraktal_glsl_header));
+    for (int i = 0; ok && i < p->num_units; i++)
+    {
+        char file[64];
+        snprintf(file, sizeof(file), "unit%d.cpp", i);
+        ok = fraktal_write_file(p->dir, file, p->units[i], strlen(p->units[i]));
+    }
+    if (!ok)
+    {
+        size_t length = 0;
+        size_t capacity = 0;
+        const char *message = "Could not write the translated kernel to ";
+        parse_append(&p->errors, &length, &capacity, message, strlen(message));
+        parse_append(&p->errors, &length, &capacity, p->dir, strlen(p->dir));
+        parse_append(&p->errors, &length, &capacity, "\n", 1);
+        p->status = -1;
+        return;
+    }
+
+    bool *compiled = new bool[p->num_units];
+    std::thread *threads = new std::thread[p->num_units];
+    for (int i = 0; i < p->num_units; i++)
+        threads[i] = std::thread(fraktal_compile_unit, p, i, &compiled[i]);
+    for (int i = 0; i < p->num_units; i++)
+        threads[i].join();
+    delete[] threads;
+
+    char *errors = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    parse_append(&errors, &length, &capacity, "", 0);
+    for (int i = 0; i < p->num_units; i++)
+    {
+        if (compiled[i])
+            continue;
+        char path[1200];
+        snprintf(path, sizeof(path), "%s/unit%d.log", p->dir, i);
+        char *log = (char*)fraktal_read_file(path, NULL);
+        if (log)
+            parse_append(&errors, &length, &capacity, log, strlen(log));
+        free(log);
+        ok = false;
+    }
+    delete[] compiled;
+
+    if (ok)
+    {
+        char *cmd = NULL;
+        size_t cmd_length = 0;
+        size_t cmd_capacity = 0;
+        fraktal_append_command(&cmd, &cmd_length, &cmd_capacity);
+        parse_append(&cmd, &cmd_length, &cmd_capacity, " -shared -o ", 12);
+        fraktal_append_path(&cmd, &cmd_length, &cmd_capacity, p->dir, "kernel.so");
+        for (int i = 0; i < p->num_units; i++)
+        {
+            char file[64];
+            snprintf(file, sizeof(file), "unit%d.o", i);
+            parse_append(&cmd, &cmd_length, &cmd_capacity, " ", 1);
+            fraktal_append_path(&cmd, &cmd_length, &cmd_capacity, p->dir, file);
+        }
+        parse_append(&cmd, &cmd_length, &cmd_capacity, " 2> ", 4);
+        fraktal_append_path(&cmd, &cmd_length, &cmd_capacity, p->dir, "link.log");
+        ok = system(cmd) == 0;
+        free(cmd);
+        if (!ok)
+        {
+            char path[1200];
+            snprintf(path, sizeof(path), "%s/link.log", p->dir);
+            char *log = (char*)fraktal_read_file(path, NULL);
+            if (log)
+                parse_append(&errors, &length, &capacity, log, strlen(log));
+            free(log);
+        }
+    }
+    p->errors = errors;
+    p->status = ok ? 1 : -1;
+}
+
+// Generates the translation units of a link (see the top of this file)
+static bool translate_link(fLinkState *link, fPendingLink *p)
+{
+    fTranslator *t = (fTranslator*)calloc(1, sizeof(fTranslator));
+    fraktal_assert(t && "Ran out of memory");
+    t->structs = (fNameSet*)calloc(1, sizeof(fNameSet));
+    t->fields = (fNameSet*)calloc(1, sizeof(fNameSet));
+    fraktal_assert(t->structs && t->fields && "Ran out of memory");
+    for (int i = 0; i < link->num_sources; i++)
+        translate_collect_structs(t, link->sources[i]);
+
+    fParams *params = &link->params;
+    p->num_units = link->num_sources + 1;
+    p->units = (char**)calloc(p->num_units, sizeof(char*));
+    fraktal_assert(p->units && "Ran out of memory");
+    char init_name[64];
+    for (int i = 0; i < link->num_sources; i++)
+    {
+        char *unit = NULL;
+        size_t length = 0;
+        size_t capacity = 0;
+        const char *prologue = "#include \"fraktal_glsl.h\"\nnamespace fraktal_glsl {\n";
+        parse_append(&unit, &length, &capacity, prologue, strlen(prologue));
+        for (int j = 0; link->uses_params[i] && j < params->count; j++)
+        {
+            const char *type = parse_param_type_name(params->type[j]);
+            parse_append(&unit, &length, &capacity, "extern ", 7);
+            parse_append(&unit, &length, &capacity, type, strlen(type));
+            parse_append(&unit, &length, &capacity, " ", 1);
+            translate_append_name(&unit, &length, &capacity, params->name[j], strlen(params->name[j]));
+            parse_append(&unit, &length, &capacity, ";\n", 2);
+        }
+
+        memset(t->declared_output, 0, sizeof(t->declared_output));
+        t->out_length = 0;
+        t->init_length = 0;
+        parse_append(&t->out, &t->out_length, &t->out_capacity, "", 0);
+        parse_append(&t->init, &t->init_length, &t->init_capacity, "", 0);
+        if (link->header && link->header_lengths[i] > 0)
+            translate_source(t, link->header, link->header_lengths[i], "library declarations");
+        translate_source(t, link->sources[i], strlen(link->sources[i]), link->names[i]);
+
+        for (int k = 0; k < t->outputs.count; k++)
+        {
+            if (!t->declared_output[k])
+                continue;
+            parse_append(&unit, &length, &capacity, "extern thread_local ", 20);
+            parse_append(&unit, &length, &capacity, t->output_types[k], strlen(t->output_types[k]));
+            parse_append(&unit, &length, &capacity, " ", 1);
+            translate_append_name(&unit, &length, &capacity, t->outputs.name[k], strlen(t->outputs.name[k]));
+            parse_append(&unit, &length, &capacity, ";\n", 2);
+        }
+        parse_append(&unit, &length, &capacity, t->out, t->out_length);
+        snprintf(init_name, sizeof(init_name), "\nvoid fraktal_init_globals_%d()\n{", i);
+        parse_append(&unit, &length, &capacity, init_name, strlen(init_name));
+        parse_append(&unit, &length, &capacity, t->init, t->init_length);
+        parse_append(&unit, &length, &capacity, "\n}\n}\n", 5);
+        p->units[i] = unit;
+    }
+
+    // outputs are written in the order given by the parser (see fraktal_run_kernel_mrt)
+    fOutputs *outputs = &link->outputs;
+    char *unit = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    const char *prologue =
+        "#include \"fraktal_glsl.h\"\n"
+        "#define FRAKTAL_EXPORT extern \"C\" __attribute__((visibility(\"default\")))\n"
+        "namespace fraktal_glsl {\n"
+        "frun fraktal_run;\n"
+        "thread_local vec4 gl_FragCoord;\n"
+        "thread_local int fraktal_slice;\n"
+        "thread_local int fraktal_batch;\n"
+        "thread_local vec2 fraktal_batch_origin;\n"
+        "void fraktal_main();\n";
+    parse_append(&unit, &length, &capacity, prologue, strlen(prologue));
+    for (int j = 0; j < params->count; j++)
+    {
+        const char *type = parse_param_type_name(params->type[j]);
+        parse_append(&unit, &length, &capacity, type, strlen(type));
+        parse_append(&unit, &length, &capacity, " ", 1);
+        translate_append_name(&unit, &length, &capacity, params->name[j], strlen(params->name[j]));
+        parse_append(&unit, &length, &capacity, ";\n", 2);
+    }
+    int output_index[FRAKTAL_MAX_OUTPUTS];
+    for (int k = 0; k < outputs->count; k++)
+    {
+        output_index[k] = -1;
+        for (int j = 0; j < t->outputs.count; j++)
+            if (strcmp(outputs->name[k], t->outputs.name[j]) == 0)
+                output_index[k] = j;
+        const char *type = output_index[k] >= 0 ? t->output_types[output_index[k]] : "vec4";
+        parse_append(&unit, &length, &capacity, "thread_local ", 13);
+        parse_append(&unit, &length, &capacity, type, strlen(type));
+        parse_append(&unit, &length, &capacity, " ", 1);
+        translate_append_name(&unit, &length, &capacity, outputs->name[k], strlen(outputs->name[k]));
+        parse_append(&unit, &length, &capacity, ";\n", 2);
+    }
+    for (int i = 0; i < link->num_sources; i++)
+    {
+        snprintf(init_name, sizeof(init_name), "void fraktal_init_globals_%d();\n", i);
+        parse_append(&unit, &length, &capacity, init_name, strlen(init_name));
+    }
+
+    char line[256];
+    snprintf(line, sizeof(line), "FRAKTAL_EXPORT int fraktal_kernel_outputs() { return %d; }\n", outputs->count);
+    parse_append(&unit, &length, &capacity, line, strlen(line));
+    const char *run = "FRAKTAL_EXPORT frun *fraktal_kernel_run() { return &fraktal_run; }\n";
+    parse_append(&unit, &length, &capacity, run, strlen(run));
+    const char *param_begin = "FRAKTAL_EXPORT void *fraktal_kernel_param(int i)\n{\n    switch (i)\n    {\n";
+    parse_append(&unit, &length, &capacity, param_begin, strlen(param_begin));
+    for (int j = 0; j < params->count; j++)
+    {
+        snprintf(line, sizeof(line), "        case %d: return &", j);
+        parse_append(&unit, &length, &capacity, line, strlen(line));
+        translate_append_name(&unit, &length, &capacity, params->name[j], strlen(params->name[j]));
+        parse_append(&unit, &length, &capacity, ";\n", 2);
+    }
+    const char *shade_begin =
+        "    }\n"
+        "    return 0;\n"
+        "}\n"
+        "FRAKTAL_EXPORT void fraktal_kernel_shade(int x0, int x1, int y, int slice, int batch, float origin_x, float origin_y, uint32_t *out, unsigned char *keep)\n"
+        "{\n"
+        "    fraktal_slice = slice;\n"
+        "    fraktal_batch = batch;\n"
+        "    fraktal_batch_origin = vec2(origin_x, origin_y);\n"
+        "    for (int x = x0; x < x1; x++)\n"
+        "    {\n"
+        "        gl_FragCoord = vec4(x + 0.5f, y + 0.5f, 0.5f, 1.0f);\n";
+    parse_append(&unit, &length, &capacity, shade_begin, strlen(shade_begin));
+    for (int i = 0; i < link->num_sources; i++)
+    {
+        snprintf(init_name, sizeof(init_name), "        fraktal_init_globals_%d();\n", i);
+        parse_append(&unit, &length, &capacity, init_name, strlen(init_name));
+    }
+    for (int k = 0; k < outputs->count; k++)
+    {
+        parse_append(&unit, &length, &capacity, "        memset(&", 16);
+        translate_append_name(&unit, &length, &capacity, outputs->name[k], strlen(outputs->name[k]));
+        parse_append(&unit, &length, &capacity, ", 0, sizeof(", 12);
+        translate_append_name(&unit, &length, &capacity, outputs->name[k], strlen(outputs->name[k]));
+        parse_append(&unit, &length, &capacity, "));\n", 4);
+    }
+    const char *shade_main =
+        "        keep[x - x0] = 1;\n"
+        "        try { fraktal_main(); }\n"
+        "        catch (fdiscard) { keep[x - x0] = 0; }\n";
+    parse_append(&unit, &length, &capacity, shade_main, strlen(shade_main));
+    for (int k = 0; k < outputs->count; k++)
+    {
+        snprintf(line, sizeof(line), "        foutput(out + %d*(x - x0) + %d, ", 4*outputs->count, 4*k);
+        parse_append(&unit, &length, &capacity, line, strlen(line));
+        translate_append_name(&unit, &length, &capacity, outputs->name[k], strlen(outputs->name[k]));
+        parse_append(&unit, &length, &capacity, ");\n", 3);
+    }
+    parse_append(&unit, &length, &capacity, "    }\n}\n}\n", 10);
+    p->units[link->num_sources] = unit;
+
+    memcpy(&p->params, params, sizeof(fParams));
+    free(t->out);
+    free(t->init);
+    free(t->structs);
+    free(t->fields);
+    free(t);
+    return true;
+}
+
+static uint64_t software_link_hash(fPendingLink *p)
+{
+    uint64_t hash = fraktal_driver_hash();
+    for (int i = 0; i < p->num_units; i++)
+        hash = fraktal_hash_string(hash, p->units[i]);
+    return hash;
+}
+
+static void free_pending_link(fPendingLink *p)
+{
+    if (!p)
+        return;
+    if (p->thread.joinable())
+        p->thread.join();
+    if (p->dir[0])
+        fraktal_remove_temp_dir(p->dir, p->num_units);
+    for (int i = 0; i < p->num_units; i++)
+        free(p->units[i]);
+    free(p->units);
+    free(p->errors);
+    delete p;
+}
+
+// Loads a compiled kernel. Each kernel needs its own copy of the file, as
+// dlopen returns the same module (with the same parameter variables) for
+// a file that is already loaded.
+static bool load_kernel_module(fKernel *f, const char *path, fParams *params)
+{
+    size_t binary_length = 0;
+    unsigned char *binary = fraktal_read_file(path, &binary_length);
+    if (!binary)
+        return false;
+    void *module = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!module)
+    {
+        log_err("Failed to load kernel module: %s\n", dlerror());
+        free(binary);
+        return false;
+    }
+    typedef int (*fKernelOutputs)();
+    typedef void *(*fKernelParam)(int);
+    typedef fSoftwareRun *(*fKernelRun)();
+    fKernelOutputs outputs = (fKernelOutputs)dlsym(module, "fraktal_kernel_outputs");
+    fKernelParam param = (fKernelParam)dlsym(module, "fraktal_kernel_param");
+    fKernelRun run = (fKernelRun)dlsym(module, "fraktal_kernel_run");
+    fSoftwareShade shade = (fSoftwareShade)dlsym(module, "fraktal_kernel_shade");
+    if (!outputs || !param || !run || !shade)
+    {
+        log_err("Failed to load kernel module: missing symbols.\n");
+        dlclose(module);
+        free(binary);
+        return false;
+    }
+
+    f->module = module;
+    f->pending = NULL;
+    f->context = fraktal_current_context;
+    fraktal_init_kernel_params(f, params);
+    for (int i = 0; i < params->count; i++)
+        f->param_addresses[i] = param(i);
+    f->run = run();
+    f->shade = shade;
+    f->num_outputs = outputs();
+    f->binary = binary;
+    f->binary_length = binary_length;
+    return true;
+}
+
+static bool export_kernel(fKernel *f, const char *path, uint64_t key)
+{
+    fraktal_assert(f);
+    fraktal_assert(f->module);
+    fraktal_assert(path);
+    char temp[1200];
+    FILE *file = fraktal_open_binary_file(path, temp, sizeof(temp));
+    if (!file)
+        return false;
+
+    fKernelBinaryHeader header = {0};
+    memcpy(header.magic, fraktal_kernel_binary_magic, sizeof(header.magic));
+    header.version = FRAKTAL_KERNEL_BINARY_VERSION;
+    header.binary_format = 0;
+    header.binary_length = (uint32_t)f->binary_length;
+    header.param_count = f->params.count;
+    header.sampler_count = f->params.sampler_count;
+    header.driver_hash = fraktal_driver_hash();
+    header.key = key;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int i = 0; ok && i < f->params.count; i++)
+    {
+        fKernelBinaryParam param = {0};
+        strcpy(param.name, f->params.name[i]);
+        param.type = f->params.type[i];
+        param.mean = f->params.mean[i];
+        param.scale = f->params.scale[i];
+        param.assigned_tex_unit = f->params.assigned_tex_unit[i];
+        param.std140_offset = f->params.std140_offset[i];
+        param.std140_size = f->params.std140_size[i];
+        ok = fwrite(&param, sizeof(param), 1, file) == 1;
+    }
+    if (ok)
+        ok = fwrite(f->binary, 1, f->binary_length, file) == f->binary_length;
+    return fraktal_close_binary_file(file, temp, path, ok);
+}
+
+// If 'key' is non-zero, the file is only accepted if it was exported with
+// the same key. Mismatches are reported to the log unless 'quiet' is set.
+static fKernel *import_kernel(const char *path, uint64_t key, bool quiet)
+{
+    fraktal_assert(path);
+    fraktal_ensure_context();
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        if (!quiet) log_err("Failed to import kernel (%s): could not open file.\n", path);
+        return NULL;
+    }
+
+    fKernelBinaryHeader header;
+    if (!fraktal_read_binary_header(file, &header))
+    {
+        if (!quiet) log_err("Failed to import kernel (%s): not a fraktal kernel binary.\n", path);
+        fclose(file);
+        return NULL;
+    }
+    if (header.driver_hash != fraktal_driver_hash())
+    {
+        if (!quiet) log_err("Failed to import kernel (%s): binary was created by a different compiler.\n", path);
+        fclose(file);
+        return NULL;
+    }
+    if (key && header.key != key)
+    {
+        if (!quiet) log_err("Failed to import kernel (%s): binary was created from different sources.\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    fParams *params = (fParams*)malloc(sizeof(fParams));
+    fraktal_assert(params && "Ran out of memory");
+    bool ok = fraktal_read_binary_params(file, header, params);
+
+    // the length was checked against the file size by fraktal_read_binary_header
+    void *binary = malloc(header.binary_length);
+    fraktal_assert(binary && "Ran out of memory");
+    if (ok)
+        ok = fread(binary, 1, header.binary_length, file) == header.binary_length;
+    fclose(file);
+
+    fKernel *kernel = NULL;
+    char dir[1024];
+    if (ok && fraktal_make_temp_dir(dir, sizeof(dir)))
+    {
+        char module_path[1200];
+        snprintf(module_path, sizeof(module_path), "%s/kernel.so", dir);
+        kernel = (fKernel*)calloc(1, sizeof(fKernel));
+        fraktal_assert(kernel && "Ran out of memory");
+        if (!fraktal_write_file(dir, "kernel.so", binary, header.binary_length) ||
+            !load_kernel_module(kernel, module_path, params))
+        {
+            free(kernel);
+            kernel = NULL;
+        }
+        fraktal_remove_temp_dir(dir, 0);
+    }
+    if (!kernel && !quiet)
+        log_err("Failed to import kernel (%s): binary is corrupt or could not be loaded.\n", path);
+
+    free(binary);
+    free(params);
+    return kernel;
+}
+
+// Returns 1 once the kernel is loaded, 0 if the compiler is still running
+// and 'block' is false, and -1 on failure.
+static int step_link(fKernel *f, bool block)
+{
+    fPendingLink *p = f->pending;
+    fraktal_assert(p);
+    fraktal_assert(f->context == fraktal_current_context && "Kernel was created in a different context");
+    if (p->failed)
+        return -1;
+    if (!block && p->status.load() == 0)
+        return 0;
+    p->thread.join();
+    if (p->status.load() < 0)
+    {
+        log_err("Failed to compile kernel:\n%s", p->errors ? p->errors : "");
+        p->failed = true;
+        return -1;
+    }
+
+    char path[1200];
+    snprintf(path, sizeof(path), "%s/kernel.so", p->dir);
+    if (!load_kernel_module(f, path, &p->params))
+    {
+        p->failed = true;
+        return -1;
+    }
+    if (p->use_cache)
+        export_kernel(f, p->cache_path, p->key);
+    free_pending_link(p);
+    f->pending = NULL;
+    return 1;
+}
+
+fKernel *fraktal_link_kernel_async(fLinkState *link)
+{
+    fraktal_assert(link);
+    fraktal_ensure_context();
+    if (link->num_sources <= 0)
+        return NULL;
+
+    fPendingLink *p = new fPendingLink();
+    if (!translate_link(link, p))
+    {
+        free_pending_link(p);
+        log_err("Failed to link kernel\n");
+        return NULL;
+    }
+    if (fraktal_kernel_cache_dir)
+    {
+        p->key = software_link_hash(p);
+        p->use_cache = kernel_cache_path(p->key, p->cache_path, sizeof(p->cache_path));
+    }
+    if (p->use_cache)
+    {
+        fKernel *kernel = import_kernel(p->cache_path, p->key, true);
+        if (kernel)
+        {
+            free_pending_link(p);
+            return kernel;
+        }
+    }
+
+    if (!fraktal_make_temp_dir(p->dir, sizeof(p->dir)))
+    {
+        p->dir[0] = '\0';
+        free_pending_link(p);
+        log_err("Failed to link kernel: could not create a temporary directory.\n");
+        return NULL;
+    }
+    p->status = 0;
+    p->thread = std::thread(fraktal_compile_kernel, p);
+
+    fKernel *kernel = (fKernel*)calloc(1, sizeof(fKernel));
+    fraktal_assert(kernel && "Ran out of memory");
+    kernel->pending = p;
+    kernel->context = fraktal_current_context;
+    return kernel;
+}
+
+int fraktal_kernel_ready(fKernel *f)
+{
+    fraktal_assert(f);
+    if (!f->pending)
+        return 1;
+    if (f->pending->failed)
+        return -1;
+    fraktal_ensure_context();
+    int status = step_link(f, false);
+    if (status < 0)
+        log_err("Failed to link kernel\n");
+    return status;
+}
+
+fKernel *fraktal_link_kernel(fLinkState *link)
+{
+    fKernel *kernel = fraktal_link_kernel_async(link);
+    if (kernel && kernel->pending && step_link(kernel, true) != 1)
+    {
+        log_err("Failed to link kernel\n");
+        fraktal_destroy_kernel(kernel);
+        return NULL;
+    }
+    return kernel;
+}
+
+void fraktal_destroy_kernel(fKernel *f)
+{
+    if (f)
+    {
+        fraktal_ensure_context();
+        fraktal_assert(f->context == fraktal_current_context && "Kernel was created in a different context");
+        if (fraktal_current_context->current_kernel == f)
+            fraktal_current_context->current_kernel = NULL;
+        free_pending_link(f->pending);
+        if (f->module)
+            dlclose(f->module);
+        free(f->param_data);
+        free(f->binary);
+        free(f);
+    }
+}
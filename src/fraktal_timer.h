@@ -0,0 +1,168 @@
+// Developed by Simen Haugo.
+// See LICENSE.txt for copyright and licensing details (standard MIT License).
+
+#pragma once
+#include <stdlib.h>
+#include <string.h>
+
+/*
+Kernel statistics (see fraktal_enable_kernel_stats) are measured with
+GL_TIME_ELAPSED queries from a per-context ring. A query is begun before
+the draw (or clear, or read-back) and ended after it, and its result is
+read when the ring is polled, oldest first, only once the driver reports
+it as available. If every query in the ring is still outstanding, the run
+is not timed rather than waiting for the GPU. Time elapsed queries cannot
+be nested, so a run inside another timed call is attributed to the outer
+call.
+
+The tiles of fraktal_run_kernel (see fraktal_set_tile_budget) are timed
+even if statistics are disabled, and their results update the kernel's
+estimate of the time per pixel that sizes the following tiles.
+*/
+enum { FRAKTAL_MAX_TIMER_QUERIES = 64 };
+struct fTimerQueries
+{
+    GLuint query[FRAKTAL_MAX_TIMER_QUERIES];
+    fKernelStats *stats[FRAKTAL_MAX_TIMER_QUERIES]; // NULL if the result is to be discarded
+    double *tile_cost[FRAKTAL_MAX_TIMER_QUERIES]; // NULL unless the query timed a tile
+    long long pixels[FRAKTAL_MAX_TIMER_QUERIES];
+    int first; // oldest outstanding query
+    int count;
+    bool active; // a query has been begun and not yet ended
+    bool enabled;
+    bool supported;
+    fKernelStats transfers; // see fraktal_get_kernel_stats(NULL)
+};
+
+static fTimerQueries &fraktal_timer_queries()
+{
+    fContext *c = fraktal_current_context;
+    fraktal_assert(c);
+    if (!c->timer_queries)
+    {
+        c->timer_queries = (fTimerQueries*)calloc(1, sizeof(fTimerQueries));
+        fraktal_assert(c->timer_queries && "Ran out of memory");
+        fTimerQueries &t = *c->timer_queries;
+        GLint major = 0, minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        t.supported = major > 3 || (major == 3 && minor >= 3);
+        GLint num_extensions = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+        for (GLint i = 0; i < num_extensions && !t.supported; i++)
+        {
+            const char *name = (const char*)glGetStringi(GL_EXTENSIONS, (GLuint)i);
+            if (name && strcmp(name, "GL_ARB_timer_query") == 0)
+                t.supported = true;
+        }
+        if (t.supported)
+            glGenQueries(FRAKTAL_MAX_TIMER_QUERIES, t.query);
+    }
+    return *c->timer_queries;
+}
+
+static void fraktal_free_timer_queries(fTimerQueries *t, bool delete_gpu_objects)
+{
+    if (!t)
+        return;
+    if (delete_gpu_objects && t->supported)
+        glDeleteQueries(FRAKTAL_MAX_TIMER_QUERIES, t->query);
+    free(t);
+}
+
+// Collects the results that are available, or all results if 'wait' is
+// set, in which case it blocks until the GPU has finished the queries.
+static void fraktal_poll_timer_queries(fTimerQueries &t, bool wait=false)
+{
+    while (t.count > 0)
+    {
+        GLuint query = t.query[t.first];
+        GLint available = 0;
+        if (!wait)
+            glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available && !wait)
+            break;
+        GLuint64 ns = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+        double ms = (double)ns*1e-6;
+        if (t.stats[t.first])
+            fraktal_add_kernel_time(t.stats[t.first], ms, t.pixels[t.first]);
+        double *cost = t.tile_cost[t.first];
+        if (cost && t.pixels[t.first] > 0)
+        {
+            double ms_per_pixel = ms/(double)t.pixels[t.first];
+            if (*cost <= 0.0) *cost = ms_per_pixel;
+            else *cost += 0.25*(ms_per_pixel - *cost);
+        }
+        t.first = (t.first + 1) % FRAKTAL_MAX_TIMER_QUERIES;
+        t.count--;
+    }
+}
+
+// Returns true if a query was begun, in which case fraktal_end_timer must
+// be called after the work to be timed. The time is added to 'stats', or
+// to the context's transfer statistics if it is NULL. If 'tile_cost' is
+// given, the work is timed even if statistics are disabled, and the time
+// per pixel is averaged into it.
+static bool fraktal_begin_timer(fKernelStats *stats, long long pixels, double *tile_cost=NULL)
+{
+    fContext *c = fraktal_current_context;
+    if (!c || !c->timer_queries)
+        return false;
+    fTimerQueries &t = *c->timer_queries;
+    if (!t.supported || t.active || (!t.enabled && !tile_cost))
+        return false;
+    fraktal_poll_timer_queries(t);
+    if (t.count == FRAKTAL_MAX_TIMER_QUERIES)
+        return false;
+    int i = (t.first + t.count) % FRAKTAL_MAX_TIMER_QUERIES;
+    t.stats[i] = !t.enabled ? NULL : stats ? stats : &t.transfers;
+    t.tile_cost[i] = tile_cost;
+    t.pixels[i] = pixels;
+    t.count++;
+    t.active = true;
+    glBeginQuery(GL_TIME_ELAPSED, t.query[i]);
+    return true;
+}
+
+static void fraktal_end_timer()
+{
+    fTimerQueries &t = fraktal_timer_queries();
+    fraktal_assert(t.active);
+    glEndQuery(GL_TIME_ELAPSED);
+    t.active = false;
+}
+
+// Discards the outstanding results for 'stats' and 'tile_cost' (e.g. when
+// their kernel is destroyed). Either may be NULL.
+static void fraktal_forget_timer_queries(fKernelStats *stats, double *tile_cost)
+{
+    fContext *c = fraktal_current_context;
+    if (!c || !c->timer_queries)
+        return;
+    fTimerQueries &t = *c->timer_queries;
+    for (int k = 0; k < t.count; k++)
+    {
+        int i = (t.first + k) % FRAKTAL_MAX_TIMER_QUERIES;
+        if (stats && t.stats[i] == stats)
+            t.stats[i] = NULL;
+        if (tile_cost && t.tile_cost[i] == tile_cost)
+            t.tile_cost[i] = NULL;
+    }
+}
+
+void fraktal_enable_kernel_stats(bool enable)
+{
+    fraktal_ensure_context();
+    fraktal_timer_queries().enabled = enable;
+    fraktal_check_gl_error();
+}
+
+void fraktal_set_tile_budget(float budget_ms)
+{
+    fraktal_assert(budget_ms >= 0.0f);
+    fraktal_ensure_context();
+    fraktal_timer_queries(); // tiles are timed to find their size
+    fraktal_current_context->tile_budget_ms = budget_ms;
+    fraktal_check_gl_error();
+}
@@ -45,13 +45,33 @@ enum fParamType_
     FRAKTAL_PARAM_INT_VEC4,
     FRAKTAL_PARAM_SAMPLER1D,
     FRAKTAL_PARAM_SAMPLER2D,
+    FRAKTAL_PARAM_ISAMPLER1D,
+    FRAKTAL_PARAM_ISAMPLER2D,
+    FRAKTAL_PARAM_USAMPLER1D,
+    FRAKTAL_PARAM_USAMPLER2D,
+    FRAKTAL_PARAM_SAMPLER3D,
+    FRAKTAL_PARAM_ISAMPLER3D,
+    FRAKTAL_PARAM_USAMPLER3D,
 };
+static bool fraktal_is_sampler_param(fParamType type)
+{
+    return type == FRAKTAL_PARAM_SAMPLER1D ||
+           type == FRAKTAL_PARAM_SAMPLER2D ||
+           type == FRAKTAL_PARAM_ISAMPLER1D ||
+           type == FRAKTAL_PARAM_ISAMPLER2D ||
+           type == FRAKTAL_PARAM_USAMPLER1D ||
+           type == FRAKTAL_PARAM_USAMPLER2D ||
+           type == FRAKTAL_PARAM_SAMPLER3D ||
+           type == FRAKTAL_PARAM_ISAMPLER3D ||
+           type == FRAKTAL_PARAM_USAMPLER3D;
+}
 struct fParams
 {
     float4 mean[FRAKTAL_MAX_PARAMS];
     float4 scale[FRAKTAL_MAX_PARAMS];
     char name[FRAKTAL_MAX_PARAMS][FRAKTAL_MAX_PARAM_NAME_LEN + 1];
-    int offset[FRAKTAL_MAX_PARAMS];
+    int offset[FRAKTAL_MAX_PARAMS];   // returned by fraktal_get_param_offset
+    int location[FRAKTAL_MAX_PARAMS]; // GL uniform location (-1 if inactive)
     fParamType type[FRAKTAL_MAX_PARAMS];
     int assigned_tex_unit[FRAKTAL_MAX_PARAMS];
 
@@ -61,3 +81,25 @@ struct fParams
     int sampler_count;
     int count;
 };
+
+// Fragment shader outputs of a kernel, in the order they are declared
+// across its linked inputs (see fraktal_run_kernel_mrt).
+enum { FRAKTAL_MAX_OUTPUTS = 8 };
+struct fOutputs
+{
+    char name[FRAKTAL_MAX_OUTPUTS][FRAKTAL_MAX_PARAM_NAME_LEN + 1];
+    int count;
+};
+
+// Adds one timed run to the statistics (see fraktal_get_kernel_stats). The
+// moving average weighs the latest run by 1/10.
+static void fraktal_add_kernel_time(fKernelStats *s, double ms, long long pixels)
+{
+    if (s->dispatches == 0 || ms < s->min_ms) s->min_ms = ms;
+    if (s->dispatches == 0 || ms > s->max_ms) s->max_ms = ms;
+    if (s->dispatches == 0) s->average_ms = ms;
+    else s->average_ms += 0.1*(ms - s->average_ms);
+    s->total_ms += ms;
+    s->pixels += pixels;
+    s->dispatches++;
+}
@@ -4,6 +4,9 @@
     See LICENSE.txt for copyright and licensing details (standard MIT License).
 */
 #define FRAKTAL_GUI
+#ifdef FRAKTAL_HEADLESS
+#error "The GUI needs a window and cannot be built with FRAKTAL_HEADLESS."
+#endif
 #include "fraktal.cpp"
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -32,6 +35,8 @@
 
 enum { MAX_WIDGETS = 128 };
 enum { NUM_PRESETS = 10 };
+enum { REDUCE_BLOCK = 8 }; // must match libf/reduce.f
+enum { DRAW_MODE_STEPS = 4 }; // must match libf/publication.f
 struct Widget;
 struct guiKey
 {
@@ -55,6 +60,7 @@ enum guiPreviewMode_ {
     guiPreviewMode_Normals,
     guiPreviewMode_Depth,
     guiPreviewMode_GBuffer,
+    guiPreviewMode_Steps,
 };
 struct guiPreset
 {
@@ -72,6 +78,7 @@ struct guiPaths
     const char *color;
     const char *geometry;
     const char *compose;
+    const char *heatmap;
 };
 struct Widget_Camera;
 struct guiState
@@ -89,8 +96,48 @@ struct guiState
     fKernel *compose_kernel;
     bool render_kernel_is_new;
     bool compose_kernel_is_new;
+
+    // kernels that are being linked in the background (see begin_load_gui)
+    fKernel *pending_render_kernel;
+    fKernel *pending_compose_kernel;
+    guiPaths pending_paths;
+    guiPreviewMode pending_mode;
+    bool pending_use_bricks;
+
+    // brick cache of the model (see fraktal_bake_bricks), baked over a
+    // cube of size 2*bricks_extent around the origin when use_bricks is set
+    bool new_use_bricks;
+    bool use_bricks;
+    float bricks_extent;
+    int bricks_resolution;
+    fBrickMap *bricks;
+
+    // the steps preview shows one of the counts of the color renderer's
+    // steps draw mode (see libf/heatmap.f), and their sums over the image.
+    // The sums are read back without waiting for the GPU (see render_steps),
+    // so step_totals lags behind and holds step_totals_samples samples.
+    int steps_count;
+    float steps_max;
+    bool has_step_totals;
+    double step_totals[4];
+    int step_totals_samples;
+    fTransfer *step_transfer;
+    bool step_transfer_stale; // the image was cleared after it was started
+    int step_transfer_samples; // -1 if no reduction was started since
+    int step_texel_count;
+    float step_texels[4*REDUCE_BLOCK*REDUCE_BLOCK];
+
     int samples;
     int max_samples;
+
+    // samples are accumulated in as many passes per frame as fit in
+    // frame_budget_ms of GPU time (see accumulate_samples). A sample that
+    // does not fit is spread over frames, and sample_row is the first row
+    // that it has yet to render.
+    float frame_budget_ms;
+    int sample_row;
+    double sample_cost; // GPU milliseconds per pixel, 0 until measured
+    fKernelStats last_stats;
     bool should_clear;
     bool should_exit;
     bool initialized;
@@ -129,47 +176,47 @@ static void save_screenshot(const char *filename, fArray *f)
     free(pixels);
 }
 
-static fKernel *load_render_shader(const char *model_path, const char *render_path)
+// hg_sdf is compiled on its own and shared by all kernels with a model
+static bool add_hg_sdf(fLinkState *link)
 {
-    fLinkState *link = fraktal_create_link();
-
     static char *hg_sdf = read_file("libf/hg_sdf.f");
     if (!hg_sdf)
         log_err("Failed to load hg_sdf: file is corrupt or not in the expected directory (libf/hg_sdf.f)\n");
 
-    if (hg_sdf)
+    if (hg_sdf && !fraktal_add_link_library(link, hg_sdf, 0, "libf/hg_sdf.f"))
     {
-        char *model = read_file(model_path);
-        if (!model)
-        {
-            log_err("Failed to load render kernel: error compiling model.\n");
-            fraktal_destroy_link(link);
-            return NULL;
-        }
-        static const char *line_0 = "#line 0\n";
-        char *concat = (char*)malloc(strlen(hg_sdf) + strlen(line_0) + strlen(model) + 1);
-        fraktal_assert(concat);
-        strcpy(concat, hg_sdf);
-        strcat(concat, line_0);
-        strcat(concat, model);
-        free(model);
-        if (!fraktal_add_link_data(link, concat, strlen(concat), model_path))
-        {
-            log_err("Failed to load render kernel: error compiling model.\n");
-            fraktal_destroy_link(link);
-            free(concat);
-            return NULL;
-        }
-        free(concat);
+        log_err("Failed to load kernel: error compiling hg_sdf.\n");
+        return false;
     }
-    else
+    return true;
+}
+
+// The returned kernel is pending until fraktal_kernel_ready returns 1.
+static fKernel *load_render_shader(const char *model_path, const char *render_path, bool use_bricks)
+{
+    fLinkState *link = fraktal_create_link();
+
+    if (!add_hg_sdf(link))
     {
-        if (!fraktal_add_link_file(link, model_path))
-        {
-            log_err("Failed to load render kernel: error compiling model.\n");
-            fraktal_destroy_link(link);
-            return NULL;
-        }
+        fraktal_destroy_link(link);
+        return NULL;
+    }
+
+    static char *bricks = read_file("libf/bricks.f");
+    if (use_bricks && !bricks)
+        log_err("Failed to load bricks: file is corrupt or not in the expected directory (libf/bricks.f)\n");
+    if (use_bricks && bricks && !fraktal_add_link_library(link, bricks, 0, "libf/bricks.f"))
+    {
+        log_err("Failed to load render kernel: error compiling bricks.\n");
+        fraktal_destroy_link(link);
+        return NULL;
+    }
+
+    if (!fraktal_add_link_file(link, model_path))
+    {
+        log_err("Failed to load render kernel: error compiling model.\n");
+        fraktal_destroy_link(link);
+        return NULL;
     }
 
     if (!fraktal_add_link_file(link, render_path))
@@ -179,18 +226,64 @@ static fKernel *load_render_shader(const char *model_path, const char *render_pa
         return NULL;
     }
 
-    fKernel *kernel = fraktal_link_kernel(link);
+    fKernel *kernel = fraktal_link_kernel_async(link);
+    fraktal_destroy_link(link);
+    return kernel;
+}
+
+// Links the model with libf/mesh.f and bakes a brick cache with it. This
+// blocks until the kernel is linked and the cache is baked.
+static fBrickMap *bake_bricks(const char *model_path, float extent, int resolution)
+{
+    fLinkState *link = fraktal_create_link();
+    fKernel *kernel = NULL;
+    if (add_hg_sdf(link) &&
+        fraktal_add_link_file(link, model_path) &&
+        fraktal_add_link_file(link, "libf/mesh.f"))
+        kernel = fraktal_link_kernel(link);
+    fraktal_destroy_link(link);
+    if (!kernel)
+    {
+        log_err("Failed to bake brick cache: error compiling kernel.\n");
+        return NULL;
+    }
+
+    float box_min[3] = { -extent, -extent, -extent };
+    float box_max[3] = { +extent, +extent, +extent };
+    fBrickMap *bricks = fraktal_bake_bricks(kernel, box_min, box_max, resolution);
+    fraktal_destroy_kernel(kernel);
+    return bricks;
+}
+
+static fKernel *load_compose_shader(const char *compose_path)
+{
+    fLinkState *link = fraktal_create_link();
+    fKernel *kernel = NULL;
+    if (fraktal_add_link_file(link, compose_path))
+        kernel = fraktal_link_kernel_async(link);
     fraktal_destroy_link(link);
     return kernel;
 }
 
-static bool load_gui(guiState &g)
+static void cancel_load_gui(guiState &g)
 {
+    fraktal_destroy_kernel(g.pending_render_kernel);
+    fraktal_destroy_kernel(g.pending_compose_kernel);
+    g.pending_render_kernel = NULL;
+    g.pending_compose_kernel = NULL;
+}
+
+// Starts linking the kernels for new_paths and new_mode. The current
+// kernels stay in use until finish_load_gui swaps them out.
+static bool begin_load_gui(guiState &g)
+{
+    cancel_load_gui(g);
+
     fKernel *render = NULL;
-    if (g.new_mode == guiPreviewMode_Color)
-        render = load_render_shader(g.new_paths.model, g.new_paths.color);
+    if (g.new_mode == guiPreviewMode_Color || g.new_mode == guiPreviewMode_Steps)
+        render = load_render_shader(g.new_paths.model, g.new_paths.color, g.new_use_bricks);
     else
-        render = load_render_shader(g.new_paths.model, g.new_paths.geometry);
+        render = load_render_shader(g.new_paths.model, g.new_paths.geometry, g.new_use_bricks);
 
     if (!render)
     {
@@ -198,7 +291,11 @@ static bool load_gui(guiState &g)
         return false;
     }
 
-    fKernel *compose = fraktal_load_kernel(g.new_paths.compose);
+    fKernel *compose = NULL;
+    if (g.new_mode == guiPreviewMode_Steps)
+        compose = load_compose_shader(g.new_paths.heatmap);
+    else
+        compose = load_compose_shader(g.new_paths.compose);
     if (!compose)
     {
         log_err("Failed to load scene: error compiling compose kernel.\n");
@@ -206,6 +303,50 @@ static bool load_gui(guiState &g)
         return false;
     }
 
+    g.pending_render_kernel = render;
+    g.pending_compose_kernel = compose;
+    g.pending_paths = g.new_paths;
+    g.pending_mode = g.new_mode;
+    g.pending_use_bricks = g.new_use_bricks;
+    return true;
+}
+
+// Returns 1 once the pending kernels have been swapped in, 0 while they
+// are still being linked, and -1 if either failed.
+static int finish_load_gui(guiState &g)
+{
+    fKernel *render = g.pending_render_kernel;
+    fKernel *compose = g.pending_compose_kernel;
+    assert(render && compose);
+
+    int render_status = fraktal_kernel_ready(render);
+    if (render_status < 0)
+        log_err("Failed to load scene: error compiling render kernel.\n");
+    int compose_status = fraktal_kernel_ready(compose);
+    if (compose_status < 0)
+        log_err("Failed to load scene: error compiling compose kernel.\n");
+    if (render_status < 0 || compose_status < 0)
+    {
+        cancel_load_gui(g);
+        return -1;
+    }
+    if (render_status == 0 || compose_status == 0)
+        return 0;
+
+    // The model may have changed, so the cache is baked again on every load
+    fBrickMap *bricks = NULL;
+    if (g.pending_use_bricks)
+    {
+        bricks = bake_bricks(g.pending_paths.model, g.bricks_extent, g.bricks_resolution);
+        if (!bricks)
+        {
+            log_err("Failed to load scene: error baking brick cache.\n");
+            g.new_use_bricks = false;
+            cancel_load_gui(g);
+            return -1;
+        }
+    }
+
     // Refetch uniform offsets
     for (int preset = 0; preset < NUM_PRESETS; preset++)
     for (int widget = 0; widget < g.presets[preset].num_widgets; widget++)
@@ -217,20 +358,78 @@ static bool load_gui(guiState &g)
     // Destroy old state and update to newly loaded state
     fraktal_destroy_kernel(g.render_kernel);
     fraktal_destroy_kernel(g.compose_kernel);
-    g.paths = g.new_paths;
-    g.mode = g.new_mode;
+    fraktal_destroy_bricks(g.bricks);
+    g.paths = g.pending_paths;
+    g.mode = g.pending_mode;
     g.render_kernel = render;
     g.compose_kernel = compose;
+    g.bricks = bricks;
+    g.use_bricks = g.pending_use_bricks;
     g.render_kernel_is_new = true;
     g.compose_kernel_is_new = true;
     g.should_clear = true;
+    if (g.step_transfer)
+        fraktal_wait(g.step_transfer);
+    g.step_transfer = NULL;
+    g.step_transfer_samples = -1;
+    g.has_step_totals = false;
+    g.sample_row = 0;
+    g.sample_cost = 0.0;
+    memset(&g.last_stats, 0, sizeof(g.last_stats));
     g.initialized = true;
+    g.pending_render_kernel = NULL;
+    g.pending_compose_kernel = NULL;
 
-    return true;
+    return 1;
 }
 
 #define fetch_uniform(kernel, name) static int loc_##name; if (scene.kernel##_is_new) loc_##name = fraktal_get_param_offset(scene.kernel, #name);
 
+// Renders as much of the following samples into 'out' as fits in the
+// frame budget by the measured cost per pixel, stopping at 'max_samples'.
+// A sample that is over budget is rendered a band of rows per frame. Until
+// the cost is measured (or if the GPU cannot be timed), a whole sample is
+// rendered per frame.
+static void accumulate_samples(guiState &scene, fArray *out, int loc_iSamples, int max_samples)
+{
+    // timer results lag a few frames behind, so the cost is averaged over
+    // the runs that have been measured since the previous frame
+    fKernelStats stats;
+    fraktal_get_kernel_stats(scene.render_kernel, &stats);
+    double ms = stats.total_ms - scene.last_stats.total_ms;
+    long long pixels = stats.pixels - scene.last_stats.pixels;
+    if (pixels > 0 && ms > 0.0)
+    {
+        double cost = ms/(double)pixels;
+        if (scene.sample_cost <= 0.0) scene.sample_cost = cost;
+        else scene.sample_cost += 0.25*(cost - scene.sample_cost);
+    }
+    scene.last_stats = stats;
+
+    int width,height;
+    fraktal_array_size(out, &width, &height);
+    double budget = (double)width*height;
+    if (scene.sample_cost > 0.0)
+        budget = scene.frame_budget_ms/scene.sample_cost;
+    do
+    {
+        int rows = height - scene.sample_row;
+        if ((double)rows*width > budget)
+            rows = (int)(budget/width);
+        if (rows < 1)
+            rows = 1;
+        fraktal_param_1i(loc_iSamples, scene.samples);
+        fraktal_run_kernel_region(out, 0, scene.sample_row, width, rows);
+        budget -= (double)rows*width;
+        scene.sample_row += rows;
+        if (scene.sample_row == height)
+        {
+            scene.sample_row = 0;
+            scene.samples++;
+        }
+    } while (budget >= width && scene.samples < max_samples);
+}
+
 #if ENABLE_CONE_TRACING_OPTIMIZATION
 static void render_color(guiState &scene)
 {
@@ -256,6 +455,9 @@ static void render_color(guiState &scene)
         fetch_uniform(render_kernel, iSamples);
         scene.render_kernel_is_new = false;
 
+        if (scene.bricks)
+            fraktal_param_bricks(scene.bricks);
+
         int width,height;
         fraktal_array_size(scene.render_buffer, &width, &height);
 
@@ -282,14 +484,13 @@ static void render_color(guiState &scene)
         {
             fraktal_zero_array(scene.render_buffer);
             scene.samples = 0;
+            scene.sample_row = 0;
             scene.should_clear = false;
         }
 
         fraktal_param_1i(loc_iMode, 0);
-        fraktal_param_1i(loc_iSamples, scene.samples);
         fraktal_param_array(loc_iChannel0, t_buffer);
-        fraktal_run_kernel(scene.render_buffer);
-        scene.samples++;
+        accumulate_samples(scene, scene.render_buffer, loc_iSamples, scene.auto_render ? scene.max_samples : scene.samples + 1);
     }
 
     // compose pass
@@ -298,6 +499,7 @@ static void render_color(guiState &scene)
         fetch_uniform(compose_kernel, iResolution);
         fetch_uniform(compose_kernel, iChannel0);
         fetch_uniform(compose_kernel, iSamples);
+        fetch_uniform(compose_kernel, iSampleRow);
         scene.compose_kernel_is_new = false;
 
         fArray *out = scene.compose_buffer;
@@ -306,6 +508,7 @@ static void render_color(guiState &scene)
         fraktal_array_size(out, &width, &height);
         fraktal_param_2f(loc_iResolution, (float)width, (float)height);
         fraktal_param_1i(loc_iSamples, scene.samples);
+        fraktal_param_1i(loc_iSampleRow, scene.sample_row);
         fraktal_param_array(loc_iChannel0, in);
 
         fraktal_zero_array(out);
@@ -331,18 +534,21 @@ static void render_color(guiState &scene)
         fetch_uniform(render_kernel, iSamples);
         scene.render_kernel_is_new = false;
 
+        if (scene.bricks)
+            fraktal_param_bricks(scene.bricks);
+
         fArray *out = scene.render_buffer;
         if (scene.should_clear)
         {
             fraktal_zero_array(out);
             scene.samples = 0;
+            scene.sample_row = 0;
             scene.should_clear = false;
         }
 
         int width,height;
         fraktal_array_size(out, &width, &height);
         fraktal_param_2f(loc_iResolution, (float)width, (float)height);
-        fraktal_param_1i(loc_iSamples, scene.samples);
 
         assert(scene.preset);
         for (int i = 0; i < scene.preset->num_widgets; i++)
@@ -351,8 +557,7 @@ static void render_color(guiState &scene)
                 scene.preset->widgets[i]->set_params(scene);
         }
 
-        fraktal_run_kernel(out);
-        scene.samples++;
+        accumulate_samples(scene, out, loc_iSamples, scene.auto_render ? scene.max_samples : scene.samples + 1);
     }
 
     // compose pass
@@ -361,6 +566,7 @@ static void render_color(guiState &scene)
         fetch_uniform(compose_kernel, iResolution);
         fetch_uniform(compose_kernel, iChannel0);
         fetch_uniform(compose_kernel, iSamples);
+        fetch_uniform(compose_kernel, iSampleRow);
         scene.compose_kernel_is_new = false;
 
         fArray *out = scene.compose_buffer;
@@ -369,6 +575,7 @@ static void render_color(guiState &scene)
         fraktal_array_size(out, &width, &height);
         fraktal_param_2f(loc_iResolution, (float)width, (float)height);
         fraktal_param_1i(loc_iSamples, scene.samples);
+        fraktal_param_1i(loc_iSampleRow, scene.sample_row);
         fraktal_param_array(loc_iChannel0, in);
 
         fraktal_zero_array(out);
@@ -393,15 +600,18 @@ static void render_geometry(guiState &scene)
         fetch_uniform(render_kernel, iDrawMode);
         scene.render_kernel_is_new = false;
 
+        if (scene.bricks)
+            fraktal_param_bricks(scene.bricks);
+
         fArray *out = scene.compose_buffer;
 
         int width,height;
         fraktal_array_size(out, &width, &height);
         fraktal_param_2f(loc_iResolution, (float)width, (float)height);
-        if      (scene.mode == guiPreviewMode_Normals) glUniform1i(loc_iDrawMode, 0);
-        else if (scene.mode == guiPreviewMode_Depth) glUniform1i(loc_iDrawMode, 1);
-        else if (scene.mode == guiPreviewMode_Thickness) glUniform1i(loc_iDrawMode, 2);
-        else if (scene.mode == guiPreviewMode_GBuffer) glUniform1i(loc_iDrawMode, 3);
+        if      (scene.mode == guiPreviewMode_Normals) fraktal_param_1i(loc_iDrawMode, 0);
+        else if (scene.mode == guiPreviewMode_Depth) fraktal_param_1i(loc_iDrawMode, 1);
+        else if (scene.mode == guiPreviewMode_Thickness) fraktal_param_1i(loc_iDrawMode, 2);
+        else if (scene.mode == guiPreviewMode_GBuffer) fraktal_param_1i(loc_iDrawMode, 3);
         else assert(false);
 
         assert(scene.preset);
@@ -419,6 +629,170 @@ static void render_geometry(guiState &scene)
     fraktal_use_kernel(NULL);
 }
 
+// Reduces a 4-channel float array with libf/reduce.f until it is at most
+// REDUCE_BLOCK texels on each side, and starts copying the remaining texels
+// into 'texels' (which holds 4*REDUCE_BLOCK*REDUCE_BLOCK floats) for them to
+// be summed on the CPU. Their number is written to 'count'. Returns NULL if
+// the reduction kernel could not be loaded.
+static fTransfer *reduce_sum_async(fArray *in, float *texels, int *count)
+{
+    static fKernel *reduce = NULL;
+    static bool reduce_failed = false;
+    if (!reduce && !reduce_failed)
+    {
+        fLinkState *link = fraktal_create_link();
+        if (fraktal_add_link_file(link, "libf/reduce.f"))
+            reduce = fraktal_link_kernel(link);
+        fraktal_destroy_link(link);
+        if (!reduce)
+        {
+            log_err("Failed to load reduction kernel: file is corrupt or not in the expected directory (libf/reduce.f)\n");
+            reduce_failed = true;
+        }
+    }
+    if (!reduce)
+        return NULL;
+    assert(fraktal_array_format(in) == FRAKTAL_FLOAT);
+    assert(fraktal_array_channels(in) == 4);
+
+    int width,height;
+    fraktal_array_size(in, &width, &height);
+    fArray *level = in;
+    fraktal_use_kernel(reduce);
+    int loc_iChannel0 = fraktal_get_param_offset(reduce, "iChannel0");
+    while (width > REDUCE_BLOCK || height > REDUCE_BLOCK)
+    {
+        width = (width + REDUCE_BLOCK - 1)/REDUCE_BLOCK;
+        height = (height + REDUCE_BLOCK - 1)/REDUCE_BLOCK;
+        fArray *next = fraktal_create_array(NULL, width, height, 4, FRAKTAL_FLOAT, FRAKTAL_READ_WRITE);
+        assert(next);
+        fraktal_param_array(loc_iChannel0, level);
+        fraktal_zero_array(next);
+        fraktal_run_kernel(next);
+        if (level != in)
+            fraktal_destroy_array(level);
+        level = next;
+    }
+    fraktal_use_kernel(NULL);
+
+    // the copy is queued after the reduction, so the array can be destroyed
+    fTransfer *transfer = fraktal_to_cpu_async(texels, level);
+    *count = width*height;
+    if (level != in)
+        fraktal_destroy_array(level);
+    return transfer;
+}
+
+// Accumulates a sample of the color renderer's steps draw mode, if
+// accumulate is set, and shows the mean count of the sample with a colormap.
+static void render_steps(guiState &scene, bool accumulate)
+{
+    if (!scene.render_kernel || !scene.compose_kernel)
+        return;
+    assert(fraktal_is_valid_array(scene.render_buffer));
+    assert(fraktal_is_valid_array(scene.compose_buffer));
+
+    bool counts_steps = false;
+    fraktal_use_kernel(scene.render_kernel);
+    {
+        fetch_uniform(render_kernel, iResolution);
+        fetch_uniform(render_kernel, iSamples);
+        fetch_uniform(render_kernel, iDrawMode);
+        scene.render_kernel_is_new = false;
+
+        // only libf/publication.f and renderers like it count their steps
+        counts_steps = loc_iDrawMode >= 0;
+        if (!counts_steps)
+            accumulate = false;
+
+        if (accumulate)
+        {
+            if (scene.bricks)
+                fraktal_param_bricks(scene.bricks);
+
+            fArray *out = scene.render_buffer;
+            if (scene.should_clear)
+            {
+                fraktal_zero_array(out);
+                scene.samples = 0;
+                scene.should_clear = false;
+                scene.has_step_totals = false;
+                scene.step_transfer_stale = scene.step_transfer != NULL;
+                scene.step_transfer_samples = -1;
+            }
+
+            int width,height;
+            fraktal_array_size(out, &width, &height);
+            fraktal_param_2f(loc_iResolution, (float)width, (float)height);
+            fraktal_param_1i(loc_iSamples, scene.samples);
+            fraktal_param_1i(loc_iDrawMode, DRAW_MODE_STEPS);
+
+            assert(scene.preset);
+            for (int i = 0; i < scene.preset->num_widgets; i++)
+            {
+                if (scene.preset->widgets[i]->is_active())
+                    scene.preset->widgets[i]->set_params(scene);
+            }
+
+            fraktal_run_kernel(out);
+            scene.samples++;
+        }
+    }
+    fraktal_use_kernel(NULL);
+
+    // The sums are read back one at a time, and a new reduction is started
+    // once the previous one has arrived, so that the GPU is never waited on.
+    if (scene.step_transfer && fraktal_poll(scene.step_transfer))
+    {
+        scene.step_transfer = NULL;
+        if (!scene.step_transfer_stale)
+        {
+            double *sum = scene.step_totals;
+            const float *texels = scene.step_texels;
+            sum[0] = sum[1] = sum[2] = sum[3] = 0.0;
+            for (int i = 0; i < scene.step_texel_count; i++)
+            for (int k = 0; k < 4; k++)
+                sum[k] += texels[4*i + k];
+            scene.step_totals_samples = scene.step_transfer_samples;
+            scene.has_step_totals = true;
+        }
+    }
+    if (counts_steps && !scene.step_transfer && scene.samples > 0 &&
+        scene.step_transfer_samples != scene.samples)
+    {
+        scene.step_transfer = reduce_sum_async(scene.render_buffer, scene.step_texels, &scene.step_texel_count);
+        scene.step_transfer_stale = false;
+        scene.step_transfer_samples = scene.samples;
+    }
+
+    // heatmap pass
+    fraktal_use_kernel(scene.compose_kernel);
+    {
+        fetch_uniform(compose_kernel, iResolution);
+        fetch_uniform(compose_kernel, iChannel0);
+        fetch_uniform(compose_kernel, iSamples);
+        fetch_uniform(compose_kernel, iColormap);
+        fetch_uniform(compose_kernel, iCount);
+        fetch_uniform(compose_kernel, iMaxCount);
+        scene.compose_kernel_is_new = false;
+
+        fArray *out = scene.compose_buffer;
+        fArray *in = scene.render_buffer;
+        int width,height;
+        fraktal_array_size(out, &width, &height);
+        fraktal_param_2f(loc_iResolution, (float)width, (float)height);
+        fraktal_param_1i(loc_iSamples, scene.samples);
+        fraktal_param_array(loc_iChannel0, in);
+        fraktal_param_array(loc_iColormap, f_colormap_inferno);
+        fraktal_param_1i(loc_iCount, scene.steps_count);
+        fraktal_param_1f(loc_iMaxCount, scene.steps_max);
+
+        fraktal_zero_array(out);
+        fraktal_run_kernel(out);
+    }
+    fraktal_use_kernel(NULL);
+}
+
 static bool open_file_dialog(bool should_open, const char *label, char *buffer, size_t sizeof_buffer)
 {
     if (should_open)
@@ -479,16 +853,27 @@ static void update_and_render_gui(guiState &scene)
     bool reload_key = scene.keys.Alt.down && scene.keys.Enter.pressed;
     static bool reload_request = true;
 
-    if (scene.new_mode != scene.mode)
+    bool loading = scene.pending_render_kernel != NULL;
+    if (scene.new_mode != (loading ? scene.pending_mode : scene.mode))
+        reload_request = true;
+    if (scene.new_use_bricks != (loading ? scene.pending_use_bricks : scene.use_bricks))
         reload_request = true;
 
     if (reload_key || (reload_request && !scene.got_error))
     {
         reload_request = false;
         log_clear();
-        if (!load_gui(scene))
+        if (!begin_load_gui(scene))
             scene.got_error = true;
-        else
+    }
+
+    // keep drawing with the current kernels until the new ones are linked
+    if (scene.pending_render_kernel)
+    {
+        int status = finish_load_gui(scene);
+        if (status < 0)
+            scene.got_error = true;
+        else if (status > 0)
             scene.got_error = false;
     }
 
@@ -515,9 +900,15 @@ static void update_and_render_gui(guiState &scene)
             scene.auto_render = !scene.auto_render;
         if (scene.auto_render && scene.samples < scene.max_samples)
             render_color(scene);
-        else if (scene.should_clear)
+        else if (scene.should_clear || scene.sample_row > 0)
             render_color(scene);
     }
+    else if (scene.mode == guiPreviewMode_Steps)
+    {
+        if (!scene.keys.Alt.down && scene.keys.Enter.pressed)
+            scene.auto_render = !scene.auto_render;
+        render_steps(scene, scene.should_clear || (scene.auto_render && scene.samples < scene.max_samples));
+    }
     else
     {
         if (scene.should_clear)
@@ -532,6 +923,7 @@ static void update_and_render_gui(guiState &scene)
         else if (scene.mode == guiPreviewMode_Normals) name = "normals.png";
         else if (scene.mode == guiPreviewMode_Depth) name = "depth.png";
         else if (scene.mode == guiPreviewMode_GBuffer) name = "gbuffer.png";
+        else if (scene.mode == guiPreviewMode_Steps) name = "steps.png";
         save_screenshot(name, scene.compose_buffer);
     }
 
@@ -689,6 +1081,7 @@ static void update_and_render_gui(guiState &scene)
             if (ImGui::BeginTabItem("Normals"))   { scene.new_mode = guiPreviewMode_Normals; ImGui::EndTabItem(); }
             if (ImGui::BeginTabItem("Depth"))     { scene.new_mode = guiPreviewMode_Depth; ImGui::EndTabItem(); }
             if (ImGui::BeginTabItem("GBuffer"))   { scene.new_mode = guiPreviewMode_GBuffer; ImGui::EndTabItem(); }
+            if (ImGui::BeginTabItem("Steps"))     { scene.new_mode = guiPreviewMode_Steps; ImGui::EndTabItem(); }
             ImGui::EndTabBar();
         }
         ImGui::EndMainMenuBar();
@@ -763,8 +1156,29 @@ static void update_and_render_gui(guiState &scene)
                     if (ImGui::MenuItem("Scale to fit", NULL, display_mode==display_mode_fit)) { display_mode = display_mode_fit; }
                     ImGui::EndMenu();
                 }
+                if (ImGui::BeginMenu(scene.bricks ? "Cache on###Cache" : "Cache off###Cache"))
+                {
+                    ImGui::MenuItem("Use brick cache", NULL, &scene.new_use_bricks);
+                    ImGui::PushItemWidth(128.0f);
+                    if (ImGui::InputFloat("Box extent", &scene.bricks_extent, 0.0f, 0.0f, "%.2f", ImGuiInputTextFlags_EnterReturnsTrue))
+                        reload_request = scene.use_bricks;
+                    if (ImGui::InputInt("Resolution", &scene.bricks_resolution, 0, 0, ImGuiInputTextFlags_EnterReturnsTrue))
+                        reload_request = scene.use_bricks;
+                    ImGui::PopItemWidth();
+                    if (scene.bricks_extent <= 0.0f) scene.bricks_extent = 5.0f;
+                    if (scene.bricks_resolution < FBRICK_CELLS) scene.bricks_resolution = FBRICK_CELLS;
+                    if (scene.bricks_resolution > 2048) scene.bricks_resolution = 2048;
+                    if (scene.bricks)
+                        ImGui::Text("%d bricks", fraktal_brick_count(scene.bricks));
+                    ImGui::EndMenu();
+                }
                 ImGui::PopStyleVar();
-                if (scene.mode == guiPreviewMode_Color)
+                if (scene.pending_render_kernel)
+                {
+                    ImGui::Separator();
+                    ImGui::Text("Compiling...");
+                }
+                if (scene.mode == guiPreviewMode_Color || scene.mode == guiPreviewMode_Steps)
                 {
                     ImGui::Separator();
                     ImGui::Text("Samples: %d / ", scene.samples);
@@ -773,6 +1187,72 @@ static void update_and_render_gui(guiState &scene)
                         scene.should_clear = true;
                     ImGui::PopItemWidth();
                 }
+                if (scene.mode == guiPreviewMode_Color)
+                {
+                    ImGui::PushItemWidth(96.0f);
+                    ImGui::DragFloat("##frame_budget", &scene.frame_budget_ms, 0.1f, 1.0f, 100.0f, "Budget %.1f ms");
+                    ImGui::PopItemWidth();
+                    if (scene.frame_budget_ms < 1.0f) scene.frame_budget_ms = 1.0f;
+                    if (ImGui::IsItemHovered())
+                        ImGui::SetTooltip("GPU time per frame for accumulating samples");
+                }
+                if (scene.mode == guiPreviewMode_Steps)
+                {
+                    static const char *counts[] = { "Primary steps", "Shadow steps", "AO steps", "Evaluations" };
+                    ImGui::Separator();
+                    ImGui::PushItemWidth(112.0f);
+                    ImGui::Combo("##steps_count", &scene.steps_count, counts, 4);
+                    ImGui::PopItemWidth();
+                    ImGui::PushItemWidth(80.0f);
+                    ImGui::DragFloat("##steps_max", &scene.steps_max, 1.0f, 1.0f, 4096.0f, "Max %.0f");
+                    ImGui::PopItemWidth();
+                    if (scene.steps_max < 1.0f) scene.steps_max = 1.0f;
+                    if (scene.has_step_totals && scene.step_totals_samples > 0)
+                    {
+                        double n = (double)scene.resolution.x*scene.resolution.y;
+                        const double *t = scene.step_totals;
+                        double s = (double)scene.step_totals_samples;
+                        ImGui::Text("%.1f / pixel", t[scene.steps_count]/(n*s));
+                        if (ImGui::IsItemHovered())
+                        {
+                            ImGui::SetTooltip(
+                                "Mean per sample (per pixel)\n"
+                                "Primary steps: %.0f (%.1f)\n"
+                                "Shadow steps: %.0f (%.1f)\n"
+                                "AO steps: %.0f (%.1f)\n"
+                                "Model evaluations: %.0f (%.1f)",
+                                t[0]/s, t[0]/(n*s), t[1]/s, t[1]/(n*s),
+                                t[2]/s, t[2]/(n*s), t[3]/s, t[3]/(n*s));
+                        }
+                    }
+                }
+                if (scene.render_kernel)
+                {
+                    fKernelStats stats;
+                    fraktal_get_kernel_stats(scene.render_kernel, &stats);
+                    if (stats.dispatches > 0)
+                    {
+                        // color samples are rendered in bands of rows, so
+                        // their time is estimated from the cost per pixel
+                        ImGui::Separator();
+                        if (scene.mode == guiPreviewMode_Color && scene.sample_cost > 0.0)
+                            ImGui::Text("%.2f ms", scene.sample_cost*scene.resolution.x*scene.resolution.y);
+                        else
+                            ImGui::Text("%.2f ms", stats.average_ms);
+                        if (ImGui::IsItemHovered())
+                        {
+                            double mpixels = stats.total_ms > 0.0 ? 1e-3*(double)stats.pixels/stats.total_ms : 0.0;
+                            ImGui::SetTooltip(
+                                "Render kernel time (GPU)\n"
+                                "Runs: %d\n"
+                                "Average: %.2f ms\n"
+                                "Min: %.2f ms\n"
+                                "Max: %.2f ms\n"
+                                "Throughput: %.1f Mpixels/s",
+                                stats.dispatches, stats.average_ms, stats.min_ms, stats.max_ms, mpixels);
+                        }
+                    }
+                }
             }
             ImGui::EndMenuBar();
 
@@ -1080,18 +1560,31 @@ int main(int argc, char **argv)
     g_scene.new_paths.color    = "libf/publication.f";
     g_scene.new_paths.geometry = "libf/geometry.f";
     g_scene.new_paths.compose  = "libf/compose.f";
+    g_scene.new_paths.heatmap  = "libf/heatmap.f";
     g_scene.new_resolution.x   = 320;
     g_scene.new_resolution.y   = 240;
     g_scene.new_mode           = guiPreviewMode_Color;
+    g_scene.bricks_extent      = 5.0f;
+    g_scene.bricks_resolution  = 512;
+    g_scene.steps_max          = 64.0f;
+    g_scene.frame_budget_ms    = 12.0f;
 
-    fraktal_create_context();
-
-    if (!fraktal_context)
+    fContext *context = fraktal_create_context();
+    if (!context)
     {
         log_err("The fraktal GUI requires you to create a context for fraktal (use fraktal_create_context).\n");
         return 1;
     }
 
+    // skip recompiling kernels that were linked in a previous session
+    fraktal_set_kernel_cache_dir("bin");
+
+    // shown next to the sample count in the preview
+    fraktal_enable_kernel_stats(true);
+
+    // switching back to a previous resolution reuses its render buffers
+    fraktal_set_array_pool_budget(128*1024*1024);
+
     // set up ImGui
     ImGui::CreateContext();
     ImGui::StyleColorsDark();
@@ -1119,21 +1612,22 @@ int main(int argc, char **argv)
 
     // this must be called before any OpenGL operations
     fraktal_ensure_context();
+    GLFWwindow *window = context->window;
 
     // create window
     guiSettings settings = g_scene.settings;
     if (settings.x >= 0 && settings.y >= 0)
-        glfwSetWindowPos(fraktal_context, settings.x, settings.y);
-    glfwSetWindowSize(fraktal_context, settings.width, settings.height);
-    glfwShowWindow(fraktal_context);
+        glfwSetWindowPos(window, settings.x, settings.y);
+    glfwSetWindowSize(window, settings.width, settings.height);
+    glfwShowWindow(window);
     glfwSwapInterval(0);
-    glfwSetKeyCallback(fraktal_context, glfw_key_callback);
-    glfwSetWindowPosCallback(fraktal_context, glfw_window_pos_callback);
+    glfwSetKeyCallback(window, glfw_key_callback);
+    glfwSetWindowPosCallback(window, glfw_window_pos_callback);
 
     // initialize OpenGL state
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    ImGui_ImplGlfw_InitForOpenGL(fraktal_context, true);
+    ImGui_ImplGlfw_InitForOpenGL(window, true);
     ImGui_ImplOpenGL3_Init(fraktal_glsl_version);
 
     // load fonts
@@ -1160,12 +1654,12 @@ int main(int argc, char **argv)
 
     // reminder for future: these must be called in order before the main loop below
     // fraktal_ensure_context();
-    // glfwShowWindow(fraktal_context);
+    // glfwShowWindow(window);
 
-    while (!glfwWindowShouldClose(fraktal_context) && !g_scene.should_exit)
+    while (!glfwWindowShouldClose(window) && !g_scene.should_exit)
     {
         static int settle_frames = 10;
-        if ((g_scene.auto_render && g_scene.samples < g_scene.max_samples) || settle_frames > 0)
+        if ((g_scene.auto_render && g_scene.samples < g_scene.max_samples) || g_scene.sample_row > 0 || settle_frames > 0)
         {
             glfwPollEvents();
         }
@@ -1179,7 +1673,7 @@ int main(int argc, char **argv)
         guiSettings &settings = g_scene.settings;
         settings.x = g_window_pos_x;
         settings.y = g_window_pos_y;
-        glfwGetWindowSize(fraktal_context, &settings.width, &settings.height);
+        glfwGetWindowSize(window, &settings.width, &settings.height);
 
         const double max_redraw_rate = 60.0;
         const double min_redraw_time = 1.0/max_redraw_rate;
@@ -1227,9 +1721,9 @@ int main(int argc, char **argv)
             }
             mark_key_events_as_processed();
 
-            glfwMakeContextCurrent(fraktal_context);
+            glfwMakeContextCurrent(window);
             int window_fb_width, window_fb_height;
-            glfwGetFramebufferSize(fraktal_context, &window_fb_width, &window_fb_height);
+            glfwGetFramebufferSize(window, &window_fb_width, &window_fb_height);
             glViewport(0, 0, window_fb_width, window_fb_height);
             glClearColor(0.14f, 0.14f, 0.14f, 1.0f);
             glClear(GL_COLOR_BUFFER_BIT);
@@ -1245,7 +1739,7 @@ int main(int argc, char **argv)
                 ImGui::GetIO().WantSaveIniSettings = false;
             }
 
-            glfwSwapBuffers(fraktal_context);
+            glfwSwapBuffers(window);
         }
     }
     write_settings_to_disk(ini_filename, g_scene);
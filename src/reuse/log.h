@@ -7,7 +7,9 @@
 #include <stdarg.h>
 #include <assert.h>
 
-static struct logfile_t
+// Each thread has its own log, so that threads driving separate fraktal
+// contexts do not mix up their error messages.
+static thread_local struct logfile_t
 {
     size_t bytes;
     size_t capacity;
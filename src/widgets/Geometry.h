@@ -19,11 +19,11 @@ struct Widget_Geometry : Widget
 
     virtual void default_values()
     {
-        min_distance = 10.0f;
-        max_distance = 30.0f;
-        min_thickness = 0.0f;
-        max_thickness = 0.5f;
-        apply_colormap = false;
+        min_distance = default_min_distance;
+        max_distance = default_max_distance;
+        min_thickness = default_min_thickness;
+        max_thickness = default_max_thickness;
+        apply_colormap = default_apply_colormap;
 
         if (!f_colormap_inferno)
         {
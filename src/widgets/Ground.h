@@ -24,17 +24,15 @@ struct Widget_Ground : Widget
 
     virtual void default_values()
     {
-        isolines_enabled = false;
-        isolines_color.x = 0.3f;
-        isolines_color.y = 0.3f;
-        isolines_color.z = 0.3f;
-        isolines_thickness = 0.25f*0.5f;
-        isolines_spacing = 0.4f;
-        isolines_count = 3;
-        ground_reflective = false;
-        ground_height = 0.0f;
-        ground_specular_exponent = 500.0f;
-        ground_reflectivity = 0.6f;
+        isolines_enabled = default_isolines_enabled;
+        isolines_color = default_isolines_color;
+        isolines_thickness = default_isolines_thickness;
+        isolines_spacing = default_isolines_spacing;
+        isolines_count = default_isolines_count;
+        ground_reflective = default_ground_reflective;
+        ground_height = default_ground_height;
+        ground_specular_exponent = default_ground_specular_exponent;
+        ground_reflectivity = default_ground_reflectivity;
 
     }
     virtual void deserialize(const char **cc)
@@ -13,14 +13,10 @@ struct Widget_Material : Widget
 
     virtual void default_values()
     {
-        glossy = true;
-        specular_albedo.x = 0.3f;
-        specular_albedo.y = 0.3f;
-        specular_albedo.z = 0.3f;
-        specular_exponent = 32.0f;
-        albedo.x = 0.6f;
-        albedo.y = 0.1f;
-        albedo.z = 0.1f;
+        glossy = default_material_glossy;
+        specular_albedo = default_material_specular_albedo;
+        specular_exponent = default_material_specular_exponent;
+        albedo = default_material_albedo;
 
     }
     virtual void deserialize(const char **cc)
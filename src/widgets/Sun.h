@@ -12,13 +12,10 @@ struct Widget_Sun : Widget
 
     virtual void default_values()
     {
-        size = 3.0f;
-        dir.theta = 30.0f;
-        dir.phi = 90.0f;
-        color.x = 1.0f;
-        color.y = 1.0f;
-        color.z = 0.8f;
-        intensity = 250.0f;
+        size = default_sun_size;
+        dir = default_sun_dir;
+        color = default_sun_color;
+        intensity = default_sun_intensity;
     }
     virtual void deserialize(const char **cc)
     {
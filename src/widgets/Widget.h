@@ -1,4 +1,5 @@
 #pragma once
+#include "defaults.h"
 
 struct Widget
 {
@@ -0,0 +1,40 @@
+#pragma once
+
+// Default values of the widgets, shared by the widgets and the benchmark
+// (src/benchmark.cpp), which renders with the parameters the GUI starts with
+
+// Widget_Camera
+static const angle2 default_camera_dir = { -20.0f, 30.0f };
+static const float3 default_camera_pos = { 0.0f, 0.0f, 24.0f };
+static const float default_camera_yfov = 10.0f;
+static const float2 default_camera_shift = { 0.0f, 0.0f };
+
+// Widget_Sun
+static const float default_sun_size = 3.0f;
+static const angle2 default_sun_dir = { 30.0f, 90.0f };
+static const float3 default_sun_color = { 1.0f, 1.0f, 0.8f };
+static const float default_sun_intensity = 250.0f;
+
+// Widget_Ground
+static const bool default_isolines_enabled = false;
+static const float3 default_isolines_color = { 0.3f, 0.3f, 0.3f };
+static const float default_isolines_thickness = 0.25f*0.5f;
+static const float default_isolines_spacing = 0.4f;
+static const int default_isolines_count = 3;
+static const bool default_ground_reflective = false;
+static const float default_ground_height = 0.0f;
+static const float default_ground_specular_exponent = 500.0f;
+static const float default_ground_reflectivity = 0.6f;
+
+// Widget_Material
+static const bool default_material_glossy = true;
+static const float3 default_material_specular_albedo = { 0.3f, 0.3f, 0.3f };
+static const float default_material_specular_exponent = 32.0f;
+static const float3 default_material_albedo = { 0.6f, 0.1f, 0.1f };
+
+// Widget_Geometry
+static const float default_min_distance = 10.0f;
+static const float default_max_distance = 30.0f;
+static const float default_min_thickness = 0.0f;
+static const float default_max_thickness = 0.5f;
+static const bool default_apply_colormap = false;